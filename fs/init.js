@@ -2,35 +2,40 @@ load('api_file.js');
 load('api_timer.js'); 
 load('api_rpc.js'); 
 load('api_sys.js'); 
+load('profile.js'); 
 load('ota.js'); 
 
 
 let s=UPD.check();
-let size; let fname;
+
+// Updates scripts in one download-and-reboot cycle: args.files is a bundle,
+// [{url, name, sha256}, ...], see UPD in ota.js. Without it, args.url
+// replaces worker.js as before.
 RPC.addHandler('update',function(args){
    
 
-  size=args.size;
-  fname=args.name;
-  fname="worker.js.new";
+  let files=args.files;
+  if(files===undefined)
+  {
+    files=[{url:args.url,name:"worker.js",sha256:args.sha256}];
+  }
+  else{
+    for(let i=0;i<files.length;i++)
+    {
+      let f=files[i];
+      if(typeof(f.url)!=='string' || typeof(f.name)!=='string' ||
+         typeof(f.sha256)!=='string' || f.sha256.length!==64)
+      {
+        return {error:-1,message:'Each file needs url, name and sha256'};
+      }
+    }
+  }
  
-  download(args.url,fname,function(res){
+  let ok=UPD.start(files,function(ok){
  
-    if(res!==null)
+    if(ok)
     {
-      let s={
-
-        files:[{
-  
-        file_o:fname,
-        file_n:fname+".new"
-  
-      }],
-      status:"TO_COMMIT"
-
-      };   
-      write_data("updater_data.json",s);
-      print('File Updated...Rebooting now');
+      print('Files Updated...Rebooting now');
       Sys.reboot(5);
     }
     else{
@@ -38,7 +43,11 @@ RPC.addHandler('update',function(args){
     }
     
   });
-  return {"result":"Update started !"};
+  if(!ok)
+  {
+    return {error:-1,message:'An update is in progress'};
+  }
+  return {"result":"Update started !","files":files.length};
 
 });
 
@@ -48,7 +57,7 @@ RPC.addHandler('downloadFile',function(args){
 
   let url=args.url;
   let name=args.name; 
-  download(url,name,function(args){
+  download(url,name,args.sha256,function(args){
     print('dwd done...rebooting');
     Sys.reboot(5);
   });
@@ -6,6 +6,7 @@ load('api_pwm.js');
 load('api_rpc.js');
 load('api_events.js');
 load('api_net.js');
+load('profile.js');
 
 
  	
@@ -25,6 +26,7 @@ let W_DUTY_CT=1;
 
 let TRANSIT_STEP_TIME=400;
 let TRANSIT_STEPS=40;
+let TRANSIT_MS=400;
 let rgbw={
   r:0,
   g:0,
@@ -44,22 +46,75 @@ GPIO.set_mode(green, GPIO.MODE_OUTPUT);
 GPIO.set_mode(blue, GPIO.MODE_OUTPUT);
 GPIO.set_mode(white, GPIO.MODE_OUTPUT);
 
+// Transition engine in C, see src/led.h. Transitions run in the
+// background, off the event loop's frame timer.
+let LED={
+  LINEAR:0,
+  EASE_IN:1,
+  EASE_OUT:2,
+  EASE_IN_OUT:3,
+  WHITE:0x100,
+  setup:ffi('void led_setup(int,int,int,int,int)'),
+  add_fixture:ffi('bool led_add_fixture(int,int,int,int,int)'),
+  add_strip:ffi('bool led_add_strip(int,int)'),
+  // Outputs are numbered as added, 0 is the fixture of setup; call
+  // flush once the pixels are set.
+  set_pixel:ffi('bool led_set_pixel(int,int,int,int,int,int)'),
+  flush:ffi('void led_flush(void)'),
+  _transit:ffi('void led_transit(int,int,int,int,int,int)'),
+  _submit:ffi('void led_submit(int,int,int,int,int,int)'),
+  _write:ffi('void led_write(int,int,int,int,int)'),
+  _levels:ffi('void led_set_levels(int,int,int,int)'),
+  brightness:ffi('void led_set_brightness(int)'),
+  _play:ffi('bool led_play(char *)'),
+  stop:ffi('void led_stop(void)'),
+  // A colour with checked:null has its common part of r, g, b moved to w.
+  flags:function(rgbw)
+  {
+    return rgbw.checked===null ? LED.WHITE : 0;
+  },
+  transit:function(rgbw,ms,easing)
+  {
+    LED._transit(rgbw.r,rgbw.g,rgbw.b,rgbw.w,ms,easing|LED.flags(rgbw));
+  },
+  // As transit, dropped if another colour comes before the next frame.
+  submit:function(rgbw,ms,easing)
+  {
+    LED._submit(rgbw.r,rgbw.g,rgbw.b,rgbw.w,ms,easing|LED.flags(rgbw));
+  },
+  write:function(rgbw)
+  {
+    LED._write(rgbw.r,rgbw.g,rgbw.b,rgbw.w,LED.flags(rgbw));
+  },
+  // Key of an effect: rgbw is reached in ms milliseconds.
+  key:function(rgbw,ms)
+  {
+    return {r:rgbw.r,g:rgbw.g,b:rgbw.b,w:rgbw.w,ms:ms,white:rgbw.checked===null};
+  },
+  // Plays keys in turn, repeat times (0 for no end); blend is 'linear',
+  // 'in', 'out', 'in_out' or 'step'. See led_play() in src/led.h.
+  play:function(keys,repeat,blend)
+  {
+    return LED._play(JSON.stringify({keys:keys,repeat:repeat,blend:blend}));
+  },
+  // Full-scale duty of the RGB and the white channels, 0..1.
+  levels:function(rgb,w)
+  {
+    LED._levels(rgb*255,rgb*255,rgb*255,w*255);
+  }
+};
+LED.setup(red,green,blue,white,200);
+if(Cfg.get('led.strip_pixels')>0)
+{
+  LED.add_strip(Cfg.get('led.strip_pin'),Cfg.get('led.strip_pixels'));
+}
+
 /***************FUNCTIONS******************/
 
 let log=function(str)
 {
   print(JSON.stringify(str));
 };
-let write_bus=function(r_b,g_b,b_b,w_b,freq)
-{
-   
-  //print('Write To Bus : ',r_b,g_b,b_b,w_b);
-  PWM.set(red, freq, r_b);
-  PWM.set(green, freq, g_b);
-  PWM.set(blue, freq, b_b);
-  PWM.set(white, freq, w_b);
-  
-};
 let getduty=function(ch,led)
 {
 
@@ -81,78 +136,16 @@ let getduty=function(ch,led)
 
 };
 
-let write_rgbwjs=function(rgbw)
-{
-  let duty_mult=RGB_DUTY_RGBW;
-  let duty_mult_w=W_DUTY_RGBW;
-  //log("RGBW");
-   
-  write_bus((rgbw.r/255)*duty_mult,(rgbw.g/255)*duty_mult,(rgbw.b/255)*duty_mult,(rgbw.w/255)*duty_mult_w,200);
-};
-
-let write_ctjs=function(rgbw)
-{
-  let duty_mult=RGB_DUTY_CT;
-  let duty_mult_w=W_DUTY_CT;
-  //log("CT");
-   
-  write_bus((rgbw.r/255)*duty_mult,(rgbw.g/255)*duty_mult,(rgbw.b/255)*duty_mult,(rgbw.w/255)*duty_mult_w,200);
-};
-
-let minimum=function(arr) {
-  let min = arr[0], max = arr[0];
-
-  for (let i = 1, len=arr.length; i < len; i++) {
-    let v = arr[i];
-    min = (v < min) ? v : min;
-    max = (v > max) ? v : max;
-  }
-
-  return  min ;
-};
-
-let write_js=function(rgbw)
+// Sets the channel levels of the mode selected by CUR_CH.
+let set_mode=function()
 {
-   
-   if(rgbw.r>255)
-     rgbw.r=255;
-   if(rgbw.r<0)
-    rgbw.r=0;
-    
-   if(rgbw.g>255)
-     rgbw.g=255;
-   if(rgbw.g<0)
-    rgbw.g=0;
-    
-   if(rgbw.b>255)
-     rgbw.b=255;
-   if(rgbw.b<0)
-    rgbw.b=0;
-    
-   if(rgbw.w>255)
-     rgbw.w=255;
-   if(rgbw.w<0)
-    rgbw.w=0;
-
-   if(rgbw.checked===null)
-   {
-    let min=minimum([rgbw.r, rgbw.g, rgbw.b]);
-    rgbw.r=rgbw.r-min;
-    rgbw.g=rgbw.g-min;
-    rgbw.b=rgbw.b-min;
-    rgbw.w=rgbw.w+min;
-   } 
-    
-    
- 
    if(CUR_CH<THR)
    {
-     write_rgbwjs(rgbw);
+     LED.levels(RGB_DUTY_RGBW,W_DUTY_RGBW);
    }
    else if(CUR_CH>THR){
-     write_ctjs(rgbw);
+     LED.levels(RGB_DUTY_CT,W_DUTY_CT);
    }
-  
 };
 
 let turn_off=function()
@@ -164,44 +157,7 @@ let turn_off=function()
 		  b:0,
 		  w:0 
 		};
-	write_rgbwjs(off_state);
-
-};
-
-
-let transit=function(rgb0,rgb1 ){
-      
-           let dr=rgb1.r-rgb0.r;
-           let dg=rgb1.g-rgb0.g;
-           let db=rgb1.b-rgb0.b;
-           let dw=rgb1.w-rgb0.w; 
-       
-       
-          if(dr!==0 || dg!==0 || db !==0 || dw!==0  )
-          {
-            let i=0;
-            let rgbwf={
-               r:0,
-               g:0,
-               b:0,
-               w:0,
-               checked:rgb1.checked 
-            };
-            let step=10;
-            for(i=0;i<=step;i++)
-            {
-               rgbwf.r=rgb0.r + ((dr * i) / step);
-               rgbwf.g=rgb0.g + ((dg * i) / step);
-               rgbwf.b=rgb0.b + ((db * i) / step);
-               rgbwf.w=rgb0.w + ((dw * i) / step);
-               write_js(rgbwf);
-               //print(JSON.stringify(rgbwf));
-               Sys.usleep(2);
-               
-            };
-      
-          }
-
+	LED.write(off_state);
 
 };
 
@@ -229,11 +185,15 @@ RPC.addHandler('set_rgb',function(args){
                     b:01,
                     w:01 
                   }; 
+         set_mode();
+         LED.transit(rgb_prev,0,LED.LINEAR);
       }
       PREV_CH=CUR_CH;
-      transit(rgb_prev,rgbw);
+      if(CUR_CH!==THR)
+      {
+         LED.submit(rgbw,TRANSIT_MS,LED.EASE_OUT);
+      }
       rgb_prev=rgbw;
-      print(JSON.stringify(args));
       let res={
           "result":"OK",
           "data":args
@@ -241,149 +201,51 @@ RPC.addHandler('set_rgb',function(args){
     return res;
     
   });
-let i=0;
-let period_in_seconds=10;
-let fade_timer=-1;
-let rgbwf={
-     r:0,
-     g:0,
-     b:0,
-     w:0 
-  };
-let rgbw=rgbwf;
+let EFFECT_STEP_MS=160;
+let off={
+  r:0,
+  g:0,
+  b:0,
+  w:0 
+};
+
+// Flashes rgbw period_in_seconds times, then turns off.
 let fade=function(_rgbw,_period_in_seconds)
 {
- 
-  
-  period_in_seconds=_period_in_seconds;
-  rgbw =_rgbw;
-  rgbwf={
-     r:0,
-     g:0,
-     b:0,
-     w:0 
-  };
-  
-  i=0;
-  fade_timer=Timer.set(160, Timer.REPEAT, function() {
-   
-   if(i<period_in_seconds)
-   {
-    
-    
-    transit(rgbw,rgbwf);
-    transit(rgbwf,rgbw);
-    i=i+1;
-    
-   }
-   else{
-     turn_off();
-     Timer.del(fade_timer);
-     fade_timer=-1;
-   }
-   
-   
-  }, null);
-
- 
-
-
+  if(_period_in_seconds>0)
+  {
+    LED.play([LED.key(_rgbw,EFFECT_STEP_MS/2),LED.key(off,EFFECT_STEP_MS/2)],
+             _period_in_seconds,'linear');
+  }
+  else{
+    turn_off();
+  }
 };
 
-let fade_array_timer=-1;
-let color_array=[];
+// Fades from one colour of the array to the next; repeat 0 for no end.
 let fade_arr=function(_color_array,repeat){
-
-
-                disable_effects();
-                i=0;
-   
-                color_array=_color_array;
-                     
-               
-                fade_array_timer=Timer.set(160, Timer.REPEAT, function() {
-                
-                
-                    
-          
-                   let j=i;
-                    i++;
-                    if(i===color_array.length)
-                     i=0;
-                    //print(i,JSON.stringify(color_array[i]));
-                     
-                  
-                    transit(color_array[j],color_array[i]);
-                    
-                    
-                
-                
-                
-                }, null);
-
-
-   
-
-
-
+  let keys=[];
+  for(let j=0;j<_color_array.length;j++)
+  {
+    keys[keys.length]=LED.key(_color_array[j],EFFECT_STEP_MS);
+  }
+  LED.play(keys,repeat>0 ? repeat : 0,'linear');
 };
 
-
-let transit_array_timer=-1;
+// As fade_arr, going through off between colours.
 let transit_arr=function(_color_array,repeat){
-
-
-                disable_effects();
-                i=0;
-                
-                color_array=_color_array;
-                     
-               
-                transit_array_timer=Timer.set(160, Timer.REPEAT, function() {
-                
-                
-                  let off={
-                    r:0,g:0,b:0,w:0
-                  };
-          
-                   let j=i;
-                    i++;
-                    if(i===color_array.length)
-                     i=0;
-                    //print(i,JSON.stringify(color_array[i]));
-                     
-                  
-                    transit(color_array[j],off);
-                    transit(off,color_array[i]);
-                    
-                    
-                
-                
-                
-                }, null);
-
-
-   
-
-
-
+  let keys=[];
+  for(let j=0;j<_color_array.length;j++)
+  {
+    keys[keys.length]=LED.key(off,EFFECT_STEP_MS/2);
+    keys[keys.length]=LED.key(_color_array[j],EFFECT_STEP_MS/2);
+  }
+  LED.play(keys,repeat>0 ? repeat : 0,'linear');
 };
 
-
-
 let disable_effects=function()
 {
- 
-    if(transit_array_timer!==-1)
-      Timer.del(transit_array_timer);
-      
-    if(fade_array_timer!==-1)
-      Timer.del(fade_array_timer);
-     
-    if(fade_timer!==-1)
-      Timer.del(fade_timer);
-     
-
+  LED.stop();
 };
 /*RPC.addHandler('set_brightness',function(args){
   
@@ -412,8 +274,6 @@ RPC.addHandler('set_effect',function(args){
 
   if(args.effect==="fade"){
     
-    if(fade_timer!==-1)
-      Timer.del(fade_timer);
     let rgbw_fade=args.rgbw;
     fade(rgbw_fade,args.repeat);
     
@@ -421,16 +281,12 @@ RPC.addHandler('set_effect',function(args){
   }
   else if(args.effect==="fade_array"){
     
-    if(fade_array_timer!==-1)
-      Timer.del(fade_array_timer);
     
     let rgbw_array=args.rgbw_array;
     fade_arr(rgbw_array,args.repeat);
     
   }else if(args.effect==="transit_array"){
     
-    if(transit_array_timer!==-1)
-      Timer.del(transit_array_timer);
     
     let rgbw_array=args.rgbw_array;
     transit_arr(rgbw_array,args.repeat);
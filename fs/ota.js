@@ -2,29 +2,99 @@ load('api_file.js');
 load('api_rpc.js');
 load('api_sys.js');
 load('api_timer.js');
+// Script updates. A bundle of files, each with its SHA-256, is downloaded
+// next to the files it replaces, as <name>.new, and applied on the next
+// boot through the journal in updater_data.json. Its status is one of:
+//
+//   TO_COMMIT    all files are downloaded and verified: move each <name>
+//                to <name>.bak and <name>.new to <name>
+//   TRIAL        applied; committed once worker.js has loaded and run for
+//                UPD.TRIAL_MS without a reboot, see UPD.check(); else all
+//                files go back. The new scripts may call UPD.commit()
+//                sooner
+//   ROLLBACK     moving the .bak files back
+//   COMMITED_OK  nothing to do
+//
+// Each step can be run again from the start, so after a reboot at any
+// point the files end up all old or all new.
 let UPD={
 
+    TRIAL_MS:10000,
+    JOURNAL:'updater_data.json',
+    bundle:null,
+    loaded:false,
+
+    exists:function(name)
+    {
+        let fp=File.fopen(name,'r');
+        if(fp===null)
+        {
+          return false;
+        }
+        File.fclose(fp);
+        return true;
+    },
+
+    apply:function(s)
+    {
+        for(let i=0;i<s.files.length;i++)
+        {
+          let f=s.files[i];
+          if(UPD.exists(f.file_n))
+          {
+            if(UPD.exists(f.file_o))
+            {
+              File.remove(f.file_o+'.bak');
+              File.rename(f.file_o,f.file_o+'.bak');
+            }
+            File.rename(f.file_n,f.file_o);
+          }
+        }
+        s.status="TRIAL";
+        write_data(UPD.JOURNAL,s);
+    },
+
     rollback:function(s){
         print('ugh rolling back');
-        File.remove('worker.js');
-        File.rename('worker.js.bak', 'worker.js');
-        s.status="COMMITED_OK";
-        write_data('updater_data.json',s);
+        s.status="ROLLBACK";
+        write_data(UPD.JOURNAL,s);
+        for(let i=0;i<s.files.length;i++)
+        {
+          let f=s.files[i];
+          if(f.is_new)
+          {
+            File.remove(f.file_o);
+          }
+          else if(UPD.exists(f.file_o+'.bak'))
+          {
+            File.remove(f.file_o);
+            File.rename(f.file_o+'.bak',f.file_o);
+          }
+          File.remove(f.file_n);
+        }
+        write_data(UPD.JOURNAL,{files:[],status:"COMMITED_OK"});
         Sys.reboot(5);
     },
+
+    // Keeps the update on trial.
     commit:function()
     {
-        let s={
-          files:[],
-          status:"COMMIED_OK"
-        };
-        write_data("updater_data.json",s);
-
+        let s=read_data(UPD.JOURNAL);
+        if(s===null || s.status!=="TRIAL")
+        {
+          return;
+        }
+        write_data(UPD.JOURNAL,{files:[],status:"COMMITED_OK"});
+        for(let i=0;i<s.files.length;i++)
+        {
+          File.remove(s.files[i].file_o+'.bak');
+        }
     },
+
     check:function()
     {
               
-        let s = read_data('updater_data.json');
+        let s = read_data(UPD.JOURNAL);
           if(s===null)
           {
             s={
@@ -33,74 +103,162 @@ let UPD={
               status:"COMMITED_OK"
         
             };
-            write_data('updater_data.json',s);
+            write_data(UPD.JOURNAL,s);
           }
-        if(s.status==="COMMITED_OK")
+        if(s.status==="TRIAL" || s.status==="ROLLBACK")
         {
-          load('worker.js');
+          // Rebooted before the new scripts committed.
+          UPD.rollback(s);
+          return s;
         }
-        else if(s.status==="TO_COMMIT")
+        if(s.status==="TO_COMMIT")
         {
-          print('Seems like changes to be commited');
-          File.rename('worker.js', 'worker.js.bak');
-          File.rename('worker.js.new', 'worker.js');
-          Timer.set(10000  , 0, function() {
+          print('Applying update of',s.files.length,'files');
+          UPD.apply(s);
+          Timer.set(UPD.TRIAL_MS  , 0, function() {
              
-              s = read_data('updater_data.json');
-              if(s.status==="COMMIED_OK"){
-        
-                print('Seems all went ok');
+              let s = read_data(UPD.JOURNAL);
+              if(s!==null && s.status==="TRIAL" && !UPD.loaded){
+               UPD.rollback(s);
               }
               else{
-               UPD.rollback(s);
+                UPD.commit();
+                print('Seems all went ok');
               }
               
             
           }, null);
-          load('worker.js');
         }
+        load('worker.js');
+        // Not reached if worker.js fails to load, which stops this script;
+        // the trial timer rolls the update back then.
+        UPD.loaded=true;
         
         
       return s;
 
-    }
+    },
 
+    // Downloads a bundle, [{url, name, sha256}, ...], all files at once.
+    // Calls cb(true) once all are verified and due to be applied on the
+    // next boot, cb(false) if any has failed; none is kept then. Returns
+    // false if a bundle is being downloaded already, or the last one is not
+    // committed yet: its journal is what would roll it back.
+    start:function(files,cb)
+    {
+        if(UPD.bundle!==null)
+        {
+          return false;
+        }
+        let s=read_data(UPD.JOURNAL);
+        if(s===null || s.status!=="COMMITED_OK")
+        {
+          return false;
+        }
+        UPD.bundle={files:files,pending:files.length,failed:false,cb:cb};
+        for(let i=0;i<files.length;i++)
+        {
+          let f=files[i];
+          let args={url:f.url,file:f.name+'.new'};
+          if(f.sha256!==undefined)
+          {
+            args.sha256=f.sha256;
+          }
+          let ok=RPC.call(RPC.LOCAL,'Fetch',args,function(res,err_code,err_msg,f){
+              if(err_code!==0)
+              {
+                print('Download of',f.name,'failed:',err_msg);
+              }
+              UPD.fetched(f,err_code===0);
+          },f);
+          if(!ok)
+          {
+            UPD.fetched(f,false);
+          }
+        }
+        return true;
+    },
 
+    fetched:function(f,ok)
+    {
+        let b=UPD.bundle;
+        if(!ok)
+        {
+          b.failed=true;
+        }
+        b.pending--;
+        if(b.pending>0)
+        {
+          return;
+        }
+        UPD.bundle=null;
+        if(b.failed)
+        {
+          for(let i=0;i<b.files.length;i++)
+          {
+            File.remove(b.files[i].name+'.new');
+          }
+          b.cb(false);
+          return;
+        }
+        let s={files:[],status:"TO_COMMIT"};
+        for(let i=0;i<b.files.length;i++)
+        {
+          let name=b.files[i].name;
+          s.files[i]={file_o:name,file_n:name+'.new',is_new:!UPD.exists(name)};
+        }
+        write_data(UPD.JOURNAL,s);
+        b.cb(true);
+    }
 
 };
+// Falls back to the temporary file of write_data if cut off before the
+// rename.
 let read_data=function(file)
 {
     let clon=File.read(file);
     if(clon===null)
+    {
+      clon=File.read(file+'.tmp');
+    }
+    if(clon===null)
     {
       return null;
     }
     return JSON.parse(clon);
 };
 
+// Writes through a temporary file, so that a reboot in the middle leaves
+// either the old or the new data.
 let write_data=function(file,data)
 {
     print('writing ',JSON.stringify(data));
-    File.write(JSON.stringify(data),file);
+    File.write(JSON.stringify(data),file+'.tmp');
+    File.remove(file);
+    File.rename(file+'.tmp',file);
 };
 
 
 
-let callback=null;
-let download=function(url,name,_callback){
+// Fetch keeps the file if the server says it has not changed, or if sha256
+// (optional) matches a file it has downloaded before. Downloads may queue up
+// in Fetch, so each one carries its own callback.
+let download=function(url,name,sha256,_callback){
 
 
-    callback=_callback;
     let args={"url": url, "file": name};
+    if(sha256!==undefined)
+    {
+      args.sha256=sha256;
+    }
 
-    File.remove(name);
-    RPC.call(RPC.LOCAL,'Fetch',args,function(res){
+    RPC.call(RPC.LOCAL,'Fetch',args,function(res,err_code,err_msg,callback){
 
         print('Download Res',JSON.stringify(res));
         callback(res);
         return true;
 
-    });
+    },_callback);
 
 
 
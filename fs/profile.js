@@ -0,0 +1,39 @@
+load('api_rpc.js');
+load('api_timer.js');
+
+// Profiling of JS RPC handlers and timers, see src/profile.h. Handlers
+// and timers set up after this file is loaded are measured, and show up
+// in the Sys.Profile RPC.
+let Prof={
+
+    stat:ffi('void *prof_stat(char *, char *)'),
+    begin:ffi('void prof_begin(void *)'),
+    end:ffi('void prof_end(void *)'),
+    _set:ffi('int mgos_set_timer(int,int,void(*)(userdata),userdata)'),
+
+    // Called from C, with what to call in the userdata: mJS has no closures.
+    _rpc:function(ri,args,src,ud)
+    {
+        Prof.begin(ud.st);
+        RPC._ahcb(ri,args,src,ud);
+        Prof.end(ud.st);
+    },
+    _timer:function(ud)
+    {
+        Prof.begin(ud.st);
+        ud.cb(ud.ud);
+        Prof.end(ud.st);
+    }
+};
+
+RPC.addHandler=function(name,cb,ud)
+{
+    let data={cb:cb,ud:ud,st:Prof.stat('rpc',name)};
+    RPC._ah(RPC._sdup(name),Prof._rpc,data);
+};
+
+Prof.js_timers=Prof.stat('timer','js');
+Timer.set=function(ms,flags,cb,ud)
+{
+    return Prof._set(ms,flags,Prof._timer,{cb:cb,ud:ud,st:Prof.js_timers});
+};
@@ -0,0 +1,106 @@
+/*
+ * CRC-32, see crc32.h.
+ *
+ * ESP32 has a table-driven implementation in mask ROM, which costs no RAM.
+ * Elsewhere slice-by-8 is used: eight 256-entry tables, built on first use,
+ * let the loop take eight bytes per iteration with independent lookups.
+ */
+
+#include "crc32.h"
+
+#include <stdbool.h>
+
+#include "common/platform.h"
+
+#define CRC32_POLY 0xedb88320U
+
+/*
+ * Appending len2 bytes to a block multiplies its CRC by x^(8 * len2) mod
+ * the polynomial. The operator for one zero bit is a 32x32 matrix over
+ * GF(2), squared repeatedly to cover len2 in log2(len2) steps.
+ */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  for (; vec != 0; vec >>= 1, mat++) {
+    if (vec & 1) sum ^= *mat;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+  int n;
+  for (n = 0; n < 32; n++) square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+uint32_t crc32_concat(uint32_t crc1, uint32_t crc2, size_t len2) {
+  uint32_t even[32], odd[32], row = 1;
+  int n;
+  if (len2 == 0) return crc1;
+  /* Operator for one zero bit, then for two and four. */
+  odd[0] = CRC32_POLY;
+  for (n = 1; n < 32; n++, row <<= 1) odd[n] = row;
+  gf2_matrix_square(even, odd);
+  gf2_matrix_square(odd, even);
+  /* Apply the operator for each set bit of len2, in bytes. */
+  do {
+    gf2_matrix_square(even, odd);
+    if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+    len2 >>= 1;
+    if (len2 == 0) break;
+    gf2_matrix_square(odd, even);
+    if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+    len2 >>= 1;
+  } while (len2 != 0);
+  return crc1 ^ crc2;
+}
+
+#if CS_PLATFORM == CS_P_ESP32
+#include "rom/crc.h"
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+  return crc32_le(crc, (const uint8_t *) data, len);
+}
+
+#else
+
+static uint32_t s_table[8][256];
+static bool s_table_ready = false;
+
+static void crc32_init_table(void) {
+  uint32_t i, j, c;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++) c = (c & 1 ? CRC32_POLY ^ (c >> 1) : c >> 1);
+    s_table[0][i] = c;
+  }
+  for (i = 0; i < 256; i++) {
+    c = s_table[0][i];
+    for (j = 1; j < 8; j++) {
+      c = s_table[0][c & 0xff] ^ (c >> 8);
+      s_table[j][i] = c;
+    }
+  }
+  s_table_ready = true;
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  if (!s_table_ready) crc32_init_table();
+  crc = ~crc;
+  while (len >= 8) {
+    uint32_t a = crc ^ ((uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+                        ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24));
+    uint32_t b = (uint32_t) p[4] | ((uint32_t) p[5] << 8) |
+                 ((uint32_t) p[6] << 16) | ((uint32_t) p[7] << 24);
+    crc = s_table[7][a & 0xff] ^ s_table[6][(a >> 8) & 0xff] ^
+          s_table[5][(a >> 16) & 0xff] ^ s_table[4][a >> 24] ^
+          s_table[3][b & 0xff] ^ s_table[2][(b >> 8) & 0xff] ^
+          s_table[1][(b >> 16) & 0xff] ^ s_table[0][b >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) crc = s_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+#endif
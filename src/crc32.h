@@ -0,0 +1,34 @@
+/*
+ * Table-driven CRC-32 (the zip / zlib polynomial).
+ *
+ * Drop-in replacement for cs_crc32(), which works one bit at a time and
+ * ends up being the slowest part of writing an update to flash.
+ */
+
+#ifndef SRC_CRC32_H_
+#define SRC_CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Continues `crc` over `len` bytes of `data`. Start with 0; the result is
+ * the same as that of cs_crc32() or zlib's crc32().
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+/*
+ * Returns the CRC of two adjacent blocks given the CRC of each and the
+ * length of the second one, like zlib's crc32_combine().
+ */
+uint32_t crc32_concat(uint32_t crc1, uint32_t crc2, size_t len2);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_CRC32_H_ */
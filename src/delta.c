@@ -0,0 +1,183 @@
+/*
+ * Streaming binary patch applier, see delta.h.
+ */
+
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DELTA_MAGIC "MGD1"
+#define DELTA_HEADER_SIZE 12U
+#define DELTA_RECORD_SIZE 5U
+
+enum delta_state {
+  DS_HEADER = 0,
+  DS_RECORD,
+  DS_ADD,
+  DS_INSERT,
+  DS_DONE,
+  DS_ERROR,
+};
+
+struct delta {
+  enum delta_state state;
+  const char *error;
+
+  delta_read_base_cb read_base;
+  void *read_base_arg;
+
+  uint32_t base_size;
+  uint32_t target_size;
+  uint32_t base_pos;
+  uint32_t produced;
+  uint32_t op_left;
+
+  size_t rpos, wpos;
+  uint8_t buf[DELTA_OUT_SIZE];
+};
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) |
+         ((uint32_t) p[3] << 24);
+}
+
+struct delta *delta_create(delta_read_base_cb read_base, uint32_t base_size,
+                           void *arg) {
+  struct delta *d = (struct delta *) calloc(1, sizeof(*d));
+  if (d == NULL) return NULL;
+  d->read_base = read_base;
+  d->read_base_arg = arg;
+  d->base_size = base_size;
+  return d;
+}
+
+void delta_free(struct delta *d) {
+  free(d);
+}
+
+const char *delta_error(const struct delta *d) {
+  return d->error;
+}
+
+uint32_t delta_target_size(const struct delta *d) {
+  return d->target_size;
+}
+
+const uint8_t *delta_output(const struct delta *d, size_t *len) {
+  *len = d->wpos - d->rpos;
+  return d->buf + d->rpos;
+}
+
+void delta_consume(struct delta *d, size_t len) {
+  if (len > d->wpos - d->rpos) len = d->wpos - d->rpos;
+  d->rpos += len;
+  if (d->rpos == d->wpos) d->rpos = d->wpos = 0;
+}
+
+/* Returns number of bytes that can be written at wpos right now. */
+static size_t out_room(struct delta *d) {
+  if (d->wpos == DELTA_OUT_SIZE && d->rpos > 0) {
+    memmove(d->buf, d->buf + d->rpos, d->wpos - d->rpos);
+    d->wpos -= d->rpos;
+    d->rpos = 0;
+  }
+  return DELTA_OUT_SIZE - d->wpos;
+}
+
+static enum delta_result fail(struct delta *d, const char *error) {
+  d->error = error;
+  d->state = DS_ERROR;
+  return DELTA_ERROR;
+}
+
+static enum delta_result delta_step(struct delta *d, const uint8_t **in,
+                                    const uint8_t *in_end) {
+  while (true) {
+    size_t avail = in_end - *in;
+    switch (d->state) {
+      case DS_HEADER: {
+        if (avail < DELTA_HEADER_SIZE) return DELTA_NEED_INPUT;
+        if (memcmp(*in, DELTA_MAGIC, 4) != 0) {
+          return fail(d, "Not a delta patch");
+        }
+        if (get_u32(*in + 4) != d->base_size) {
+          return fail(d, "Patch is for another base image");
+        }
+        d->target_size = get_u32(*in + 8);
+        *in += DELTA_HEADER_SIZE;
+        d->state = DS_RECORD;
+        break;
+      }
+      case DS_RECORD: {
+        if (d->produced == d->target_size) {
+          d->state = DS_DONE;
+          break;
+        }
+        if (avail < DELTA_RECORD_SIZE) return DELTA_NEED_INPUT;
+        uint8_t op = **in;
+        uint32_t arg = get_u32(*in + 1);
+        *in += DELTA_RECORD_SIZE;
+        switch (op) {
+          case 'A':
+          case 'I':
+            if (arg > d->target_size - d->produced) {
+              return fail(d, "Patch exceeds target size");
+            }
+            d->op_left = arg;
+            d->state = (op == 'A' ? DS_ADD : DS_INSERT);
+            break;
+          case 'S':
+            /* Cursor is only checked when it is used. */
+            d->base_pos += arg;
+            break;
+          default:
+            return fail(d, "Invalid patch record");
+        }
+        break;
+      }
+      case DS_ADD:
+      case DS_INSERT: {
+        while (d->op_left > 0) {
+          size_t n = out_room(d);
+          if (n == 0) return DELTA_OUTPUT_FULL;
+          if (n > d->op_left) n = d->op_left;
+          if (n > (size_t)(in_end - *in)) n = in_end - *in;
+          if (n == 0) return DELTA_NEED_INPUT;
+          uint8_t *out = d->buf + d->wpos;
+          if (d->state == DS_ADD) {
+            size_t i;
+            if (d->base_pos > d->base_size || n > d->base_size - d->base_pos) {
+              return fail(d, "Patch reads past the base image");
+            }
+            if (!d->read_base(d->base_pos, out, n, d->read_base_arg)) {
+              return fail(d, "Failed to read the base image");
+            }
+            for (i = 0; i < n; i++) out[i] += (*in)[i];
+            d->base_pos += n;
+          } else {
+            memcpy(out, *in, n);
+          }
+          *in += n;
+          d->wpos += n;
+          d->produced += n;
+          d->op_left -= n;
+        }
+        d->state = DS_RECORD;
+        break;
+      }
+      case DS_DONE:
+        return DELTA_DONE;
+      case DS_ERROR:
+        return DELTA_ERROR;
+    }
+  }
+}
+
+enum delta_result delta_run(struct delta *d, const uint8_t *in, size_t len,
+                            size_t *consumed) {
+  const uint8_t *p = in;
+  enum delta_result res = delta_step(d, &p, in + len);
+  *consumed = p - in;
+  return res;
+}
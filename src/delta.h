@@ -0,0 +1,84 @@
+/*
+ * Streaming binary patch applier for delta updates.
+ *
+ * A patch describes the target image in terms of a base image (the firmware
+ * currently running), in the spirit of bsdiff: most of the target is the
+ * base with small arithmetic differences, the rest is new data. The updater
+ * checks that the running firmware is the base before it starts, by the
+ * "base_size" and "base_cs_sha1" of the part in the manifest. Patches are
+ * made by tools/mkdelta.py. Patch layout, all integers are little-endian:
+ *
+ *   "MGD1"                         4
+ *   base image size                4
+ *   target image size              4
+ *   records, until the whole target is produced:
+ *     op                           1
+ *     argument                     4
+ *     payload                      argument bytes, ADD and INSERT only
+ *
+ * Operations:
+ *   'A' ADD     payload bytes are added (mod 256) to base bytes at the base
+ *               cursor, the cursor advances by the same amount;
+ *   'I' INSERT  payload bytes are copied to the output as is;
+ *   'S' SEEK    argument, as a signed number, is added to the base cursor.
+ *
+ * Like the inflater, the patcher takes input in arbitrary pieces and leaves
+ * an incomplete header or record at the end of a piece unconsumed. Output is
+ * held until taken with delta_output() / delta_consume().
+ */
+
+#ifndef SRC_DELTA_H_
+#define SRC_DELTA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum amount of output held until consumed by the caller. */
+#define DELTA_OUT_SIZE 4096U
+
+enum delta_result {
+  DELTA_ERROR = -1,
+  DELTA_NEED_INPUT = 0,
+  DELTA_OUTPUT_FULL = 1,
+  DELTA_DONE = 2,
+};
+
+/* Reads `len` bytes of the base image at `offset`. */
+typedef bool (*delta_read_base_cb)(uint32_t offset, void *buf, size_t len,
+                                   void *arg);
+
+struct delta;
+
+/*
+ * `base_size` is the size of the base image the patch must have been made
+ * against; a patch whose header says otherwise is refused.
+ */
+struct delta *delta_create(delta_read_base_cb read_base, uint32_t base_size,
+                           void *arg);
+
+/* Same as inflater_run(). */
+enum delta_result delta_run(struct delta *d, const uint8_t *in, size_t len,
+                            size_t *consumed);
+
+const uint8_t *delta_output(const struct delta *d, size_t *len);
+
+void delta_consume(struct delta *d, size_t len);
+
+/* Size of the target image, known once the header has been processed. */
+uint32_t delta_target_size(const struct delta *d);
+
+/* Returns description of the last error, or NULL. */
+const char *delta_error(const struct delta *d);
+
+void delta_free(struct delta *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_DELTA_H_ */
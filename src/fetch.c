@@ -0,0 +1,1605 @@
+/*
+ * Fetch RPC, see fetch.h.
+ *
+ * Transfers go over a pool of HTTP/1.1 connections that stay open between
+ * requests. At most fetch.max_conns connections are open at a time. A
+ * request is sent on an idle connection to its host if there is one,
+ * otherwise on a new connection, otherwise - if fetch.pipeline allows -
+ * behind the requests already in flight on a connection to that host.
+ * Requests that find no connection wait in a queue, by priority and then in
+ * arrival order. A new transfer only starts while free heap is above
+ * fetch.min_free_heap, see fetch_admit(). Transfers can be listed, with
+ * their progress, and cancelled with Fetch.List and Fetch.Cancel.
+ *
+ * A download to a file can be split into segments fetched in parallel with
+ * Range requests, see req_add_segments().
+ *
+ * File writes go through a write-behind buffer per download or segment, so
+ * that flash sees whole sectors instead of every network read, see
+ * wbuf_write().
+ *
+ * A UART takes only what fits in its transmit buffer. The rest of the reply
+ * stays in the receive buffer of the connection, which stops reading once
+ * that is full, and is picked up again from a timer that polls the UART
+ * for room, see uart_poll(); the UART dispatcher is left to the app. Nothing
+ * waits for the UART, not even a reply whose connection has been closed,
+ * see conn_closed().
+ *
+ * Requests that are not for a range offer gzip, and a gzip-encoded reply is
+ * decoded on the way to the file or UART. A decoder takes about 38 KB, so
+ * only fetch.gzip_decoders requests at a time offer it.
+ *
+ * A firmware archive can go straight to the updater instead, which writes
+ * it to the inactive slot as it arrives, with no copy on the filesystem.
+ * If the connection drops, the download is resumed with a Range request
+ * from where the updater has got to, see req_resume(). Parts the updater
+ * is going to skip are not downloaded, see req_skip(). If the update
+ * times out, the download is stopped, see fetch_update_aborted(). OTA.Update
+ * takes the same path, see ota_update_handler().
+ *
+ * Downloads to files are recorded in the cache index, see fetch_cache.h. A
+ * file that is in the index is asked for with the validators the server
+ * gave for it, and is only opened for writing if it has changed. A file
+ * whose SHA-256 is given is not downloaded at all if the index has one with
+ * that content.
+ *
+ * Replies are framed here rather than by the mongoose HTTP client: once a
+ * body has been consumed in chunks, the latter loses track of where the
+ * reply ends, so it can neither reuse the connection nor pipeline on it.
+ */
+
+#include "fetch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "common/queue.h"
+
+#include "mbedtls/sha256.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#include "crc32.h"
+#include "fetch_cache.h"
+#include "gunzip.h"
+#include "profile.h"
+#include "updater.h"
+
+/* Longest status line and headers accepted in a reply. */
+#ifndef FETCH_MAX_HEADERS_SIZE
+#define FETCH_MAX_HEADERS_SIZE 2048
+#endif
+
+/*
+ * Receive buffer limit of a connection. It is where reading stops while
+ * the UART is catching up, and must hold the reply headers.
+ */
+#ifndef FETCH_RECV_BUF_LIMIT
+#define FETCH_RECV_BUF_LIMIT 4096
+#endif
+
+/* Longest chunk size or trailer line accepted in a chunked reply. */
+#define FETCH_MAX_LINE_SIZE 256
+
+/*
+ * A segmented download starts with a request for this many bytes, which
+ * also tells the size of the resource; segments are not made smaller.
+ */
+#ifndef FETCH_SEGMENT_MIN_SIZE
+#define FETCH_SEGMENT_MIN_SIZE (16 * 1024)
+#endif
+
+#define FETCH_MAX_SEGMENTS 8
+
+/* range_end of a request for everything from range_start on. */
+#define FETCH_RANGE_TO_END ((size_t) -1)
+
+/* Times in a row an update is resumed without getting any further. */
+#ifndef FETCH_OTA_MAX_RESUMES
+#define FETCH_OTA_MAX_RESUMES 5
+#endif
+
+/*
+ * A part of an update archive that the updater is going to skip, e.g. one
+ * that is installed already, is not downloaded if it is at least this big
+ * and the server serves ranges: a new connection asks for what follows it.
+ */
+#ifndef FETCH_OTA_SKIP_MIN_SIZE
+#define FETCH_OTA_SKIP_MIN_SIZE (64 * 1024)
+#endif
+
+/*
+ * How often a reply that is waiting for the UART checks it for room. At
+ * 115200 baud, the UART sends some 230 bytes in that time.
+ */
+#ifndef FETCH_UART_POLL_MS
+#define FETCH_UART_POLL_MS 20
+#endif
+
+/* Writes to files are coalesced into whole sectors of this size. */
+#ifndef FETCH_SECTOR_SIZE
+#define FETCH_SECTOR_SIZE 4096
+#endif
+
+enum fetch_body_state {
+  FBS_HEADERS = 0, /* Status line and headers */
+  FBS_LENGTH,      /* Body of known length */
+  FBS_UNTIL_CLOSE, /* Body that ends with the connection */
+  FBS_CHUNK_SIZE,  /* Chunked body: size line */
+  FBS_CHUNK_DATA,  /* Chunked body: chunk data */
+  FBS_CHUNK_END,   /* Chunked body: line end after the data */
+  FBS_TRAILERS,    /* Chunked body: trailers */
+};
+
+struct fetch_segment {
+  size_t len;
+  uint32_t crc;
+};
+
+struct fetch_req {
+  struct mg_rpc_request_info *ri; /* RPC request info */
+  struct fetch_req *parent;       /* Download this is a segment of */
+  char *url;                      /* URL, the strings below point into it */
+  struct mg_str host, path, query;
+  unsigned int port;
+  bool ssl;
+  char *key;          /* Pool key, scheme://host:port */
+  int uart_no;        /* UART number to write to */
+  char *file;         /* Name of the file to write to */
+  FILE *fp;           /* File to write to, once opened */
+  int status;         /* Request status */
+  int64_t written;    /* Number of bytes written */
+  uint32_t crc;       /* CRC-32 of the bytes written */
+  bool range;         /* Asks for the bytes from range_start to range_end */
+  size_t range_start, range_end;
+  bool replied;       /* Reply headers have arrived */
+  bool reused;        /* Sent on a connection that served others */
+  bool retried;       /* Sent again after its connection was closed */
+  double queued;      /* When the RPC came in */
+  double sent;        /* When the request was sent */
+  double first_byte;  /* When the reply headers arrived */
+  double paused;      /* Time spent waiting for the UART */
+  /* Segmented download: segments after the first range, in file order. */
+  int want_segs;
+  int num_segs;
+  int segs_left;      /* Segments not finished yet */
+  struct fetch_segment *segs;
+  int seg;            /* Index of this segment in parent->segs */
+  bool body_done;     /* Own reply has been received */
+  bool failed;        /* A segment has failed */
+  long file_pos, file_size;
+  unsigned long num_writes;
+  /* Write-behind buffer: wb_len bytes to go to the file at wb_off. */
+  char *wb;
+  long wb_off;
+  size_t wb_len;
+  bool wb_denied;     /* Over the memory budget, writes go straight out */
+  /* Validators sent with the request, then those of a successful reply. */
+  bool conditional;
+  char *etag, *last_modified;
+  char sha256[FETCH_CACHE_SHA256_LEN + 1]; /* Expected SHA-256, if given */
+  mbedtls_sha256_context sha;              /* Of a download in one piece */
+  bool accept_gzip;   /* Holds a decoder slot and offers gzip */
+  struct gunzip *gz;  /* Decoder of a gzip-encoded reply */
+  int64_t wire;       /* Body bytes received, before decoding */
+  int id;             /* Transfer ID, for Fetch.List and Fetch.Cancel */
+  int priority;       /* Transfers of a higher priority start first */
+  bool admitted;      /* Has started, see fetch_admit() */
+  const char *cancelled; /* Why it was stopped, NULL if it was not */
+  double started;     /* When it was admitted */
+  int64_t received;   /* Body bytes received, of all segments */
+  int64_t total;      /* Size of the body, 0 if not known yet */
+  struct update_context *upd; /* Update the body goes to */
+  int resumes;        /* Times resumed since the update last got further */
+  int64_t resumed_at; /* Bytes written when last resumed */
+  bool accept_ranges; /* The server has said that it serves ranges */
+  bool skipping;      /* Closing the connection to skip, see req_skip() */
+  STAILQ_ENTRY(fetch_req) next;
+  STAILQ_ENTRY(fetch_req) next_job; /* In s_jobs */
+};
+
+struct fetch_conn {
+  struct mg_connection *nc;
+  char *key;
+  /* Requests sent, in the order their replies will come. */
+  STAILQ_HEAD(, fetch_req) reqs;
+  int num_reqs;
+  int num_done;       /* Replies completed on this connection */
+  int connect_err;
+  bool keep_alive;    /* Can take more requests */
+  bool paused;        /* Waiting for room in the UART transmit buffer */
+  /* What was left of the replies when the server closed, see conn_closed(). */
+  struct mbuf rest;
+  double paused_since;
+  double idle_since;
+  /* Reply being received, to the first request in reqs. */
+  enum fetch_body_state state;
+  size_t body_left;
+  SLIST_ENTRY(fetch_conn) next;
+};
+
+/* File writes, for Fetch.Stats. */
+static struct {
+  unsigned long writes;
+  unsigned long bytes;
+  /* Writes of under 256 bytes, under 1 KB, under 4 KB and larger. */
+  unsigned long sizes[4];
+  size_t buf_mem, peak_buf_mem;
+  unsigned long over_budget; /* Writers that got no buffer */
+} s_wstats;
+
+static const char s_zeros[FETCH_SECTOR_SIZE] = {0};
+
+static STAILQ_HEAD(, fetch_req) s_queue = STAILQ_HEAD_INITIALIZER(s_queue);
+/* Transfers from the RPC until the reply, in arrival order. */
+static STAILQ_HEAD(, fetch_req) s_jobs = STAILQ_HEAD_INITIALIZER(s_jobs);
+static int s_num_active = 0; /* Transfers admitted */
+static int s_next_id = 1;
+static SLIST_HEAD(, fetch_conn) s_conns = SLIST_HEAD_INITIALIZER(s_conns);
+static int s_num_conns = 0;
+static int s_num_decoders = 0; /* Requests holding a decoder slot */
+/* Runs while a reply is waiting for room in the UART, see uart_poll(). */
+static mgos_timer_id s_uart_timer = MGOS_INVALID_TIMER_ID;
+
+static void fetch_dispatch(void);
+
+static bool parse_url(struct fetch_req *req) {
+  struct mg_str scheme, user_info, fragment;
+  unsigned int port = 0;
+  if (mg_parse_uri(mg_mk_str(req->url), &scheme, &user_info, &req->host, &port,
+                   &req->path, &req->query, &fragment) != 0 ||
+      req->host.len == 0) {
+    return false;
+  }
+  if (scheme.len == 0 || mg_vcmp(&scheme, "http") == 0) {
+    req->ssl = false;
+#if MG_ENABLE_SSL
+  } else if (mg_vcmp(&scheme, "https") == 0) {
+    req->ssl = true;
+#endif
+  } else {
+    return false;
+  }
+  req->port = (port != 0 ? port : (req->ssl ? 443 : 80));
+  mg_asprintf(&req->key, 0, "%s://%.*s:%u", (req->ssl ? "https" : "http"),
+              (int) req->host.len, req->host.p, req->port);
+  return (req->key != NULL);
+}
+
+/* Writes at the current position of the file. */
+static bool file_write(struct fetch_req *t, const char *data, size_t len) {
+  size_t n = fwrite(data, 1, len, t->fp);
+  s_wstats.writes++;
+  s_wstats.bytes += n;
+  s_wstats.sizes[len < 256 ? 0 : len < 1024 ? 1 : len < 4096 ? 2 : 3]++;
+  t->num_writes++;
+  t->file_pos += n;
+  if (t->file_pos > t->file_size) t->file_size = t->file_pos;
+  return (n == len);
+}
+
+/*
+ * Moves the write position of a segmented download. Not all filesystems
+ * can seek past the end of a file, so the gap is filled with zeros, to be
+ * overwritten when the segment before it arrives.
+ */
+static bool file_seek(struct fetch_req *t, long off) {
+  if (off <= t->file_size) {
+    if (fseek(t->fp, off, SEEK_SET) != 0) return false;
+    t->file_pos = off;
+    return true;
+  }
+  if (fseek(t->fp, t->file_size, SEEK_SET) != 0) return false;
+  t->file_pos = t->file_size;
+  while (t->file_pos < off) {
+    size_t n = FETCH_SECTOR_SIZE - t->file_pos % FETCH_SECTOR_SIZE;
+    if (n > (size_t) (off - t->file_pos)) n = off - t->file_pos;
+    if (!file_write(t, s_zeros, n)) return false;
+  }
+  return true;
+}
+
+static bool file_write_at(struct fetch_req *t, long off, const char *data,
+                          size_t len) {
+  if (off != t->file_pos && !file_seek(t, off)) return false;
+  return file_write(t, data, len);
+}
+
+static bool wbuf_flush(struct fetch_req *req) {
+  struct fetch_req *t = (req->parent != NULL ? req->parent : req);
+  bool ok = true;
+  if (req->wb_len > 0) ok = file_write_at(t, req->wb_off, req->wb, req->wb_len);
+  req->wb_len = 0;
+  return ok;
+}
+
+static void wbuf_free(struct fetch_req *req) {
+  if (req->wb == NULL) return;
+  free(req->wb);
+  req->wb = NULL;
+  s_wstats.buf_mem -= FETCH_SECTOR_SIZE;
+}
+
+/*
+ * Writes `len` bytes at `off` through the buffer of `req`. Data is held
+ * until it reaches a sector boundary; whole sectors that arrive in one
+ * piece are written straight from the network buffer. Buffers come out of
+ * a fixed budget, a writer that finds none left writes through.
+ */
+static bool wbuf_write(struct fetch_req *req, long off, const char *data,
+                       size_t len) {
+  struct fetch_req *t = (req->parent != NULL ? req->parent : req);
+  if (req->wb == NULL && !req->wb_denied) {
+    if (s_wstats.buf_mem + FETCH_SECTOR_SIZE <=
+            (size_t) mgos_sys_config_get_fetch_write_buf_budget() &&
+        (req->wb = (char *) malloc(FETCH_SECTOR_SIZE)) != NULL) {
+      s_wstats.buf_mem += FETCH_SECTOR_SIZE;
+      if (s_wstats.buf_mem > s_wstats.peak_buf_mem) {
+        s_wstats.peak_buf_mem = s_wstats.buf_mem;
+      }
+    } else {
+      req->wb_denied = true;
+      s_wstats.over_budget++;
+    }
+  }
+  if (req->wb == NULL) return file_write_at(t, off, data, len);
+  while (len > 0) {
+    size_t room, n;
+    if (req->wb_len == 0) {
+      if (off % FETCH_SECTOR_SIZE == 0 && len >= FETCH_SECTOR_SIZE) {
+        n = len - len % FETCH_SECTOR_SIZE;
+        if (!file_write_at(t, off, data, n)) return false;
+        off += n;
+        data += n;
+        len -= n;
+        continue;
+      }
+      req->wb_off = off;
+    }
+    room = FETCH_SECTOR_SIZE - (req->wb_off + req->wb_len) % FETCH_SECTOR_SIZE;
+    n = (len < room ? len : room);
+    memcpy(req->wb + req->wb_len, data, n);
+    req->wb_len += n;
+    off += n;
+    data += n;
+    len -= n;
+    if (n == room && !wbuf_flush(req)) return false;
+  }
+  return true;
+}
+
+static void req_free(struct fetch_req *req) {
+  wbuf_free(req);
+  gunzip_free(req->gz);
+  if (req->accept_gzip) s_num_decoders--;
+  if (req->id != 0) STAILQ_REMOVE(&s_jobs, req, fetch_req, next_job);
+  if (req->admitted) s_num_active--;
+  /* Segments borrow the URL and the file from their parent. */
+  if (req->parent == NULL) {
+    if (req->fp != NULL) fclose(req->fp);
+    free(req->url);
+    free(req->key);
+    free(req->segs);
+    free(req->file);
+    free(req->etag);
+    free(req->last_modified);
+    mbedtls_sha256_free(&req->sha);
+    if (req->upd != NULL) updater_context_free(req->upd);
+  }
+  free(req);
+}
+
+/*
+ * Success status for a request: 206 if it has asked for a range, 304 if it
+ * has asked for a file only if it has changed.
+ */
+static bool req_ok(const struct fetch_req *req) {
+  return (req->status == 200 || (req->range && req->status == 206) ||
+          (req->conditional && req->status == 304));
+}
+
+/* Opens the file of a download, which then drops out of the cache. */
+static bool req_open_file(struct fetch_req *req) {
+  fetch_cache_forget(req->file);
+  if ((req->fp = fopen(req->file, "w")) == NULL) return false;
+  /* Writes are buffered here, in whole sectors. */
+  setvbuf(req->fp, NULL, _IONBF, 0);
+  return true;
+}
+
+static void req_reply_cached(struct fetch_req *req,
+                             const struct fetch_cache_entry *e) {
+  LOG(LL_INFO, ("%s: %s is up to date, %lu bytes", req->url, e->file,
+                e->size));
+  mg_rpc_send_responsef(req->ri,
+                        "{written: %lu, crc32: %lu, sha256: %Q, time: %.3f, "
+                        "cached: %B}",
+                        e->size, (unsigned long) e->crc32, e->sha256,
+                        mg_time() - req->queued, true);
+}
+
+/*
+ * Checks the SHA-256 of a finished download against the expected one and
+ * records the download in the cache. A segmented download is hashed from
+ * the file, its pieces have arrived out of order.
+ */
+static bool req_cache(struct fetch_req *req, int64_t written) {
+  struct fetch_cache_entry e;
+  char sha256[FETCH_CACHE_SHA256_LEN + 1];
+  if (req->num_segs == 0) {
+    unsigned char digest[32];
+    mbedtls_sha256_finish(&req->sha, digest);
+    fetch_cache_hex(digest, sha256);
+  } else if (!fetch_cache_hash_file(req->file, sha256)) {
+    return false;
+  }
+  if (req->sha256[0] != '\0' && strcasecmp(req->sha256, sha256) != 0) {
+    LOG(LL_ERROR, ("%s: SHA-256 %s, expected %s", req->url, sha256,
+                   req->sha256));
+    return false;
+  }
+  memcpy(req->sha256, sha256, sizeof(sha256));
+  memset(&e, 0, sizeof(e));
+  e.url = req->url;
+  e.file = req->file;
+  e.etag = req->etag;
+  e.last_modified = req->last_modified;
+  memcpy(e.sha256, sha256, sizeof(e.sha256));
+  e.crc32 = req->crc;
+  e.size = (unsigned long) written;
+  fetch_cache_put(&e);
+  return true;
+}
+
+/*
+ * Applies an update once the download is over, or ends it if the download
+ * has failed. Returns true if the update has succeeded.
+ */
+static bool req_end_update(struct fetch_req *req) {
+  struct update_context *upd = req->upd;
+  if (req_ok(req) && is_write_finished(upd)) updater_finalize(upd);
+  if (!is_update_finished(upd)) {
+    upd->status_msg =
+        (req_ok(req) ? "Archive is incomplete" : "Download failed");
+    upd->result = -1;
+    updater_finish(upd);
+  }
+  return (upd->result > 0);
+}
+
+static void req_reply(struct fetch_req *req) {
+  double now = mg_time();
+  int64_t written = req->written, wire = req->wire;
+  int i;
+  /* Close the file first, the client may read it as soon as it is told. */
+  if (req->fp != NULL && fclose(req->fp) != 0) req->failed = true;
+  req->fp = NULL;
+  if (req->failed && req_ok(req)) req->status = 500;
+  for (i = 0; i < req->num_segs; i++) {
+    req->crc = crc32_concat(req->crc, req->segs[i].crc, req->segs[i].len);
+    written += req->segs[i].len;
+    wire += req->segs[i].len;
+  }
+  if (req->status == 304) {
+    const struct fetch_cache_entry *e = fetch_cache_find(req->url, req->file);
+    if (e != NULL) {
+      req_reply_cached(req, e);
+    } else {
+      /* Overwritten while the request was out. */
+      mg_rpc_send_errorf(req->ri, 500, "%s has changed", req->file);
+    }
+    req_free(req);
+    return;
+  }
+  if (req->file != NULL && req_ok(req) && !req_cache(req, written)) {
+    req->status = 500;
+  }
+  if (req->upd != NULL && !req_end_update(req) && req_ok(req)) {
+    req->status = 500;
+  }
+  LOG(LL_INFO, ("%s: status %d bytes %llu (%llu on the wire) time %.3f%s",
+                req->url, req->status, written, wire, now - req->queued,
+                (req->reused ? " (reused)" : "")));
+  if (req_ok(req)) {
+    /* Report success only for complete downloads */
+    mg_rpc_send_responsef(
+        req->ri, "{written: %llu, wire: %llu, gzip: %B, crc32: %lu, "
+                 "sha256: %Q, segments: %d, writes: %lu, time: %.3f, "
+                 "wait: %.3f, ttfb: %.3f, paused: %.3f, reused: %B, "
+                 "cached: %B, update: %Q, reboot: %B}",
+        written, wire, (req->gz != NULL), (unsigned long) req->crc,
+        (req->file != NULL ? req->sha256 : NULL), req->num_segs + 1,
+        req->num_writes, now - req->queued, req->sent - req->queued,
+        req->first_byte - req->sent, req->paused, req->reused, false,
+        (req->upd != NULL ? req->upd->status_msg : NULL),
+        (req->upd != NULL && is_reboot_required(req->upd)));
+  } else if (req->cancelled != NULL) {
+    mg_rpc_send_errorf(req->ri, req->status, "%s", req->cancelled);
+  } else if (req->upd != NULL) {
+    mg_rpc_send_errorf(req->ri, req->status, "%s",
+                       (req->upd->status_msg != NULL ? req->upd->status_msg
+                                                     : "Update failed"));
+  } else {
+    mg_rpc_send_errorf(req->ri, req->status, NULL);
+  }
+  req_free(req);
+}
+
+/*
+ * Called when the reply to a request is over. A download is reported once
+ * its own reply and all of its segments are.
+ */
+static void req_finish(struct fetch_req *req, bool complete) {
+  struct fetch_req *parent = req->parent;
+  size_t n;
+  if (complete && req->gz != NULL && req_ok(req) &&
+      gunzip_run(req->gz, (const uint8_t *) "", 0, &n) != GUNZIP_DONE) {
+    LOG(LL_ERROR, ("%s: gzip stream is incomplete", req->url));
+    complete = false;
+  }
+  if (!wbuf_flush(req)) complete = false;
+  wbuf_free(req);
+  if (!complete && (req->status == 0 || req_ok(req))) req->status = 500;
+  if (parent == NULL) {
+    req->body_done = true;
+    if (!req_ok(req)) req->failed = true;
+    if (req->segs_left == 0) req_reply(req);
+    return;
+  }
+  if (req_ok(req)) {
+    parent->segs[req->seg].crc = req->crc;
+  } else {
+    LOG(LL_ERROR, ("%s: segment %d failed, status %d", req->url, req->seg + 1,
+                   req->status));
+    parent->failed = true;
+  }
+  req_free(req);
+  if (--parent->segs_left == 0 && parent->body_done) req_reply(parent);
+}
+
+/*
+ * Writes what can be written of `len` bytes without waiting: all of it to
+ * a file, what fits in the transmit buffer to a UART (mgos_uart_write()
+ * blocks until all data is written). Returns the number of bytes taken, -1
+ * on error.
+ */
+static long req_write(struct fetch_req *req, const char *data, size_t len) {
+  struct fetch_req *t = (req->parent != NULL ? req->parent : req);
+  size_t n = len;
+  if (t->failed) return -1;
+  if (t->file != NULL) {
+    long off = (long) (req->range_start + req->written);
+    if (!wbuf_write(req, off, data, len)) return -1;
+    if (req == t && t->num_segs == 0) {
+      mbedtls_sha256_update(&t->sha, (const unsigned char *) data, n);
+    }
+  } else if (t->upd != NULL) {
+    /* The updater takes all of it, keeping what it cannot process yet. */
+    if (updater_process(t->upd, data, len) < 0) return -1;
+  } else {
+    size_t avail = mgos_uart_write_avail(req->uart_no);
+    if (n > avail) n = avail;
+    if (n > 0 && mgos_uart_write(req->uart_no, data, n) != n) return -1;
+  }
+  req->crc = crc32_update(req->crc, data, n);
+  req->written += n;
+  return (long) n;
+}
+
+/*
+ * Passes `len` bytes of reply body on, through the decoder if the reply is
+ * encoded. Returns the number of bytes taken, -1 on error. Sets `blocked`
+ * if the UART could not take all of what they have decoded to; the rest
+ * stays in the decoder, to go out first on the next call.
+ */
+static long req_body(struct fetch_req *req, const char *data, size_t len,
+                     bool *blocked) {
+  size_t pos = 0, out_len, n;
+  *blocked = false;
+  if (req->gz == NULL) {
+    long taken = req_write(req, data, len);
+    if (taken < 0) return -1;
+    *blocked = ((size_t) taken < len);
+    req->wire += taken;
+    (req->parent != NULL ? req->parent : req)->received += taken;
+    return taken;
+  }
+  while (true) {
+    const uint8_t *out = gunzip_output(req->gz, &out_len);
+    enum gunzip_result res;
+    if (out_len > 0) {
+      long taken = req_write(req, (const char *) out, out_len);
+      if (taken < 0) return -1;
+      gunzip_consume(req->gz, taken);
+      if ((size_t) taken < out_len) {
+        *blocked = true;
+        break;
+      }
+    }
+    res = gunzip_run(req->gz, (const uint8_t *) data + pos, len - pos, &n);
+    pos += n;
+    if (res == GUNZIP_ERROR) {
+      LOG(LL_ERROR, ("%s: %s", req->url, gunzip_error(req->gz)));
+      return -1;
+    }
+    gunzip_output(req->gz, &out_len);
+    if (res != GUNZIP_OUTPUT_FULL && out_len == 0) break;
+  }
+  req->wire += pos;
+  (req->parent != NULL ? req->parent : req)->received += pos;
+  return (long) pos;
+}
+
+/* Sets up decoding of a reply that has a Content-Encoding. */
+static bool req_start_decoder(struct fetch_req *req, struct http_message *hm) {
+  struct mg_str *ce = mg_get_http_header(hm, "Content-Encoding");
+  if (ce == NULL || mg_vcasecmp(ce, "identity") == 0) return true;
+  if (!req->accept_gzip ||
+      (mg_vcasecmp(ce, "gzip") != 0 && mg_vcasecmp(ce, "x-gzip") != 0)) {
+    return false;
+  }
+  return ((req->gz = gunzip_create()) != NULL);
+}
+
+/*
+ * Splits the part of a `total` bytes resource after the first range into
+ * parallel segment requests, which go to the head of the queue.
+ */
+static void req_add_segments(struct fetch_req *req, size_t total) {
+  STAILQ_HEAD(, fetch_req) segs = STAILQ_HEAD_INITIALIZER(segs);
+  size_t start = req->range_end + 1, seg_len;
+  int i, n = req->want_segs;
+
+  if ((total - start) / n < FETCH_SEGMENT_MIN_SIZE) {
+    n = (total - start) / FETCH_SEGMENT_MIN_SIZE;
+  }
+  if (n < 1) n = 1;
+  seg_len = (total - start + n - 1) / n;
+  if ((req->segs = calloc(n, sizeof(*req->segs))) == NULL) {
+    req->failed = true;
+    return;
+  }
+  for (i = 0; i < n && start < total; i++) {
+    struct fetch_req *seg = calloc(1, sizeof(*seg));
+    if (seg == NULL) {
+      req->failed = true;
+      break;
+    }
+    seg->parent = req;
+    seg->url = req->url;
+    seg->key = req->key;
+    seg->host = req->host;
+    seg->path = req->path;
+    seg->query = req->query;
+    seg->port = req->port;
+    seg->ssl = req->ssl;
+    seg->uart_no = -1;
+    seg->range = true;
+    seg->range_start = start;
+    seg->range_end = (total - start > seg_len ? start + seg_len : total) - 1;
+    seg->seg = i;
+    seg->priority = req->priority;
+    seg->queued = mg_time();
+    req->segs[i].len = seg->range_end - start + 1;
+    start = seg->range_end + 1;
+    STAILQ_INSERT_TAIL(&segs, seg, next);
+    req->num_segs++;
+    req->segs_left++;
+  }
+  LOG(LL_INFO, ("%s: %lu bytes in %d segments", req->url,
+                (unsigned long) total, req->num_segs + 1));
+  STAILQ_CONCAT(&segs, &s_queue);
+  STAILQ_CONCAT(&s_queue, &segs);
+}
+
+/*
+ * Takes the validators of a successful reply to a download, for the cache,
+ * and opens the file if the request was a conditional one.
+ */
+static bool req_start_file(struct fetch_req *req, struct http_message *hm) {
+  struct mg_str *etag = mg_get_http_header(hm, "ETag");
+  struct mg_str *lm = mg_get_http_header(hm, "Last-Modified");
+  free(req->etag);
+  free(req->last_modified);
+  req->etag = (etag != NULL ? (char *) mg_strdup_nul(*etag).p : NULL);
+  req->last_modified = (lm != NULL ? (char *) mg_strdup_nul(*lm).p : NULL);
+  return (req->fp != NULL || req_open_file(req));
+}
+
+/*
+ * Checks the range of a reply to a request for one. A download that has
+ * asked for its first range learns the size of the resource from it.
+ */
+static bool req_check_range(struct fetch_req *req, struct http_message *hm) {
+  struct mg_str *cr = mg_get_http_header(hm, "Content-Range");
+  unsigned long start, end, total;
+  char buf[64];
+  int n;
+  if (!req->range || req->status != 206) {
+    /*
+     * A server may ignore the range: fine for a download, not for a segment
+     * or a resumed update, which would get the start of the resource again.
+     */
+    return !(req->range && req->status == 200 &&
+             (req->parent != NULL || req->upd != NULL));
+  }
+  if (cr == NULL) return false;
+  /* Header values are not NUL-terminated. */
+  snprintf(buf, sizeof(buf), "%.*s", (int) cr->len, cr->p);
+  n = sscanf(buf, "bytes %lu-%lu/%lu", &start, &end, &total);
+  if (n < 2 || start != req->range_start || end > req->range_end) return false;
+  if (req->parent == NULL) {
+    req->range_end = end;
+    if (n == 3) req->total = total;
+    if (n == 3 && total > end + 1 && req->want_segs > 1) {
+      req_add_segments(req, total);
+    }
+  } else if (end != req->range_end) {
+    return false;
+  }
+  return true;
+}
+
+static void conn_handler(struct mg_connection *nc, int ev, void *ev_data,
+                         void *user_data);
+
+static struct fetch_conn *conn_open(const struct fetch_req *req) {
+  struct mg_connect_opts opts;
+  struct fetch_conn *c;
+  struct mg_str host = mg_strdup_nul(req->host);
+  char *addr = NULL;
+
+  memset(&opts, 0, sizeof(opts));
+#if MG_ENABLE_SSL
+  if (req->ssl) {
+    /* Same as mg_connect_http(): encrypt, but do not verify the server. */
+    opts.ssl_ca_cert = "*";
+    opts.ssl_server_name = host.p;
+  }
+#endif
+  mg_asprintf(&addr, 0, "tcp://%.*s:%u", (int) req->host.len, req->host.p,
+              req->port);
+  if ((c = calloc(1, sizeof(*c))) != NULL) {
+    STAILQ_INIT(&c->reqs);
+    c->keep_alive = true;
+    c->key = strdup(req->key);
+    if (c->key != NULL && addr != NULL && host.p != NULL) {
+      c->nc = mg_connect_opt(mgos_get_mgr(), addr, conn_handler, c, opts);
+    }
+    if (c->nc != NULL) c->nc->recv_mbuf_limit = FETCH_RECV_BUF_LIMIT;
+    if (c->nc == NULL) {
+      free(c->key);
+      free(c);
+      c = NULL;
+    }
+  }
+  free(addr);
+  free((void *) host.p);
+  if (c == NULL) return NULL;
+  SLIST_INSERT_HEAD(&s_conns, c, next);
+  s_num_conns++;
+  return c;
+}
+
+/* Closes a connection that has nothing in flight and forgets about it. */
+static void conn_drop(struct fetch_conn *c) {
+  SLIST_REMOVE(&s_conns, c, fetch_conn, next);
+  s_num_conns--;
+  c->nc->user_data = NULL;
+  c->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  free(c->key);
+  free(c);
+}
+
+/*
+ * Returns an idle connection for `req` or, if `pipeline` is set, the least
+ * loaded one that can take one more request. A request sent again after
+ * its connection was closed only goes on a fresh one.
+ */
+static struct fetch_conn *conn_find(const struct fetch_req *req,
+                                    bool pipeline) {
+  struct fetch_conn *c, *found = NULL;
+  if (req->retried) return NULL;
+  SLIST_FOREACH(c, &s_conns, next) {
+    if (c->nc == NULL || !c->keep_alive || strcmp(c->key, req->key) != 0) {
+      continue;
+    }
+    if (c->num_reqs == 0) return c;
+    /* Only pipeline once the server has shown it keeps connections. */
+    if (pipeline && c->num_done > 0 &&
+        c->num_reqs < mgos_sys_config_get_fetch_pipeline() &&
+        (found == NULL || c->num_reqs < found->num_reqs)) {
+      found = c;
+    }
+  }
+  return found;
+}
+
+/* Makes room for a new connection by closing an idle one. */
+static bool conn_evict_idle(void) {
+  struct fetch_conn *c;
+  SLIST_FOREACH(c, &s_conns, next) {
+    if (c->nc != NULL && c->num_reqs == 0) {
+      conn_drop(c);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void conn_send(struct fetch_conn *c, struct fetch_req *req) {
+  bool default_port = (req->port == (req->ssl ? 443 : 80));
+  if (req->parent == NULL && !req->admitted) {
+    req->admitted = true;
+    req->started = mg_time();
+    s_num_active++;
+  }
+  req->reused = (c->num_done > 0 || c->num_reqs > 0);
+  req->sent = mg_time();
+  mg_printf(c->nc, "GET %.*s%s%.*s HTTP/1.1\r\nHost: %.*s",
+            (int) (req->path.len > 0 ? req->path.len : 1),
+            (req->path.len > 0 ? req->path.p : "/"),
+            (req->query.len > 0 ? "?" : ""), (int) req->query.len,
+            req->query.p, (int) req->host.len, req->host.p);
+  if (!default_port) mg_printf(c->nc, ":%u", req->port);
+  /*
+   * A range of an encoded reply would be a range of the encoded bytes, so
+   * neither ranges nor updates, which may be resumed with one, offer gzip.
+   */
+  if (!req->range && req->upd == NULL && !req->accept_gzip &&
+      s_num_decoders < mgos_sys_config_get_fetch_gzip_decoders()) {
+    req->accept_gzip = true;
+    s_num_decoders++;
+  }
+  if (req->accept_gzip) mg_printf(c->nc, "\r\nAccept-Encoding: gzip");
+  if (req->etag != NULL) {
+    mg_printf(c->nc, "\r\nIf-None-Match: %s", req->etag);
+  }
+  if (req->last_modified != NULL) {
+    mg_printf(c->nc, "\r\nIf-Modified-Since: %s", req->last_modified);
+  }
+  if (req->range && req->range_end == FETCH_RANGE_TO_END) {
+    mg_printf(c->nc, "\r\nRange: bytes=%lu-", (unsigned long) req->range_start);
+  } else if (req->range) {
+    mg_printf(c->nc, "\r\nRange: bytes=%lu-%lu",
+              (unsigned long) req->range_start, (unsigned long) req->range_end);
+  }
+  mg_printf(c->nc, "\r\n\r\n");
+  STAILQ_INSERT_TAIL(&c->reqs, req, next);
+  c->num_reqs++;
+}
+
+/*
+ * Queues a new transfer behind those of the same or a higher priority.
+ * Segments and retries go to the head instead: they are part of transfers
+ * that have started already.
+ */
+static void fetch_enqueue(struct fetch_req *req) {
+  struct fetch_req *r, *after = NULL;
+  STAILQ_FOREACH(r, &s_queue, next) {
+    if (r->priority < req->priority) break;
+    after = r;
+  }
+  if (after == NULL) {
+    STAILQ_INSERT_HEAD(&s_queue, req, next);
+  } else {
+    STAILQ_INSERT_AFTER(&s_queue, after, req, next);
+  }
+}
+
+/*
+ * Tells if a new transfer can start. Buffers, decoders and TLS sessions of
+ * transfers come out of the heap, so one only starts while free heap is
+ * above fetch.min_free_heap - except when none is running, as then none
+ * would free any.
+ */
+static bool fetch_admit(void) {
+  size_t free_heap = mgos_get_free_heap_size();
+  if (s_num_active == 0 ||
+      free_heap >= (size_t) mgos_sys_config_get_fetch_min_free_heap()) {
+    return true;
+  }
+  LOG(LL_DEBUG, ("free heap %lu, transfers wait", (unsigned long) free_heap));
+  return false;
+}
+
+/* Gives queued requests to connections, opening new ones within the limit. */
+static void fetch_dispatch(void) {
+  struct fetch_req *req;
+  while ((req = STAILQ_FIRST(&s_queue)) != NULL) {
+    struct fetch_conn *c;
+    if (req->parent != NULL && req->parent->failed) {
+      STAILQ_REMOVE_HEAD(&s_queue, next);
+      req_finish(req, false);
+      continue;
+    }
+    if (req->parent == NULL && !req->admitted && !fetch_admit()) break;
+    c = conn_find(req, false /* pipeline */);
+    if (c == NULL && (s_num_conns < mgos_sys_config_get_fetch_max_conns() ||
+                      conn_evict_idle())) {
+      if ((c = conn_open(req)) == NULL) {
+        STAILQ_REMOVE_HEAD(&s_queue, next);
+        LOG(LL_ERROR, ("%s: cannot connect", req->url));
+        req_finish(req, false);
+        continue;
+      }
+    }
+    if (c == NULL) c = conn_find(req, true /* pipeline */);
+    if (c == NULL) break;
+    STAILQ_REMOVE_HEAD(&s_queue, next);
+    conn_send(c, req);
+  }
+}
+
+static void conn_fail(struct fetch_conn *c, const char *reason) {
+  struct fetch_req *req = STAILQ_FIRST(&c->reqs);
+  LOG(LL_ERROR, ("%s: %s", req->url, reason));
+  req->status = 500;
+  c->keep_alive = false;
+  if (c->nc != NULL) c->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+}
+
+/* Looks at the reply headers and sets up reading of the body. */
+static void conn_start_body(struct fetch_conn *c, struct http_message *hm) {
+  struct mg_str *te = mg_get_http_header(hm, "Transfer-Encoding");
+  struct mg_str *cl = mg_get_http_header(hm, "Content-Length");
+  struct mg_str *conn = mg_get_http_header(hm, "Connection");
+
+  c->keep_alive = (mg_vcmp(&hm->proto, "HTTP/1.0") != 0);
+  if (conn != NULL && mg_vcasecmp(conn, "close") == 0) c->keep_alive = false;
+  if (conn != NULL && mg_vcasecmp(conn, "keep-alive") == 0) {
+    c->keep_alive = true;
+  }
+  c->body_left = 0;
+  if (hm->resp_code == 204 || hm->resp_code == 304) {
+    c->state = FBS_LENGTH;
+  } else if (te != NULL && mg_vcasecmp(te, "chunked") == 0) {
+    c->state = FBS_CHUNK_SIZE;
+  } else if (cl != NULL) {
+    c->body_left = (size_t) strtoul(cl->p, NULL, 10);
+    c->state = FBS_LENGTH;
+  } else {
+    c->state = FBS_UNTIL_CLOSE;
+    c->keep_alive = false;
+  }
+}
+
+/*
+ * Completes the first request on the connection. Returns false if the
+ * connection is going away.
+ */
+static bool conn_reply_done(struct fetch_conn *c) {
+  struct fetch_req *req = STAILQ_FIRST(&c->reqs);
+  STAILQ_REMOVE_HEAD(&c->reqs, next);
+  c->num_reqs--;
+  c->num_done++;
+  c->state = FBS_HEADERS;
+  req_finish(req, true);
+  if (!c->keep_alive) {
+    /* Requests pipelined behind this one are sent again by conn_release(). */
+    if (c->nc != NULL) c->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return false;
+  }
+  if (c->num_reqs == 0) c->idle_since = mg_time();
+  return true;
+}
+
+static void uart_poll(void *arg);
+static void conn_release(struct fetch_conn *c);
+
+/* Stops consuming the reply until the UART has room for more. */
+static void conn_pause(struct fetch_conn *c) {
+  c->paused = true;
+  c->paused_since = mg_time();
+  if (s_uart_timer == MGOS_INVALID_TIMER_ID) {
+    s_uart_timer =
+        mgos_set_timer(FETCH_UART_POLL_MS, MGOS_TIMER_REPEAT, uart_poll, NULL);
+  }
+}
+
+/*
+ * Has an update that is about to skip FETCH_OTA_SKIP_MIN_SIZE or more of
+ * the archive ask for what follows instead: the skipped bytes are marked
+ * as received and the connection is closed, for conn_release() to send a
+ * Range request from the new resume offset. Returns true if it does.
+ */
+static bool req_skip(struct fetch_conn *c, struct fetch_req *req) {
+  size_t n;
+  if (req->upd == NULL || !req_ok(req) || !req->accept_ranges ||
+      c->nc == NULL) {
+    return false;
+  }
+  n = updater_skippable(req->upd);
+  if (n < FETCH_OTA_SKIP_MIN_SIZE || updater_skip(req->upd, n) != 0) {
+    return false;
+  }
+  LOG(LL_INFO, ("%s: skipping %lu bytes", req->url, (unsigned long) n));
+  req->skipping = true;
+  c->keep_alive = false;
+  c->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  return true;
+}
+
+static void conn_parse(struct fetch_conn *c) {
+  struct mbuf *io = (c->nc != NULL ? &c->nc->recv_mbuf : &c->rest);
+  struct fetch_req *req = STAILQ_FIRST(&c->reqs);
+
+  /* The rest of a reply whose connection is closing, see req_skip(). */
+  if (req != NULL && req->skipping) {
+    mbuf_remove(io, io->len);
+    return;
+  }
+  if (c->paused && req != NULL) {
+    bool blocked;
+    req->paused += mg_time() - c->paused_since;
+    c->paused = false;
+    /* What the decoder has ready goes out before more is decoded. */
+    if (req->gz != NULL) {
+      if (req_body(req, "", 0, &blocked) < 0) {
+        conn_fail(c, "write error");
+        return;
+      }
+      if (blocked) {
+        conn_pause(c);
+        return;
+      }
+      /* The body may have been all in when the UART filled up. */
+      if (c->state == FBS_LENGTH && c->body_left == 0 &&
+          !conn_reply_done(c)) {
+        return;
+      }
+    }
+  }
+  c->paused = false;
+
+  while (io->len > 0 && (req = STAILQ_FIRST(&c->reqs)) != NULL) {
+    const char *eol;
+    char *end;
+    size_t n = 0;
+    long taken;
+    bool done = false, blocked = false;
+
+    switch (c->state) {
+      case FBS_HEADERS: {
+        struct http_message hm;
+        struct mg_str *ar;
+        int len = mg_parse_http(io->buf, io->len, &hm, 0 /* is_req */);
+        if (len == 0 && io->len < FETCH_MAX_HEADERS_SIZE) return;
+        if (len <= 0) {
+          conn_fail(c, "malformed reply");
+          return;
+        }
+        n = len;
+        /* 1xx replies are informational, the actual reply follows. */
+        if (hm.resp_code < 200) break;
+        req->replied = true;
+        req->first_byte = mg_time();
+        req->status = hm.resp_code;
+        ar = mg_get_http_header(&hm, "Accept-Ranges");
+        req->accept_ranges = (req->status == 206 ||
+                              (ar != NULL && mg_vcasecmp(ar, "bytes") == 0));
+        conn_start_body(c, &hm);
+        if (!req_check_range(req, &hm)) {
+          conn_fail(c, "unexpected range in reply");
+          return;
+        }
+        if (req->parent == NULL && req->status == 200 &&
+            c->state == FBS_LENGTH) {
+          req->total = c->body_left;
+        }
+        if (req_ok(req) && req->status != 304 &&
+            !req_start_decoder(req, &hm)) {
+          conn_fail(c, "cannot decode reply");
+          return;
+        }
+        if (req->parent == NULL && req->file != NULL && req_ok(req) &&
+            req->status != 304 && !req_start_file(req, &hm)) {
+          conn_fail(c, "cannot open file");
+          return;
+        }
+        done = (c->state == FBS_LENGTH && c->body_left == 0);
+        break;
+      }
+      case FBS_LENGTH:
+      case FBS_CHUNK_DATA:
+      case FBS_UNTIL_CLOSE:
+        n = io->len;
+        if (c->state != FBS_UNTIL_CLOSE && n > c->body_left) n = c->body_left;
+        /* Error pages are not written out. */
+        if (req_ok(req)) {
+          taken = req_body(req, io->buf, n, &blocked);
+          if (taken < 0) {
+            conn_fail(c, "write error");
+            return;
+          }
+          n = taken;
+          if (blocked) conn_pause(c);
+        }
+        if (c->state != FBS_UNTIL_CLOSE) {
+          c->body_left -= n;
+          if (c->body_left == 0) {
+            done = (c->state == FBS_LENGTH);
+            if (c->state == FBS_CHUNK_DATA) c->state = FBS_CHUNK_END;
+          }
+        }
+        break;
+      case FBS_CHUNK_SIZE:
+      case FBS_CHUNK_END:
+      case FBS_TRAILERS:
+        if ((eol = (const char *) memchr(io->buf, '\n', io->len)) == NULL) {
+          if (io->len >= FETCH_MAX_LINE_SIZE) conn_fail(c, "malformed chunk");
+          return;
+        }
+        n = eol - io->buf + 1;
+        if (c->state == FBS_CHUNK_SIZE) {
+          c->body_left = (size_t) strtoul(io->buf, &end, 16);
+          if (end == io->buf) {
+            conn_fail(c, "malformed chunk");
+            return;
+          }
+          c->state = (c->body_left > 0 ? FBS_CHUNK_DATA : FBS_TRAILERS);
+        } else if (c->state == FBS_CHUNK_END) {
+          c->state = FBS_CHUNK_SIZE;
+        } else {
+          /* An empty line ends the trailers. */
+          done = (n <= 2);
+        }
+        break;
+    }
+    mbuf_remove(io, n);
+    if (c->paused) return;
+    if (!done && req_skip(c, req)) {
+      mbuf_remove(io, io->len);
+      return;
+    }
+    if (done && !conn_reply_done(c)) return;
+  }
+  /* Nothing is expected on an idle connection. */
+  if (STAILQ_EMPTY(&c->reqs)) mbuf_remove(io, io->len);
+}
+
+/*
+ * Resumes the replies that are waiting for room in the UART. A timer rather
+ * than the UART dispatcher, which the app may have set for itself.
+ */
+static void uart_poll(void *arg) {
+  struct fetch_conn *c, *tmp;
+  bool waiting = false;
+  SLIST_FOREACH_SAFE(c, &s_conns, next, tmp) {
+    struct fetch_req *req = STAILQ_FIRST(&c->reqs);
+    if (!c->paused || req == NULL) continue;
+    if (mgos_uart_write_avail(req->uart_no) > 0) conn_parse(c);
+    if (c->paused) {
+      waiting = true;
+    } else if (c->nc == NULL) {
+      /* All that was left after the server closed has been taken. */
+      conn_release(c);
+    }
+  }
+  if (!waiting) {
+    mgos_clear_timer(s_uart_timer);
+    s_uart_timer = MGOS_INVALID_TIMER_ID;
+  }
+  fetch_dispatch();
+  (void) arg;
+}
+
+/*
+ * Makes an update whose connection has closed before the end of the archive
+ * ask for the rest of it. The updater has taken all that has arrived, and
+ * keeps what it has not processed yet, so the rest starts at its resume
+ * offset. Returns false if the download cannot go on.
+ */
+static bool req_resume(struct fetch_req *req) {
+  struct update_context *upd = req->upd;
+  size_t offset;
+  if (upd == NULL || req->cancelled != NULL || upd->result != 0 ||
+      is_write_finished(upd) ||
+      (req->replied && !req_ok(req))) {
+    return false;
+  }
+  offset = updater_resume_offset(upd);
+  if (req->skipping) {
+    /* Not a failure, the update has got further. */
+    req->skipping = false;
+    LOG(LL_INFO, ("%s: resuming at %lu", req->url, (unsigned long) offset));
+  } else {
+    if (req->written > req->resumed_at) req->resumes = 0;
+    if (req->resumes++ == FETCH_OTA_MAX_RESUMES) return false;
+    req->resumed_at = req->written;
+    LOG(LL_WARN, ("%s: connection lost, resuming at %lu", req->url,
+                  (unsigned long) offset));
+  }
+  req->range = (offset > 0);
+  req->range_start = offset;
+  req->range_end = FETCH_RANGE_TO_END;
+  req->replied = false;
+  req->status = 0;
+  req->retried = true;
+  return true;
+}
+
+/* Finishes or requeues the requests of a closed connection and frees it. */
+static void conn_release(struct fetch_conn *c) {
+  STAILQ_HEAD(, fetch_req) retry = STAILQ_HEAD_INITIALIZER(retry);
+  struct fetch_req *req;
+
+  SLIST_REMOVE(&s_conns, c, fetch_conn, next);
+  s_num_conns--;
+  while ((req = STAILQ_FIRST(&c->reqs)) != NULL) {
+    STAILQ_REMOVE_HEAD(&c->reqs, next);
+    if (req_resume(req)) {
+      STAILQ_INSERT_TAIL(&retry, req, next);
+    } else if (req->replied) {
+      req_finish(req, c->state == FBS_UNTIL_CLOSE);
+    } else if (c->num_done > 0 && !req->retried && req->cancelled == NULL) {
+      /*
+       * The server has closed a connection it kept alive before getting to
+       * this request. Nothing has been written, so it is safe to resend.
+       */
+      req->retried = true;
+      STAILQ_INSERT_TAIL(&retry, req, next);
+    } else {
+      if (c->connect_err != 0) req->status = c->connect_err;
+      req_finish(req, false);
+    }
+  }
+  /* Retries go first, they have waited the longest. */
+  STAILQ_CONCAT(&retry, &s_queue);
+  STAILQ_CONCAT(&s_queue, &retry);
+  mbuf_free(&c->rest);
+  free(c->key);
+  free(c);
+}
+
+/*
+ * Called when the server has closed the connection. A reply that is waiting
+ * for the UART keeps what has been received, to be taken by uart_poll()
+ * like before; the connection is released after that.
+ */
+static void conn_closed(struct fetch_conn *c) {
+  if (c->paused) {
+    mbuf_init(&c->rest, 0);
+    mbuf_append(&c->rest, c->nc->recv_mbuf.buf, c->nc->recv_mbuf.len);
+    c->nc = NULL;
+    c->keep_alive = false;
+    return;
+  }
+  conn_release(c);
+  fetch_dispatch();
+}
+
+static void conn_handler(struct mg_connection *nc, int ev, void *ev_data,
+                         void *user_data) {
+  struct fetch_conn *c = (struct fetch_conn *) user_data;
+  if (c == NULL) return; /* Dropped from the pool */
+
+  switch (ev) {
+    case MG_EV_CONNECT:
+      c->connect_err = *(int *) ev_data;
+      break;
+    case MG_EV_RECV:
+      conn_parse(c);
+      /* Not earlier: this connection may be evicted to make room. */
+      fetch_dispatch();
+      break;
+    case MG_EV_POLL:
+      if (c->num_reqs == 0 && c->keep_alive &&
+          mg_time() - c->idle_since >
+              mgos_sys_config_get_fetch_idle_timeout()) {
+        LOG(LL_DEBUG, ("%s: closing idle connection", c->key));
+        conn_drop(c);
+      }
+      break;
+    case MG_EV_CLOSE:
+      conn_closed(c);
+      break;
+  }
+  (void) nc;
+}
+
+/* What a transfer is asked for, see fetch_start(). */
+struct fetch_args {
+  char *url;
+  int uart_no;
+  char *file;
+  int segments;
+  char *sha256;
+  bool ota;
+  int commit_timeout;
+  bool ignore_same_version;
+  int priority;
+};
+
+/*
+ * Starts a transfer and replies to `ri` when it is over, or right away if
+ * it cannot start. Takes the URL and the file name if it keeps them, and
+ * sets them to NULL then.
+ */
+static void fetch_start(struct mg_rpc_request_info *ri, struct fetch_args *a) {
+  struct fetch_req *req = NULL;
+  const struct fetch_cache_entry *e = NULL;
+
+  if (a->url == NULL || (a->uart_no < 0 && a->file == NULL && !a->ota)) {
+    mg_rpc_send_errorf(ri, 500, "expecting url, uart, file or ota");
+    goto done;
+  }
+
+  if (a->ota && (a->uart_no >= 0 || a->file != NULL)) {
+    mg_rpc_send_errorf(ri, 500, "ota takes neither uart nor file");
+    goto done;
+  }
+
+  if (a->segments > 1 && a->file == NULL) {
+    mg_rpc_send_errorf(ri, 500, "segments need a file");
+    goto done;
+  }
+
+  if (a->sha256 != NULL &&
+      (a->file == NULL || strlen(a->sha256) != FETCH_CACHE_SHA256_LEN)) {
+    mg_rpc_send_errorf(ri, 500, "sha256 needs a file and 64 hex digits");
+    goto done;
+  }
+
+  if ((req = calloc(1, sizeof(*req))) == NULL) {
+    mg_rpc_send_errorf(ri, 500, "OOM");
+    goto done;
+  }
+  req->url = a->url;
+  a->url = NULL;
+
+  if (!parse_url(req)) {
+    mg_rpc_send_errorf(ri, 500, "malformed URL");
+    goto done;
+  }
+
+  req->uart_no = a->uart_no;
+  req->ri = ri;
+  req->queued = mg_time();
+  req->file = a->file;
+  a->file = NULL;
+
+  if (a->sha256 != NULL) {
+    strcpy(req->sha256, a->sha256);
+    e = fetch_cache_find_sha256(a->sha256);
+  }
+  if (e != NULL) {
+    /* The content is here already, maybe under another name. */
+    struct fetch_cache_entry ne = *e;
+    if (strcmp(e->file, req->file) != 0) {
+      fetch_cache_forget(req->file);
+      if (!fetch_cache_copy(e, req->file)) {
+        mg_rpc_send_errorf(ri, 500, "cannot copy %s", e->file);
+        goto done;
+      }
+    }
+    req_reply_cached(req, e);
+    if (strcmp(e->url, req->url) != 0 || strcmp(e->file, req->file) != 0) {
+      /* The validators only hold for the URL they came from. */
+      if (strcmp(e->url, req->url) != 0) ne.etag = ne.last_modified = NULL;
+      ne.url = req->url;
+      ne.file = req->file;
+      fetch_cache_put(&ne);
+    }
+    goto done;
+  }
+
+  if (req->file != NULL) {
+    e = fetch_cache_find(req->url, req->file);
+    if (e != NULL && (e->etag != NULL || e->last_modified != NULL)) {
+      /* The file is opened once the server says that it has changed. */
+      req->conditional = true;
+      if (e->etag != NULL) req->etag = strdup(e->etag);
+      if (e->last_modified != NULL) {
+        req->last_modified = strdup(e->last_modified);
+      }
+    } else if (!req_open_file(req)) {
+      mg_rpc_send_errorf(ri, 500, "cannot open %s", req->file);
+      goto done;
+    }
+    mbedtls_sha256_init(&req->sha);
+    mbedtls_sha256_starts(&req->sha, 0 /* is224 */);
+  }
+  if (a->segments > 1) {
+    req->range = true;
+    req->range_end = FETCH_SEGMENT_MIN_SIZE - 1;
+    req->want_segs =
+        (a->segments > FETCH_MAX_SEGMENTS ? FETCH_MAX_SEGMENTS : a->segments);
+  }
+
+  if (a->ota) {
+    /* The updater reports why it cannot start. */
+    if ((req->upd = updater_context_create(0 /* timeout */)) == NULL) {
+      mg_rpc_send_errorf(ri, 500, "cannot start update");
+      goto done;
+    }
+    if (a->commit_timeout > 0) {
+      req->upd->fctx.commit_timeout = a->commit_timeout;
+    }
+    req->upd->ignore_same_version = a->ignore_same_version;
+  }
+
+  req->id = s_next_id++;
+  req->priority = a->priority;
+  LOG(LL_INFO, ("Fetching %s to %d/%s%s, id %d", req->url, a->uart_no,
+                (a->ota ? "OTA" : req->file ? req->file : ""),
+                (req->conditional ? " if changed" : ""), req->id));
+  STAILQ_INSERT_TAIL(&s_jobs, req, next_job);
+  fetch_enqueue(req);
+  req = NULL;
+  fetch_dispatch();
+
+done:
+  if (req != NULL) req_free(req);
+}
+
+static void fetch_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                          struct mg_rpc_frame_info *fi, struct mg_str args) {
+  struct fetch_args a;
+  memset(&a, 0, sizeof(a));
+  a.uart_no = -1;
+  a.segments = 1;
+  json_scanf(args.p, args.len, ri->args_fmt, &a.url, &a.uart_no, &a.file,
+             &a.segments, &a.sha256, &a.ota, &a.commit_timeout, &a.priority);
+  fetch_start(ri, &a);
+  free(a.url);
+  free(a.file);
+  free(a.sha256);
+  (void) cb_arg;
+  (void) fi;
+}
+
+/*
+ * OTA.Update, taken over from the OTA RPC service: the update goes through
+ * Fetch, so a dropped connection is resumed with a Range request instead of
+ * failing the update. It replies once the update is over.
+ */
+static void ota_update_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                               struct mg_rpc_frame_info *fi,
+                               struct mg_str args) {
+  struct fetch_args a;
+  memset(&a, 0, sizeof(a));
+  a.uart_no = -1;
+  a.segments = 1;
+  a.ota = true;
+  json_scanf(args.p, args.len, ri->args_fmt, &a.url, &a.commit_timeout,
+             &a.ignore_same_version);
+  fetch_start(ri, &a);
+  free(a.url);
+  (void) cb_arg;
+  (void) fi;
+}
+
+static int print_jobs(struct json_out *out, va_list *ap) {
+  struct fetch_req *t;
+  double now = mg_time();
+  int len = 0;
+  len += json_printf(out, "[");
+  STAILQ_FOREACH(t, &s_jobs, next_job) {
+    double elapsed = now - t->started;
+    double rate = (t->admitted && elapsed > 0 ? t->received / elapsed : 0);
+    double eta = (t->total > 0 && rate > 0 ? (t->total - t->received) / rate
+                                           : -1);
+    len += json_printf(
+        out, "%s{id: %d, url: %Q, file: %Q, uart: %d, ota: %B, "
+             "priority: %d, state: %Q, received: %llu, total: %llu, "
+             "rate: %.0f, eta: %.1f}",
+        (t == STAILQ_FIRST(&s_jobs) ? "" : ", "), t->id, t->url, t->file,
+        t->uart_no, (t->upd != NULL), t->priority,
+        (t->admitted ? "active" : "queued"), t->received, t->total, rate,
+        eta);
+  }
+  len += json_printf(out, "]");
+  (void) ap;
+  return len;
+}
+
+/* Transfers in progress and waiting, in arrival order. */
+static void fetch_list_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                               struct mg_rpc_frame_info *fi,
+                               struct mg_str args) {
+  mg_rpc_send_responsef(ri, "{transfers: %M, active: %d, free_heap: %lu}",
+                        print_jobs, s_num_active,
+                        (unsigned long) mgos_get_free_heap_size());
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+/*
+ * Stops a transfer and fails its RPC with `reason`. Requests that are being
+ * received are cut off by closing their connections; those pipelined
+ * behind them are sent again, see conn_release().
+ */
+static void fetch_cancel(struct fetch_req *t, const char *reason) {
+  struct fetch_req *req, *rtmp;
+  struct fetch_conn *c, *ctmp;
+  LOG(LL_INFO, ("%s: %s", t->url, reason));
+  t->cancelled = reason;
+  t->failed = true;
+  /* Keeps t from being replied to, and freed, before the end. */
+  t->segs_left++;
+  STAILQ_FOREACH_SAFE(req, &s_queue, next, rtmp) {
+    if (req != t && req->parent != t) continue;
+    STAILQ_REMOVE(&s_queue, req, fetch_req, next);
+    req_finish(req, false);
+  }
+  SLIST_FOREACH_SAFE(c, &s_conns, next, ctmp) {
+    req = STAILQ_FIRST(&c->reqs);
+    if (req == NULL || (req != t && req->parent != t)) continue;
+    c->keep_alive = false;
+    c->paused = false;
+    if (c->nc != NULL) {
+      c->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    } else {
+      conn_release(c);
+    }
+  }
+  if (--t->segs_left == 0 && t->body_done) req_reply(t);
+  fetch_dispatch();
+}
+
+static void fetch_cancel_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                                 struct mg_rpc_frame_info *fi,
+                                 struct mg_str args) {
+  struct fetch_req *t;
+  int id = 0;
+  json_scanf(args.p, args.len, ri->args_fmt, &id);
+  STAILQ_FOREACH(t, &s_jobs, next_job) {
+    if (t->id == id) break;
+  }
+  if (t == NULL) {
+    mg_rpc_send_errorf(ri, 404, "no transfer %d", id);
+    return;
+  }
+  fetch_cancel(t, "cancelled");
+  mg_rpc_send_responsef(ri, "{id: %d}", id);
+  (void) cb_arg;
+  (void) fi;
+}
+
+/* Stops the download of an update that has timed out. */
+static void fetch_update_aborted(struct update_context *upd, void *cb_arg) {
+  struct fetch_req *t;
+  STAILQ_FOREACH(t, &s_jobs, next_job) {
+    if (t->upd == upd) {
+      fetch_cancel(t, "Update timed out");
+      break;
+    }
+  }
+  (void) cb_arg;
+}
+
+static void fetch_stats_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                                struct mg_rpc_frame_info *fi,
+                                struct mg_str args) {
+  mg_rpc_send_responsef(
+      ri, "{writes: %lu, bytes: %lu, avg_write: %lu, sizes: [%lu, %lu, %lu, "
+          "%lu], buf_mem: %lu, peak_buf_mem: %lu, over_budget: %lu}",
+      s_wstats.writes, s_wstats.bytes,
+      (s_wstats.writes > 0 ? s_wstats.bytes / s_wstats.writes : 0),
+      s_wstats.sizes[0], s_wstats.sizes[1], s_wstats.sizes[2],
+      s_wstats.sizes[3], (unsigned long) s_wstats.buf_mem,
+      (unsigned long) s_wstats.peak_buf_mem, s_wstats.over_budget);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+bool fetch_init(void) {
+  prof_add_rpc_handler("Fetch",
+                       "{url: %Q, uart: %d, file: %Q, segments: %d, "
+                       "sha256: %Q, ota: %B, commit_timeout: %d, priority: %d}",
+                       fetch_handler, NULL);
+  prof_add_rpc_handler("Fetch.List", "", fetch_list_handler, NULL);
+  prof_add_rpc_handler("Fetch.Cancel", "{id: %d}", fetch_cancel_handler, NULL);
+  prof_add_rpc_handler("Fetch.Stats", "", fetch_stats_handler, NULL);
+  /* Added after the OTA RPC service's, so it is this one that is called. */
+  prof_add_rpc_handler("OTA.Update",
+                       "{url: %Q, commit_timeout: %d, ignore_same_version: %B}",
+                       ota_update_handler, NULL);
+  updater_set_abort_cb(fetch_update_aborted, NULL);
+  return true;
+}
@@ -0,0 +1,24 @@
+/*
+ * Fetch RPC: downloads a URL to a file, to a UART or to the updater.
+ */
+
+#ifndef SRC_FETCH_H_
+#define SRC_FETCH_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Registers the Fetch RPC handlers, and OTA.Update in place of the stock
+ * one, so that an update from a URL resumes after a dropped connection.
+ */
+bool fetch_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_FETCH_H_ */
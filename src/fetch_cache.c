@@ -0,0 +1,270 @@
+/*
+ * Fetch download cache index, see fetch_cache.h.
+ *
+ * The index is small, so it is held in RAM, most recently used entry first,
+ * and written out as a whole to fetch.cache_index on every change. It goes
+ * to a temporary file first, so that a power cut leaves the old or the new
+ * index, never half of one.
+ */
+
+#include "fetch_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "mbedtls/sha256.h"
+
+#include "mgos.h"
+
+#ifndef FETCH_CACHE_MAX_ENTRIES
+#define FETCH_CACHE_MAX_ENTRIES 16
+#endif
+
+/* Size of the reads that hash and copy files. */
+#define FETCH_CACHE_IO_SIZE 1024
+
+static struct fetch_cache_entry *s_entries[FETCH_CACHE_MAX_ENTRIES];
+static int s_num_entries = 0;
+static bool s_loaded = false;
+
+static void entry_free(struct fetch_cache_entry *e) {
+  if (e == NULL) return;
+  free(e->url);
+  free(e->file);
+  free(e->etag);
+  free(e->last_modified);
+  free(e);
+}
+
+static void entry_remove(int i) {
+  entry_free(s_entries[i]);
+  memmove(&s_entries[i], &s_entries[i + 1],
+          (s_num_entries - i - 1) * sizeof(s_entries[0]));
+  s_num_entries--;
+}
+
+/*
+ * True if the file of the entry still looks like what was downloaded.
+ * With `rehash`, its contents are checked as well, which reads it all.
+ */
+static bool entry_valid(const struct fetch_cache_entry *e, bool rehash) {
+  struct stat st;
+  char sha256[FETCH_CACHE_SHA256_LEN + 1];
+  if (stat(e->file, &st) != 0 || (unsigned long) st.st_size != e->size) {
+    return false;
+  }
+  return (!rehash || (fetch_cache_hash_file(e->file, sha256) &&
+                      strcasecmp(sha256, e->sha256) == 0));
+}
+
+static const char *index_file(void) {
+  const char *name = mgos_sys_config_get_fetch_cache_index();
+  return (name != NULL && name[0] != '\0' ? name : NULL);
+}
+
+static void index_load(void) {
+  const char *name = index_file();
+  struct json_token t;
+  char *data;
+  int i, len;
+  s_loaded = true;
+  if (name == NULL || (data = json_fread(name)) == NULL) return;
+  len = strlen(data);
+  for (i = 0; s_num_entries < FETCH_CACHE_MAX_ENTRIES &&
+              json_scanf_array_elem(data, len, ".entries", i, &t) > 0;
+       i++) {
+    struct fetch_cache_entry *e = calloc(1, sizeof(*e));
+    char *sha256 = NULL;
+    unsigned long crc = 0;
+    if (e == NULL) break;
+    json_scanf(t.ptr, t.len,
+               "{url: %Q, file: %Q, etag: %Q, last_modified: %Q, sha256: %Q, "
+               "crc32: %lu, size: %lu}",
+               &e->url, &e->file, &e->etag, &e->last_modified, &sha256, &crc,
+               &e->size);
+    if (e->url != NULL && e->file != NULL && sha256 != NULL &&
+        strlen(sha256) == FETCH_CACHE_SHA256_LEN) {
+      strcpy(e->sha256, sha256);
+      e->crc32 = (uint32_t) crc;
+      s_entries[s_num_entries++] = e;
+    } else {
+      entry_free(e);
+    }
+    free(sha256);
+  }
+  free(data);
+  LOG(LL_DEBUG, ("%s: %d entries", name, s_num_entries));
+}
+
+static int print_entries(struct json_out *out, va_list *ap) {
+  int i, len = 0;
+  len += json_printf(out, "[");
+  for (i = 0; i < s_num_entries; i++) {
+    const struct fetch_cache_entry *e = s_entries[i];
+    len += json_printf(out,
+                       "%s{url: %Q, file: %Q, etag: %Q, last_modified: %Q, "
+                       "sha256: %Q, crc32: %lu, size: %lu}",
+                       (i > 0 ? ", " : ""), e->url, e->file, e->etag,
+                       e->last_modified, e->sha256, (unsigned long) e->crc32,
+                       e->size);
+  }
+  len += json_printf(out, "]");
+  (void) ap;
+  return len;
+}
+
+static void index_save(void) {
+  const char *name = index_file();
+  char *tmp = NULL;
+  if (name == NULL) return;
+  mg_asprintf(&tmp, 0, "%s.tmp", name);
+  if (tmp == NULL) return;
+  if (json_fprintf(tmp, "{entries: %M}", print_entries) < 0 ||
+      rename(tmp, name) != 0) {
+    LOG(LL_ERROR, ("cannot write %s", name));
+    remove(tmp);
+  }
+  free(tmp);
+}
+
+/* Loads the index on first use, returns false if the cache is disabled. */
+static bool index_ready(void) {
+  if (index_file() == NULL) return false;
+  if (!s_loaded) index_load();
+  return true;
+}
+
+/* Moves an entry to the front and returns it, dropping it if it is stale. */
+static const struct fetch_cache_entry *entry_use(int i, bool rehash) {
+  struct fetch_cache_entry *e = s_entries[i];
+  if (!entry_valid(e, rehash)) {
+    LOG(LL_INFO, ("%s: changed, dropped from the cache", e->file));
+    entry_remove(i);
+    index_save();
+    return NULL;
+  }
+  memmove(&s_entries[1], &s_entries[0], i * sizeof(s_entries[0]));
+  s_entries[0] = e;
+  return e;
+}
+
+const struct fetch_cache_entry *fetch_cache_find(const char *url,
+                                                 const char *file) {
+  int i;
+  if (!index_ready()) return NULL;
+  for (i = 0; i < s_num_entries; i++) {
+    if (strcmp(s_entries[i]->url, url) == 0 &&
+        strcmp(s_entries[i]->file, file) == 0) {
+      return entry_use(i, false /* rehash */);
+    }
+  }
+  return NULL;
+}
+
+const struct fetch_cache_entry *fetch_cache_find_sha256(const char *sha256) {
+  int i;
+  if (!index_ready()) return NULL;
+  for (i = 0; i < s_num_entries; i++) {
+    const struct fetch_cache_entry *e;
+    if (strcasecmp(s_entries[i]->sha256, sha256) != 0) continue;
+    /* Its contents are what is asked for, not merely a file of that name. */
+    if ((e = entry_use(i, true /* rehash */)) != NULL) return e;
+    i--; /* Stale entries are removed */
+  }
+  return NULL;
+}
+
+void fetch_cache_put(const struct fetch_cache_entry *e) {
+  struct fetch_cache_entry *ne;
+  int i;
+  if (!index_ready()) return;
+  /* `e` may be one of the entries replaced below. */
+  if ((ne = calloc(1, sizeof(*ne))) == NULL) return;
+  ne->url = strdup(e->url);
+  ne->file = strdup(e->file);
+  ne->etag = (e->etag != NULL ? strdup(e->etag) : NULL);
+  ne->last_modified =
+      (e->last_modified != NULL ? strdup(e->last_modified) : NULL);
+  memcpy(ne->sha256, e->sha256, sizeof(ne->sha256));
+  ne->crc32 = e->crc32;
+  ne->size = e->size;
+  if (ne->url == NULL || ne->file == NULL ||
+      (e->etag != NULL && ne->etag == NULL) ||
+      (e->last_modified != NULL && ne->last_modified == NULL)) {
+    entry_free(ne);
+    return;
+  }
+  for (i = 0; i < s_num_entries; i++) {
+    if (strcmp(s_entries[i]->url, ne->url) == 0 ||
+        strcmp(s_entries[i]->file, ne->file) == 0) {
+      entry_remove(i--);
+    }
+  }
+  if (s_num_entries == FETCH_CACHE_MAX_ENTRIES) entry_remove(s_num_entries - 1);
+  memmove(&s_entries[1], &s_entries[0], s_num_entries * sizeof(s_entries[0]));
+  s_entries[0] = ne;
+  s_num_entries++;
+  index_save();
+}
+
+void fetch_cache_forget(const char *file) {
+  bool changed = false;
+  int i;
+  if (!index_ready()) return;
+  for (i = 0; i < s_num_entries; i++) {
+    if (strcmp(s_entries[i]->file, file) == 0) {
+      entry_remove(i--);
+      changed = true;
+    }
+  }
+  if (changed) index_save();
+}
+
+bool fetch_cache_copy(const struct fetch_cache_entry *e, const char *file) {
+  char buf[FETCH_CACHE_IO_SIZE];
+  FILE *in, *out = NULL;
+  bool ok = false;
+  size_t n;
+  if ((in = fopen(e->file, "r")) == NULL) return false;
+  if ((out = fopen(file, "w")) != NULL) {
+    ok = true;
+    while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+      ok = (fwrite(buf, 1, n, out) == n);
+    }
+    if (ferror(in)) ok = false;
+    if (fclose(out) != 0) ok = false;
+  }
+  fclose(in);
+  if (!ok && out != NULL) remove(file);
+  return ok;
+}
+
+void fetch_cache_hex(const unsigned char digest[32],
+                     char sha256[FETCH_CACHE_SHA256_LEN + 1]) {
+  int i;
+  for (i = 0; i < 32; i++) sprintf(sha256 + i * 2, "%02x", digest[i]);
+}
+
+bool fetch_cache_hash_file(const char *file,
+                           char sha256[FETCH_CACHE_SHA256_LEN + 1]) {
+  mbedtls_sha256_context ctx;
+  unsigned char buf[FETCH_CACHE_IO_SIZE], digest[32];
+  FILE *fp = fopen(file, "r");
+  bool ok;
+  size_t n;
+  if (fp == NULL) return false;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0 /* is224 */);
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    mbedtls_sha256_update(&ctx, buf, n);
+  }
+  ok = !ferror(fp);
+  fclose(fp);
+  mbedtls_sha256_finish(&ctx, digest);
+  mbedtls_sha256_free(&ctx);
+  if (ok) fetch_cache_hex(digest, sha256);
+  return ok;
+}
@@ -0,0 +1,67 @@
+/*
+ * Index of the files Fetch has downloaded, kept on flash.
+ *
+ * An entry ties a URL to the file it was last downloaded to, along with the
+ * validators the server sent for it, for conditional requests, and the
+ * SHA-256 of the contents, so that a file can be found by what is in it.
+ * An entry is only good while its file still has the recorded size, and,
+ * when it is looked up by contents, the recorded SHA-256.
+ */
+
+#ifndef SRC_FETCH_CACHE_H_
+#define SRC_FETCH_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FETCH_CACHE_SHA256_LEN 64
+
+struct fetch_cache_entry {
+  char *url;
+  char *file;
+  char *etag;          /* NULL if the server sent none */
+  char *last_modified; /* NULL if the server sent none */
+  char sha256[FETCH_CACHE_SHA256_LEN + 1]; /* Lowercase hex */
+  uint32_t crc32;
+  unsigned long size;
+};
+
+/*
+ * Returns the entry for `url` downloaded to `file`, NULL if there is none.
+ * The entry is valid until the next call that changes the index.
+ */
+const struct fetch_cache_entry *fetch_cache_find(const char *url,
+                                                 const char *file);
+
+/*
+ * Returns an entry whose file has the given contents, NULL if none does.
+ * The file is hashed again before it is returned.
+ */
+const struct fetch_cache_entry *fetch_cache_find_sha256(const char *sha256);
+
+/* Records a download, replacing earlier entries for its URL or its file. */
+void fetch_cache_put(const struct fetch_cache_entry *e);
+
+/* Drops the entries of a file that is about to be overwritten. */
+void fetch_cache_forget(const char *file);
+
+/* Copies the file of an entry to `file`. */
+bool fetch_cache_copy(const struct fetch_cache_entry *e, const char *file);
+
+/* Computes the hex SHA-256 of a file. */
+bool fetch_cache_hash_file(const char *file,
+                           char sha256[FETCH_CACHE_SHA256_LEN + 1]);
+
+/* Formats a SHA-256 digest as lowercase hex. */
+void fetch_cache_hex(const unsigned char digest[32],
+                     char sha256[FETCH_CACHE_SHA256_LEN + 1]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_FETCH_CACHE_H_ */
@@ -0,0 +1,272 @@
+/*
+ * Streaming gzip decoder, see gunzip.h.
+ *
+ * Header and trailer are taken a byte at a time, so they can be split
+ * anywhere. Deflate data goes to the inflater straight from the caller's
+ * buffer; only a symbol cut off at the end of it is copied aside, and is
+ * topped up from the next piece until the inflater can get past it.
+ */
+
+#include "gunzip.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "inflater.h"
+
+/*
+ * Longest deflate input the inflater may need in one piece. The longest
+ * one is a dynamic block header, which takes under 300 bytes.
+ */
+#define GUNZIP_CARRY_SIZE 512
+
+#define GZIP_FHCRC 0x02
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+#define GZIP_FRESERVED 0xe0
+
+enum gunzip_state {
+  GS_HEADER = 0, /* Fixed part of the header */
+  GS_EXTRA_LEN,  /* Length of the extra field */
+  GS_EXTRA,      /* Extra field */
+  GS_NAME,       /* Zero-terminated file name */
+  GS_COMMENT,    /* Zero-terminated comment */
+  GS_HCRC,       /* Header CRC */
+  GS_DATA,       /* Deflate data */
+  GS_TRAILER,    /* CRC-32 and size */
+  GS_DONE,
+  GS_ERROR,
+};
+
+struct gunzip {
+  enum gunzip_state state;
+  const char *error;
+  struct inflater *inf;
+  uint8_t flags;
+  uint8_t buf[10]; /* Fixed header or trailer being collected */
+  size_t buf_len;
+  size_t skip;     /* Bytes left of the extra field or header CRC */
+  uint32_t crc;    /* CRC-32 of the output consumed so far */
+  uint32_t size;   /* Length of the output consumed so far, mod 2^32 */
+  uint8_t carry[GUNZIP_CARRY_SIZE];
+  size_t carry_len;
+};
+
+struct gunzip *gunzip_create(void) {
+  struct gunzip *gz = (struct gunzip *) calloc(1, sizeof(*gz));
+  if (gz == NULL) return NULL;
+  if ((gz->inf = inflater_create()) == NULL) {
+    free(gz);
+    return NULL;
+  }
+  gz->state = GS_HEADER;
+  return gz;
+}
+
+void gunzip_free(struct gunzip *gz) {
+  if (gz == NULL) return;
+  inflater_free(gz->inf);
+  free(gz);
+}
+
+const char *gunzip_error(const struct gunzip *gz) {
+  return gz->error;
+}
+
+const uint8_t *gunzip_output(const struct gunzip *gz, size_t *len) {
+  return inflater_output(gz->inf, len);
+}
+
+void gunzip_consume(struct gunzip *gz, size_t len) {
+  size_t pending;
+  const uint8_t *out = inflater_output(gz->inf, &pending);
+  if (len > pending) len = pending;
+  gz->crc = crc32_update(gz->crc, out, len);
+  gz->size += (uint32_t) len;
+  inflater_consume(gz->inf, len);
+}
+
+static enum gunzip_result fail(struct gunzip *gz, const char *error) {
+  gz->state = GS_ERROR;
+  gz->error = error;
+  return GUNZIP_ERROR;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Moves on to the next part of the header that the flags say is there. */
+static void header_next(struct gunzip *gz) {
+  switch (gz->state) {
+    case GS_HEADER:
+      if (gz->flags & GZIP_FEXTRA) {
+        gz->state = GS_EXTRA_LEN;
+        return;
+      }
+    /* fall through */
+    case GS_EXTRA_LEN:
+    case GS_EXTRA:
+      if (gz->flags & GZIP_FNAME) {
+        gz->state = GS_NAME;
+        return;
+      }
+    /* fall through */
+    case GS_NAME:
+      if (gz->flags & GZIP_FCOMMENT) {
+        gz->state = GS_COMMENT;
+        return;
+      }
+    /* fall through */
+    case GS_COMMENT:
+      if (gz->flags & GZIP_FHCRC) {
+        gz->state = GS_HCRC;
+        gz->skip = 2;
+        return;
+      }
+    /* fall through */
+    default:
+      gz->state = GS_DATA;
+  }
+}
+
+/* Takes one byte of the header. Returns false if it is not a gzip header. */
+static bool header_byte(struct gunzip *gz, uint8_t b) {
+  switch (gz->state) {
+    case GS_HEADER:
+      gz->buf[gz->buf_len++] = b;
+      if (gz->buf_len < 10) break;
+      /* Magic, deflate method, no reserved flags. */
+      if (gz->buf[0] != 0x1f || gz->buf[1] != 0x8b || gz->buf[2] != 8 ||
+          (gz->buf[3] & GZIP_FRESERVED) != 0) {
+        return false;
+      }
+      gz->flags = gz->buf[3];
+      gz->buf_len = 0;
+      header_next(gz);
+      break;
+    case GS_EXTRA_LEN:
+      gz->buf[gz->buf_len++] = b;
+      if (gz->buf_len < 2) break;
+      gz->skip = gz->buf[0] | (gz->buf[1] << 8);
+      gz->buf_len = 0;
+      gz->state = GS_EXTRA;
+      if (gz->skip == 0) header_next(gz);
+      break;
+    case GS_EXTRA:
+    case GS_HCRC:
+      if (--gz->skip == 0) header_next(gz);
+      break;
+    case GS_NAME:
+    case GS_COMMENT:
+      if (b == 0) header_next(gz);
+      break;
+    default:
+      break;
+  }
+  return true;
+}
+
+/* Runs the inflater on carried input topped up from `in`, or on `in`. */
+static enum inflater_result run_inflater(struct gunzip *gz,
+                                         const uint8_t *in, size_t len,
+                                         size_t *pos) {
+  enum inflater_result res;
+  size_t n;
+  if (gz->carry_len > 0) {
+    n = GUNZIP_CARRY_SIZE - gz->carry_len;
+    if (n > len - *pos) n = len - *pos;
+    memcpy(gz->carry + gz->carry_len, in + *pos, n);
+    gz->carry_len += n;
+    *pos += n;
+    res = inflater_run(gz->inf, gz->carry, gz->carry_len, &n);
+    memmove(gz->carry, gz->carry + n, gz->carry_len - n);
+    gz->carry_len -= n;
+  } else {
+    res = inflater_run(gz->inf, in + *pos, len - *pos, &n);
+    *pos += n;
+    if (res == INFLATER_NEED_INPUT && *pos < len) {
+      /* The rest is the start of a symbol that goes on in the next piece. */
+      n = len - *pos;
+      if (n > GUNZIP_CARRY_SIZE) return INFLATER_ERROR;
+      memcpy(gz->carry, in + *pos, n);
+      gz->carry_len = n;
+      *pos = len;
+    }
+  }
+  return res;
+}
+
+enum gunzip_result gunzip_run(struct gunzip *gz, const uint8_t *in, size_t len,
+                              size_t *consumed) {
+  enum gunzip_result res = GUNZIP_NEED_INPUT;
+  size_t pos = 0, pending, i;
+
+  while (res == GUNZIP_NEED_INPUT) {
+    switch (gz->state) {
+      case GS_DATA: {
+        enum inflater_result ir = run_inflater(gz, in, len, &pos);
+        if (ir == INFLATER_ERROR) {
+          res = fail(gz, (inflater_error(gz->inf) != NULL
+                              ? inflater_error(gz->inf)
+                              : "Bad deflate data"));
+        } else if (ir == INFLATER_OUTPUT_FULL) {
+          res = GUNZIP_OUTPUT_FULL;
+        } else if (ir == INFLATER_DONE) {
+          /* Anything carried over belongs to the trailer. */
+          if (gz->carry_len > sizeof(gz->buf)) {
+            res = fail(gz, "Trailing data");
+            break;
+          }
+          memcpy(gz->buf, gz->carry, gz->carry_len);
+          gz->buf_len = gz->carry_len;
+          gz->carry_len = 0;
+          gz->state = GS_TRAILER;
+        } else if (gz->carry_len == GUNZIP_CARRY_SIZE) {
+          res = fail(gz, "Deflate symbol too long");
+        } else if (pos == len) {
+          goto out;
+        }
+        break;
+      }
+      case GS_TRAILER:
+        while (gz->buf_len < 8 && pos < len) gz->buf[gz->buf_len++] = in[pos++];
+        if (gz->buf_len < 8) goto out;
+        gunzip_output(gz, &pending);
+        if (pending > 0) {
+          res = GUNZIP_OUTPUT_FULL;
+        } else if (gz->buf_len > 8) {
+          res = fail(gz, "Trailing data");
+        } else if (get_le32(gz->buf) != gz->crc ||
+                   get_le32(gz->buf + 4) != gz->size) {
+          res = fail(gz, "CRC or length mismatch");
+        } else {
+          gz->state = GS_DONE;
+        }
+        break;
+      case GS_DONE:
+        res = (pos < len ? fail(gz, "Trailing data") : GUNZIP_DONE);
+        break;
+      case GS_ERROR:
+        res = GUNZIP_ERROR;
+        break;
+      default:
+        for (i = pos; i < len && gz->state < GS_DATA; i++) {
+          if (!header_byte(gz, in[i])) {
+            res = fail(gz, "Not a gzip stream");
+            break;
+          }
+        }
+        pos = i;
+        if (res == GUNZIP_NEED_INPUT && gz->state < GS_DATA) goto out;
+        break;
+    }
+  }
+
+out:
+  *consumed = pos;
+  return res;
+}
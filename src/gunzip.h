@@ -0,0 +1,61 @@
+/*
+ * Streaming gzip (RFC 1952) decoder on top of the inflater.
+ *
+ * Unlike inflater_run(), gunzip_run() takes all of its input unless output
+ * is full: a symbol split between two pieces is carried over internally, so
+ * input can come straight from a buffer that is about to be reused, such
+ * as the data of one chunk of a chunked HTTP reply.
+ *
+ * The CRC-32 and the length in the trailer are checked against the output
+ * consumed by the caller: GUNZIP_DONE is only returned once all of it has
+ * been consumed and matches.
+ */
+
+#ifndef SRC_GUNZIP_H_
+#define SRC_GUNZIP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum gunzip_result {
+  GUNZIP_ERROR = -1,
+  /* All input has been taken, more is needed to continue. */
+  GUNZIP_NEED_INPUT = 0,
+  /* Pending output has to be consumed before decoding can continue. */
+  GUNZIP_OUTPUT_FULL = 1,
+  /* The trailer has been checked, the stream is complete. */
+  GUNZIP_DONE = 2,
+};
+
+struct gunzip;
+
+struct gunzip *gunzip_create(void);
+
+/*
+ * Decodes as much of `in` as possible. Number of input bytes taken is
+ * stored in `consumed`; it is less than `len` only if the result is not
+ * GUNZIP_NEED_INPUT.
+ */
+enum gunzip_result gunzip_run(struct gunzip *gz, const uint8_t *in, size_t len,
+                              size_t *consumed);
+
+/* Returns decoded data not yet consumed; it is always contiguous. */
+const uint8_t *gunzip_output(const struct gunzip *gz, size_t *len);
+
+/* Marks `len` bytes of pending output as consumed. */
+void gunzip_consume(struct gunzip *gz, size_t len);
+
+/* Returns description of the last error, or NULL. */
+const char *gunzip_error(const struct gunzip *gz);
+
+void gunzip_free(struct gunzip *gz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_GUNZIP_H_ */
@@ -0,0 +1,450 @@
+/*
+ * Streaming raw DEFLATE decoder, see inflater.h.
+ *
+ * Huffman decoding follows the canonical code approach of zlib's puff.c:
+ * tables hold only code length counts and symbols ordered by code, which
+ * keeps them under a kilobyte. Window and pending output share one buffer;
+ * once it fills up, the last INFLATER_WINDOW_SIZE bytes are moved to the
+ * front, so pending output is always contiguous.
+ */
+
+#include "inflater.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BITS 15
+#define MAX_LCODES 286
+#define MAX_DCODES 30
+#define FIX_LCODES 288
+#define BUF_SIZE (INFLATER_WINDOW_SIZE + INFLATER_OUT_SIZE)
+
+enum inflater_state {
+  IS_BLOCK_HEADER = 0,
+  IS_STORED_HEADER,
+  IS_STORED_DATA,
+  IS_CODES,
+  IS_COPY,
+  IS_DONE,
+  IS_ERROR,
+};
+
+struct inflater {
+  enum inflater_state state;
+  bool last_block;
+  const char *error;
+
+  uint32_t bitbuf;
+  int bitcnt;
+  const uint8_t *in, *in_end;
+
+  uint32_t stored_left;
+  int copy_len, copy_dist;
+
+  uint16_t lencnt[MAX_BITS + 1], lensym[FIX_LCODES];
+  uint16_t distcnt[MAX_BITS + 1], distsym[MAX_DCODES];
+
+  size_t wpos;    /* Write position in buf */
+  size_t pending; /* Bytes before wpos not yet consumed */
+  uint8_t buf[BUF_SIZE];
+};
+
+/* Saved input position, used to roll back a partially decoded symbol. */
+struct inflater_mark {
+  const uint8_t *in;
+  uint32_t bitbuf;
+  int bitcnt;
+};
+
+static const uint16_t s_len_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t s_len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                        1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                        4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t s_dist_base[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,
+    33,  49,  65,  97,  129, 193,  257,  385,  513,  769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t s_dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                         4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                         9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t s_clen_order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                         11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+struct inflater *inflater_create(void) {
+  struct inflater *inf = (struct inflater *) malloc(sizeof(*inf));
+  if (inf != NULL) inflater_reset(inf);
+  return inf;
+}
+
+void inflater_reset(struct inflater *inf) {
+  inf->state = IS_BLOCK_HEADER;
+  inf->last_block = false;
+  inf->error = NULL;
+  inf->bitbuf = 0;
+  inf->bitcnt = 0;
+  inf->in = inf->in_end = NULL;
+  inf->stored_left = 0;
+  inf->copy_len = inf->copy_dist = 0;
+  inf->wpos = inf->pending = 0;
+}
+
+void inflater_free(struct inflater *inf) {
+  free(inf);
+}
+
+const char *inflater_error(const struct inflater *inf) {
+  return inf->error;
+}
+
+const uint8_t *inflater_output(const struct inflater *inf, size_t *len) {
+  *len = inf->pending;
+  return inf->buf + inf->wpos - inf->pending;
+}
+
+void inflater_consume(struct inflater *inf, size_t len) {
+  if (len > inf->pending) len = inf->pending;
+  inf->pending -= len;
+}
+
+static void mark(const struct inflater *inf, struct inflater_mark *m) {
+  m->in = inf->in;
+  m->bitbuf = inf->bitbuf;
+  m->bitcnt = inf->bitcnt;
+}
+
+static void rollback(struct inflater *inf, const struct inflater_mark *m) {
+  inf->in = m->in;
+  inf->bitbuf = m->bitbuf;
+  inf->bitcnt = m->bitcnt;
+}
+
+/* Makes sure there are at least n (<= 16) bits in the bit buffer. */
+static bool need_bits(struct inflater *inf, int n) {
+  while (inf->bitcnt < n) {
+    if (inf->in == inf->in_end) return false;
+    inf->bitbuf |= ((uint32_t) *inf->in++) << inf->bitcnt;
+    inf->bitcnt += 8;
+  }
+  return true;
+}
+
+static uint32_t take_bits(struct inflater *inf, int n) {
+  uint32_t v = inf->bitbuf & ((1UL << n) - 1);
+  inf->bitbuf >>= n;
+  inf->bitcnt -= n;
+  return v;
+}
+
+/*
+ * Decodes one symbol. Returns the symbol, -1 if more input is needed or
+ * -2 if the code is not in the table.
+ */
+static int decode(struct inflater *inf, const uint16_t *count,
+                  const uint16_t *symbol) {
+  int code = 0, first = 0, index = 0, len;
+  for (len = 1; len <= MAX_BITS; len++) {
+    if (!need_bits(inf, 1)) return -1;
+    code |= (int) take_bits(inf, 1);
+    int cnt = count[len];
+    if (code - cnt < first) return symbol[index + (code - first)];
+    index += cnt;
+    first += cnt;
+    first <<= 1;
+    code <<= 1;
+  }
+  return -2;
+}
+
+/*
+ * Builds decoding table from code lengths. Returns 0 for a complete code,
+ * negative for an over-subscribed one and positive for an incomplete one.
+ */
+static int construct(uint16_t *count, uint16_t *symbol, const uint8_t *length,
+                     int n) {
+  int sym, len, left;
+  uint16_t offs[MAX_BITS + 1];
+
+  for (len = 0; len <= MAX_BITS; len++) count[len] = 0;
+  for (sym = 0; sym < n; sym++) count[length[sym]]++;
+  if (count[0] == n) return 0;
+
+  left = 1;
+  for (len = 1; len <= MAX_BITS; len++) {
+    left <<= 1;
+    left -= count[len];
+    if (left < 0) return left;
+  }
+
+  offs[1] = 0;
+  for (len = 1; len < MAX_BITS; len++) offs[len + 1] = offs[len] + count[len];
+  for (sym = 0; sym < n; sym++) {
+    if (length[sym] != 0) symbol[offs[length[sym]]++] = sym;
+  }
+  return left;
+}
+
+static void build_fixed(struct inflater *inf) {
+  uint8_t lengths[FIX_LCODES];
+  int sym;
+  for (sym = 0; sym < 144; sym++) lengths[sym] = 8;
+  for (; sym < 256; sym++) lengths[sym] = 9;
+  for (; sym < 280; sym++) lengths[sym] = 7;
+  for (; sym < FIX_LCODES; sym++) lengths[sym] = 8;
+  construct(inf->lencnt, inf->lensym, lengths, FIX_LCODES);
+  for (sym = 0; sym < MAX_DCODES; sym++) lengths[sym] = 5;
+  construct(inf->distcnt, inf->distsym, lengths, MAX_DCODES);
+}
+
+/*
+ * Reads code tables of a dynamic block. Returns 1 on success, 0 if more
+ * input is needed, -1 on error.
+ */
+static int read_dynamic(struct inflater *inf) {
+  uint8_t lengths[MAX_LCODES + MAX_DCODES];
+  int nlen, ndist, ncode, index, err;
+
+  if (!need_bits(inf, 14)) return 0;
+  nlen = (int) take_bits(inf, 5) + 257;
+  ndist = (int) take_bits(inf, 5) + 1;
+  ncode = (int) take_bits(inf, 4) + 4;
+  if (nlen > MAX_LCODES || ndist > MAX_DCODES) {
+    inf->error = "Bad counts";
+    return -1;
+  }
+
+  for (index = 0; index < ncode; index++) {
+    if (!need_bits(inf, 3)) return 0;
+    lengths[s_clen_order[index]] = (uint8_t) take_bits(inf, 3);
+  }
+  for (; index < 19; index++) lengths[s_clen_order[index]] = 0;
+  /* Code length code must be complete. */
+  if (construct(inf->lencnt, inf->lensym, lengths, 19) != 0) {
+    inf->error = "Bad code lengths";
+    return -1;
+  }
+
+  index = 0;
+  while (index < nlen + ndist) {
+    int sym = decode(inf, inf->lencnt, inf->lensym);
+    if (sym < 0) {
+      if (sym == -1) return 0;
+      inf->error = "Bad code lengths";
+      return -1;
+    }
+    if (sym < 16) {
+      lengths[index++] = (uint8_t) sym;
+      continue;
+    }
+    uint8_t len = 0;
+    if (sym == 16) {
+      if (index == 0) {
+        inf->error = "Repeat with no first length";
+        return -1;
+      }
+      len = lengths[index - 1];
+      if (!need_bits(inf, 2)) return 0;
+      sym = 3 + (int) take_bits(inf, 2);
+    } else if (sym == 17) {
+      if (!need_bits(inf, 3)) return 0;
+      sym = 3 + (int) take_bits(inf, 3);
+    } else {
+      if (!need_bits(inf, 7)) return 0;
+      sym = 11 + (int) take_bits(inf, 7);
+    }
+    if (index + sym > nlen + ndist) {
+      inf->error = "Too many lengths";
+      return -1;
+    }
+    while (sym--) lengths[index++] = len;
+  }
+
+  if (lengths[256] == 0) {
+    inf->error = "No end of block code";
+    return -1;
+  }
+  /* Incomplete codes are only allowed if there is a single length. */
+  err = construct(inf->lencnt, inf->lensym, lengths, nlen);
+  if (err && (err < 0 || nlen != inf->lencnt[0] + inf->lencnt[1])) {
+    inf->error = "Bad literal/length code";
+    return -1;
+  }
+  err = construct(inf->distcnt, inf->distsym, lengths + nlen, ndist);
+  if (err && (err < 0 || ndist != inf->distcnt[0] + inf->distcnt[1])) {
+    inf->error = "Bad distance code";
+    return -1;
+  }
+  return 1;
+}
+
+/* Returns number of bytes that can be written at wpos right now. */
+static size_t out_room(struct inflater *inf) {
+  if (inf->pending >= INFLATER_OUT_SIZE) return 0;
+  if (inf->wpos == BUF_SIZE) {
+    /* Pending output is never longer than the window, so it is kept too. */
+    memmove(inf->buf, inf->buf + BUF_SIZE - INFLATER_WINDOW_SIZE,
+            INFLATER_WINDOW_SIZE);
+    inf->wpos = INFLATER_WINDOW_SIZE;
+  }
+  size_t room = INFLATER_OUT_SIZE - inf->pending;
+  if (room > BUF_SIZE - inf->wpos) room = BUF_SIZE - inf->wpos;
+  return room;
+}
+
+/*
+ * Decodes one literal or length/distance pair. Returns 1 if the caller
+ * should continue, 0 if more input is needed, -1 on error.
+ */
+static int decode_symbol(struct inflater *inf) {
+  int sym = decode(inf, inf->lencnt, inf->lensym);
+  if (sym == -1) return 0;
+  if (sym < 0) {
+    inf->error = "Bad literal/length code";
+    return -1;
+  }
+  if (sym < 256) {
+    inf->buf[inf->wpos++] = (uint8_t) sym;
+    inf->pending++;
+    return 1;
+  }
+  if (sym == 256) {
+    inf->state = (inf->last_block ? IS_DONE : IS_BLOCK_HEADER);
+    return 1;
+  }
+  sym -= 257;
+  if (sym >= 29) {
+    inf->error = "Bad length symbol";
+    return -1;
+  }
+  if (!need_bits(inf, s_len_extra[sym])) return 0;
+  int len = s_len_base[sym] + (int) take_bits(inf, s_len_extra[sym]);
+
+  sym = decode(inf, inf->distcnt, inf->distsym);
+  if (sym == -1) return 0;
+  if (sym < 0 || sym >= 30) {
+    inf->error = "Bad distance symbol";
+    return -1;
+  }
+  if (!need_bits(inf, s_dist_extra[sym])) return 0;
+  int dist = s_dist_base[sym] + (int) take_bits(inf, s_dist_extra[sym]);
+  if ((size_t) dist > inf->wpos) {
+    inf->error = "Distance too far back";
+    return -1;
+  }
+  inf->copy_len = len;
+  inf->copy_dist = dist;
+  inf->state = IS_COPY;
+  return 1;
+}
+
+static enum inflater_result inflater_step(struct inflater *inf) {
+  struct inflater_mark m;
+  int ret;
+
+  while (true) {
+    mark(inf, &m);
+    switch (inf->state) {
+      case IS_BLOCK_HEADER: {
+        if (!need_bits(inf, 3)) goto need_input;
+        inf->last_block = take_bits(inf, 1);
+        switch (take_bits(inf, 2)) {
+          case 0:
+            inf->state = IS_STORED_HEADER;
+            break;
+          case 1:
+            build_fixed(inf);
+            inf->state = IS_CODES;
+            break;
+          case 2:
+            if ((ret = read_dynamic(inf)) <= 0) {
+              if (ret == 0) goto need_input;
+              goto error;
+            }
+            inf->state = IS_CODES;
+            break;
+          default:
+            inf->error = "Invalid block type";
+            goto error;
+        }
+        break;
+      }
+      case IS_STORED_HEADER: {
+        /* Stored data starts at a byte boundary. */
+        take_bits(inf, inf->bitcnt & 7);
+        if (!need_bits(inf, 16)) goto need_input;
+        uint32_t len = take_bits(inf, 16);
+        if (!need_bits(inf, 16)) goto need_input;
+        if (take_bits(inf, 16) != (~len & 0xffff)) {
+          inf->error = "Stored block length mismatch";
+          goto error;
+        }
+        inf->stored_left = len;
+        inf->state = IS_STORED_DATA;
+      } /* fall through */
+      case IS_STORED_DATA: {
+        while (inf->stored_left > 0) {
+          size_t n = out_room(inf);
+          if (n == 0) return INFLATER_OUTPUT_FULL;
+          if (n > inf->stored_left) n = inf->stored_left;
+          if (n > (size_t)(inf->in_end - inf->in)) n = inf->in_end - inf->in;
+          if (n == 0) return INFLATER_NEED_INPUT;
+          memcpy(inf->buf + inf->wpos, inf->in, n);
+          inf->in += n;
+          inf->wpos += n;
+          inf->pending += n;
+          inf->stored_left -= n;
+        }
+        inf->state = (inf->last_block ? IS_DONE : IS_BLOCK_HEADER);
+        break;
+      }
+      case IS_CODES: {
+        if (out_room(inf) == 0) return INFLATER_OUTPUT_FULL;
+        if ((ret = decode_symbol(inf)) <= 0) {
+          if (ret == 0) goto need_input;
+          goto error;
+        }
+        break;
+      }
+      case IS_COPY: {
+        while (inf->copy_len > 0) {
+          size_t n = out_room(inf);
+          if (n == 0) return INFLATER_OUTPUT_FULL;
+          if (n > (size_t) inf->copy_len) n = inf->copy_len;
+          /* Source and destination may overlap, copy byte by byte. */
+          const uint8_t *src = inf->buf + inf->wpos - inf->copy_dist;
+          uint8_t *dst = inf->buf + inf->wpos;
+          inf->wpos += n;
+          inf->pending += n;
+          inf->copy_len -= (int) n;
+          while (n-- > 0) *dst++ = *src++;
+        }
+        inf->state = IS_CODES;
+        break;
+      }
+      case IS_DONE:
+        return INFLATER_DONE;
+      case IS_ERROR:
+        return INFLATER_ERROR;
+    }
+  }
+
+need_input:
+  rollback(inf, &m);
+  return INFLATER_NEED_INPUT;
+
+error:
+  inf->state = IS_ERROR;
+  return INFLATER_ERROR;
+}
+
+enum inflater_result inflater_run(struct inflater *inf, const uint8_t *in,
+                                  size_t len, size_t *consumed) {
+  inf->in = in;
+  inf->in_end = in + len;
+  enum inflater_result res = inflater_step(inf);
+  *consumed = inf->in - in;
+  inf->in = inf->in_end = NULL;
+  return res;
+}
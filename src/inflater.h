@@ -0,0 +1,69 @@
+/*
+ * Streaming raw DEFLATE (RFC 1951) decoder with bounded memory.
+ *
+ * Input is pushed in arbitrary pieces with inflater_run(). The decoder
+ * consumes input one complete symbol at a time: if a piece ends in the
+ * middle of a symbol, the incomplete tail is left unconsumed and must be
+ * passed again, together with more data, on the next call.
+ *
+ * Decoded bytes are kept in the sliding window until the caller takes them
+ * with inflater_output() / inflater_consume(). At most INFLATER_OUT_SIZE
+ * bytes are held pending; when that is reached, inflater_run() returns
+ * INFLATER_OUTPUT_FULL and has to be called again after draining.
+ */
+
+#ifndef SRC_INFLATER_H_
+#define SRC_INFLATER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum back reference distance allowed by DEFLATE. */
+#define INFLATER_WINDOW_SIZE 32768U
+/* Maximum amount of decoded data held until consumed by the caller. */
+#define INFLATER_OUT_SIZE 4096U
+
+enum inflater_result {
+  INFLATER_ERROR = -1,
+  /* All usable input has been consumed, more is needed to continue. */
+  INFLATER_NEED_INPUT = 0,
+  /* Pending output has to be consumed before decoding can continue. */
+  INFLATER_OUTPUT_FULL = 1,
+  /* The final block has been decoded. */
+  INFLATER_DONE = 2,
+};
+
+struct inflater;
+
+struct inflater *inflater_create(void);
+
+/* Prepares the decoder for a new stream, pending output is dropped. */
+void inflater_reset(struct inflater *inf);
+
+/*
+ * Decodes as much of `in` as possible. Number of input bytes used is stored
+ * in `consumed`, the rest has to be presented again on the next call.
+ */
+enum inflater_result inflater_run(struct inflater *inf, const uint8_t *in,
+                                  size_t len, size_t *consumed);
+
+/* Returns decoded data not yet consumed; it is always contiguous. */
+const uint8_t *inflater_output(const struct inflater *inf, size_t *len);
+
+/* Marks `len` bytes of pending output as consumed. */
+void inflater_consume(struct inflater *inf, size_t len);
+
+/* Returns description of the last error, or NULL. */
+const char *inflater_error(const struct inflater *inf);
+
+void inflater_free(struct inflater *inf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_INFLATER_H_ */
@@ -0,0 +1,184 @@
+/*
+ * Push-style JSON object scanner, see json_stream.h.
+ */
+
+#include "json_stream.h"
+
+#include <string.h>
+
+enum json_stream_state {
+  JSS_START = 0,
+  JSS_KEY_OR_END,
+  JSS_KEY_START,
+  JSS_KEY,
+  JSS_COLON,
+  JSS_VALUE,
+  JSS_STRING,
+  JSS_NESTED,
+  JSS_SCALAR,
+  JSS_NEXT,
+  JSS_DONE,
+  JSS_ERROR,
+};
+
+static bool is_space(char c) {
+  return (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+}
+
+static bool is_scalar_char(char c) {
+  return ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+          (c >= 'A' && c <= 'Z') || c == '-' || c == '+' || c == '.');
+}
+
+void json_stream_init(struct json_stream *js, json_stream_cb cb, void *arg) {
+  memset(js, 0, sizeof(*js));
+  js->state = JSS_START;
+  js->cb = cb;
+  js->cb_arg = arg;
+}
+
+/* Reports the current member whose value ends at `end`. */
+static bool emit(struct json_stream *js, const char *buf, size_t end,
+                 enum json_token_type type) {
+  struct json_token key, value;
+  key.ptr = buf + js->key_start;
+  key.len = js->key_len;
+  key.type = JSON_TYPE_STRING;
+  value.ptr = buf + js->value_start;
+  value.len = end - js->value_start;
+  value.type = type;
+  js->state = JSS_NEXT;
+  return js->cb(js->cb_arg, &key, &value);
+}
+
+static enum json_token_type scalar_type(const char *p, size_t len) {
+  if (len == 4 && strncmp(p, "true", 4) == 0) return JSON_TYPE_TRUE;
+  if (len == 5 && strncmp(p, "false", 5) == 0) return JSON_TYPE_FALSE;
+  if (len == 4 && strncmp(p, "null", 4) == 0) return JSON_TYPE_NULL;
+  if (p[0] == '-' || (p[0] >= '0' && p[0] <= '9')) return JSON_TYPE_NUMBER;
+  return JSON_TYPE_INVALID;
+}
+
+/* Tracks quotes and escapes, returns true if `c` is inside a string. */
+static bool skip_string(struct json_stream *js, char c) {
+  if (!js->in_string) return false;
+  if (js->escape) {
+    js->escape = false;
+  } else if (c == '\\') {
+    js->escape = true;
+  } else if (c == '"') {
+    js->in_string = false;
+    return false;
+  }
+  return true;
+}
+
+int json_stream_feed(struct json_stream *js, const char *buf, size_t len) {
+  while (js->pos < len && js->state != JSS_ERROR) {
+    char c = buf[js->pos];
+    bool ok = true;
+    switch (js->state) {
+      case JSS_START:
+        if (c == '{') {
+          js->state = JSS_KEY_OR_END;
+        } else {
+          ok = is_space(c);
+        }
+        break;
+      case JSS_KEY_OR_END:
+        if (c == '}') {
+          js->state = JSS_DONE;
+          break;
+        }
+      /* fall through */
+      case JSS_KEY_START:
+        if (c == '"') {
+          js->key_start = js->pos + 1;
+          js->in_string = true;
+          js->state = JSS_KEY;
+        } else {
+          ok = is_space(c);
+        }
+        break;
+      case JSS_KEY:
+        if (!skip_string(js, c)) {
+          js->key_len = js->pos - js->key_start;
+          js->state = JSS_COLON;
+        }
+        break;
+      case JSS_COLON:
+        if (c == ':') {
+          js->state = JSS_VALUE;
+        } else {
+          ok = is_space(c);
+        }
+        break;
+      case JSS_VALUE:
+        if (c == '"') {
+          js->value_start = js->pos + 1;
+          js->in_string = true;
+          js->state = JSS_STRING;
+        } else if (c == '{' || c == '[') {
+          js->value_start = js->pos;
+          js->nesting = 1;
+          js->state = JSS_NESTED;
+        } else if (is_scalar_char(c)) {
+          js->value_start = js->pos;
+          js->state = JSS_SCALAR;
+        } else {
+          ok = is_space(c);
+        }
+        break;
+      case JSS_STRING:
+        if (!skip_string(js, c)) {
+          ok = emit(js, buf, js->pos, JSON_TYPE_STRING);
+        }
+        break;
+      case JSS_NESTED:
+        if (js->in_string) {
+          skip_string(js, c);
+        } else if (c == '"') {
+          js->in_string = true;
+        } else if (c == '{' || c == '[') {
+          js->nesting++;
+        } else if (c == '}' || c == ']') {
+          if (--js->nesting == 0) {
+            ok = emit(js, buf, js->pos + 1,
+                      (buf[js->value_start] == '{' ? JSON_TYPE_OBJECT_END
+                                                   : JSON_TYPE_ARRAY_END));
+          }
+        }
+        break;
+      case JSS_SCALAR: {
+        if (is_scalar_char(c)) break;
+        enum json_token_type type =
+            scalar_type(buf + js->value_start, js->pos - js->value_start);
+        ok = (type != JSON_TYPE_INVALID && emit(js, buf, js->pos, type));
+        /* The delimiter is looked at again in the JSS_NEXT state. */
+        if (ok) continue;
+        break;
+      }
+      case JSS_NEXT:
+        if (c == ',') {
+          js->state = JSS_KEY_START;
+        } else if (c == '}') {
+          js->state = JSS_DONE;
+        } else {
+          ok = is_space(c);
+        }
+        break;
+      case JSS_DONE:
+        ok = is_space(c);
+        break;
+      case JSS_ERROR:
+        break;
+    }
+    if (!ok) {
+      js->state = JSS_ERROR;
+      break;
+    }
+    js->pos++;
+  }
+  if (js->state == JSS_ERROR) return -1;
+  return (js->state == JSS_DONE);
+}
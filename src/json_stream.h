@@ -0,0 +1,59 @@
+/*
+ * Push-style scanner for the top level members of a JSON object.
+ *
+ * The document is scanned as it arrives and each member is reported as soon
+ * as its value is complete, so a consumer can act on the first members
+ * without waiting for the rest. The scanner does not keep a copy of the
+ * data: the caller accumulates the document in one buffer and passes it
+ * again, with the new bytes at the end, on every call. Reported tokens
+ * point into that buffer and are laid out like those of frozen's json_walk():
+ * strings exclude the quotes, objects and arrays include the brackets.
+ *
+ * Nested values are only checked for balanced brackets, they are meant to
+ * be parsed later with frozen.
+ */
+
+#ifndef SRC_JSON_STREAM_H_
+#define SRC_JSON_STREAM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "frozen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called for every top level member; returning false stops the scan. */
+typedef bool (*json_stream_cb)(void *arg, const struct json_token *key,
+                               const struct json_token *value);
+
+struct json_stream {
+  int state;
+  json_stream_cb cb;
+  void *cb_arg;
+  /* Offset of the next byte to scan. */
+  size_t pos;
+  /* Member being scanned. */
+  size_t key_start, key_len;
+  size_t value_start;
+  int nesting;
+  bool in_string, escape;
+};
+
+void json_stream_init(struct json_stream *js, json_stream_cb cb, void *arg);
+
+/*
+ * Scans what has been added to `buf` since the last call; `len` is the
+ * total length of the document received so far. Returns 1 once the object
+ * has been closed, 0 if more data is expected and -1 on a syntax error or
+ * if the callback has stopped the scan.
+ */
+int json_stream_feed(struct json_stream *js, const char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_JSON_STREAM_H_ */
@@ -0,0 +1,541 @@
+/*
+ * LED transition engine, see led.h.
+ *
+ * Levels are kept in 8.8 fixed point, so that a slow fade moves in steps
+ * finer than one unit of the 0..255 colour scale. A transition is driven by
+ * a timer at led.fps frames per second that only runs while there is one.
+ * Where a frame is in the transition is worked out from the time elapsed,
+ * not from the number of frames, so a late frame does not delay the fade.
+ *
+ * On the way out a level is scaled by brightness and the channel's level,
+ * then mapped to a 16-bit duty through the brightness curve. Transitions
+ * move linearly in lightness, so with the CIE curve they look even. All of
+ * it is integer math; the curves are tables built by the compiler.
+ *
+ * Effects are played by the same frame timer: when a transition ends, the
+ * next key of the effect is started from the time the last one was due to
+ * end, so an effect keeps to its timing whatever the frames do.
+ *
+ * Colours submitted faster than frames are shown are coalesced: only the
+ * latest one is kept until the next frame, the ones it replaces are
+ * dropped and counted, see LED.Stats.
+ *
+ * Frames go to all outputs, see led_fb.h: each is filled with the colour
+ * and flushed once per frame, and only when the colour has changed.
+ */
+
+#include "led.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frozen.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#include "led_fb.h"
+#include "profile.h"
+
+/* 1.0 in the Q16 fixed point of transition progress. */
+#define LED_ONE 65536
+
+/* Full level in 8.8 fixed point. */
+#define LED_LEVEL_MAX (255 << 8)
+
+/* Full duty of the output, see led_out(). */
+#define LED_DUTY_MAX 65535
+
+/*
+ * Brightness curves, from a colour component `i` of 0..255 to a duty of
+ * 0..LED_DUTY_MAX. CIE 1976 lightness: L* = 100 * i / 255 is taken to the
+ * relative luminance Y that gives it. The gamma curve is a cheaper
+ * approximation of a power of about 2.4.
+ */
+#define LED_SQ(x) ((x) * (x))
+#define LED_CUBE(x) ((x) * (x) * (x))
+#define LED_CIE_L(i) ((i) * 100.0 / 255)
+#define LED_CIE(i)                                   \
+  (LED_CIE_L(i) <= 8 ? LED_CIE_L(i) / 903.3          \
+                     : LED_CUBE((LED_CIE_L(i) + 16) / 116))
+#define LED_GAMMA(i) (0.8 * LED_SQ((i) / 255.0) + 0.2 * LED_CUBE((i) / 255.0))
+#define LED_DUTY(y) ((uint16_t) ((y) * LED_DUTY_MAX + 0.5))
+#define LED_CIE_DUTY(i) LED_DUTY(LED_CIE(i))
+#define LED_GAMMA_DUTY(i) LED_DUTY(LED_GAMMA(i))
+
+/* Expand to f(i), f(i + 1), ... f(i + n - 1). */
+#define LED_T4(f, i) f(i), f((i) + 1), f((i) + 2), f((i) + 3)
+#define LED_T16(f, i) \
+  LED_T4(f, i), LED_T4(f, (i) + 4), LED_T4(f, (i) + 8), LED_T4(f, (i) + 12)
+#define LED_T64(f, i)                                          \
+  LED_T16(f, i), LED_T16(f, (i) + 16), LED_T16(f, (i) + 32), \
+      LED_T16(f, (i) + 48)
+#define LED_T256(f)                                              \
+  LED_T64(f, 0), LED_T64(f, 64), LED_T64(f, 128), LED_T64(f, 192)
+
+/* Most outputs: fixtures and strips. */
+#define LED_MAX_OUTPUTS 4
+
+/* Most keys an effect may have. */
+#define LED_FX_MAX_KEYS 64
+
+/* Blend of an effect that jumps to each key and holds it. */
+#define LED_BLEND_STEP (-1)
+
+static const uint16_t s_cie[256] = {LED_T256(LED_CIE_DUTY)};
+static const uint16_t s_gamma[256] = {LED_T256(LED_GAMMA_DUTY)};
+
+static struct {
+  bool ready;
+  struct led_fb *outputs[LED_MAX_OUTPUTS];
+  int num_outputs;
+  bool pixels_set; /* Pixels have been set one by one since the last fill */
+  const uint16_t *curve; /* NULL for linear */
+  uint8_t brightness;
+  uint8_t levels[LED_CHANNELS];
+  uint32_t scale[LED_CHANNELS]; /* Brightness times level, Q16 */
+  uint16_t cur[LED_CHANNELS];   /* Levels shown, 8.8 fixed point */
+  uint16_t duty[LED_CHANNELS];  /* Duty the outputs are filled with */
+  uint16_t from[LED_CHANNELS];
+  uint16_t to[LED_CHANNELS];
+  double start;
+  int duration_ms;
+  int frame_ms;
+  enum led_easing easing;
+  mgos_timer_id timer;
+} s_led = {.timer = MGOS_INVALID_TIMER_ID};
+
+struct led_key {
+  int rgbw[LED_CHANNELS];
+  int flags;
+  int ms;
+};
+
+/* Effect being played. */
+static struct {
+  struct led_key *keys; /* NULL if none */
+  int num_keys;
+  int next;   /* Key to go to when the transition to this one ends */
+  int repeat; /* Passes through the keys left, 0 for no end */
+  int blend;  /* Easing, or LED_BLEND_STEP */
+} s_fx;
+
+/* Colour submitted by led_submit() to be shown at the next frame. */
+static struct {
+  bool pending;
+  int rgbw[LED_CHANNELS];
+  int ms;
+  int easing;
+  unsigned long received;   /* Colours submitted */
+  unsigned long rendered;   /* Submitted colours shown */
+  unsigned long superseded; /* Submitted colours dropped for a later one */
+  unsigned long frames;
+} s_in;
+
+static struct prof_stat *s_frame_stat;
+
+static void start_transit(int r, int g, int b, int w, int ms, int easing);
+
+/* Maps progress `t`, 0..LED_ONE, through an easing curve. */
+static uint32_t ease(enum led_easing easing, uint32_t t) {
+  uint32_t t2 = (uint32_t) (((uint64_t) t * t) >> 16);
+  switch (easing) {
+    case LED_EASE_IN:
+      return t2;
+    case LED_EASE_OUT:
+      /* 1 - (1 - t)^2 */
+      return 2 * t - t2;
+    case LED_EASE_IN_OUT:
+      /* Smoothstep, 3t^2 - 2t^3 */
+      return (uint32_t) (((uint64_t) t2 * (3 * LED_ONE - 2 * t)) >> 16);
+    default:
+      return t;
+  }
+}
+
+/* Maps the level of channel `i` to the duty to write for it. */
+static uint16_t led_out(int i, uint16_t level) {
+  uint32_t v = (level * s_led.scale[i]) >> 16, idx = v >> 8, frac = v & 0xff;
+  const uint16_t *t = s_led.curve;
+  if (t == NULL) return (uint16_t) (v + idx);
+  if (frac == 0) return t[idx];
+  return (uint16_t) (t[idx] + (((t[idx + 1] - t[idx]) * frac) >> 8));
+}
+
+/* Shows `levels` on all outputs, unless that is what they show already. */
+static void led_show(const uint16_t *levels, bool force) {
+  uint16_t duty[LED_CHANNELS];
+  bool changed = force || s_led.pixels_set;
+  int i;
+  memcpy(s_led.cur, levels, sizeof(s_led.cur));
+  for (i = 0; i < LED_CHANNELS; i++) {
+    duty[i] = led_out(i, levels[i]);
+    if (duty[i] != s_led.duty[i]) changed = true;
+  }
+  if (!changed) return;
+  memcpy(s_led.duty, duty, sizeof(s_led.duty));
+  s_led.pixels_set = false;
+  for (i = 0; i < s_led.num_outputs; i++) {
+    led_fb_fill(s_led.outputs[i], duty);
+    led_fb_flush(s_led.outputs[i], force);
+  }
+}
+
+static void update_scale(void) {
+  int i;
+  for (i = 0; i < LED_CHANNELS; i++) {
+    /* 255 * 255 maps to 65536, so that full scale is exactly 1.0. */
+    s_led.scale[i] =
+        ((uint32_t) s_led.brightness * s_led.levels[i] * 65536 + 32512) /
+        65025;
+  }
+}
+
+static void stop_timer(void) {
+  if (s_led.timer == MGOS_INVALID_TIMER_ID) return;
+  mgos_clear_timer(s_led.timer);
+  s_led.timer = MGOS_INVALID_TIMER_ID;
+}
+
+static void fx_free(void) {
+  free(s_fx.keys);
+  memset(&s_fx, 0, sizeof(s_fx));
+}
+
+/* Drops a submitted colour not yet shown, for a later command. */
+static void drop_pending(void) {
+  if (!s_in.pending) return;
+  s_in.pending = false;
+  s_in.superseded++;
+}
+
+void led_stop(void) {
+  drop_pending();
+  fx_free();
+  stop_timer();
+}
+
+bool led_busy(void) {
+  return (s_led.timer != MGOS_INVALID_TIMER_ID);
+}
+
+static int clamp(int v) {
+  return (v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+/* Sets the target of a transition, 8.8 levels from 0..255 components. */
+static void set_target(int r, int g, int b, int w, int flags) {
+  int min;
+  r = clamp(r);
+  g = clamp(g);
+  b = clamp(b);
+  w = clamp(w);
+  if (flags & LED_WHITE) {
+    min = (r < g ? r : g);
+    if (b < min) min = b;
+    r -= min;
+    g -= min;
+    b -= min;
+    w = clamp(w + min);
+  }
+  s_led.to[0] = (uint16_t) (r << 8);
+  s_led.to[1] = (uint16_t) (g << 8);
+  s_led.to[2] = (uint16_t) (b << 8);
+  s_led.to[3] = (uint16_t) (w << 8);
+}
+
+/*
+ * Goes on to the next key of the effect, if there is one. The transition
+ * to it starts when the last one was due to end.
+ */
+static bool fx_next(void) {
+  const struct led_key *k;
+  double now = mgos_uptime();
+  if (s_fx.keys == NULL) return false;
+  if (s_fx.next == s_fx.num_keys) {
+    if (s_fx.repeat > 0 && --s_fx.repeat == 0) {
+      fx_free();
+      return false;
+    }
+    s_fx.next = 0;
+  }
+  k = &s_fx.keys[s_fx.next++];
+  set_target(k->rgbw[0], k->rgbw[1], k->rgbw[2], k->rgbw[3], k->flags);
+  if (s_fx.blend == LED_BLEND_STEP) led_show(s_led.to, false);
+  memcpy(s_led.from, s_led.cur, sizeof(s_led.from));
+  s_led.start += s_led.duration_ms / 1000.0;
+  /* Too far behind to show this key at all: catch up rather than skip. */
+  if (now - s_led.start >= k->ms / 1000.0) s_led.start = now;
+  s_led.duration_ms = k->ms;
+  s_led.easing = (s_fx.blend == LED_BLEND_STEP ? LED_EASE_LINEAR
+                                               : (enum led_easing) s_fx.blend);
+  return true;
+}
+
+static void render_frame(void) {
+  uint16_t levels[LED_CHANNELS];
+  uint32_t e;
+  int elapsed, i;
+  s_in.frames++;
+  if (s_in.pending) {
+    s_in.pending = false;
+    s_in.rendered++;
+    start_transit(s_in.rgbw[0], s_in.rgbw[1], s_in.rgbw[2], s_in.rgbw[3],
+                  s_in.ms, s_in.easing);
+    if (!led_busy()) return;
+    /*
+     * Show its first step now: under a steady stream of colours every
+     * frame starts a new transition, and none would get anywhere.
+     */
+    s_led.start -= s_led.frame_ms / 1000.0;
+  }
+  elapsed = (int) ((mgos_uptime() - s_led.start) * 1000);
+  if (elapsed >= s_led.duration_ms) {
+    led_show(s_led.to, false);
+    if (!fx_next()) stop_timer();
+    return;
+  }
+  e = ease(s_led.easing,
+           (uint32_t) (((uint64_t) elapsed << 16) / s_led.duration_ms));
+  for (i = 0; i < LED_CHANNELS; i++) {
+    int32_t d = (int32_t) s_led.to[i] - s_led.from[i];
+    levels[i] = (uint16_t) (s_led.from[i] + ((int64_t) d * e) / LED_ONE);
+  }
+  led_show(levels, false);
+}
+
+static void led_frame(void *arg) {
+  prof_begin(s_frame_stat);
+  render_frame();
+  prof_end(s_frame_stat);
+  (void) arg;
+}
+
+static void start_timer(void) {
+  int fps = mgos_sys_config_get_led_fps();
+  if (s_led.timer != MGOS_INVALID_TIMER_ID) return;
+  if (fps <= 0) fps = 50;
+  s_led.frame_ms = 1000 / fps;
+  s_led.timer =
+      mgos_set_timer(s_led.frame_ms, MGOS_TIMER_REPEAT, led_frame, NULL);
+}
+
+static void start_transit(int r, int g, int b, int w, int ms, int easing) {
+  if (!s_led.ready) {
+    LOG(LL_ERROR, ("LED engine is not set up"));
+    return;
+  }
+  fx_free();
+  memcpy(s_led.from, s_led.cur, sizeof(s_led.from));
+  set_target(r, g, b, w, easing);
+  if (ms <= 0) {
+    stop_timer();
+    led_show(s_led.to, false);
+    return;
+  }
+  easing &= ~LED_WHITE;
+  s_led.start = mgos_uptime();
+  s_led.duration_ms = ms;
+  s_led.easing = (easing >= LED_EASE_LINEAR && easing <= LED_EASE_IN_OUT
+                      ? (enum led_easing) easing
+                      : LED_EASE_LINEAR);
+  start_timer();
+}
+
+void led_transit(int r, int g, int b, int w, int ms, int easing) {
+  drop_pending();
+  start_transit(r, g, b, w, ms, easing);
+}
+
+void led_submit(int r, int g, int b, int w, int ms, int easing) {
+  s_in.received++;
+  if (!led_busy()) {
+    /* Nothing to wait for, so there is nothing to coalesce with either. */
+    s_in.rendered++;
+    start_transit(r, g, b, w, ms, easing);
+    return;
+  }
+  if (s_in.pending) s_in.superseded++;
+  s_in.pending = true;
+  s_in.rgbw[0] = r;
+  s_in.rgbw[1] = g;
+  s_in.rgbw[2] = b;
+  s_in.rgbw[3] = w;
+  s_in.ms = ms;
+  s_in.easing = easing;
+}
+
+static int parse_blend(const char *blend) {
+  if (blend == NULL || strcmp(blend, "linear") == 0) return LED_EASE_LINEAR;
+  if (strcmp(blend, "in") == 0) return LED_EASE_IN;
+  if (strcmp(blend, "out") == 0) return LED_EASE_OUT;
+  if (strcmp(blend, "in_out") == 0) return LED_EASE_IN_OUT;
+  if (strcmp(blend, "step") == 0) return LED_BLEND_STEP;
+  LOG(LL_WARN, ("Unknown blend %s, using linear", blend));
+  return LED_EASE_LINEAR;
+}
+
+bool led_play(const char *effect) {
+  struct json_token t;
+  struct led_key *keys;
+  char *blend = NULL;
+  int i, n, len, repeat = 1;
+  if (!s_led.ready) {
+    LOG(LL_ERROR, ("LED engine is not set up"));
+    return false;
+  }
+  len = strlen(effect);
+  for (n = 0; json_scanf_array_elem(effect, len, ".keys", n, &t) > 0; n++) {
+  }
+  if (n == 0 || n > LED_FX_MAX_KEYS) {
+    LOG(LL_ERROR, ("Effect must have 1 to %d keys", LED_FX_MAX_KEYS));
+    return false;
+  }
+  if ((keys = (struct led_key *) calloc(n, sizeof(*keys))) == NULL) {
+    return false;
+  }
+  for (i = 0; i < n; i++) {
+    struct led_key *k = &keys[i];
+    bool white = false;
+    json_scanf_array_elem(effect, len, ".keys", i, &t);
+    json_scanf(t.ptr, t.len, "{r: %d, g: %d, b: %d, w: %d, ms: %d, white: %B}",
+               &k->rgbw[0], &k->rgbw[1], &k->rgbw[2], &k->rgbw[3], &k->ms,
+               &white);
+    k->flags = (white ? LED_WHITE : 0);
+    /* A key lasts at least a frame, so that the timer cannot spin. */
+    if (k->ms < 1) k->ms = 1;
+  }
+  json_scanf(effect, len, "{repeat: %d, blend: %Q}", &repeat, &blend);
+  led_stop();
+  s_fx.keys = keys;
+  s_fx.num_keys = n;
+  s_fx.repeat = (repeat > 0 ? repeat : 0);
+  s_fx.blend = parse_blend(blend);
+  free(blend);
+  s_led.start = mgos_uptime();
+  s_led.duration_ms = 0;
+  fx_next();
+  start_timer();
+  return true;
+}
+
+void led_write(int r, int g, int b, int w, int flags) {
+  led_transit(r, g, b, w, 0, flags & LED_WHITE);
+}
+
+void led_set_brightness(int brightness) {
+  s_led.brightness = (uint8_t) clamp(brightness);
+  update_scale();
+  if (s_led.ready) led_show(s_led.cur, false);
+}
+
+void led_set_levels(int r, int g, int b, int w) {
+  s_led.levels[0] = (uint8_t) clamp(r);
+  s_led.levels[1] = (uint8_t) clamp(g);
+  s_led.levels[2] = (uint8_t) clamp(b);
+  s_led.levels[3] = (uint8_t) clamp(w);
+  update_scale();
+  if (s_led.ready) led_show(s_led.cur, false);
+}
+
+/* Adds an output and shows the colour shown on the others on it. */
+static bool add_output(struct led_fb *fb) {
+  if (fb == NULL) return false;
+  if (s_led.num_outputs == LED_MAX_OUTPUTS) {
+    LOG(LL_ERROR, ("Too many LED outputs"));
+    led_fb_free(fb);
+    return false;
+  }
+  s_led.outputs[s_led.num_outputs++] = fb;
+  led_fb_fill(fb, s_led.duty);
+  led_fb_flush(fb, true);
+  return true;
+}
+
+bool led_add_fixture(int r_pin, int g_pin, int b_pin, int w_pin, int freq) {
+  int pins[LED_CHANNELS] = {r_pin, g_pin, b_pin, w_pin};
+  if (!s_led.ready) {
+    LOG(LL_ERROR, ("LED engine is not set up"));
+    return false;
+  }
+  return add_output(led_fb_create_pwm(pins, freq));
+}
+
+bool led_add_strip(int pin, int num_pixels) {
+  if (!s_led.ready) {
+    LOG(LL_ERROR, ("LED engine is not set up"));
+    return false;
+  }
+  if (!add_output(led_fb_create_strip(pin, num_pixels))) {
+    LOG(LL_ERROR, ("Failed to add a strip of %d on pin %d", num_pixels, pin));
+    return false;
+  }
+  return true;
+}
+
+bool led_set_pixel(int output, int i, int r, int g, int b, int w) {
+  uint16_t duty[LED_CHANNELS];
+  if (output < 0 || output >= s_led.num_outputs || i < 0 ||
+      i >= led_fb_num_pixels(s_led.outputs[output])) {
+    return false;
+  }
+  duty[0] = led_out(0, (uint16_t) (clamp(r) << 8));
+  duty[1] = led_out(1, (uint16_t) (clamp(g) << 8));
+  duty[2] = led_out(2, (uint16_t) (clamp(b) << 8));
+  duty[3] = led_out(3, (uint16_t) (clamp(w) << 8));
+  led_fb_set(s_led.outputs[output], i, duty);
+  s_led.pixels_set = true;
+  return true;
+}
+
+void led_flush(void) {
+  int i;
+  for (i = 0; i < s_led.num_outputs; i++) {
+    led_fb_flush(s_led.outputs[i], false);
+  }
+}
+
+void led_setup(int r_pin, int g_pin, int b_pin, int w_pin, int freq) {
+  const char *curve = mgos_sys_config_get_led_curve();
+  led_stop();
+  while (s_led.num_outputs > 0) {
+    led_fb_free(s_led.outputs[--s_led.num_outputs]);
+  }
+  if (curve != NULL && strcmp(curve, "cie") == 0) {
+    s_led.curve = s_cie;
+  } else if (curve != NULL && strcmp(curve, "gamma") == 0) {
+    s_led.curve = s_gamma;
+  } else {
+    if (curve != NULL && strcmp(curve, "linear") != 0) {
+      LOG(LL_WARN, ("Unknown led.curve %s, using linear", curve));
+    }
+    s_led.curve = NULL;
+  }
+  s_led.brightness = 255;
+  memset(s_led.levels, 255, sizeof(s_led.levels));
+  update_scale();
+  memset(s_led.cur, 0, sizeof(s_led.cur));
+  memset(s_led.duty, 0, sizeof(s_led.duty));
+  s_led.ready = true;
+  led_add_fixture(r_pin, g_pin, b_pin, w_pin, freq);
+}
+
+static void led_stats_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                              struct mg_rpc_frame_info *fi,
+                              struct mg_str args) {
+  mg_rpc_send_responsef(ri,
+                        "{received: %lu, rendered: %lu, superseded: %lu, "
+                        "frames: %lu, busy: %B, outputs: %d}",
+                        s_in.received, s_in.rendered, s_in.superseded,
+                        s_in.frames, led_busy(), s_led.num_outputs);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+bool led_init(void) {
+  s_frame_stat = prof_stat("timer", "led_frame");
+  prof_add_rpc_handler("LED.Stats", "", led_stats_handler, NULL);
+  return true;
+}
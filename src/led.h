@@ -0,0 +1,112 @@
+/*
+ * LED transition engine: fades RGBW fixtures and pixel strips from the
+ * colour they show to a target colour, in the background.
+ *
+ * Output goes through a colour pipeline: white extraction on request, then
+ * brightness and per-channel levels, then the brightness curve set by
+ * led.curve, which is read by led_setup().
+ *
+ * These functions are called from JS over FFI, see fs/lib.js, so they take
+ * plain ints: colour components are 0..255, times are in milliseconds.
+ */
+
+#ifndef SRC_LED_H_
+#define SRC_LED_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Red, green, blue, white. */
+#define LED_CHANNELS 4
+
+enum led_easing {
+  LED_EASE_LINEAR = 0,
+  LED_EASE_IN = 1,     /* Starts slow */
+  LED_EASE_OUT = 2,    /* Ends slow */
+  LED_EASE_IN_OUT = 3, /* Starts and ends slow */
+};
+
+/*
+ * Flag for the `easing` of led_transit() and the `flags` of led_write():
+ * moves the part of red, green and blue common to all three to white.
+ */
+#define LED_WHITE 0x100
+
+/* Registers the LED.Stats RPC. */
+bool led_init(void);
+
+/*
+ * Sets up the engine with one PWM fixture: the pins of its channels, -1 for
+ * one not connected, and the PWM frequency. Removes other outputs and
+ * turns all off.
+ */
+void led_setup(int r_pin, int g_pin, int b_pin, int w_pin, int freq);
+
+/* Adds another PWM fixture, showing the same colour as the first. */
+bool led_add_fixture(int r_pin, int g_pin, int b_pin, int w_pin, int freq);
+
+/* Adds a WS2812 strip of `num_pixels`, showing the same colour. */
+bool led_add_strip(int pin, int num_pixels);
+
+/*
+ * Sets pixel `i` of output `output`, in the order the outputs were added,
+ * 0 being the fixture of led_setup(). Shown by led_flush() or with the
+ * next frame, and replaced by the colour of the next transition.
+ */
+bool led_set_pixel(int output, int i, int r, int g, int b, int w);
+
+/* Writes pixels set by led_set_pixel() to the outputs. */
+void led_flush(void);
+
+/*
+ * Starts a transition from the colour shown now to the given one, taking
+ * `ms` milliseconds, 0 to switch at once. Returns at once; a transition in
+ * progress is replaced, starting from where it has got to.
+ */
+void led_transit(int r, int g, int b, int w, int ms, int easing);
+
+/*
+ * As led_transit(), for a stream of colours such as from a colour picker.
+ * While frames are being shown, the colour waits for the next one, and is
+ * dropped if another is submitted before it.
+ */
+void led_submit(int r, int g, int b, int w, int ms, int easing);
+
+/* Switches to the given colour at once, stopping a transition. */
+void led_write(int r, int g, int b, int w, int flags);
+
+/* Sets overall brightness, 0..255; 255 after led_setup(). */
+void led_set_brightness(int brightness);
+
+/* Sets the full-scale level of each channel, 0..255; 255 after setup. */
+void led_set_levels(int r, int g, int b, int w);
+
+/*
+ * Plays an effect: a list of keys the colour moves through in turn, each
+ * reached in `ms` milliseconds, given as JSON:
+ *
+ *   {keys: [{r: 255, g: 0, b: 0, w: 0, ms: 160, white: false}, ...],
+ *    repeat: 1, blend: "linear"}
+ *
+ * `white` is as LED_WHITE. `repeat` is the number of passes through the
+ * keys, 0 for no end. `blend` is "linear", "in", "out" or "in_out" to fade
+ * to each key as the easings, or "step" to jump to it and hold it for `ms`.
+ * Replaces a transition or effect in progress; led_transit() and
+ * led_write() stop one. Returns false if the effect is not valid.
+ */
+bool led_play(const char *effect);
+
+/* Stops a transition or effect, leaving the colour it has got to. */
+void led_stop(void);
+
+/* True while a transition or effect is in progress. */
+bool led_busy(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_LED_H_ */
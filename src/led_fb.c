@@ -0,0 +1,159 @@
+/*
+ * LED output frame buffers, see led_fb.h.
+ *
+ * Each kind of output is a backend with a flush and a free function. A
+ * buffer keeps the duties of its pixels and a dirty range, so that a flush
+ * after a frame that changed nothing costs nothing, and one after a
+ * change writes the whole strip with a single show.
+ */
+
+#include "led_fb.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_neopixel.h"
+#include "mgos_pwm.h"
+
+#define LED_FB_DUTY_MAX 65535
+
+struct led_fb_backend {
+  void (*flush)(struct led_fb *fb, bool force);
+  void (*free)(struct led_fb *fb);
+};
+
+struct led_fb {
+  const struct led_fb_backend *backend;
+  int num_pixels;
+  uint16_t *duty; /* LED_CHANNELS per pixel */
+  int dirty_from, dirty_to; /* Pixels set since the last flush */
+
+  /* PWM fixture */
+  int pins[LED_CHANNELS];
+  int freq;
+  uint16_t shown[LED_CHANNELS]; /* Duties written to the pins */
+
+  /* Strip */
+  struct mgos_neopixel *np;
+};
+
+static struct led_fb *fb_create(const struct led_fb_backend *backend,
+                                int num_pixels) {
+  struct led_fb *fb = (struct led_fb *) calloc(1, sizeof(*fb));
+  if (fb == NULL) return NULL;
+  fb->duty = (uint16_t *) calloc(num_pixels, LED_CHANNELS * sizeof(uint16_t));
+  if (fb->duty == NULL) {
+    free(fb);
+    return NULL;
+  }
+  fb->backend = backend;
+  fb->num_pixels = num_pixels;
+  fb->dirty_from = num_pixels;
+  fb->dirty_to = 0;
+  return fb;
+}
+
+static void pwm_flush(struct led_fb *fb, bool force) {
+  int i;
+  for (i = 0; i < LED_CHANNELS; i++) {
+    if (fb->pins[i] < 0 || (fb->duty[i] == fb->shown[i] && !force)) continue;
+    fb->shown[i] = fb->duty[i];
+    mgos_pwm_set(fb->pins[i], fb->freq,
+                 (float) fb->duty[i] / LED_FB_DUTY_MAX);
+  }
+}
+
+static void pwm_free(struct led_fb *fb) {
+  int i;
+  for (i = 0; i < LED_CHANNELS; i++) {
+    if (fb->pins[i] >= 0) mgos_pwm_set(fb->pins[i], 0, 0);
+  }
+}
+
+static const struct led_fb_backend s_pwm_backend = {pwm_flush, pwm_free};
+
+/* 8-bit value of a duty, with white mixed in. */
+static int strip_value(uint16_t duty, uint16_t white) {
+  uint32_t v = ((uint32_t) duty + white + 128) >> 8;
+  return (v > 255 ? 255 : (int) v);
+}
+
+static void strip_flush(struct led_fb *fb, bool force) {
+  const uint16_t *d;
+  int i;
+  if (force) {
+    fb->dirty_from = 0;
+    fb->dirty_to = fb->num_pixels;
+  }
+  if (fb->dirty_from >= fb->dirty_to) return;
+  for (i = fb->dirty_from; i < fb->dirty_to; i++) {
+    d = &fb->duty[i * LED_CHANNELS];
+    mgos_neopixel_set(fb->np, i, strip_value(d[0], d[3]),
+                      strip_value(d[1], d[3]), strip_value(d[2], d[3]));
+  }
+  mgos_neopixel_show(fb->np);
+}
+
+static void strip_free(struct led_fb *fb) {
+  mgos_neopixel_clear(fb->np);
+  mgos_neopixel_show(fb->np);
+  mgos_neopixel_free(fb->np);
+}
+
+static const struct led_fb_backend s_strip_backend = {strip_flush,
+                                                      strip_free};
+
+struct led_fb *led_fb_create_pwm(const int *pins, int freq) {
+  struct led_fb *fb = fb_create(&s_pwm_backend, 1);
+  if (fb == NULL) return NULL;
+  memcpy(fb->pins, pins, sizeof(fb->pins));
+  fb->freq = freq;
+  return fb;
+}
+
+struct led_fb *led_fb_create_strip(int pin, int num_pixels) {
+  struct led_fb *fb;
+  if (pin < 0 || num_pixels <= 0) return NULL;
+  if ((fb = fb_create(&s_strip_backend, num_pixels)) == NULL) return NULL;
+  fb->np = mgos_neopixel_create(pin, num_pixels, MGOS_NEOPIXEL_ORDER_GRB);
+  if (fb->np == NULL) {
+    free(fb->duty);
+    free(fb);
+    return NULL;
+  }
+  return fb;
+}
+
+int led_fb_num_pixels(const struct led_fb *fb) {
+  return fb->num_pixels;
+}
+
+void led_fb_set(struct led_fb *fb, int i, const uint16_t *duty) {
+  if (i < 0 || i >= fb->num_pixels) return;
+  memcpy(&fb->duty[i * LED_CHANNELS], duty, LED_CHANNELS * sizeof(*duty));
+  if (i < fb->dirty_from) fb->dirty_from = i;
+  if (i >= fb->dirty_to) fb->dirty_to = i + 1;
+}
+
+void led_fb_fill(struct led_fb *fb, const uint16_t *duty) {
+  int i;
+  for (i = 0; i < fb->num_pixels; i++) {
+    memcpy(&fb->duty[i * LED_CHANNELS], duty, LED_CHANNELS * sizeof(*duty));
+  }
+  fb->dirty_from = 0;
+  fb->dirty_to = fb->num_pixels;
+}
+
+void led_fb_flush(struct led_fb *fb, bool force) {
+  fb->backend->flush(fb, force);
+  fb->dirty_from = fb->num_pixels;
+  fb->dirty_to = 0;
+}
+
+void led_fb_free(struct led_fb *fb) {
+  if (fb == NULL) return;
+  fb->backend->free(fb);
+  free(fb->duty);
+  free(fb);
+}
@@ -0,0 +1,56 @@
+/*
+ * Frame buffers of LED outputs, for the transition engine in led.c.
+ *
+ * An output is a PWM fixture, one RGBW pixel on up to four pins, or a
+ * WS2812 strip of many RGB pixels. Pixels are set in the buffer as 16-bit
+ * duties, after the colour pipeline; led_fb_flush() then writes what has
+ * changed to the hardware in one go, once per frame.
+ */
+
+#ifndef SRC_LED_FB_H_
+#define SRC_LED_FB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "led.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct led_fb;
+
+/*
+ * Creates a PWM fixture on the pins of red, green, blue and white, -1 for
+ * a channel that is not connected.
+ */
+struct led_fb *led_fb_create_pwm(const int *pins, int freq);
+
+/*
+ * Creates a strip of `num_pixels` WS2812 pixels on `pin`. The pixels have
+ * no white of their own, so white is mixed into red, green and blue.
+ */
+struct led_fb *led_fb_create_strip(int pin, int num_pixels);
+
+int led_fb_num_pixels(const struct led_fb *fb);
+
+/* Sets pixel `i` to the duties of its LED_CHANNELS channels. */
+void led_fb_set(struct led_fb *fb, int i, const uint16_t *duty);
+
+/* Sets all pixels to the same duties. */
+void led_fb_fill(struct led_fb *fb, const uint16_t *duty);
+
+/*
+ * Writes the pixels set since the last flush to the hardware, or all of
+ * them if `force` is true.
+ */
+void led_fb_flush(struct led_fb *fb, bool force);
+
+void led_fb_free(struct led_fb *fb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_LED_FB_H_ */
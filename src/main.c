@@ -1,106 +1,48 @@
 #include "mgos.h"
 #include "mgos_rpc.h" 
 
- 
-struct state {
-  struct mg_rpc_request_info *ri; /* RPC request info */
-  int uart_no;                    /* UART number to write to */
-  int status;                     /* Request status */
-  int64_t written;                /* Number of bytes written */
-  FILE *fp;                       /* File to write to */
-};
-
-static void http_cb(struct mg_connection *c, int ev, void *ev_data, void *ud) {
-  struct http_message *hm = (struct http_message *) ev_data;
-  struct state *state = (struct state *) ud;
-
-  switch (ev) {
-    case MG_EV_CONNECT:
-      state->status = *(int *) ev_data;
-      break;
-    case MG_EV_HTTP_CHUNK: {
-      /*
-       * Write data to file or UART. mgos_uart_write() blocks until
-       * all data is written.
-       */
-      size_t n =
-          (state->fp != NULL)
-              ? fwrite(hm->body.p, 1, hm->body.len, state->fp)
-              : mgos_uart_write(state->uart_no, hm->body.p, hm->body.len);
-      if (n != hm->body.len) {
-        c->flags |= MG_F_CLOSE_IMMEDIATELY;
-        state->status = 500;
-      }
-      state->written += n;
-      c->flags |= MG_F_DELETE_CHUNK;
-      break;
-    }
-    case MG_EV_HTTP_REPLY:
-      /* Only when we successfully got full reply, set the status. */
-      state->status = hm->resp_code;
-      LOG(LL_INFO, ("Finished fetching"));
-      c->flags |= MG_F_CLOSE_IMMEDIATELY;
-      break;
-    case MG_EV_CLOSE:
-      LOG(LL_INFO, ("status %d bytes %llu", state->status, state->written));
-      if (state->status == 200) {
-        /* Report success only for HTTP 200 downloads */
-        mg_rpc_send_responsef(state->ri, "{written: %llu}", state->written);
-      } else {
-        mg_rpc_send_errorf(state->ri, state->status, NULL);
-      }
-      if (state->fp != NULL) fclose(state->fp);
-      free(state);
-      break;
+#include "fetch.h"
+#include "led.h"
+#include "profile.h"
+#include "updater.h"
+
+static int print_ota_stats(struct json_out *out, va_list *ap) {
+  struct updater_stats st;
+  int i, len = 0;
+  len += json_printf(out, "[");
+  for (i = 0; updater_get_stats(i, &st); i++) {
+    len += json_printf(
+        out,
+        "%s{started: %.3f, duration: %.3f, result: %d, bytes: %lu, "
+        "recv_time: %.3f, crc_time: %.3f, write_time: %.3f, "
+        "finalize_time: %.3f, cur_rate: %.0f, avg_rate: %.0f, stalls: %d, "
+        "longest_stall: %.3f, peak_buffered: %lu, peak_heap: %lu}",
+        (i > 0 ? ", " : ""), st.started, st.duration, st.result,
+        (unsigned long) st.bytes, st.recv_time, st.crc_time, st.write_time,
+        st.finalize_time, st.cur_rate, st.avg_rate, st.stalls,
+        st.longest_stall, (unsigned long) st.peak_buffered,
+        (unsigned long) st.peak_heap);
   }
+  len += json_printf(out, "]");
+  (void) ap;
+  return len;
 }
 
-static void fetch_handler(struct mg_rpc_request_info *ri, void *cb_arg,
-                          struct mg_rpc_frame_info *fi, struct mg_str args) {
-  struct state *state;
-  int uart_no = -1;
-  FILE *fp = NULL;
-  char *url = NULL, *path = NULL;
-
-  json_scanf(args.p, args.len, ri->args_fmt, &url, &uart_no, &path);
-
-  if (url == NULL || (uart_no < 0 && path == NULL)) {
-    mg_rpc_send_errorf(ri, 500, "expecting url, uart or file");
-    goto done;
-  }
-
-  if (path != NULL && (fp = fopen(path, "w")) == NULL) {
-    mg_rpc_send_errorf(ri, 500, "cannot open %s", path);
-    goto done;
-  }
-
-  if ((state = calloc(1, sizeof(*state))) == NULL) {
-    mg_rpc_send_errorf(ri, 500, "OOM");
-    goto done;
-  }
-
-  state->uart_no = uart_no;
-  state->fp = fp;
-  state->ri = ri;
-
-  LOG(LL_INFO, ("Fetching %s to %d/%s", url, uart_no, path ? path : ""));
-  if (!mg_connect_http(mgos_get_mgr(), http_cb, state, url, NULL, NULL)) {
-    free(state);
-    mg_rpc_send_errorf(ri, 500, "malformed URL");
-    goto done;
-  }
-
+/* Metrics of the last few OTA updates, most recent first. */
+static void ota_stats_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                              struct mg_rpc_frame_info *fi,
+                              struct mg_str args) {
+  mg_rpc_send_responsef(ri, "{updates: %M}", print_ota_stats);
   (void) cb_arg;
   (void) fi;
-
-done:
-  free(url);
-  free(path);
+  (void) args;
 }
 
 enum mgos_app_init_result mgos_app_init(void) {
-  mg_rpc_add_handler(mgos_rpc_get_global(), "Fetch",
-                     "{url: %Q, uart: %d, file: %Q}", fetch_handler, NULL);
+  prof_init();
+  fetch_init();
+  led_init();
+  prof_add_rpc_handler("OTA.Stats", "", ota_stats_handler, NULL);
  
  
  
@@ -0,0 +1,208 @@
+/*
+ * Profiler, see profile.h.
+ *
+ * Latency histograms have PROF_HIST_BUCKETS buckets on a log2 scale: the
+ * first counts calls under PROF_HIST_BASE_US microseconds, each next one
+ * those under twice as long as the one before, the last all the rest.
+ *
+ * Event loop lag is measured by a timer that should fire every
+ * profile.lag_interval ms: how late it fires is time the loop was busy
+ * with something else.
+ *
+ * mJS allocates from the system heap, so the heap before and after a call
+ * is the free system heap; what a JS handler takes shows up there.
+ */
+
+#include "profile.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+
+#define PROF_MAX_STATS 32
+#define PROF_HIST_BUCKETS 16
+#define PROF_HIST_BASE_US 64
+
+struct prof_stat {
+  char *kind;
+  char *name;
+  int depth; /* Calls in progress */
+  double started;
+  unsigned long heap_before;
+  unsigned long calls;
+  uint64_t total_us;
+  uint32_t max_us;
+  uint32_t hist[PROF_HIST_BUCKETS];
+  unsigned long last_heap_before; /* Free heap around the last call */
+  unsigned long last_heap_after;
+  long max_heap_used; /* Most heap taken by a call and not given back */
+};
+
+/* C RPC handler measured by prof_rpc_handler(). */
+struct prof_rpc {
+  mg_handler_cb_t cb;
+  void *cb_arg;
+  struct prof_stat *st;
+};
+
+static struct prof_stat *s_stats[PROF_MAX_STATS];
+static int s_num_stats;
+
+static struct prof_stat *s_lag;
+static double s_lag_last;
+static int s_lag_interval;
+
+struct prof_stat *prof_stat(const char *kind, const char *name) {
+  struct prof_stat *st;
+  int i;
+  for (i = 0; i < s_num_stats; i++) {
+    st = s_stats[i];
+    if (strcmp(st->kind, kind) == 0 && strcmp(st->name, name) == 0) return st;
+  }
+  if (s_num_stats == PROF_MAX_STATS) {
+    LOG(LL_WARN, ("No room to profile %s %s", kind, name));
+    return NULL;
+  }
+  if ((st = (struct prof_stat *) calloc(1, sizeof(*st))) == NULL) return NULL;
+  st->kind = strdup(kind);
+  st->name = strdup(name);
+  if (st->kind == NULL || st->name == NULL) {
+    free(st->kind);
+    free(st->name);
+    free(st);
+    return NULL;
+  }
+  s_stats[s_num_stats++] = st;
+  return st;
+}
+
+static int hist_bucket(uint32_t us) {
+  int b = 0;
+  us /= PROF_HIST_BASE_US;
+  while (us > 0 && b < PROF_HIST_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  return b;
+}
+
+static void record(struct prof_stat *st, uint32_t us) {
+  st->calls++;
+  st->total_us += us;
+  if (us > st->max_us) st->max_us = us;
+  st->hist[hist_bucket(us)]++;
+}
+
+void prof_begin(struct prof_stat *st) {
+  if (st == NULL || st->depth++ > 0) return;
+  st->heap_before = (unsigned long) mgos_get_free_heap_size();
+  st->started = mgos_uptime();
+}
+
+void prof_end(struct prof_stat *st) {
+  double us;
+  if (st == NULL || st->depth == 0 || --st->depth > 0) return;
+  us = (mgos_uptime() - st->started) * 1e6;
+  record(st, (us > 0 ? (uint32_t) us : 0));
+  st->last_heap_before = st->heap_before;
+  st->last_heap_after = (unsigned long) mgos_get_free_heap_size();
+  if ((long) (st->last_heap_before - st->last_heap_after) > st->max_heap_used) {
+    st->max_heap_used = (long) (st->last_heap_before - st->last_heap_after);
+  }
+}
+
+static void prof_rpc_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                             struct mg_rpc_frame_info *fi,
+                             struct mg_str args) {
+  struct prof_rpc *pr = (struct prof_rpc *) cb_arg;
+  prof_begin(pr->st);
+  pr->cb(ri, pr->cb_arg, fi, args);
+  prof_end(pr->st);
+}
+
+bool prof_add_rpc_handler(const char *name, const char *args_fmt,
+                          mg_handler_cb_t cb, void *cb_arg) {
+  struct prof_rpc *pr = (struct prof_rpc *) calloc(1, sizeof(*pr));
+  if (pr == NULL) return false;
+  pr->cb = cb;
+  pr->cb_arg = cb_arg;
+  pr->st = prof_stat("rpc", name);
+  mg_rpc_add_handler(mgos_rpc_get_global(), name, args_fmt, prof_rpc_handler,
+                     pr);
+  return true;
+}
+
+static void lag_timer_cb(void *arg) {
+  double now = mgos_uptime();
+  double lag = now - s_lag_last - s_lag_interval / 1000.0;
+  s_lag_last = now;
+  record(s_lag, (lag > 0 ? (uint32_t) (lag * 1e6) : 0));
+  (void) arg;
+}
+
+static int print_stats(struct json_out *out, va_list *ap) {
+  int i, j, len = 0;
+  len += json_printf(out, "[");
+  for (i = 0; i < s_num_stats; i++) {
+    const struct prof_stat *st = s_stats[i];
+    len += json_printf(
+        out,
+        "%s{kind: %Q, name: %Q, calls: %lu, avg_us: %lu, max_us: %lu, "
+        "heap_before: %lu, heap_after: %lu, max_heap_used: %ld, hist: [",
+        (i > 0 ? ", " : ""), st->kind, st->name, st->calls,
+        (unsigned long) (st->calls > 0 ? st->total_us / st->calls : 0),
+        (unsigned long) st->max_us, st->last_heap_before, st->last_heap_after,
+        st->max_heap_used);
+    for (j = 0; j < PROF_HIST_BUCKETS; j++) {
+      len += json_printf(out, "%s%lu", (j > 0 ? ", " : ""),
+                         (unsigned long) st->hist[j]);
+    }
+    len += json_printf(out, "]}");
+  }
+  len += json_printf(out, "]");
+  (void) ap;
+  return len;
+}
+
+static void reset_stats(void) {
+  int i;
+  for (i = 0; i < s_num_stats; i++) {
+    struct prof_stat *st = s_stats[i];
+    st->calls = 0;
+    st->total_us = 0;
+    st->max_us = 0;
+    memset(st->hist, 0, sizeof(st->hist));
+    st->max_heap_used = 0;
+  }
+}
+
+/* Reports all stats; with {reset: true}, clears them after that. */
+static void profile_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                            struct mg_rpc_frame_info *fi,
+                            struct mg_str args) {
+  bool reset = false;
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  mg_rpc_send_responsef(
+      ri,
+      "{uptime: %.3f, free_heap: %lu, min_free_heap: %lu, "
+      "hist_base_us: %d, stats: %M}",
+      mgos_uptime(), (unsigned long) mgos_get_free_heap_size(),
+      (unsigned long) mgos_get_min_free_heap_size(), PROF_HIST_BASE_US,
+      print_stats);
+  if (reset) reset_stats();
+  (void) cb_arg;
+  (void) fi;
+}
+
+bool prof_init(void) {
+  mg_rpc_add_handler(mgos_rpc_get_global(), "Sys.Profile", "{reset: %B}",
+                     profile_handler, NULL);
+  s_lag_interval = mgos_sys_config_get_profile_lag_interval();
+  if (s_lag_interval > 0 && (s_lag = prof_stat("loop", "lag")) != NULL) {
+    s_lag_last = mgos_uptime();
+    mgos_set_timer(s_lag_interval, MGOS_TIMER_REPEAT, lag_timer_cb, NULL);
+  }
+  return true;
+}
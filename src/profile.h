@@ -0,0 +1,50 @@
+/*
+ * Lightweight profiler: call counts, latency histograms and heap use of
+ * RPC handlers and timer callbacks, and event loop lag, reported by the
+ * Sys.Profile RPC.
+ *
+ * Each thing measured has a stat, found by a kind such as "rpc" or "timer"
+ * and a name. A measurement costs two clock and two free heap reads, so it
+ * can stay on in production. JS handlers and timers are measured by
+ * fs/profile.js over FFI.
+ */
+
+#ifndef SRC_PROFILE_H_
+#define SRC_PROFILE_H_
+
+#include <stdbool.h>
+
+#include "mgos_rpc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct prof_stat;
+
+/*
+ * Returns the stat of `kind` and `name`, creating it if there is none.
+ * Returns NULL if there is no room for it; the functions below take NULL
+ * and do nothing.
+ */
+struct prof_stat *prof_stat(const char *kind, const char *name);
+
+/*
+ * Start and end of a call. Calls nested in one of the same stat are
+ * counted as part of it.
+ */
+void prof_begin(struct prof_stat *st);
+void prof_end(struct prof_stat *st);
+
+/* As mg_rpc_add_handler() on the global RPC, measuring the handler. */
+bool prof_add_rpc_handler(const char *name, const char *args_fmt,
+                          mg_handler_cb_t cb, void *cb_arg);
+
+/* Registers Sys.Profile and starts measuring event loop lag. */
+bool prof_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_PROFILE_H_ */
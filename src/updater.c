@@ -20,9 +20,9 @@
 #include <stdio.h>
 #include <strings.h>
 
-#include "common/cs_crc32.h"
 #include "common/cs_dbg.h"
 #include "common/cs_file.h"
+#include "common/cs_sha1.h"
 #include "common/str_util.h"
 
 #include "mgos_event.h"
@@ -32,6 +32,18 @@
 #include "mgos_updater_hal.h"
 #include "mgos_vfs.h"
 
+#if CS_PLATFORM == CS_P_ESP32
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#endif
+
+#include "crc32.h"
+#include "delta.h"
+#include "inflater.h"
+#include "json_stream.h"
+#include "updater.h"
+
 /*
  * Using static variable (not only c->user_data), it allows to check if update
  * already in progress when another request arrives
@@ -48,8 +60,22 @@ extern const char *build_version;
 #define PROGRESS_REPORT_BYTES 50000
 #define PROGRESS_REPORT_SECONDS 5
 
+/*
+ * Capacity of ctx->unprocessed. It only ever holds a zip header or the tail
+ * of a chunk that could not be processed yet (an incomplete deflate symbol,
+ * bytes the HAL wants more of), so it is allocated once and never grows.
+ */
+#ifndef UPDATER_STAGING_SIZE
+#define UPDATER_STAGING_SIZE 1024
+#endif
+#ifndef UPDATER_MANIFEST_MAX_SIZE
+#define UPDATER_MANIFEST_MAX_SIZE 8192
+#endif
+
 static mgos_upd_event_cb s_event_cb = NULL;
 static void *s_event_cb_arg = NULL;
+static updater_abort_cb s_abort_cb = NULL;
+static void *s_abort_cb_arg = NULL;
 
 #define CALL_HOOK(ll, _upd_ev, _upd_arg, _state, _fmt, ...)            \
   do {                                                                 \
@@ -91,10 +117,15 @@ static void *s_event_cb_arg = NULL;
 #define ZIP_FILENAME_LEN_OFFSET 26U
 #define ZIP_EXTRAS_LEN_OFFSET 28U
 #define ZIP_FILENAME_OFFSET 30U
+/* Without the optional signature, which makes it 4 bytes longer. */
 #define ZIP_FILE_DESCRIPTOR_SIZE 12U
 
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATE 8
+
 const uint32_t c_zip_file_header_magic = 0x04034b50;
 const uint32_t c_zip_cdir_magic = 0x02014b50;
+const uint32_t c_zip_descriptor_magic = 0x08074b50;
 
 enum update_state {
   US_INITED = 0,
@@ -111,6 +142,128 @@ enum update_state {
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+/*
+ * Details of the archive entry being processed. These do not fit into
+ * struct update_context, which is shared with the OTA transports, but there
+ * is only one update in progress at a time anyway (see s_ctx).
+ *
+ * Entry data is what the archive holds for the file once inflated. It
+ * differs from what goes to the HAL (info.current_file) for delta parts.
+ */
+static struct {
+  uint16_t method;
+  uint32_t compressed_size;
+  uint32_t compressed_processed;
+  uint32_t size;
+  uint32_t processed;
+  struct inflater *inflater;
+  struct delta *delta;
+  /* SHA1 of data given to the HAL, if the manifest has one to check. */
+  bool check_sha1;
+  char want_sha1[SHA1SUM_LEN];
+  cs_sha1_ctx sha1_ctx;
+} s_entry;
+
+/* Scans the manifest as it arrives, see receive_manifest(). */
+static struct json_stream s_manifest_js;
+
+/* A gap between two pieces of data this long counts as a stall. */
+#define UPDATER_STALL_SECONDS 1.0
+/* Window over which the current rate is measured. */
+#define UPDATER_RATE_SECONDS 1.0
+
+/* Metrics of the current and past updates, see updater_get_stats(). */
+static struct updater_stats s_stats[UPDATER_STATS_HISTORY];
+static int s_stats_num = 0, s_stats_cur = 0;
+/*
+ * The context each slot is for. A context that has timed out may still be
+ * processed, or finished, after the next update has taken the current slot.
+ */
+static const struct update_context *s_stats_ctx[UPDATER_STATS_HISTORY];
+/* Takes the metrics of a context whose slot has been reused. */
+static struct updater_stats s_stats_stale;
+
+/* What the metrics of the current update are derived from. */
+static struct {
+  size_t heap_start;
+  size_t heap_min;
+  double last_call_end;
+  double rate_start;
+  size_t rate_bytes;
+} s_meter;
+
+static struct updater_stats *ctx_stats(const struct update_context *ctx) {
+  int i;
+  for (i = 0; i < s_stats_num; i++) {
+    if (s_stats_ctx[i] == ctx) return &s_stats[i];
+  }
+  return &s_stats_stale;
+}
+
+/* Adds time elapsed since `start` to `*total`. */
+static void stats_add_time(double *total, double start) {
+  *total += mgos_uptime() - start;
+}
+
+static void updater_stats_begin(const struct update_context *ctx) {
+  double now = mgos_uptime();
+  if (s_stats_num > 0) {
+    s_stats_cur = (s_stats_cur + 1) % UPDATER_STATS_HISTORY;
+  }
+  if (s_stats_num < UPDATER_STATS_HISTORY) s_stats_num++;
+  memset(&s_stats[s_stats_cur], 0, sizeof(struct updater_stats));
+  s_stats[s_stats_cur].started = now;
+  s_stats_ctx[s_stats_cur] = ctx;
+  memset(&s_meter, 0, sizeof(s_meter));
+  s_meter.heap_start = s_meter.heap_min = mgos_get_free_heap_size();
+  s_meter.last_call_end = s_meter.rate_start = now;
+}
+
+/* Accounts for `len` bytes that have just arrived. */
+static void updater_stats_received(const struct update_context *ctx,
+                                   size_t len) {
+  struct updater_stats *st = ctx_stats(ctx);
+  double now = mgos_uptime(), gap = now - s_meter.last_call_end;
+  /* s_meter is of the current update. */
+  if (len == 0 || st != &s_stats[s_stats_cur]) return;
+  /* Time between calls is time spent waiting for the network. */
+  st->recv_time += gap;
+  if (gap >= UPDATER_STALL_SECONDS) {
+    st->stalls++;
+    if (gap > st->longest_stall) st->longest_stall = gap;
+  }
+  st->bytes += len;
+  if (now - s_meter.rate_start >= UPDATER_RATE_SECONDS) {
+    st->cur_rate = (st->bytes - s_meter.rate_bytes) / (now - s_meter.rate_start);
+    s_meter.rate_start = now;
+    s_meter.rate_bytes = st->bytes;
+  }
+}
+
+static void updater_stats_processed(struct update_context *ctx) {
+  struct updater_stats *st = ctx_stats(ctx);
+  size_t free_heap = mgos_get_free_heap_size();
+  if (st != &s_stats[s_stats_cur]) return;
+  if (free_heap < s_meter.heap_min) s_meter.heap_min = free_heap;
+  st->peak_heap = s_meter.heap_start - s_meter.heap_min;
+  /* Carried over to the next call, this is what the buffer is sized for. */
+  if (ctx->unprocessed.len > st->peak_buffered) {
+    st->peak_buffered = ctx->unprocessed.len;
+  }
+  s_meter.last_call_end = mgos_uptime();
+}
+
+bool updater_get_stats(int i, struct updater_stats *st) {
+  if (i < 0 || i >= s_stats_num) return false;
+  *st = s_stats[(s_stats_cur - i + UPDATER_STATS_HISTORY) %
+                UPDATER_STATS_HISTORY];
+  if (i == 0 && s_ctx != NULL && !is_update_finished(s_ctx)) {
+    st->duration = mgos_uptime() - st->started;
+  }
+  st->avg_rate = (st->duration > 0 ? st->bytes / st->duration : 0);
+  return true;
+}
+
 static void updater_abort(void *arg) {
   struct update_context *ctx = (struct update_context *) arg;
   if (s_ctx != ctx) return;
@@ -121,6 +274,13 @@ static void updater_abort(void *arg) {
   if (ctx->nc) ctx->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
   ctx->wdt = MGOS_INVALID_TIMER_ID;
   s_ctx = NULL;
+  /* Last: the transport may free the context. */
+  if (s_abort_cb != NULL) s_abort_cb(ctx, s_abort_cb_arg);
+}
+
+void updater_set_abort_cb(updater_abort_cb cb, void *cb_arg) {
+  s_abort_cb = cb;
+  s_abort_cb_arg = cb_arg;
 }
 
 struct update_context *updater_context_create(int timeout) {
@@ -137,11 +297,19 @@ struct update_context *updater_context_create(int timeout) {
   }
 
   s_ctx = calloc(1, sizeof(*s_ctx));
+  if (s_ctx != NULL) {
+    mbuf_init(&s_ctx->unprocessed, UPDATER_STAGING_SIZE);
+    if (s_ctx->unprocessed.buf == NULL) {
+      free(s_ctx);
+      s_ctx = NULL;
+    }
+  }
   if (s_ctx == NULL) {
     LOG(LL_ERROR, ("Out of memory"));
     return NULL;
   }
 
+  updater_stats_begin(s_ctx);
   s_ctx->dev_ctx = mgos_upd_hal_ctx_create();
 
   if (timeout <= 0) timeout = mgos_sys_config_get_update_timeout();
@@ -160,34 +328,58 @@ void updater_set_status(struct update_context *ctx, enum update_state st) {
   ctx->update_state = st;
 }
 
+size_t updater_resume_offset(const struct update_context *ctx) {
+  /* Whatever has not been processed yet is kept in ctx->unprocessed. */
+  return ctx->bytes_already_downloaded;
+}
+
+size_t updater_skippable(const struct update_context *ctx) {
+  if (ctx->update_state != US_SKIPPING_DATA || ctx->unprocessed.len != 0) {
+    return 0;
+  }
+  return ctx->info.current_file.size - ctx->info.current_file.processed;
+}
+
+int updater_skip(struct update_context *ctx, size_t len) {
+  if (len > updater_skippable(ctx)) {
+    LOG(LL_ERROR, ("Cannot skip %u bytes", (unsigned int) len));
+    return -1;
+  }
+  ctx->info.current_file.processed += len;
+  ctx->bytes_already_downloaded += len;
+  return 0;
+}
+
 /*
  * During its work, updater requires requires to store some data.
- * For example, manifest file, zip header - must be received fully, while
- * content FW/FS files can be flashed directly from recv_mbuf
+ * For example, zip header - must be received fully, while content FW/FS
+ * files can be flashed directly from recv_mbuf
  * To avoid extra memory usage, context contains plain pointer (*data)
  * and mbuf (unprocessed); data is storing in memory only if where is no way
- * to process it right now.
+ * to process it right now. The mbuf is preallocated with
+ * UPDATER_STAGING_SIZE bytes, see updater_process_int() for how arriving
+ * data is joined with it.
  */
-static void context_update(struct update_context *ctx, const char *data,
-                           size_t len) {
-  if (ctx->unprocessed.len != 0) {
-    /* We have unprocessed data, concatenate them with arrived */
-    mbuf_append(&ctx->unprocessed, data, len);
-    ctx->data = ctx->unprocessed.buf;
-    ctx->data_len = ctx->unprocessed.len;
-  } else {
-    /* No unprocessed, trying to process directly received data */
-    ctx->data = data;
-    ctx->data_len = len;
-  }
+static void context_stash(struct update_context *ctx, const char *data,
+                          size_t len) {
+  mbuf_append(&ctx->unprocessed, data, len);
+  ctx->data = ctx->unprocessed.buf;
+  ctx->data_len = ctx->unprocessed.len;
 }
 
-static void context_save_unprocessed(struct update_context *ctx) {
-  if (ctx->unprocessed.len == 0) {
-    mbuf_append(&ctx->unprocessed, ctx->data, ctx->data_len);
-    ctx->data = ctx->unprocessed.buf;
-    ctx->data_len = ctx->unprocessed.len;
+/* Returns 0, or -1 if the data does not fit into the staging buffer. */
+static int context_save_unprocessed(struct update_context *ctx) {
+  if (ctx->unprocessed.len == 0 && ctx->data_len > 0) {
+    if (ctx->data_len > ctx->unprocessed.size) {
+      LOG(LL_ERROR, ("%u bytes left over, staging buffer is %u",
+                     (unsigned int) ctx->data_len,
+                     (unsigned int) ctx->unprocessed.size));
+      ctx->status_msg = "Staging buffer overflow";
+      return -1;
+    }
+    context_stash(ctx, ctx->data, ctx->data_len);
   }
+  return 0;
 }
 
 void context_remove_data(struct update_context *ctx, size_t len) {
@@ -207,6 +399,28 @@ static void context_clear_current_file(struct update_context *ctx) {
   memset(&ctx->info.current_file, 0, sizeof(ctx->info.current_file));
   ctx->current_file_crc = ctx->current_file_crc_calc = 0;
   ctx->current_file_has_descriptor = false;
+  s_entry.method = ZIP_METHOD_STORED;
+  s_entry.compressed_size = s_entry.compressed_processed = 0;
+  s_entry.size = s_entry.processed = 0;
+  s_entry.check_sha1 = false;
+  delta_free(s_entry.delta);
+  s_entry.delta = NULL;
+}
+
+/* Number of archive bytes taken by the data of the current entry. */
+static uint32_t entry_data_size(void) {
+  return (s_entry.method == ZIP_METHOD_DEFLATE ? s_entry.compressed_size
+                                               : s_entry.size);
+}
+
+/* Returns the inflater, ready for a new entry. Created on first use. */
+static struct inflater *entry_inflater(void) {
+  if (s_entry.inflater == NULL) {
+    s_entry.inflater = inflater_create();
+  } else {
+    inflater_reset(s_entry.inflater);
+  }
+  return s_entry.inflater;
 }
 
 int is_write_finished(struct update_context *ctx) {
@@ -240,6 +454,10 @@ static int parse_zip_file_header(struct update_context *ctx) {
 
   LOG(LL_DEBUG, ("Filename len = %d bytes, extras len = %d bytes",
                  (int) file_name_len, (int) extras_len));
+  if (ZIP_LOCAL_HDR_SIZE + file_name_len + extras_len > UPDATER_STAGING_SIZE) {
+    ctx->status_msg = "Zip header is too big";
+    return -1;
+  }
   if (ctx->data_len < ZIP_LOCAL_HDR_SIZE + file_name_len + extras_len) {
     /* Still need mode data */
     return 0;
@@ -250,10 +468,11 @@ static int parse_zip_file_header(struct update_context *ctx) {
          sizeof(compression_method));
 
   LOG(LL_DEBUG, ("Compression method=%d", (int) compression_method));
-  if (compression_method != 0) {
-    /* Do not support compressed archives */
-    ctx->status_msg = "Cannot handle compressed .zip";
-    LOG(LL_ERROR, ("File is compressed)"));
+  if (compression_method != ZIP_METHOD_STORED &&
+      compression_method != ZIP_METHOD_DEFLATE) {
+    ctx->status_msg = "Unsupported .zip compression method";
+    LOG(LL_ERROR, ("Unsupported compression method %d",
+                   (int) compression_method));
     return -1;
   }
 
@@ -283,28 +502,44 @@ static int parse_zip_file_header(struct update_context *ctx) {
   }
   memcpy(ctx->info.current_file.name, nodir_file_name, nodir_file_name_len);
 
-  memcpy(&ctx->info.current_file.size, ctx->data + ZIP_COMPRESSED_SIZE_OFFSET,
-         sizeof(ctx->info.current_file.size));
-
-  uint32_t uncompressed_size;
+  uint32_t compressed_size, uncompressed_size;
+  memcpy(&compressed_size, ctx->data + ZIP_COMPRESSED_SIZE_OFFSET,
+         sizeof(compressed_size));
   memcpy(&uncompressed_size, ctx->data + ZIP_UNCOMPRESSED_SIZE_OFFSET,
          sizeof(uncompressed_size));
 
-  if (ctx->info.current_file.size != uncompressed_size) {
+  if (compression_method == ZIP_METHOD_STORED &&
+      compressed_size != uncompressed_size) {
     /* Probably malformed archive*/
     LOG(LL_ERROR, ("Malformed archive"));
     ctx->status_msg = "Malformed archive";
     return -1;
   }
 
-  LOG(LL_DEBUG, ("File size: %u", (unsigned int) ctx->info.current_file.size));
-
   uint16_t gen_flag;
   memcpy(&gen_flag, ctx->data + ZIP_GENFLAG_OFFSET, sizeof(gen_flag));
   ctx->current_file_has_descriptor = ((gen_flag & (1 << 3)) != 0);
 
   LOG(LL_DEBUG, ("General flag=%d", (int) gen_flag));
 
+  if (compression_method == ZIP_METHOD_DEFLATE &&
+      ctx->current_file_has_descriptor && compressed_size == 0) {
+    /* Sizes are only in the descriptor, but we need them upfront. */
+    ctx->status_msg = "Cannot handle compressed .zip without sizes";
+    return -1;
+  }
+
+  ctx->info.current_file.size = uncompressed_size;
+  s_entry.method = compression_method;
+  s_entry.compressed_size = compressed_size;
+  s_entry.compressed_processed = 0;
+  s_entry.size = uncompressed_size;
+  s_entry.processed = 0;
+
+  LOG(LL_DEBUG, ("File size: %u, compressed: %u",
+                 (unsigned int) ctx->info.current_file.size,
+                 (unsigned int) compressed_size));
+
   memcpy(&ctx->current_file_crc, ctx->data + ZIP_CRC32_OFFSET,
          sizeof(ctx->current_file_crc));
 
@@ -315,20 +550,129 @@ static int parse_zip_file_header(struct update_context *ctx) {
   return 1;
 }
 
-static int parse_manifest(struct update_context *ctx) {
+/* Tokens are not NUL-terminated, so lengths have to match as well. */
+static bool token_equals(const struct json_token *tok, const char *str,
+                         bool ignore_case) {
+  if ((size_t) tok->len != strlen(str)) return false;
+  return (ignore_case ? strncasecmp(tok->ptr, str, tok->len)
+                      : strncmp(tok->ptr, str, tok->len)) == 0;
+}
+
+/* Picks up the manifest fields we need, as soon as each one is complete. */
+static bool manifest_member_cb(void *arg, const struct json_token *key,
+                               const struct json_token *value) {
+  struct update_context *ctx = (struct update_context *) arg;
   struct mgos_upd_info *info = &ctx->info;
-  ctx->manifest_data = calloc(1, info->current_file.size);
+  if (token_equals(key, "name", false)) {
+    info->name = *value;
+  } else if (token_equals(key, "version", false)) {
+    info->version = *value;
+  } else if (token_equals(key, "build_id", false)) {
+    info->build_id = *value;
+  } else if (token_equals(key, "parts", false)) {
+    info->parts = *value;
+  } else if (token_equals(key, "platform", false)) {
+    info->platform = *value;
+    /* No point in downloading the rest of it. */
+    if (!token_equals(&info->platform, CS_STRINGIFY_MACRO(FW_ARCHITECTURE),
+                      true)) {
+      LOG(LL_ERROR, ("Wrong platform: want \"%s\", got \"%.*s\"",
+                     CS_STRINGIFY_MACRO(FW_ARCHITECTURE),
+                     (int) info->platform.len, info->platform.ptr));
+      ctx->status_msg = "Wrong platform";
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Appends manifest data and scans what has been added. */
+static int manifest_append(struct update_context *ctx, const void *data,
+                           size_t len) {
+  memcpy(ctx->manifest_data + s_entry.processed, data, len);
+  s_entry.processed += len;
+  if (json_stream_feed(&s_manifest_js, ctx->manifest_data,
+                       s_entry.processed) < 0) {
+    if (ctx->status_msg == NULL) ctx->status_msg = "Failed to parse manifest";
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Collects the manifest in manifest_data as it arrives, so it is stored
+ * exactly once, and scans it on the way. Returns 1 once it is complete,
+ * 0 if more data is needed.
+ */
+static int receive_manifest(struct update_context *ctx) {
   if (ctx->manifest_data == NULL) {
-    ctx->status_msg = "Out of memory";
+    if (s_entry.size > UPDATER_MANIFEST_MAX_SIZE) {
+      ctx->status_msg = "Manifest is too big";
+      return -1;
+    }
+    ctx->manifest_data = calloc(1, s_entry.size + 1);
+    if (ctx->manifest_data == NULL ||
+        (s_entry.method == ZIP_METHOD_DEFLATE && entry_inflater() == NULL)) {
+      ctx->status_msg = "Out of memory";
+      return -1;
+    }
+    json_stream_init(&s_manifest_js, manifest_member_cb, ctx);
+  }
+
+  if (s_entry.method != ZIP_METHOD_DEFLATE) {
+    size_t n = MIN(ctx->data_len, s_entry.size - s_entry.processed);
+    if (manifest_append(ctx, ctx->data, n) < 0) return -1;
+    context_remove_data(ctx, n);
+    return (s_entry.processed == s_entry.size);
+  }
+
+  struct inflater *inf = s_entry.inflater;
+  enum inflater_result res;
+  do {
+    size_t consumed, n;
+    res = inflater_run(
+        inf, (const uint8_t *) ctx->data,
+        MIN(ctx->data_len,
+            s_entry.compressed_size - s_entry.compressed_processed),
+        &consumed);
+    context_remove_data(ctx, consumed);
+    s_entry.compressed_processed += consumed;
+    const uint8_t *out = inflater_output(inf, &n);
+    if (res == INFLATER_ERROR || n > s_entry.size - s_entry.processed) {
+      ctx->status_msg = "Malformed archive (bad deflate data)";
+      return -1;
+    }
+    if (manifest_append(ctx, out, n) < 0) return -1;
+    inflater_consume(inf, n);
+  } while (res == INFLATER_OUTPUT_FULL);
+
+  if (res == INFLATER_NEED_INPUT) {
+    if (s_entry.compressed_processed == s_entry.compressed_size) {
+      ctx->status_msg = "Malformed archive (truncated deflate data)";
+      return -1;
+    }
+    return 0;
+  }
+  if (s_entry.compressed_processed != s_entry.compressed_size ||
+      s_entry.processed != s_entry.size) {
+    ctx->status_msg = "Malformed archive (size mismatch)";
     return -1;
   }
-  memcpy(ctx->manifest_data, ctx->data, info->current_file.size);
+  return 1;
+}
 
-  if (json_scanf(
-          ctx->manifest_data, info->current_file.size,
-          "{name: %T, platform: %T, version: %T, build_id: %T, parts: %T}",
-          &info->name, &info->platform, &info->version, &info->build_id,
-          &info->parts) <= 0) {
+static int parse_manifest(struct update_context *ctx) {
+  struct mgos_upd_info *info = &ctx->info;
+  if (ctx->current_file_crc != 0 &&
+      crc32_update(0, ctx->manifest_data, info->current_file.size) !=
+          ctx->current_file_crc) {
+    ctx->status_msg = "Invalid CRC";
+    return -1;
+  }
+
+  /* Fields have been picked up by manifest_member_cb() already. */
+  if (json_stream_feed(&s_manifest_js, ctx->manifest_data,
+                       info->current_file.size) != 1) {
     ctx->status_msg = "Failed to parse manifest";
     return -1;
   }
@@ -345,18 +689,250 @@ static int parse_manifest(struct update_context *ctx) {
        (int) info->version.len, info->version.ptr, (int) info->build_id.len,
        info->build_id.ptr));
 
-  context_remove_data(ctx, info->current_file.size);
+  return 1;
+}
+
+struct part_field_ctx {
+  struct mg_str src;
+  const char *field;
+  bool src_matches;
+  struct json_token value;
+  struct json_token result;
+};
+
+static void part_field_cb(void *data, const char *name, size_t name_len,
+                          const char *path, const struct json_token *token) {
+  struct part_field_ctx *pf = (struct part_field_ctx *) data;
+  /* Paths of part objects are ".part", their fields are ".part.field" */
+  const char *dot = (path[0] == '.' ? strchr(path + 1, '.') : NULL);
+  if (path[0] == '\0' || strchr(path, '[') != NULL) return;
+  if (dot == NULL) {
+    if (token->type == JSON_TYPE_OBJECT_START) {
+      pf->src_matches = false;
+      memset(&pf->value, 0, sizeof(pf->value));
+    } else if (token->type == JSON_TYPE_OBJECT_END && pf->src_matches &&
+               pf->result.ptr == NULL) {
+      pf->result = pf->value;
+    }
+  } else if (strchr(dot + 1, '.') == NULL) {
+    if (name_len == 3 && strncmp(name, "src", 3) == 0) {
+      pf->src_matches = (token->type == JSON_TYPE_STRING &&
+                         (size_t) token->len == pf->src.len &&
+                         strncmp(token->ptr, pf->src.p, pf->src.len) == 0);
+    } else if (name_len == strlen(pf->field) &&
+               strncmp(name, pf->field, name_len) == 0) {
+      pf->value = *token;
+    }
+  }
+}
+
+/*
+ * Looks up `field` of the manifest part whose "src" is the current file.
+ * Returns false if there is no such part or it has no such field.
+ */
+static bool manifest_part_field(struct update_context *ctx, const char *field,
+                                struct json_token *value) {
+  struct part_field_ctx pf;
+  memset(&pf, 0, sizeof(pf));
+  pf.src = mg_mk_str_n(ctx->info.current_file.name,
+                       strlen(ctx->info.current_file.name));
+  pf.field = field;
+  json_walk(ctx->info.parts.ptr, ctx->info.parts.len, part_field_cb, &pf);
+  if (pf.result.ptr == NULL) return false;
+  *value = pf.result;
+  return true;
+}
 
+#if CS_PLATFORM == CS_P_ESP32
+static bool read_running_app(uint32_t offset, void *buf, size_t len,
+                             void *arg) {
+  const esp_partition_t *p = esp_ota_get_running_partition();
+  (void) arg;
+  return (p != NULL && offset + len <= p->size &&
+          esp_partition_read(p, offset, buf, len) == ESP_OK);
+}
+
+static bool read_flash(uint32_t offset, void *buf, size_t len, void *arg) {
+  (void) arg;
+  return (spi_flash_read(offset, buf, len) == ESP_OK);
+}
+
+/*
+ * Tells if `size` bytes at `offset`, as read by `read`, have the SHA-1
+ * `want` (hex).
+ */
+static bool sha1_matches(delta_read_base_cb read, uint32_t offset,
+                         uint32_t size, const char *want) {
+  uint8_t buf[256], digest[20];
+  char sha1[SHA1SUM_LEN + 1];
+  cs_sha1_ctx sha1_ctx;
+  uint32_t off;
+  cs_sha1_init(&sha1_ctx);
+  for (off = 0; off < size; off += sizeof(buf)) {
+    uint32_t n = MIN(sizeof(buf), size - off);
+    if (!read(offset + off, buf, n, NULL)) return false;
+    cs_sha1_update(&sha1_ctx, buf, n);
+  }
+  cs_sha1_final(digest, &sha1_ctx);
+  bin2hex(digest, sizeof(digest), sha1);
+  return (strncasecmp(sha1, want, SHA1SUM_LEN) == 0);
+}
+#endif
+
+/*
+ * Prepares the current file to be patched against the running firmware if
+ * the manifest says so. The HAL is then given the size of the result.
+ * A patch only makes sense against the image it was made from, so the part
+ * must say which one that is, by its "base_size" and "base_cs_sha1", and
+ * the running app must be it.
+ * Returns 1 if the file is a delta, 0 if it is not, -1 on error.
+ */
+static int setup_delta(struct update_context *ctx) {
+  struct json_token delta, type, size, base_size, base_sha1;
+  if (!manifest_part_field(ctx, "delta", &delta) ||
+      delta.type != JSON_TYPE_TRUE) {
+    return 0;
+  }
+  if (!manifest_part_field(ctx, "type", &type) || type.len != 3 ||
+      strncmp(type.ptr, "app", 3) != 0) {
+    ctx->status_msg = "Delta is only supported for the app";
+    return -1;
+  }
+  if (!manifest_part_field(ctx, "size", &size) ||
+      size.type != JSON_TYPE_NUMBER) {
+    ctx->status_msg = "Delta part has no size";
+    return -1;
+  }
+  if (!manifest_part_field(ctx, "base_size", &base_size) ||
+      base_size.type != JSON_TYPE_NUMBER ||
+      !manifest_part_field(ctx, "base_cs_sha1", &base_sha1) ||
+      base_sha1.len != SHA1SUM_LEN) {
+    ctx->status_msg = "Delta part has no base_size or base_cs_sha1";
+    return -1;
+  }
+#if CS_PLATFORM == CS_P_ESP32
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  uint32_t base_len = strtoul(base_size.ptr, NULL, 10);
+  if (running == NULL || base_len > running->size ||
+      !sha1_matches(read_running_app, 0, base_len, base_sha1.ptr)) {
+    LOG(LL_ERROR, ("Running app is not the base of %s (%u bytes, SHA1 %.*s)",
+                   ctx->info.current_file.name, (unsigned int) base_len,
+                   SHA1SUM_LEN, base_sha1.ptr));
+    ctx->status_msg = "Delta is for another base image";
+    return -1;
+  }
+  s_entry.delta = delta_create(read_running_app, base_len, NULL);
+  if (s_entry.delta == NULL) {
+    ctx->status_msg = "Out of memory";
+    return -1;
+  }
+  ctx->info.current_file.size = strtoul(size.ptr, NULL, 10);
+  LOG(LL_INFO, ("%s is a delta, target size %u", ctx->info.current_file.name,
+                (unsigned int) ctx->info.current_file.size));
   return 1;
+#else
+  ctx->status_msg = "Delta updates are not supported on this platform";
+  return -1;
+#endif
 }
 
-static int finalize_write(struct update_context *ctx, struct mg_str tail) {
-  /* We have to add the tail to CRC now to be able to verify it. */
-  if (tail.len > 0) {
-    ctx->current_file_crc_calc = cs_crc32(ctx->current_file_crc_calc,
-                                          (const uint8_t *) tail.p, tail.len);
+/* Starts checking the file against its "cs_sha1" from the manifest. */
+static void setup_sha1(struct update_context *ctx) {
+  struct json_token sha1;
+  if (!manifest_part_field(ctx, "cs_sha1", &sha1)) return;
+  if (sha1.len != SHA1SUM_LEN) {
+    LOG(LL_WARN, ("%s: ignoring bad cs_sha1", ctx->info.current_file.name));
+    return;
+  }
+  memcpy(s_entry.want_sha1, sha1.ptr, SHA1SUM_LEN);
+  cs_sha1_init(&s_entry.sha1_ctx);
+  s_entry.check_sha1 = true;
+}
+
+/*
+ * Parts at a fixed address (bootloader, partition table and such, as
+ * opposed to app and fs, which go to the inactive slot) are not rewritten
+ * if flash already holds exactly what the manifest says.
+ */
+static bool part_is_installed(struct update_context *ctx) {
+  struct json_token ptn, addr, want;
+  if (manifest_part_field(ctx, "ptn", &ptn) ||
+      !manifest_part_field(ctx, "addr", &addr) ||
+      addr.type != JSON_TYPE_NUMBER ||
+      !manifest_part_field(ctx, "cs_sha1", &want) ||
+      want.len != SHA1SUM_LEN) {
+    return false;
+  }
+#if CS_PLATFORM == CS_P_ESP32
+  uint32_t start = strtoul(addr.ptr, NULL, 10);
+  if (!sha1_matches(read_flash, start, ctx->info.current_file.size,
+                    want.ptr)) {
+    return false;
+  }
+  LOG(LL_INFO, ("%s is already installed at 0x%x", ctx->info.current_file.name,
+                (unsigned int) start));
+  return true;
+#else
+  return false;
+#endif
+}
+
+/* Passes data to the HAL, returns number of bytes taken or -1 on error. */
+static int write_file_data(struct update_context *ctx, const uint8_t *data,
+                           size_t len) {
+  double start = mgos_uptime();
+  int num_processed =
+      mgos_upd_file_data(ctx->dev_ctx, &ctx->info.current_file,
+                         mg_mk_str_n((const char *) data, len));
+  stats_add_time(&ctx_stats(ctx)->write_time, start);
+  if (num_processed < 0) {
+    ctx->status_msg = mgos_upd_get_status_msg(ctx->dev_ctx);
+    return num_processed;
+  }
+  ctx->info.current_file.processed += num_processed;
+  if (s_entry.check_sha1) {
+    start = mgos_uptime();
+    cs_sha1_update(&s_entry.sha1_ctx, data, num_processed);
+    stats_add_time(&ctx_stats(ctx)->crc_time, start);
+  }
+  return num_processed;
+}
+
+/*
+ * Feeds patch data to the delta patcher and writes out what it produces.
+ * Returns number of patch bytes consumed, or -1 on error.
+ */
+static int apply_delta(struct update_context *ctx, const uint8_t *data,
+                       size_t len) {
+  size_t total = 0;
+  while (true) {
+    size_t consumed, out_len;
+    enum delta_result res =
+        delta_run(s_entry.delta, data + total, len - total, &consumed);
+    total += consumed;
+    if (res == DELTA_ERROR) {
+      LOG(LL_ERROR, ("Patch failed: %s", delta_error(s_entry.delta)));
+      ctx->status_msg = "Failed to apply delta";
+      return -1;
+    }
+    const uint8_t *out = delta_output(s_entry.delta, &out_len);
+    int num_processed = 0;
+    if (out_len > 0) {
+      if ((num_processed = write_file_data(ctx, out, out_len)) < 0) {
+        return num_processed;
+      }
+      delta_consume(s_entry.delta, num_processed);
+    }
+    if (res != DELTA_OUTPUT_FULL) return (int) total;
+    if (num_processed == 0) {
+      /* The HAL refuses a full output buffer, it will not get better. */
+      ctx->status_msg = "Not all data was processed";
+      return -1;
+    }
   }
+}
 
+static int finalize_write(struct update_context *ctx, struct mg_str tail) {
   if (ctx->current_file_crc != 0 &&
       ctx->current_file_crc != ctx->current_file_crc_calc) {
     LOG(LL_ERROR, ("Invalid CRC, want 0x%x, got 0x%x",
@@ -366,7 +942,23 @@ static int finalize_write(struct update_context *ctx, struct mg_str tail) {
     return -1;
   }
 
+  if (s_entry.check_sha1) {
+    uint8_t digest[20];
+    char sha1[SHA1SUM_LEN + 1];
+    cs_sha1_update(&s_entry.sha1_ctx, (const uint8_t *) tail.p, tail.len);
+    cs_sha1_final(digest, &s_entry.sha1_ctx);
+    bin2hex(digest, sizeof(digest), sha1);
+    if (strncasecmp(sha1, s_entry.want_sha1, SHA1SUM_LEN) != 0) {
+      LOG(LL_ERROR, ("Invalid SHA1, want %.*s, got %s", SHA1SUM_LEN,
+                     s_entry.want_sha1, sha1));
+      ctx->status_msg = "Invalid checksum";
+      return -1;
+    }
+  }
+
+  double start = mgos_uptime();
   int ret = mgos_upd_file_end(ctx->dev_ctx, &ctx->info.current_file, tail);
+  stats_add_time(&ctx_stats(ctx)->write_time, start);
   if (ret != (int) tail.len) {
     if (ret < 0) {
       ctx->status_msg = mgos_upd_get_status_msg(ctx->dev_ctx);
@@ -377,8 +969,6 @@ static int finalize_write(struct update_context *ctx, struct mg_str tail) {
     return ret;
   }
 
-  context_remove_data(ctx, tail.len);
-
   return 1;
 }
 
@@ -407,13 +997,122 @@ static void mgos_updater_progress(struct update_context *ctx) {
   }
 }
 
-static int updater_process_int(struct update_context *ctx, const char *data,
-                               size_t len) {
-  int ret;
-  if (len != 0) {
-    context_update(ctx, data, len);
+/*
+ * Moves entry data to the HAL: from ctx->data or through the inflater, then
+ * directly or through the delta patcher. Returns 1 once the file is complete,
+ * 0 if more data is needed and -1 on error. Input left in ctx->data has to
+ * be saved by the caller.
+ */
+static int process_entry_data(struct update_context *ctx) {
+  struct mgos_upd_file_info *fi = &ctx->info.current_file;
+  struct inflater *inf = s_entry.inflater;
+
+  while (true) {
+    /* Pick up entry data available right now. */
+    enum inflater_result res = INFLATER_NEED_INPUT;
+    const uint8_t *data;
+    size_t len;
+    bool is_last;
+    if (s_entry.method == ZIP_METHOD_DEFLATE) {
+      size_t consumed;
+      size_t in_len =
+          MIN(ctx->data_len,
+              s_entry.compressed_size - s_entry.compressed_processed);
+      res = inflater_run(inf, (const uint8_t *) ctx->data, in_len, &consumed);
+      context_remove_data(ctx, consumed);
+      s_entry.compressed_processed += consumed;
+      if (res == INFLATER_ERROR) {
+        LOG(LL_ERROR, ("Inflate failed: %s", inflater_error(inf)));
+        ctx->status_msg = "Malformed archive (bad deflate data)";
+        return -1;
+      }
+      data = inflater_output(inf, &len);
+      is_last = (res == INFLATER_DONE);
+      if (is_last &&
+          s_entry.compressed_processed != s_entry.compressed_size) {
+        ctx->status_msg = "Malformed archive (size mismatch)";
+        return -1;
+      }
+    } else {
+      data = (const uint8_t *) ctx->data;
+      len = MIN(ctx->data_len, s_entry.size - s_entry.processed);
+      is_last = (len == s_entry.size - s_entry.processed);
+    }
+    if (len > s_entry.size - s_entry.processed ||
+        (is_last && len != s_entry.size - s_entry.processed)) {
+      ctx->status_msg = "Malformed archive (size mismatch)";
+      return -1;
+    }
+
+    /* Hand it over. */
+    int num_processed =
+        (s_entry.delta != NULL ? apply_delta(ctx, data, len)
+                               : write_file_data(ctx, data, len));
+    if (num_processed < 0) return num_processed;
+    double start = mgos_uptime();
+    ctx->current_file_crc_calc =
+        crc32_update(ctx->current_file_crc_calc, data, num_processed);
+    stats_add_time(&ctx_stats(ctx)->crc_time, start);
+    s_entry.processed += num_processed;
+    if (s_entry.method == ZIP_METHOD_DEFLATE) {
+      inflater_consume(inf, num_processed);
+    } else if (!is_last) {
+      /* The last piece stays put: its tail is still to be read from it. */
+      context_remove_data(ctx, num_processed);
+    }
+    mgos_updater_progress(ctx);
+
+    if (is_last) {
+      struct mg_str tail = mg_mk_str_n((const char *) data + num_processed,
+                                       len - num_processed);
+      if (s_entry.delta != NULL) {
+        size_t out_len;
+        if (tail.len > 0) {
+          ctx->status_msg = "Patch has trailing data";
+          return -1;
+        }
+        tail.p = (const char *) delta_output(s_entry.delta, &out_len);
+        tail.len = out_len;
+        if (fi->processed + tail.len != fi->size) {
+          ctx->status_msg = "Patch is incomplete";
+          return -1;
+        }
+      } else {
+        /* Whatever the HAL did not take goes to it as the tail. */
+        ctx->current_file_crc_calc = crc32_update(
+            ctx->current_file_crc_calc, (const uint8_t *) tail.p, tail.len);
+        s_entry.processed += tail.len;
+      }
+      if (finalize_write(ctx, tail) < 0) return -1;
+      if (s_entry.delta != NULL) {
+        delta_consume(s_entry.delta, tail.len);
+      } else if (s_entry.method == ZIP_METHOD_DEFLATE) {
+        inflater_consume(inf, tail.len);
+      } else {
+        context_remove_data(ctx, num_processed + tail.len);
+      }
+      return 1;
+    }
+
+    if (s_entry.method != ZIP_METHOD_DEFLATE || res == INFLATER_NEED_INPUT) {
+      if (s_entry.method == ZIP_METHOD_DEFLATE &&
+          s_entry.compressed_processed == s_entry.compressed_size) {
+        ctx->status_msg = "Malformed archive (truncated deflate data)";
+        return -1;
+      }
+      return 0;
+    }
+    if (num_processed == 0) {
+      /* Inflater output is full and nobody takes it. */
+      ctx->status_msg = "Not all data was processed";
+      return -1;
+    }
   }
+}
 
+/* Runs the state machine over ctx->data. */
+static int updater_run(struct update_context *ctx) {
+  int ret;
   while (true) {
     switch (ctx->update_state) {
       case US_INITED: {
@@ -421,9 +1120,7 @@ static int updater_process_int(struct update_context *ctx, const char *data,
       } /* fall through */
       case US_WAITING_MANIFEST_HEADER: {
         if ((ret = parse_zip_file_header(ctx)) <= 0) {
-          if (ret == 0) {
-            context_save_unprocessed(ctx);
-          }
+          if (ret == 0) ret = context_save_unprocessed(ctx);
           return ret;
         }
         if (strncmp(ctx->info.current_file.name, MANIFEST_FILENAME,
@@ -431,44 +1128,22 @@ static int updater_process_int(struct update_context *ctx, const char *data,
           /* We've got file header, but it isn't not metadata */
           LOG(LL_ERROR, ("Get %s instead of %s", ctx->info.current_file.name,
                          MANIFEST_FILENAME));
+          ctx->status_msg = "Malformed archive (no manifest)";
           return -1;
         }
         updater_set_status(ctx, US_WAITING_MANIFEST);
       } /* fall through */
       case US_WAITING_MANIFEST: {
-        /*
-         * Assume metadata isn't too big and might be cached
-         * otherwise we need streaming json-parser
-         */
-        if (ctx->data_len < ctx->info.current_file.size) {
-          context_save_unprocessed(ctx);
-          return 0;
-        }
-
-        if (ctx->current_file_crc != 0 &&
-            cs_crc32(0, (const uint8_t *) ctx->data,
-                     ctx->info.current_file.size) != ctx->current_file_crc) {
-          ctx->status_msg = "Invalid CRC";
-          return -1;
+        if ((ret = receive_manifest(ctx)) <= 0) {
+          if (ret == 0) ret = context_save_unprocessed(ctx);
+          return ret;
         }
 
         if ((ret = parse_manifest(ctx)) < 0) return ret;
 
-        if (strncasecmp(ctx->info.platform.ptr,
-                        CS_STRINGIFY_MACRO(FW_ARCHITECTURE),
-                        strlen(CS_STRINGIFY_MACRO(FW_ARCHITECTURE))) != 0) {
-          LOG(LL_ERROR,
-              ("Wrong platform: want \"%s\", got \"%s\"",
-               CS_STRINGIFY_MACRO(FW_ARCHITECTURE), ctx->info.platform.ptr));
-          ctx->status_msg = "Wrong platform";
-          return -1;
-        }
-
         if (ctx->ignore_same_version &&
-            strncmp(ctx->info.version.ptr, build_version,
-                    ctx->info.version.len) == 0 &&
-            strncmp(ctx->info.build_id.ptr, build_id, ctx->info.build_id.len) ==
-                0) {
+            token_equals(&ctx->info.version, build_version, false) &&
+            token_equals(&ctx->info.build_id, build_id, false)) {
           ctx->status_msg = "Version is the same as current";
           return 1;
         }
@@ -487,13 +1162,12 @@ static int updater_process_int(struct update_context *ctx, const char *data,
 
         if (ctx->result) return ctx->result;
 
-        context_clear_current_file(ctx);
-        updater_set_status(ctx, US_WAITING_FILE_HEADER);
-      } /* fall through */
+        updater_set_status(ctx, US_SKIPPING_DESCRIPTOR);
+        break;
+      }
       case US_WAITING_FILE_HEADER: {
         if (ctx->data_len < 4) {
-          context_save_unprocessed(ctx);
-          return 0;
+          return context_save_unprocessed(ctx);
         }
         if (memcmp(ctx->data, &c_zip_cdir_magic, 4) == 0) {
           LOG(LL_DEBUG, ("Reached the end of archive"));
@@ -501,60 +1175,41 @@ static int updater_process_int(struct update_context *ctx, const char *data,
           break;
         }
         if ((ret = parse_zip_file_header(ctx)) <= 0) {
-          if (ret == 0) context_save_unprocessed(ctx);
+          if (ret == 0) ret = context_save_unprocessed(ctx);
           return ret;
         }
+        if (setup_delta(ctx) < 0) return -1;
 
         enum mgos_upd_file_action r =
-            mgos_upd_file_begin(ctx->dev_ctx, &ctx->info.current_file);
+            (part_is_installed(ctx)
+                 ? MGOS_UPDATER_SKIP_FILE
+                 : mgos_upd_file_begin(ctx->dev_ctx, &ctx->info.current_file));
 
         if (r == MGOS_UPDATER_ABORT) {
           ctx->status_msg = mgos_upd_get_status_msg(ctx->dev_ctx);
           return -1;
         } else if (r == MGOS_UPDATER_SKIP_FILE) {
+          /* Skipping works on archive bytes, not on inflated data. */
+          ctx->info.current_file.size = entry_data_size();
+          ctx->info.current_file.processed = 0;
           updater_set_status(ctx, US_SKIPPING_DATA);
           break;
         }
+        if (s_entry.method == ZIP_METHOD_DEFLATE && entry_inflater() == NULL) {
+          ctx->status_msg = "Out of memory";
+          return -1;
+        }
+        setup_sha1(ctx);
         updater_set_status(ctx, US_WAITING_FILE);
         ctx->current_file_crc_calc = 0;
         ctx->last_reported_bytes = 0;
       } /* fall through */
       case US_WAITING_FILE: {
-        struct mg_str to_process;
-        to_process.p = ctx->data;
-        to_process.len =
-            MIN(ctx->info.current_file.size - ctx->info.current_file.processed,
-                ctx->data_len);
-
-        int num_processed = mgos_upd_file_data(
-            ctx->dev_ctx, &ctx->info.current_file, to_process);
-        if (num_processed < 0) {
-          ctx->status_msg = mgos_upd_get_status_msg(ctx->dev_ctx);
-          return num_processed;
-        } else if (num_processed > 0) {
-          ctx->current_file_crc_calc =
-              cs_crc32(ctx->current_file_crc_calc,
-                       (const uint8_t *) to_process.p, num_processed);
-          context_remove_data(ctx, num_processed);
-          ctx->info.current_file.processed += num_processed;
-        }
-        mgos_updater_progress(ctx);
-
-        uint32_t bytes_left =
-            ctx->info.current_file.size - ctx->info.current_file.processed;
-        if (bytes_left > ctx->data_len) {
-          context_save_unprocessed(ctx);
-          return 0;
-        }
-
-        to_process.p = ctx->data;
-        to_process.len = bytes_left;
-
-        if (finalize_write(ctx, to_process) < 0) {
-          return -1;
+        if ((ret = process_entry_data(ctx)) <= 0) {
+          if (ret == 0) ret = context_save_unprocessed(ctx);
+          return ret;
         }
-        context_clear_current_file(ctx);
-        updater_set_status(ctx, US_WAITING_FILE_HEADER);
+        updater_set_status(ctx, US_SKIPPING_DESCRIPTOR);
         break;
       }
       case US_SKIPPING_DATA: {
@@ -566,31 +1221,37 @@ static int updater_process_int(struct update_context *ctx, const char *data,
         mgos_updater_progress(ctx);
 
         if (ctx->info.current_file.processed < ctx->info.current_file.size) {
-          context_save_unprocessed(ctx);
-          return 0;
+          return context_save_unprocessed(ctx);
         }
 
-        context_clear_current_file(ctx);
         updater_set_status(ctx, US_SKIPPING_DESCRIPTOR);
       } /* fall through */
       case US_SKIPPING_DESCRIPTOR: {
         bool has_descriptor = ctx->current_file_has_descriptor;
+        uint32_t descriptor_size = ZIP_FILE_DESCRIPTOR_SIZE;
         LOG(LL_DEBUG, ("Has descriptor : %d", has_descriptor));
+        if (has_descriptor) {
+          /* Most zip writers start the descriptor with a signature. */
+          if (ctx->data_len < 4) return context_save_unprocessed(ctx);
+          if (memcmp(ctx->data, &c_zip_descriptor_magic, 4) == 0) {
+            descriptor_size += 4;
+          }
+        }
         context_clear_current_file(ctx);
         ctx->current_file_has_descriptor = false;
         if (has_descriptor) {
-          /* If file has descriptor we have to skip 12 bytes after its body */
-          ctx->info.current_file.size = ZIP_FILE_DESCRIPTOR_SIZE;
+          /* If file has descriptor we have to skip it after its body */
+          ctx->info.current_file.size = descriptor_size;
           updater_set_status(ctx, US_SKIPPING_DATA);
         } else {
           updater_set_status(ctx, US_WAITING_FILE_HEADER);
         }
-
-        context_save_unprocessed(ctx);
         break;
       }
       case US_WRITE_FINISHED: {
-        /* We will stay in this state until explicitly finalized. */
+        /* We will stay in this state until explicitly finalized.
+         * The central directory that follows is of no interest. */
+        context_remove_data(ctx, ctx->data_len);
         return 0;
       }
       case US_FINALIZE: {
@@ -604,7 +1265,10 @@ static int updater_process_int(struct update_context *ctx, const char *data,
             return -1;
           }
         }
-        if ((ret = mgos_upd_finalize(ctx->dev_ctx)) < 0) {
+        double start = mgos_uptime();
+        ret = mgos_upd_finalize(ctx->dev_ctx);
+        stats_add_time(&ctx_stats(ctx)->finalize_time, start);
+        if (ret < 0) {
           ctx->status_msg = mgos_upd_get_status_msg(ctx->dev_ctx);
           return ret;
         }
@@ -626,9 +1290,48 @@ static int updater_process_int(struct update_context *ctx, const char *data,
   }
 }
 
+/*
+ * Arriving data is processed in place. Only if something is left over from
+ * the previous call, as much of the new data as fits is appended to it and
+ * the state machine runs on the staging buffer; as soon as it gets past the
+ * old bytes, it continues on the caller's buffer.
+ */
+static int updater_process_int(struct update_context *ctx, const char *data,
+                               size_t len) {
+  int ret;
+  if (ctx->unprocessed.len != 0 && len != 0) {
+    size_t n = MIN(len, ctx->unprocessed.size - ctx->unprocessed.len);
+    context_stash(ctx, data, n);
+    data += n;
+    len -= n;
+    if ((ret = updater_run(ctx)) != 0) return ret;
+    if (ctx->unprocessed.len > n) {
+      /* Still stuck on the old bytes. */
+      if (len == 0) return 0;
+      ctx->status_msg = "Staging buffer overflow";
+      return -1;
+    }
+    /* What is left in the buffer is a copy of the caller's data. */
+    data -= ctx->unprocessed.len;
+    len += ctx->unprocessed.len;
+    mbuf_remove(&ctx->unprocessed, ctx->unprocessed.len);
+    if (len == 0) return 0;
+  }
+  if (len != 0 || ctx->unprocessed.len == 0) {
+    ctx->data = data;
+    ctx->data_len = len;
+  } else {
+    ctx->data = ctx->unprocessed.buf;
+    ctx->data_len = ctx->unprocessed.len;
+  }
+  return updater_run(ctx);
+}
+
 int updater_process(struct update_context *ctx, const char *data, size_t len) {
   ctx->bytes_already_downloaded += len;
+  updater_stats_received(ctx, len);
   ctx->result = updater_process_int(ctx, data, len);
+  updater_stats_processed(ctx);
   if (ctx->result != 0) {
     updater_finish(ctx);
   }
@@ -644,6 +1347,16 @@ void updater_finish(struct update_context *ctx) {
   if (ctx->update_state == US_FINISHED) return;
   updater_set_status(ctx, US_FINISHED);
   const char *msg = (ctx->status_msg ? ctx->status_msg : "???");
+  struct updater_stats *st = ctx_stats(ctx);
+  st->result = ctx->result;
+  st->duration = mgos_uptime() - st->started;
+  LOG(LL_INFO,
+      ("%u bytes in %.2f s: recv %.2f crc %.2f write %.2f finalize %.2f, "
+       "%d stalls, peak heap %u, staging %u of %u",
+       (unsigned int) st->bytes, st->duration, st->recv_time, st->crc_time,
+       st->write_time, st->finalize_time, st->stalls,
+       (unsigned int) st->peak_heap, (unsigned int) st->peak_buffered,
+       (unsigned int) ctx->unprocessed.size));
   CALL_HOOK(LL_INFO, MGOS_UPD_EV_END, ctx, MGOS_OTA_STATE_DONE,
             "Finished: %d %s", ctx->result, msg);
   updater_process_int(ctx, NULL, 0);
@@ -654,10 +1367,20 @@ void updater_context_free(struct update_context *ctx) {
     LOG(LL_ERROR, ("Update terminated unexpectedly"));
   }
   if (ctx == s_ctx) s_ctx = NULL;
+  /* A context allocated at the same address is not to take its metrics. */
+  if (ctx_stats(ctx) != &s_stats_stale) {
+    s_stats_ctx[ctx_stats(ctx) - s_stats] = NULL;
+  }
   mgos_clear_timer(ctx->wdt);
   mgos_upd_hal_ctx_free(ctx->dev_ctx);
   mbuf_free(&ctx->unprocessed);
   free(ctx->manifest_data);
+  if (s_ctx == NULL) {
+    inflater_free(s_entry.inflater);
+    s_entry.inflater = NULL;
+    delta_free(s_entry.delta);
+    s_entry.delta = NULL;
+  }
   free(ctx);
 }
 
@@ -670,14 +1393,35 @@ void bin2hex(const uint8_t *src, int src_len, char *dst) {
   }
 }
 
-static bool file_copy(const char *old_path, const char *new_path,
-                      const char *name, char tmp_name[MG_MAX_PATH]) {
+/* Copy buffer; halved until it can be allocated. */
+#define MERGE_BUF_SIZE 4096
+#define MERGE_BUF_MIN_SIZE 256
+#define MERGE_WDT_FEED_SECONDS 0.5
+
+struct merge_ctx {
+  char *buf;
+  size_t buf_size;
+  double last_wdt_feed;
+  int num_copied, num_kept;
+  size_t bytes_copied;
+};
+
+/* Feeds the watchdog every so often, however long individual steps take. */
+static void merge_wdt_feed(struct merge_ctx *mc) {
+  double now = mgos_uptime();
+  if (now - mc->last_wdt_feed >= MERGE_WDT_FEED_SECONDS) {
+    mgos_wdt_feed();
+    mc->last_wdt_feed = now;
+  }
+}
+
+static bool file_copy(struct merge_ctx *mc, const char *old_path,
+                      const char *new_path, const char *name,
+                      char tmp_name[MG_MAX_PATH]) {
   bool ret = false;
   FILE *old_f = NULL, *new_f = NULL;
-  struct stat st;
-  int readen, to_read = 0, total = 0;
-
-  LOG(LL_INFO, ("Copying %s", name));
+  size_t n, total = 0;
+  double start = mgos_uptime();
 
   sprintf(tmp_name, "%s/%s", old_path, name);
   old_f = fopen(tmp_name, "r");
@@ -685,10 +1429,6 @@ static bool file_copy(const char *old_path, const char *new_path,
     LOG(LL_ERROR, ("Failed to open %s for reading", tmp_name));
     goto out;
   }
-  if (stat(tmp_name, &st) != 0) {
-    LOG(LL_ERROR, ("Cannot get previous %s size", tmp_name));
-    goto out;
-  }
 
   sprintf(tmp_name, "%s/%s", new_path, name);
   new_f = fopen(tmp_name, "w");
@@ -697,39 +1437,61 @@ static bool file_copy(const char *old_path, const char *new_path,
     goto out;
   }
 
-  char buf[128];
-  to_read = MIN(sizeof(buf), (size_t) st.st_size);
-  while (to_read != 0) {
-    if ((readen = fread(buf, 1, to_read, old_f)) < 0) {
-      LOG(LL_ERROR, ("Failed to read %d bytes from %s", to_read, name));
-      goto out;
-    }
+  /* Data goes through mc->buf, stdio buffers would only add a copy. */
+  setvbuf(old_f, NULL, _IONBF, 0);
+  setvbuf(new_f, NULL, _IONBF, 0);
 
-    if (fwrite(buf, 1, readen, new_f) != (size_t) readen) {
-      LOG(LL_ERROR, ("Failed to write %d bytes to %s", readen, name));
+  while ((n = fread(mc->buf, 1, mc->buf_size, old_f)) > 0) {
+    if (fwrite(mc->buf, 1, n, new_f) != n) {
+      LOG(LL_ERROR, ("Failed to write %d bytes to %s", (int) n, name));
       goto out;
     }
-
-    total += readen;
-    to_read = MIN(sizeof(buf), (size_t)(st.st_size - total));
+    total += n;
+    merge_wdt_feed(mc);
+  }
+  if (ferror(old_f)) {
+    LOG(LL_ERROR, ("Failed to read %s", name));
+    goto out;
   }
 
-  LOG(LL_DEBUG, ("Wrote %d to %s", total, tmp_name));
+  LOG(LL_INFO, ("Copied %s: %d bytes in %.3f s", name, (int) total,
+                mgos_uptime() - start));
+  mc->num_copied++;
+  mc->bytes_copied += total;
 
   ret = true;
 
 out:
   if (old_f != NULL) fclose(old_f);
   if (new_f != NULL) {
-    fclose(new_f);
+    if (fclose(new_f) != 0) ret = false;
     if (!ret) remove(tmp_name);
   }
   return ret;
 }
 
+/*
+ * Copies files of the old fs which the new one does not have. Files that
+ * come with the new fs win, so there is no need to look into them.
+ */
 bool mgos_upd_merge_fs(const char *old_fs_path, const char *new_fs_path) {
   bool ret = false;
-  DIR *dir = opendir(old_fs_path);
+  DIR *dir = NULL;
+  struct merge_ctx mc;
+  double start = mgos_uptime();
+  memset(&mc, 0, sizeof(mc));
+  mc.last_wdt_feed = start;
+
+  for (mc.buf_size = MERGE_BUF_SIZE; mc.buf_size >= MERGE_BUF_MIN_SIZE;
+       mc.buf_size /= 2) {
+    if ((mc.buf = (char *) malloc(mc.buf_size)) != NULL) break;
+  }
+  if (mc.buf == NULL) {
+    LOG(LL_ERROR, ("Out of memory"));
+    goto out;
+  }
+
+  dir = opendir(old_fs_path);
   if (dir == NULL) {
     LOG(LL_ERROR, ("Failed to open root directory"));
     goto out;
@@ -739,20 +1501,30 @@ bool mgos_upd_merge_fs(const char *old_fs_path, const char *new_fs_path) {
   while ((de = readdir(dir)) != NULL) {
     struct stat st;
     char tmp_name[MG_MAX_PATH];
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
     sprintf(tmp_name, "%s/%s", new_fs_path, de->d_name);
     if (stat(tmp_name, &st) != 0) {
       /* File not found on the new fs, copy. */
-      if (!file_copy(old_fs_path, new_fs_path, de->d_name, tmp_name)) {
+      if (!file_copy(&mc, old_fs_path, new_fs_path, de->d_name, tmp_name)) {
         LOG(LL_ERROR, ("Failed to copy %s", de->d_name));
         goto out;
       }
+    } else {
+      mc.num_kept++;
     }
-    mgos_wdt_feed();
+    merge_wdt_feed(&mc);
   }
   ret = true;
 
+  LOG(LL_INFO, ("FS merged in %.3f s: %d files (%d bytes) copied, %d kept",
+                mgos_uptime() - start, mc.num_copied, (int) mc.bytes_copied,
+                mc.num_kept));
+
 out:
   if (dir != NULL) closedir(dir);
+  free(mc.buf);
   return ret;
 }
 
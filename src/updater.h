@@ -0,0 +1,75 @@
+/*
+ * Additions of this app's updater to the API in mgos_updater_common.h.
+ */
+
+#ifndef SRC_UPDATER_H_
+#define SRC_UPDATER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mgos_updater_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Returns the archive offset from which data has to be sent to continue
+ * the update, e.g. with a Range request after the connection has dropped.
+ * Everything before it has been processed or is buffered in the context,
+ * so the context must be kept rather than freed for the update to resume.
+ */
+size_t updater_resume_offset(const struct update_context *ctx);
+
+/*
+ * Returns the number of archive bytes from updater_resume_offset() on that
+ * the updater is going to skip, e.g. a part that is already installed.
+ * A transport that can seek may drop them instead of downloading, and
+ * report so with updater_skip().
+ */
+size_t updater_skippable(const struct update_context *ctx);
+
+/* Marks `len` skippable bytes as received. Returns 0, or -1 on error. */
+int updater_skip(struct update_context *ctx, size_t len);
+
+/*
+ * Called when an update times out (update.timeout), once it is no longer
+ * the current one. A transport that has no ctx->nc to be closed for it
+ * has to stop feeding the update here; it may free the context.
+ */
+typedef void (*updater_abort_cb)(struct update_context *ctx, void *cb_arg);
+void updater_set_abort_cb(updater_abort_cb cb, void *cb_arg);
+
+/* Number of updates updater_get_stats() keeps metrics of. */
+#define UPDATER_STATS_HISTORY 4
+
+/* Times are in seconds, rates in bytes per second. */
+struct updater_stats {
+  double started;       /* mgos_uptime() at the start */
+  double duration;
+  int result;           /* 0 while in progress, else as updater_process() */
+  size_t bytes;         /* archive bytes received */
+  double recv_time;     /* waiting for data between updater_process() calls */
+  double crc_time;      /* CRC and SHA1 checks */
+  double write_time;    /* in the HAL, writing parts */
+  double finalize_time; /* in the HAL, finalizing the update */
+  double cur_rate;      /* over the last second or so */
+  double avg_rate;
+  int stalls;           /* data did not arrive for a second or more */
+  double longest_stall;
+  size_t peak_buffered; /* data carried over between calls */
+  size_t peak_heap;     /* drop of free heap since the start */
+};
+
+/*
+ * Fills `st` with metrics of the update `i` updates ago, 0 being the one
+ * in progress or the last one. Returns false if there is no such update.
+ */
+bool updater_get_stats(int i, struct updater_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_UPDATER_H_ */
@@ -0,0 +1,113 @@
+/*
+ * CRC-32 and SHA-1 throughput over 16 MB in network-sized (1460 byte) and
+ * flash-sized (4 KB) chunks:
+ *
+ *   cs_crc32     one bit at a time, what the updater used to call
+ *   crc32_le     byte-wise table, as in the ESP32 ROM (crc32.c there)
+ *   slice-by-8   crc32_update() as built for other platforms
+ *   cs_sha1      SHA-1 of the mocks, for scale; not the device's code
+ *
+ * Results are checked against each other on odd lengths and offsets first.
+ *
+ * Usage: bench_crc [MB]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common/cs_sha1.h"
+#include "mgos_timers.h"
+#include "rom/crc.h"
+
+#include "crc32.h"
+#include "mock.h"
+
+/* cs_crc32() of mongoose-os common/cs_crc32.c */
+static uint32_t cs_crc32(uint32_t crc32, const void *data, uint32_t len) {
+  const uint8_t *buf = (const uint8_t *) data;
+  int i;
+  crc32 = ~crc32;
+  while (len--) {
+    uint8_t b = *buf++;
+    for (i = 0; i < 8; i++) {
+      if ((crc32 ^ b) & 1) {
+        crc32 = (crc32 >> 1) ^ 0xedb88320;
+      } else {
+        crc32 >>= 1;
+      }
+      b >>= 1;
+    }
+  }
+  return ~crc32;
+}
+
+static uint32_t rom_crc32(uint32_t crc, const void *data, uint32_t len) {
+  return crc32_le(crc, (const uint8_t *) data, len);
+}
+
+static uint32_t slice8_crc32(uint32_t crc, const void *data, uint32_t len) {
+  return crc32_update(crc, data, len);
+}
+
+/* Keeps the results alive. */
+static uint32_t s_sink;
+
+static uint32_t sha1(uint32_t crc, const void *data, uint32_t len) {
+  static cs_sha1_ctx ctx;
+  if (crc == 0) cs_sha1_init(&ctx);
+  cs_sha1_update(&ctx, (const unsigned char *) data, len);
+  return 1;
+}
+
+struct algo {
+  const char *name;
+  uint32_t (*fn)(uint32_t crc, const void *data, uint32_t len);
+};
+
+static const struct algo s_algos[] = {
+    {"cs_crc32", cs_crc32},
+    {"crc32_le", rom_crc32},
+    {"slice-by-8", slice8_crc32},
+    {"cs_sha1", sha1},
+};
+
+int main(int argc, char **argv) {
+  size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 16) << 20, i, a, c;
+  static const size_t chunks[] = {1460, 4096};
+  uint8_t *buf = (uint8_t *) malloc(size + 64);
+  uint32_t x = 1;
+  if (buf == NULL) return 1;
+  for (i = 0; i < size + 64; i++) {
+    x = x * 1103515245 + 12345;
+    buf[i] = (uint8_t)(x >> 16);
+  }
+  mock_init();
+
+  for (i = 0; i < 2000; i++) {
+    size_t off = i % 61, len = (i * 7919) % 5000;
+    uint32_t want = cs_crc32((uint32_t) i, buf + off, len);
+    if (rom_crc32((uint32_t) i, buf + off, len) != want ||
+        slice8_crc32((uint32_t) i, buf + off, len) != want) {
+      fprintf(stderr, "CRC mismatch at %d+%d\n", (int) off, (int) len);
+      return 1;
+    }
+  }
+
+  printf("%-12s %8s %10s\n", "", "chunk", "MB/s");
+  for (a = 0; a < sizeof(s_algos) / sizeof(s_algos[0]); a++) {
+    for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+      double start = mgos_uptime();
+      uint32_t crc = 0;
+      size_t off;
+      for (off = 0; off < size; off += chunks[c]) {
+        size_t n = (size - off < chunks[c] ? size - off : chunks[c]);
+        crc = s_algos[a].fn(crc, buf + off, (uint32_t) n);
+      }
+      s_sink += crc;
+      printf("%-12s %8d %10.1f\n", s_algos[a].name, (int) chunks[c],
+             size / (mgos_uptime() - start) / 1e6);
+    }
+  }
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Latency of a batch of small downloads with Fetch: N files of up to 5 KB
+ * asked for at once, each to a file, over the simulated network of
+ * mock_net.c. Reports, on the virtual clock, the time until the last of
+ * them has been replied to and the mean time a file takes, for a server
+ * that closes the connection after every reply - a connection per file -
+ * and for one that keeps it open, without and with pipelining.
+ *
+ * Usage: bench_fetch [rtt ms] [handshake ms] [KB/s]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fetch.h"
+#include "profile.h"
+
+#include "mock.h"
+
+#define MAX_FILES 64
+#define MAX_FILE_SIZE 5120
+
+static double s_replied[MAX_FILES];
+static int s_errors;
+static int64_t s_first_id, s_calls;
+
+static void on_reply(int64_t id, int error_code, const char *reply) {
+  if (id - s_first_id < 0 || id - s_first_id >= MAX_FILES) return;
+  s_replied[id - s_first_id] = mgos_uptime();
+  if (error_code != 0) {
+    fprintf(stderr, "request %d: %d %s\n", (int) (id - s_first_id),
+            error_code, reply);
+    s_errors++;
+  }
+}
+
+/* Runs one batch. Returns the time until the last reply, < 0 on error. */
+static double run_batch(int n, double *mean) {
+  char args[200];
+  double start, last = 0, sum = 0;
+  int i;
+  /* Ids go up by one per call, see mock_rpc_call(). */
+  s_first_id = s_calls + 1;
+  s_calls += n;
+  s_errors = 0;
+  start = mgos_uptime();
+  for (i = 0; i < n; i++) {
+    snprintf(args, sizeof(args),
+             "{\"url\": \"http://files.local/f%d\", "
+             "\"file\": \"bench_fetch_%d.bin\"}",
+             i, i);
+    s_replied[i] = -1;
+    if (mock_rpc_call("Fetch", args, NULL) != NULL) return -1;
+  }
+  if (!mock_net_run(600)) return -1;
+  for (i = 0; i < n; i++) {
+    char name[50];
+    if (s_replied[i] < 0) return -1;
+    if (s_replied[i] - start > last) last = s_replied[i] - start;
+    sum += s_replied[i] - start;
+    snprintf(name, sizeof(name), "bench_fetch_%d.bin", i);
+    remove(name);
+  }
+  *mean = sum / n;
+  return (s_errors == 0 ? last : -1);
+}
+
+int main(int argc, char **argv) {
+  static const int batches[] = {10, 30};
+  static const struct {
+    const char *name;
+    bool close;
+    int max_conns;
+    int pipeline;
+  } modes[] = {
+      {"conn per file", true, 4, 1},
+      {"keep-alive", false, 4, 1},
+      {"keep-alive+pipe", false, 4, 4},
+      {"1 conn, pipe", false, 1, 4},
+  };
+  double rtt = (argc > 1 ? atof(argv[1]) : 50) / 1000;
+  double handshake = (argc > 2 ? atof(argv[2]) : 150) / 1000;
+  double bandwidth = (argc > 3 ? atof(argv[3]) : 300) * 1024;
+  size_t b, m;
+  int i;
+  char data[MAX_FILE_SIZE];
+
+  mock_init();
+  mock_clock_set(0);
+  /* The index is not written, the entries stay in RAM. */
+  mock_cfg.fetch_cache_index = "";
+  mock_rpc_on_reply = on_reply;
+  prof_init();
+  fetch_init();
+  srand(11);
+  for (i = 0; i < MAX_FILE_SIZE; i++) data[i] = (char) rand();
+
+  printf("rtt %.0f ms, handshake %.0f ms, %.0f KB/s\n", rtt * 1000,
+         handshake * 1000, bandwidth / 1024);
+  printf("%-16s %5s %10s %10s %8s %6s\n", "", "files", "last (s)", "mean (s)",
+         "KB", "conns");
+  for (b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+      double last, mean = 0;
+      size_t bytes = 0;
+      char path[20];
+      mock_net_reset();
+      mock_net.rtt = rtt;
+      mock_net.handshake = handshake;
+      mock_net.bandwidth = bandwidth;
+      mock_net.close = modes[m].close;
+      mock_cfg.fetch_max_conns = modes[m].max_conns;
+      mock_cfg.fetch_pipeline = modes[m].pipeline;
+      srand(7);
+      for (i = 0; i < batches[b]; i++) {
+        size_t len = (size_t) rand() % (MAX_FILE_SIZE + 1);
+        snprintf(path, sizeof(path), "/f%d", i);
+        mock_net_add_file(path, data, len, NULL);
+        bytes += len;
+      }
+      last = run_batch(batches[b], &mean);
+      if (last < 0) {
+        fprintf(stderr, "%s, %d files: failed\n", modes[m].name, batches[b]);
+        return 1;
+      }
+      printf("%-16s %5d %10.3f %10.3f %8.1f %6d\n", modes[m].name, batches[b],
+             last, mean, bytes / 1024.0, mock_net.connects);
+      /* Idle connections go before the next batch. */
+      mock_clock_advance(mock_cfg.fetch_idle_timeout + 1);
+      mock_net_poll();
+      mock_net_run(10);
+    }
+  }
+  return 0;
+}
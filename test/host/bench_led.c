@@ -0,0 +1,90 @@
+/*
+ * Pixel throughput of the LED engine: frames of a transition rendered to a
+ * strip and a PWM fixture, pixels set one by one and flushed, and frames
+ * that change nothing. The frame timer runs on the virtual clock, the time
+ * taken is real CPU time.
+ *
+ * Usage: bench_led [strip pixels] [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "led.h"
+#include "profile.h"
+
+#include "mock.h"
+
+static double cpu_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, int frames, unsigned long shows,
+                   double t) {
+  printf("%-16s %8d %8lu %10.2f %8.1f\n", what, frames, shows,
+         t / frames * 1e6, mock_led.pixels_shown / t / 1e6);
+}
+
+int main(int argc, char **argv) {
+  int num_pixels = (argc > 1 ? atoi(argv[1]) : 300);
+  int frames = (argc > 2 ? atoi(argv[2]) : 20000);
+  double frame = 1.0 / mock_cfg.led_fps, start, t;
+  const char *stats;
+  int i, k;
+  mock_init();
+  mock_clock_set(0);
+  prof_init();
+  led_init();
+  led_setup(4, 15, 5, 19, 200);
+  if (!led_add_strip(18, num_pixels)) return 1;
+  printf("%d pixel strip and a PWM fixture, led.curve %s\n", num_pixels,
+         mock_cfg.led_curve);
+  printf("%-16s %8s %8s %10s %8s\n", "", "frames", "shows", "us/frame",
+         "Mpx/s");
+
+  /* An endless fade back and forth, a frame per timer tick. */
+  led_play(
+      "{keys: [{r: 255, g: 120, b: 0, w: 30, ms: 1000}, "
+      "{r: 0, g: 20, b: 255, w: 0, ms: 1000}], repeat: 0}");
+  memset(&mock_led, 0, sizeof(mock_led));
+  start = cpu_time();
+  for (k = 0; k < frames; k++) mock_clock_advance(frame);
+  t = cpu_time() - start;
+  report("engine", frames, mock_led.shows, t);
+  led_stop();
+
+  /* A moving gradient, pixel by pixel, then a flush. */
+  memset(&mock_led, 0, sizeof(mock_led));
+  start = cpu_time();
+  for (k = 0; k < frames; k++) {
+    for (i = 0; i < num_pixels; i++) {
+      led_set_pixel(1, i, (i * 255 / num_pixels + k) & 255, k & 255,
+                    255 - i * 255 / num_pixels, 0);
+    }
+    led_flush();
+  }
+  t = cpu_time() - start;
+  report("set_pixel+flush", frames, mock_led.shows, t);
+
+  /* The same colour again and again: nothing goes to the outputs. */
+  led_write(10, 10, 10, 10, 0);
+  memset(&mock_led, 0, sizeof(mock_led));
+  start = cpu_time();
+  for (k = 0; k < frames; k++) led_write(10, 10, 10, 10, 0);
+  t = cpu_time() - start;
+  printf("%-16s %8d %8lu %10.2f %8s  pwm writes %lu\n", "unchanged", frames,
+         mock_led.shows, t / frames * 1e6, "-", mock_led.pwm_writes);
+  if (mock_led.shows != 0 || mock_led.pwm_writes != 0) {
+    fprintf(stderr, "unchanged frames were sent to the outputs\n");
+    return 1;
+  }
+
+  if ((stats = mock_rpc_call("LED.Stats", NULL, NULL)) != NULL) {
+    printf("LED.Stats: %s\n", stats);
+  }
+  return 0;
+}
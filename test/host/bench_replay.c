@@ -0,0 +1,106 @@
+/*
+ * Replays the fixture archives through the updater at a range of chunk sizes
+ * and reports throughput, heap allocations and peak heap use per update.
+ * The HAL only hashes what it is given, so the figures are the updater's
+ * own: zip parsing, inflating, CRC and staging.
+ *
+ * Usage: bench_replay <fixtures dir> [runs]
+ */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos_updater_common.h"
+
+#include "mock.h"
+#include "replay.h"
+
+/* Allocation accounting, see -Wl,--wrap in the Makefile. */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+static size_t s_allocs, s_live, s_peak;
+
+static void account(void *p) {
+  if (p == NULL) return;
+  s_allocs++;
+  s_live += malloc_usable_size(p);
+  if (s_live > s_peak) s_peak = s_live;
+}
+
+void *__wrap_malloc(size_t size) {
+  void *p = __real_malloc(size);
+  account(p);
+  return p;
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  void *p = __real_calloc(n, size);
+  account(p);
+  return p;
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  size_t old = (p != NULL ? malloc_usable_size(p) : 0);
+  void *np = __real_realloc(p, size);
+  if (np != NULL || size == 0) s_live -= old;
+  account(np);
+  return np;
+}
+
+void __wrap_free(void *p) {
+  if (p != NULL) s_live -= malloc_usable_size(p);
+  __real_free(p);
+}
+
+int main(int argc, char **argv) {
+  static const char *archives[] = {"fw_stored.zip", "fw_deflate.zip",
+                                   "fw_descriptor.zip"};
+  static const size_t chunks[] = {256, 1460, 4096, 16384, 65536};
+  int runs = (argc > 2 ? atoi(argv[2]) : 5);
+  size_t i, j;
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <fixtures dir> [runs]\n", argv[0]);
+    return 2;
+  }
+  mock_init();
+  mock_upd_reset();
+  printf("%-18s %6s %8s %8s %10s\n", "archive", "chunk", "MB/s", "allocs",
+         "peak heap");
+  for (i = 0; i < sizeof(archives) / sizeof(archives[0]); i++) {
+    char path[256], msg[100];
+    size_t len;
+    char *data;
+    snprintf(path, sizeof(path), "%s/%s", argv[1], archives[i]);
+    if ((data = mock_read_file(path, &len)) == NULL) {
+      fprintf(stderr, "cannot read %s\n", path);
+      return 1;
+    }
+    for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+      double best = 0;
+      size_t allocs = 0, peak = 0;
+      int r;
+      for (r = 0; r < runs; r++) {
+        size_t base = s_live, allocs0 = s_allocs;
+        double start = mgos_uptime(), t;
+        s_peak = s_live;
+        if (replay_fixed(data, len, chunks[j], msg, sizeof(msg)) != 1) {
+          fprintf(stderr, "%s: %s\n", archives[i], msg);
+          return 1;
+        }
+        t = mgos_uptime() - start;
+        if (best == 0 || t < best) best = t;
+        allocs = s_allocs - allocs0;
+        peak = s_peak - base;
+      }
+      printf("%-18s %6d %8.1f %8d %10d\n", archives[i], (int) chunks[j],
+             len / best / 1e6, (int) allocs, (int) peak);
+    }
+    free(data);
+  }
+  return 0;
+}
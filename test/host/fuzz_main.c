@@ -0,0 +1,126 @@
+/*
+ * Driver for fuzz_updater.c without libFuzzer.
+ *
+ *   fuzz_updater file...              runs each file once (AFL: @@)
+ *   fuzz_updater -n N [-s S] file...  runs N random mutations of the files
+ *
+ * A mutated input that crashes is saved to crash-<run>.zip.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock.h"
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* Set if built with a sanitizer. */
+void __sanitizer_set_death_callback(void (*callback)(void))
+    __attribute__((weak));
+
+#define MAX_INPUT (256 * 1024)
+
+static uint8_t s_buf[MAX_INPUT];
+static size_t s_len;
+static int s_run;
+static uint32_t s_rand = 1;
+
+static uint32_t rnd(uint32_t n) {
+  s_rand ^= s_rand << 13;
+  s_rand ^= s_rand >> 17;
+  s_rand ^= s_rand << 5;
+  return (n == 0 ? 0 : s_rand % n);
+}
+
+static void save_input(void) {
+  char name[32];
+  FILE *fp;
+  snprintf(name, sizeof(name), "crash-%d.zip", s_run);
+  if ((fp = fopen(name, "wb")) != NULL) {
+    fwrite(s_buf, 1, s_len, fp);
+    fclose(fp);
+    fprintf(stderr, "input saved to %s\n", name);
+  }
+}
+
+static void mutate(void) {
+  int i, n = 1 + rnd(8);
+  for (i = 0; i < n && s_len > 0; i++) {
+    uint32_t pos = rnd(s_len), k;
+    switch (rnd(6)) {
+      case 0: /* Flip a bit */
+        s_buf[pos] ^= (uint8_t)(1 << rnd(8));
+        break;
+      case 1: { /* An interesting byte, often in a header or the manifest */
+        static const uint8_t vals[] = {0, 1, 0x7f, 0x80, 0xff, '"',
+                                       '{', '}', '[', ':', ',', '\\'};
+        if (rnd(2)) pos = rnd(s_len < 2048 ? s_len : 2048);
+        s_buf[pos] = vals[rnd(sizeof(vals))];
+        break;
+      }
+      case 2: /* Delete a range */
+        k = rnd(s_len - pos < 64 ? s_len - pos : 64);
+        memmove(s_buf + pos, s_buf + pos + k, s_len - pos - k);
+        s_len -= k;
+        break;
+      case 3: /* Duplicate a range */
+        k = rnd(64);
+        if (s_len + k > MAX_INPUT || pos + k > s_len) break;
+        memmove(s_buf + pos + k, s_buf + pos, s_len - pos);
+        s_len += k;
+        break;
+      case 4: /* Truncate */
+        s_len = pos;
+        break;
+      default: /* A 32-bit field: a size, offset or CRC */
+        if (pos + 4 > s_len) break;
+        k = (rnd(2) ? rnd(0xffffffffu) : rnd(4096));
+        memcpy(s_buf + pos, &k, 4);
+        break;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  long runs = 0;
+  int i = 1, nfiles;
+  while (i + 1 < argc && argv[i][0] == '-') {
+    if (strcmp(argv[i], "-n") == 0) {
+      runs = atol(argv[i + 1]);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      s_rand = (uint32_t) strtoul(argv[i + 1], NULL, 0);
+    } else {
+      break;
+    }
+    i += 2;
+  }
+  if (i >= argc) {
+    fprintf(stderr, "usage: %s [-n runs] [-s seed] file...\n", argv[0]);
+    return 2;
+  }
+  argv += i;
+  nfiles = argc - i;
+  LLVMFuzzerInitialize(&argc, &argv);
+  if (__sanitizer_set_death_callback != NULL) {
+    __sanitizer_set_death_callback(save_input);
+  }
+  for (s_run = 0; s_run < (runs > 0 ? runs : nfiles); s_run++) {
+    const char *file = argv[runs > 0 ? (int) rnd(nfiles) : s_run];
+    size_t len;
+    char *data = mock_read_file(file, &len);
+    if (data == NULL) {
+      fprintf(stderr, "cannot read %s\n", file);
+      return 1;
+    }
+    s_len = (len < MAX_INPUT ? len : MAX_INPUT);
+    memcpy(s_buf, data, s_len);
+    free(data);
+    if (runs > 0) mutate();
+    LLVMFuzzerTestOneInput(s_buf, s_len);
+  }
+  printf("%d inputs OK\n", s_run);
+  return 0;
+}
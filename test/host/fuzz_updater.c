@@ -0,0 +1,39 @@
+/*
+ * Fuzz target for the zip and manifest parsing in the updater: the input is
+ * fed to updater_process() in chunks of varying size, then finalized as the
+ * Fetch OTA path would. Build with -fsanitize=fuzzer for libFuzzer (make
+ * fuzz) or with fuzz_main.c for AFL and plain runs (make check).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mock.h"
+#include "replay.h"
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* Chunk sizes from 1 to 2 KB, the same for the same input. */
+static size_t next_chunk(void *arg) {
+  uint32_t *x = (uint32_t *) arg;
+  *x ^= *x << 13;
+  *x ^= *x >> 17;
+  *x ^= *x << 5;
+  return 1 + (*x % 2048);
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  (void) argc;
+  (void) argv;
+  mock_init();
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  uint32_t seed = 2463534242u ^ (uint32_t) size;
+  char msg[100];
+  mock_upd_reset();
+  replay((const char *) data, size, next_chunk, &seed, msg, sizeof(msg));
+  return 0;
+}
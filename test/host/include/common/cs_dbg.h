@@ -0,0 +1,27 @@
+#ifndef TEST_HOST_COMMON_CS_DBG_H_
+#define TEST_HOST_COMMON_CS_DBG_H_
+
+enum cs_log_level {
+  LL_NONE = -1,
+  LL_ERROR = 0,
+  LL_WARN = 1,
+  LL_INFO = 2,
+  LL_DEBUG = 3,
+  LL_VERBOSE_DEBUG = 4,
+};
+
+/* Messages up to this level go to stderr; mock_init() reads $LOG_LEVEL. */
+extern enum cs_log_level cs_log_level;
+
+int cs_log_print_prefix(enum cs_log_level level, const char *func);
+void cs_log_printf(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+#define LOG(l, x)                            \
+  do {                                       \
+    if (cs_log_print_prefix(l, __func__)) { \
+      cs_log_printf x;                       \
+    }                                        \
+  } while (0)
+
+#endif /* TEST_HOST_COMMON_CS_DBG_H_ */
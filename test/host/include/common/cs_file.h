@@ -0,0 +1,8 @@
+#ifndef TEST_HOST_COMMON_CS_FILE_H_
+#define TEST_HOST_COMMON_CS_FILE_H_
+
+#include <stddef.h>
+
+char *cs_read_file(const char *path, size_t *size);
+
+#endif /* TEST_HOST_COMMON_CS_FILE_H_ */
@@ -0,0 +1,17 @@
+#ifndef TEST_HOST_COMMON_CS_SHA1_H_
+#define TEST_HOST_COMMON_CS_SHA1_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  uint32_t state[5];
+  uint32_t count[2];
+  unsigned char buffer[64];
+} cs_sha1_ctx;
+
+void cs_sha1_init(cs_sha1_ctx *ctx);
+void cs_sha1_update(cs_sha1_ctx *ctx, const unsigned char *data, uint32_t len);
+void cs_sha1_final(unsigned char digest[20], cs_sha1_ctx *ctx);
+
+#endif /* TEST_HOST_COMMON_CS_SHA1_H_ */
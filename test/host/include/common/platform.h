@@ -0,0 +1,18 @@
+/*
+ * Host stand-ins for the Mongoose OS SDK headers, just enough of them for the
+ * sources under src/ to build and run on Linux. See test/host/README.md.
+ */
+
+#ifndef TEST_HOST_COMMON_PLATFORM_H_
+#define TEST_HOST_COMMON_PLATFORM_H_
+
+#define CS_P_CUSTOM 0
+#define CS_P_UNIX 1
+#define CS_P_ESP32 15
+
+/* The Makefile picks the platform; the updater is built as ESP32. */
+#ifndef CS_PLATFORM
+#define CS_PLATFORM CS_P_UNIX
+#endif
+
+#endif /* TEST_HOST_COMMON_PLATFORM_H_ */
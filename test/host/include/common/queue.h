@@ -0,0 +1,21 @@
+#ifndef TEST_HOST_COMMON_QUEUE_H_
+#define TEST_HOST_COMMON_QUEUE_H_
+
+/* glibc has the BSD lists, all but the _SAFE iterators. */
+#include <sys/queue.h>
+
+#ifndef SLIST_FOREACH_SAFE
+#define SLIST_FOREACH_SAFE(var, head, field, tvar)        \
+  for ((var) = SLIST_FIRST((head));                       \
+       (var) && ((tvar) = SLIST_NEXT((var), field), 1); \
+       (var) = (tvar))
+#endif
+
+#ifndef STAILQ_FOREACH_SAFE
+#define STAILQ_FOREACH_SAFE(var, head, field, tvar)        \
+  for ((var) = STAILQ_FIRST((head));                       \
+       (var) && ((tvar) = STAILQ_NEXT((var), field), 1); \
+       (var) = (tvar))
+#endif
+
+#endif /* TEST_HOST_COMMON_QUEUE_H_ */
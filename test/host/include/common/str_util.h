@@ -0,0 +1,8 @@
+#ifndef TEST_HOST_COMMON_STR_UTIL_H_
+#define TEST_HOST_COMMON_STR_UTIL_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#endif /* TEST_HOST_COMMON_STR_UTIL_H_ */
@@ -0,0 +1,9 @@
+#ifndef TEST_HOST_ESP_OTA_OPS_H_
+#define TEST_HOST_ESP_OTA_OPS_H_
+
+#include "esp_partition.h"
+
+/* The running app slot, backed by mock_upd.running_app. */
+const esp_partition_t *esp_ota_get_running_partition(void);
+
+#endif /* TEST_HOST_ESP_OTA_OPS_H_ */
@@ -0,0 +1,22 @@
+#ifndef TEST_HOST_ESP_PARTITION_H_
+#define TEST_HOST_ESP_PARTITION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_INVALID_SIZE 0x104
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+                             size_t src_offset, void *dst, size_t size);
+
+#endif /* TEST_HOST_ESP_PARTITION_H_ */
@@ -0,0 +1,9 @@
+#ifndef TEST_HOST_ESP_SPI_FLASH_H_
+#define TEST_HOST_ESP_SPI_FLASH_H_
+
+#include "esp_partition.h"
+
+/* Reads mock_upd.flash; past its end the flash reads as erased. */
+esp_err_t spi_flash_read(size_t src_addr, void *dest, size_t size);
+
+#endif /* TEST_HOST_ESP_SPI_FLASH_H_ */
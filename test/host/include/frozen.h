@@ -0,0 +1,75 @@
+#ifndef TEST_HOST_FROZEN_H_
+#define TEST_HOST_FROZEN_H_
+
+#include <stdarg.h>
+#include <stdio.h>
+
+enum json_token_type {
+  JSON_TYPE_INVALID = 0,
+  JSON_TYPE_STRING,
+  JSON_TYPE_NUMBER,
+  JSON_TYPE_TRUE,
+  JSON_TYPE_FALSE,
+  JSON_TYPE_NULL,
+  JSON_TYPE_OBJECT_START,
+  JSON_TYPE_OBJECT_END,
+  JSON_TYPE_ARRAY_START,
+  JSON_TYPE_ARRAY_END,
+  JSON_TYPES_CNT,
+};
+
+struct json_token {
+  const char *ptr;
+  int len;
+  enum json_token_type type;
+};
+
+#define JSON_INVALID_TOKEN \
+  { 0, 0, JSON_TYPE_INVALID }
+
+#define JSON_STRING_INVALID -1
+#define JSON_STRING_INCOMPLETE -2
+
+typedef void (*json_walk_callback_t)(void *callback_data, const char *name,
+                                     size_t name_len, const char *path,
+                                     const struct json_token *token);
+
+int json_walk(const char *json_string, int json_string_length,
+              json_walk_callback_t callback, void *callback_data);
+
+struct json_out {
+  int (*printer)(struct json_out *, const char *str, size_t len);
+  union {
+    struct {
+      char *buf;
+      size_t size;
+      size_t len;
+    } buf;
+    void *data;
+    FILE *fp;
+  } u;
+};
+
+int json_printer_buf(struct json_out *, const char *, size_t);
+
+#define JSON_OUT_BUF(buf, len) \
+  {                            \
+    json_printer_buf, {        \
+      { buf, len, 0 }          \
+    }                          \
+  }
+
+typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
+
+int json_printf(struct json_out *, const char *fmt, ...);
+int json_vprintf(struct json_out *, const char *fmt, va_list ap);
+int json_fprintf(const char *file_name, const char *fmt, ...);
+
+int json_scanf(const char *str, int str_len, const char *fmt, ...);
+int json_vscanf(const char *str, int str_len, const char *fmt, va_list ap);
+int json_scanf_array_elem(const char *s, int len, const char *path, int index,
+                          struct json_token *token);
+
+char *json_fread(const char *file_name);
+
+#endif /* TEST_HOST_FROZEN_H_ */
@@ -0,0 +1,29 @@
+#ifndef TEST_HOST_MGOS_H_
+#define TEST_HOST_MGOS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/cs_dbg.h"
+#include "frozen.h"
+#include "mgos_event.h"
+#include "mgos_hal.h"
+#include "mgos_sys_config.h"
+#include "mgos_timers.h"
+#include "mongoose.h"
+
+enum mgos_app_init_result {
+  MGOS_APP_INIT_SUCCESS = 0,
+  MGOS_APP_INIT_ERROR = -2,
+};
+
+struct mg_mgr *mgos_get_mgr(void);
+
+typedef void (*mgos_uart_dispatcher_t)(int uart_no, void *arg);
+size_t mgos_uart_write(int uart_no, const void *buf, size_t len);
+size_t mgos_uart_write_avail(int uart_no);
+void mgos_uart_set_dispatcher(int uart_no, mgos_uart_dispatcher_t cb,
+                              void *arg);
+
+#endif /* TEST_HOST_MGOS_H_ */
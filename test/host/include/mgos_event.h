@@ -0,0 +1,11 @@
+#ifndef TEST_HOST_MGOS_EVENT_H_
+#define TEST_HOST_MGOS_EVENT_H_
+
+#include <stdbool.h>
+
+#define MGOS_EVENT_BASE(a, b, c) ((a) << 24 | (b) << 16 | (c) << 8)
+#define MGOS_EVENT_SYS MGOS_EVENT_BASE('M', 'O', 'S')
+
+int mgos_event_trigger(int ev, void *ev_data);
+
+#endif /* TEST_HOST_MGOS_EVENT_H_ */
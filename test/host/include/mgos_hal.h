@@ -0,0 +1,14 @@
+#ifndef TEST_HOST_MGOS_HAL_H_
+#define TEST_HOST_MGOS_HAL_H_
+
+#include <stddef.h>
+
+#include "mgos_timers.h"
+
+size_t mgos_get_heap_size(void);
+size_t mgos_get_free_heap_size(void);
+size_t mgos_get_min_free_heap_size(void);
+void mgos_wdt_feed(void);
+void mgos_system_restart(void);
+
+#endif /* TEST_HOST_MGOS_HAL_H_ */
@@ -0,0 +1,19 @@
+#ifndef TEST_HOST_MGOS_NEOPIXEL_H_
+#define TEST_HOST_MGOS_NEOPIXEL_H_
+
+enum mgos_neopixel_order {
+  MGOS_NEOPIXEL_ORDER_RGB,
+  MGOS_NEOPIXEL_ORDER_GRB,
+  MGOS_NEOPIXEL_ORDER_BGR,
+};
+
+struct mgos_neopixel;
+
+struct mgos_neopixel *mgos_neopixel_create(int pin, int num_pixels,
+                                           enum mgos_neopixel_order order);
+void mgos_neopixel_set(struct mgos_neopixel *np, int i, int r, int g, int b);
+void mgos_neopixel_clear(struct mgos_neopixel *np);
+void mgos_neopixel_show(struct mgos_neopixel *np);
+void mgos_neopixel_free(struct mgos_neopixel *np);
+
+#endif /* TEST_HOST_MGOS_NEOPIXEL_H_ */
@@ -0,0 +1,8 @@
+#ifndef TEST_HOST_MGOS_PWM_H_
+#define TEST_HOST_MGOS_PWM_H_
+
+#include <stdbool.h>
+
+bool mgos_pwm_set(int pin, int freq, float duty);
+
+#endif /* TEST_HOST_MGOS_PWM_H_ */
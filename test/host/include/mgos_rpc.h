@@ -0,0 +1,32 @@
+#ifndef TEST_HOST_MGOS_RPC_H_
+#define TEST_HOST_MGOS_RPC_H_
+
+#include "mgos.h"
+
+struct mg_rpc;
+struct mg_rpc_frame_info;
+
+struct mg_rpc_request_info {
+  struct mg_rpc *rpc;
+  int64_t id;
+  struct mg_str method;
+  const char *args_fmt;
+  void *user_data;
+};
+
+typedef void (*mg_handler_cb_t)(struct mg_rpc_request_info *ri, void *cb_arg,
+                                struct mg_rpc_frame_info *fi,
+                                struct mg_str args);
+
+struct mg_rpc *mgos_rpc_get_global(void);
+void mg_rpc_add_handler(struct mg_rpc *c, const char *method,
+                        const char *args_fmt, mg_handler_cb_t cb,
+                        void *cb_arg);
+/* Both free ri, as the real ones do. */
+bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri,
+                           const char *result_json_fmt, ...);
+bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code,
+                        const char *error_msg_fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif /* TEST_HOST_MGOS_RPC_H_ */
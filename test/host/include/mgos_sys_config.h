@@ -0,0 +1,17 @@
+#ifndef TEST_HOST_MGOS_SYS_CONFIG_H_
+#define TEST_HOST_MGOS_SYS_CONFIG_H_
+
+/* Getters read mock_cfg, see mock.h; defaults follow mos.yml. */
+int mgos_sys_config_get_update_timeout(void);
+int mgos_sys_config_get_fetch_max_conns(void);
+int mgos_sys_config_get_fetch_pipeline(void);
+int mgos_sys_config_get_fetch_idle_timeout(void);
+int mgos_sys_config_get_fetch_write_buf_budget(void);
+int mgos_sys_config_get_fetch_min_free_heap(void);
+int mgos_sys_config_get_fetch_gzip_decoders(void);
+const char *mgos_sys_config_get_fetch_cache_index(void);
+int mgos_sys_config_get_led_fps(void);
+const char *mgos_sys_config_get_led_curve(void);
+int mgos_sys_config_get_profile_lag_interval(void);
+
+#endif /* TEST_HOST_MGOS_SYS_CONFIG_H_ */
@@ -0,0 +1,17 @@
+#ifndef TEST_HOST_MGOS_TIMERS_H_
+#define TEST_HOST_MGOS_TIMERS_H_
+
+#include <stdint.h>
+
+typedef uintptr_t mgos_timer_id;
+typedef void (*timer_callback)(void *param);
+
+#define MGOS_INVALID_TIMER_ID 0
+#define MGOS_TIMER_REPEAT 1
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb,
+                             void *cb_arg);
+void mgos_clear_timer(mgos_timer_id id);
+double mgos_uptime(void);
+
+#endif /* TEST_HOST_MGOS_TIMERS_H_ */
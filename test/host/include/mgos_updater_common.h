@@ -0,0 +1,131 @@
+#ifndef TEST_HOST_MGOS_UPDATER_COMMON_H_
+#define TEST_HOST_MGOS_UPDATER_COMMON_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frozen.h"
+#include "mgos_event.h"
+#include "mgos_timers.h"
+#include "mongoose.h"
+
+struct mgos_upd_file_info {
+  char name[50];
+  uint32_t size;
+  uint32_t processed;
+};
+
+struct mgos_upd_info {
+  struct json_token name;
+  struct json_token platform;
+  struct json_token version;
+  struct json_token build_id;
+  struct json_token parts;
+  struct mgos_upd_file_info current_file;
+};
+
+struct update_file_context {
+  int commit_timeout;
+};
+
+struct update_context;
+struct mgos_upd_hal_ctx;
+typedef void (*updater_result_cb)(struct update_context *ctx);
+
+struct update_context {
+  int update_state;
+  const char *status_msg;
+
+  const char *data;
+  size_t data_len;
+  struct mbuf unprocessed;
+
+  struct mgos_upd_info info;
+
+  uint32_t current_file_crc;
+  uint32_t current_file_crc_calc;
+  bool current_file_has_descriptor;
+
+  int need_reboot;
+  int result;
+  updater_result_cb result_cb;
+
+  char *manifest_data;
+  struct update_file_context fctx;
+  struct mgos_upd_hal_ctx *dev_ctx;
+
+  mgos_timer_id wdt;
+
+  size_t bytes_already_downloaded;
+  size_t last_reported_bytes;
+  double last_reported_time;
+  size_t zip_file_size;
+
+  bool ignore_same_version;
+  struct mg_connection *nc;
+};
+
+enum mgos_upd_event {
+  MGOS_UPD_EV_INIT = 0,
+  MGOS_UPD_EV_BEGIN = 1,
+  MGOS_UPD_EV_PROGRESS = 2,
+  MGOS_UPD_EV_END = 3,
+  MGOS_UPD_EV_ERROR = 4,
+  MGOS_UPD_EV_COMMIT = 5,
+  MGOS_UPD_EV_ROLLBACK = 6,
+};
+
+typedef void (*mgos_upd_event_cb)(enum mgos_upd_event ev, const void *ev_arg,
+                                  void *cb_arg);
+
+enum mgos_ota_state {
+  MGOS_OTA_STATE_NONE = 0,
+  MGOS_OTA_STATE_INIT,
+  MGOS_OTA_STATE_BEGIN,
+  MGOS_OTA_STATE_PROGRESS,
+  MGOS_OTA_STATE_FINALIZING,
+  MGOS_OTA_STATE_DONE,
+  MGOS_OTA_STATE_ERROR,
+  MGOS_OTA_STATE_COMMIT,
+  MGOS_OTA_STATE_ROLLBACK,
+};
+
+struct mgos_ota_status {
+  bool is_committed;
+  int commit_timeout;
+  int partition;
+  enum mgos_ota_state state;
+  const char *msg;
+  int progress_percent;
+};
+
+#define MGOS_EVENT_OTA_STATUS (MGOS_EVENT_SYS + 21)
+
+struct update_context *updater_context_create(int timeout);
+struct update_context *updater_context_get_current(void);
+int updater_process(struct update_context *ctx, const char *data, size_t len);
+int updater_finalize(struct update_context *ctx);
+int is_write_finished(struct update_context *ctx);
+int is_update_finished(struct update_context *ctx);
+int is_reboot_required(struct update_context *ctx);
+void updater_finish(struct update_context *ctx);
+void updater_context_free(struct update_context *ctx);
+void bin2hex(const uint8_t *src, int src_len, char *dst);
+
+bool mgos_upd_commit(void);
+bool mgos_upd_is_committed(void);
+bool mgos_upd_revert(bool reboot);
+int mgos_upd_get_commit_timeout(void);
+bool mgos_upd_set_commit_timeout(int commit_timeout);
+void mgos_upd_boot_finish(bool is_successful, bool is_first);
+void mgos_upd_set_event_cb(mgos_upd_event_cb cb, void *cb_arg);
+const char *mgos_ota_state_str(enum mgos_ota_state state);
+const char *mgos_ota_status_get_msg(struct mgos_ota_status *s);
+bool mgos_upd_merge_fs(const char *old_fs_path, const char *new_fs_path);
+void mgos_upd_watchdog_cb(void *arg);
+bool mgos_ota_common_init(void);
+
+#endif /* TEST_HOST_MGOS_UPDATER_COMMON_H_ */
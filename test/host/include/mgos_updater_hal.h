@@ -0,0 +1,38 @@
+#ifndef TEST_HOST_MGOS_UPDATER_HAL_H_
+#define TEST_HOST_MGOS_UPDATER_HAL_H_
+
+#include "mgos_updater_common.h"
+
+/* Implemented by mock_upd_hal.c. */
+struct mgos_upd_hal_ctx *mgos_upd_hal_ctx_create(void);
+const char *mgos_upd_get_status_msg(struct mgos_upd_hal_ctx *ctx);
+int mgos_upd_begin(struct mgos_upd_hal_ctx *ctx, struct json_token *parts);
+
+enum mgos_upd_file_action {
+  MGOS_UPDATER_ABORT = 0,
+  MGOS_UPDATER_PROCESS_FILE = 1,
+  MGOS_UPDATER_SKIP_FILE = 2,
+};
+
+enum mgos_upd_file_action mgos_upd_file_begin(
+    struct mgos_upd_hal_ctx *ctx, const struct mgos_upd_file_info *fi);
+int mgos_upd_file_data(struct mgos_upd_hal_ctx *ctx,
+                       const struct mgos_upd_file_info *fi,
+                       struct mg_str data);
+int mgos_upd_file_end(struct mgos_upd_hal_ctx *ctx,
+                      const struct mgos_upd_file_info *fi, struct mg_str tail);
+int mgos_upd_finalize(struct mgos_upd_hal_ctx *ctx);
+void mgos_upd_hal_ctx_free(struct mgos_upd_hal_ctx *ctx);
+
+struct mgos_upd_boot_state {
+  int active_slot;
+  bool is_committed;
+  int revert_slot;
+};
+
+bool mgos_upd_boot_get_state(struct mgos_upd_boot_state *bs);
+bool mgos_upd_boot_set_state(const struct mgos_upd_boot_state *bs);
+void mgos_upd_boot_commit(void);
+void mgos_upd_boot_revert(void);
+
+#endif /* TEST_HOST_MGOS_UPDATER_HAL_H_ */
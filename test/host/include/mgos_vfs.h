@@ -0,0 +1,9 @@
+#ifndef TEST_HOST_MGOS_VFS_H_
+#define TEST_HOST_MGOS_VFS_H_
+
+/* On the host the VFS is the process working directory. */
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif /* TEST_HOST_MGOS_VFS_H_ */
@@ -0,0 +1,124 @@
+#ifndef TEST_HOST_MONGOOSE_H_
+#define TEST_HOST_MONGOOSE_H_
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "common/cs_dbg.h"
+#include "common/platform.h"
+
+#define MG_ENABLE_SSL 0
+#define MG_MAX_PATH 256
+#define MG_MAX_HTTP_HEADERS 40
+
+#define CS_STRINGIFY_LIT(x) #x
+#define CS_STRINGIFY_MACRO(x) CS_STRINGIFY_LIT(x)
+
+struct mbuf {
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+void mbuf_init(struct mbuf *mb, size_t initial_capacity);
+void mbuf_free(struct mbuf *mb);
+size_t mbuf_append(struct mbuf *mb, const void *data, size_t len);
+size_t mbuf_insert(struct mbuf *mb, size_t off, const void *data, size_t len);
+void mbuf_remove(struct mbuf *mb, size_t data_size);
+void mbuf_resize(struct mbuf *mb, size_t new_size);
+void mbuf_trim(struct mbuf *mb);
+
+struct mg_str {
+  const char *p;
+  size_t len;
+};
+
+#define MG_NULL_STR \
+  { NULL, 0 }
+
+struct mg_str mg_mk_str(const char *s);
+struct mg_str mg_mk_str_n(const char *s, size_t len);
+int mg_vcmp(const struct mg_str *str2, const char *str1);
+int mg_vcasecmp(const struct mg_str *str2, const char *str1);
+struct mg_str mg_strdup_nul(const struct mg_str s);
+int mg_strcmp(const struct mg_str str1, const struct mg_str str2);
+const char *mg_strstr(const struct mg_str haystack, const struct mg_str needle);
+int mg_asprintf(char **buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+double mg_time(void);
+
+/* Events */
+#define MG_EV_POLL 0
+#define MG_EV_ACCEPT 1
+#define MG_EV_CONNECT 2
+#define MG_EV_RECV 3
+#define MG_EV_SEND 4
+#define MG_EV_CLOSE 5
+#define MG_EV_TIMER 6
+
+/* Connection flags */
+#define MG_F_SEND_AND_CLOSE (1 << 10)
+#define MG_F_CLOSE_IMMEDIATELY (1 << 11)
+#define MG_F_USER_1 (1 << 20)
+
+struct mg_mgr;
+struct mg_connection;
+typedef void (*mg_event_handler_t)(struct mg_connection *nc, int ev,
+                                   void *ev_data, void *user_data);
+
+struct mg_connection {
+  struct mg_mgr *mgr;
+  struct mbuf recv_mbuf;
+  struct mbuf send_mbuf;
+  size_t recv_mbuf_limit;
+  mg_event_handler_t handler;
+  void *user_data;
+  unsigned long flags;
+  void *priv_mock; /* The simulated server side, see mock_net.c */
+};
+
+struct mg_connect_opts {
+  void *user_data;
+  unsigned int flags;
+  const char **error_string;
+  const char *ssl_cert;
+  const char *ssl_key;
+  const char *ssl_ca_cert;
+  const char *ssl_server_name;
+};
+
+struct mg_connection *mg_connect_opt(struct mg_mgr *mgr, const char *address,
+                                     mg_event_handler_t handler,
+                                     void *user_data,
+                                     struct mg_connect_opts opts);
+int mg_printf(struct mg_connection *nc, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void mg_send(struct mg_connection *nc, const void *buf, int len);
+
+struct http_message {
+  struct mg_str message;
+  struct mg_str body;
+  struct mg_str method;
+  struct mg_str uri;
+  struct mg_str proto;
+  int resp_code;
+  struct mg_str resp_status_msg;
+  struct mg_str query_string;
+  struct mg_str header_names[MG_MAX_HTTP_HEADERS];
+  struct mg_str header_values[MG_MAX_HTTP_HEADERS];
+};
+
+int mg_parse_http(const char *s, int n, struct http_message *hm, int is_req);
+struct mg_str *mg_get_http_header(struct http_message *hm, const char *name);
+int mg_parse_uri(const struct mg_str uri, struct mg_str *scheme,
+                 struct mg_str *user_info, struct mg_str *host,
+                 unsigned int *port, struct mg_str *path, struct mg_str *query,
+                 struct mg_str *fragment);
+
+#endif /* TEST_HOST_MONGOOSE_H_ */
@@ -0,0 +1,9 @@
+#ifndef TEST_HOST_ROM_CRC_H_
+#define TEST_HOST_ROM_CRC_H_
+
+#include <stdint.h>
+
+/* The ESP32 ROM routine: a byte-at-a-time table lookup. */
+uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+#endif /* TEST_HOST_ROM_CRC_H_ */
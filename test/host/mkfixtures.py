@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+"""Builds the archives the host tests and benchmarks replay.
+
+From build/fw.zip (all entries stored):
+
+  fw_stored.zip      the archive itself
+  fw_deflate.zip     the same entries deflated
+  fw_descriptor.zip  deflated and stored entries in turn, each followed by a
+                     data descriptor, sizes in the local headers too; every
+                     other descriptor starts with the optional signature
+  fw_flash.bin       a flash image with the fixed-address parts in place, for
+                     part_is_installed()
+  fw_delta.zip       a delta update by tools/mkdelta.py: the app of fw.zip,
+                     changed, as a patch against delta_base.bin, the app of
+                     fw.zip
+  head.bin           the first 128 KB of fw.zip, for gunzip
+  head.gz            head.bin gzipped, with no optional header fields
+  head_named.gz      the same with the file name in the header
+
+and, as seeds for fuzz_updater, small archives of the same shape under
+seeds/. In seeds/*_nocrc.zip the CRCs are zeroed, which the updater takes as
+"not known", so mutations of the manifest get past the CRC check.
+
+Usage: mkfixtures.py <fw.zip> <out dir>
+"""
+
+import gzip
+import hashlib
+import json
+import os
+import random
+import struct
+import subprocess
+import sys
+import zipfile
+import zlib
+
+
+def read_entries(path):
+    with zipfile.ZipFile(path) as z:
+        return [(i.filename, z.read(i)) for i in z.infolist()]
+
+
+def write_zip(path, entries, method):
+    with zipfile.ZipFile(path, "w", method) as z:
+        for name, data in entries:
+            z.writestr(name, data)
+
+
+def write_descriptor_zip(path, entries):
+    out = bytearray()
+    for i, (name, data) in enumerate(entries):
+        crc = zlib.crc32(data)
+        method = 8 if i % 2 == 0 else 0
+        if method == 8:
+            c = zlib.compressobj(6, zlib.DEFLATED, -15)
+            comp = c.compress(data) + c.flush()
+        else:
+            comp = data
+        bname = name.encode()
+        out += struct.pack("<IHHHHHIIIHH", 0x04034B50, 20, 1 << 3, method, 0,
+                           0, crc, len(comp), len(data), len(bname), 0)
+        out += bname + comp
+        if i % 4 < 2:
+            out += struct.pack("<I", 0x08074B50)
+        out += struct.pack("<III", crc, len(comp), len(data))
+    # The updater stops at the central directory, whatever is in it.
+    out += struct.pack("<I", 0x02014B50) + bytes(42)
+    with open(path, "wb") as f:
+        f.write(out)
+
+
+def write_flash(path, entries):
+    manifest = json.loads(dict(entries)[manifest_name(entries)])
+    by_src = {os.path.basename(n): d for n, d in entries}
+    flash = bytearray(b"\xff" * 0x10000)
+    for part in manifest["parts"].values():
+        if "ptn" in part or part.get("src") not in by_src:
+            continue
+        data = by_src[part["src"]]
+        addr = part["addr"]
+        if addr + len(data) > len(flash):
+            flash += b"\xff" * (addr + len(data) - len(flash))
+        flash[addr:addr + len(data)] = data
+    with open(path, "wb") as f:
+        f.write(flash)
+
+
+def changed_app(app):
+    """A next version of the app: code inserted, moved and patched."""
+    new = bytearray(app[:5000] + b"new code" * 64 + app[5000:800000] +
+                    app[800100:])
+    for i in range(4096, len(new), 4096):
+        new[i] ^= 0x20
+    return bytes(new)
+
+
+def write_delta(out, entries):
+    """Writes delta_base.bin and fw_delta.zip."""
+    manifest = json.loads(dict(entries)[manifest_name(entries)])
+    app = manifest["parts"]["app"]
+    name = [n for n, _ in entries if os.path.basename(n) == app["src"]][0]
+    base = dict(entries)[name]
+    new = changed_app(base)
+    app["size"] = len(new)
+    app["cs_sha1"] = hashlib.sha1(new).hexdigest()
+    changed = [(n, new if n == name else
+                json.dumps(manifest).encode() if n == manifest_name(entries)
+                else d) for n, d in entries]
+    base_path = os.path.join(out, "delta_base.bin")
+    new_path = os.path.join(out, "fw_new.zip")
+    with open(base_path, "wb") as f:
+        f.write(base)
+    write_zip(new_path, changed, zipfile.ZIP_STORED)
+    tool = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        "..", "..", "tools", "mkdelta.py")
+    subprocess.check_call([sys.executable, tool, base_path, new_path,
+                           os.path.join(out, "fw_delta.zip")])
+    os.remove(new_path)
+
+
+def manifest_name(entries):
+    return [n for n, _ in entries if n.endswith("manifest.json")][0]
+
+
+def zero_crcs(data):
+    """Zeroes the CRC in every local header and data descriptor."""
+    out = bytearray(data)
+    pos = 0
+    while out[pos:pos + 4] == b"PK\x03\x04":
+        flags, method = struct.unpack_from("<HH", out, pos + 6)
+        csize, _, nlen, xlen = struct.unpack_from("<IIHH", out, pos + 18)
+        struct.pack_into("<I", out, pos + 14, 0)
+        pos += 30 + nlen + xlen + csize
+        if flags & (1 << 3):
+            if out[pos:pos + 4] == b"PK\x07\x08":
+                pos += 4
+            struct.pack_into("<I", out, pos, 0)
+            pos += 12
+    return bytes(out)
+
+
+def small_entries(entries):
+    """Same manifest shape, parts of a few KB."""
+    rnd = random.Random(7)
+    manifest = json.loads(dict(entries)[manifest_name(entries)])
+    files = []
+    for name, part in sorted(manifest["parts"].items()):
+        if "src" not in part:
+            continue
+        size = rnd.randint(100, 5000)
+        # Compressible, but not trivially so.
+        data = bytes(rnd.choice(b"abcdefgh\x00\xff") for _ in range(size))
+        part["size"] = size
+        part["cs_sha1"] = hashlib.sha1(data).hexdigest()
+        files.append(("fw/" + part["src"], data))
+    m = json.dumps(manifest, indent=1).encode()
+    return [("fw/manifest.json", m)] + files
+
+
+def write_gzip(out, data):
+    with open(os.path.join(out, "head.bin"), "wb") as f:
+        f.write(data)
+    with open(os.path.join(out, "head.gz"), "wb") as f:
+        f.write(gzip.compress(data, mtime=0))
+    with open(os.path.join(out, "head_named.gz"), "wb") as f:
+        with gzip.GzipFile("head.bin", "wb", fileobj=f, mtime=0) as gz:
+            gz.write(data)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    fw, out = sys.argv[1], sys.argv[2]
+    os.makedirs(os.path.join(out, "seeds"), exist_ok=True)
+    entries = read_entries(fw)
+
+    with open(fw, "rb") as src, \
+            open(os.path.join(out, "fw_stored.zip"), "wb") as dst:
+        fw_data = src.read()
+        dst.write(fw_data)
+    write_zip(os.path.join(out, "fw_deflate.zip"), entries,
+              zipfile.ZIP_DEFLATED)
+    write_descriptor_zip(os.path.join(out, "fw_descriptor.zip"), entries)
+    write_flash(os.path.join(out, "fw_flash.bin"), entries)
+    write_delta(out, entries)
+    write_gzip(out, fw_data[:128 * 1024])
+
+    small = small_entries(entries)
+    seeds = os.path.join(out, "seeds")
+    write_zip(os.path.join(seeds, "stored.zip"), small, zipfile.ZIP_STORED)
+    write_zip(os.path.join(seeds, "deflate.zip"), small, zipfile.ZIP_DEFLATED)
+    write_descriptor_zip(os.path.join(seeds, "descriptor.zip"), small)
+    for name in ("stored", "deflate", "descriptor"):
+        with open(os.path.join(seeds, name + ".zip"), "rb") as f:
+            data = zero_crcs(f.read())
+        with open(os.path.join(seeds, name + "_nocrc.zip"), "wb") as f:
+            f.write(data)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,156 @@
+/*
+ * Control side of the host mocks.
+ *
+ * The mocks stand in for the parts of Mongoose OS that the sources under src/
+ * call: logging, the clock and timers, config, heap figures, RPC, the
+ * network, LED outputs, and the update HAL with the ESP32 flash reads behind it. Tests
+ * and benchmarks set them up through this header.
+ */
+
+#ifndef TEST_HOST_MOCK_H_
+#define TEST_HOST_MOCK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Reads $LOG_LEVEL (default: none) and resets the clock. */
+void mock_init(void);
+
+/*
+ * The clock is real (CLOCK_MONOTONIC) until mock_clock_set(), then virtual and
+ * moved only by mock_clock_advance(). Timers fire from mock_timers_run() or
+ * mock_clock_advance(), never on their own.
+ */
+void mock_clock_set(double now);
+void mock_clock_advance(double seconds);
+int mock_timers_run(void);
+int mock_timers_pending(void);
+
+/* Values returned by the mgos_sys_config_get_*() getters. */
+struct mock_config {
+  int update_timeout;
+  int fetch_max_conns;
+  int fetch_pipeline;
+  int fetch_idle_timeout;
+  int fetch_write_buf_budget;
+  int fetch_min_free_heap;
+  int fetch_gzip_decoders;
+  const char *fetch_cache_index;
+  int led_fps;
+  const char *led_curve;
+  int profile_lag_interval;
+};
+extern struct mock_config mock_cfg;
+
+/* What mgos_get_free_heap_size() reports. */
+extern size_t mock_free_heap;
+/* Calls to mgos_system_restart(). */
+extern int mock_restarts;
+
+/*
+ * The update HAL. Each part is written to out_dir/<name>, or only hashed when
+ * out_dir is NULL, and its SHA-1 checked against the manifest's cs_sha1 in
+ * mgos_upd_file_end(), as the ESP32 HAL does.
+ */
+struct mock_upd {
+  const char *out_dir;
+  /* mgos_upd_file_data() takes multiples of this; the rest is the tail. */
+  size_t align;
+  /* mgos_upd_file_begin() answers MGOS_UPDATER_SKIP_FILE for this name. */
+  const char *skip;
+  /* Contents of the running app slot and of the flash, read as erased past
+   * the end of the file. */
+  const char *running_app;
+  uint32_t running_app_slot_size;
+  const char *flash;
+  bool committed;
+  /* Counters */
+  int begins;
+  int files;
+  int skipped;
+  size_t bytes;
+  int finalized;
+  int commits;
+  int reverts;
+};
+extern struct mock_upd mock_upd;
+
+/* Back to the defaults: nothing written, 16 byte alignment, committed. */
+void mock_upd_reset(void);
+
+/* Neopixel strips and PWM pins: what has been sent to them. */
+#define MOCK_LED_PINS 40
+struct mock_led {
+  unsigned long shows;
+  unsigned long pixels_shown;
+  unsigned long pwm_writes;
+  uint32_t checksum; /* Of the bytes shown */
+  int duty[MOCK_LED_PINS]; /* Last duty set on each pin, 0..65535 */
+};
+extern struct mock_led mock_led;
+
+/*
+ * Calls the handler registered for `method` with `args` (NULL for "{}"), as
+ * a request would. Returns the result or error message it sends, NULL if
+ * there is no such method or it sends nothing; *error_code is 0 for a result.
+ * Requests are numbered from 1, in the order of the calls.
+ */
+const char *mock_rpc_call(const char *method, const char *args,
+                          int *error_code);
+/* If set, told of every reply, including those sent after the call. */
+extern void (*mock_rpc_on_reply)(int64_t id, int error_code,
+                                 const char *reply);
+
+/*
+ * The network, see mock_net.c: one HTTP server, with the files added by
+ * mock_net_add_file() at their paths, for any host.
+ */
+struct mock_net_config {
+  double rtt;       /* Round trip, seconds */
+  double handshake; /* From connect to connected, seconds */
+  double bandwidth; /* Of the link all replies share, bytes per second */
+  bool close;       /* Closes the connection after every reply */
+  int max_requests; /* Closes it after this many replies, 0 for no limit */
+  bool ranges;      /* Serves Range requests */
+  /* Breaks the next reply with a longer body after this many bytes. */
+  size_t drop_after;
+  /* Counters */
+  int connects;
+  int closes;
+  int requests;
+  int not_modified;
+  int ranges_served;
+  size_t last_range_start;
+  size_t body_bytes;
+  size_t uart_bytes; /* Written to UARTs */
+  /*
+   * Transmit buffer of the UARTs, 0 for one that takes everything, and
+   * the bytes per second they send from it.
+   */
+  size_t uart_buf_size;
+  double uart_rate;
+};
+extern struct mock_net_config mock_net;
+
+/* No files, 50 ms round trip and handshake, 1 MB/s, ranges, keep-alive. */
+void mock_net_reset(void);
+void mock_net_add_file(const char *path, const void *data, size_t len,
+                       const char *etag);
+/*
+ * Delivers network events and moves the virtual clock on to the next one,
+ * for up to `max_seconds`. Returns true if it stopped because nothing more
+ * was due, false at the time limit.
+ */
+bool mock_net_run(double max_seconds);
+/* Delivers what is due now, and MG_EV_POLL to every connection. */
+void mock_net_poll(void);
+/* Connections open. */
+int mock_net_conns(void);
+/* Calls the dispatcher set for the UART, as a UART event would. */
+void mock_uart_dispatch(int uart_no);
+
+/* Reads a whole file; NUL-terminated, NULL if it cannot. */
+char *mock_read_file(const char *path, size_t *size);
+
+#endif /* TEST_HOST_MOCK_H_ */
@@ -0,0 +1,626 @@
+/*
+ * The subset of frozen (the Mongoose OS JSON library) that src/ uses:
+ * json_walk(), json_scanf() with %Q %B %T %M and the numeric conversions,
+ * json_scanf_array_elem(), json_printf() with %Q %B %M and printf
+ * conversions, json_fprintf() and json_fread(). Callbacks, paths and tokens
+ * follow frozen, so code that walks a manifest sees the same thing as on the
+ * device.
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frozen.h"
+
+#include "mock.h"
+
+#define JSON_MAX_PATH_LEN 256
+
+/* json_walk() */
+
+struct walker {
+  const char *cur;
+  const char *end;
+  char path[JSON_MAX_PATH_LEN];
+  json_walk_callback_t cb;
+  void *cb_data;
+};
+
+static void skip_space(struct walker *w) {
+  while (w->cur < w->end && isspace((unsigned char) *w->cur)) w->cur++;
+}
+
+static void call_back(struct walker *w, const char *name, size_t name_len,
+                      enum json_token_type type, const char *ptr, int len) {
+  struct json_token t;
+  t.ptr = ptr;
+  t.len = len;
+  t.type = type;
+  if (w->cb != NULL) w->cb(w->cb_data, name, name_len, w->path, &t);
+}
+
+/* Scans a string whose opening quote is at w->cur, leaves w->cur after it. */
+static int scan_string(struct walker *w) {
+  w->cur++;
+  while (w->cur < w->end) {
+    char c = *w->cur++;
+    if (c == '"') return 0;
+    if (c == '\\') {
+      if (w->cur >= w->end) return JSON_STRING_INCOMPLETE;
+      if (*w->cur == 'u') {
+        int i;
+        for (i = 1; i <= 4; i++) {
+          if (w->cur + i >= w->end) return JSON_STRING_INCOMPLETE;
+          if (!isxdigit((unsigned char) w->cur[i])) return JSON_STRING_INVALID;
+        }
+        w->cur += 5;
+      } else if (strchr("\"\\/bfnrt", *w->cur) != NULL) {
+        w->cur++;
+      } else {
+        return JSON_STRING_INVALID;
+      }
+    } else if ((unsigned char) c < 0x20) {
+      return JSON_STRING_INVALID;
+    }
+  }
+  return JSON_STRING_INCOMPLETE;
+}
+
+static int scan_number(struct walker *w) {
+  const char *p = w->cur;
+  if (p < w->end && *p == '-') p++;
+  if (p >= w->end) return JSON_STRING_INCOMPLETE;
+  if (!isdigit((unsigned char) *p)) return JSON_STRING_INVALID;
+  while (p < w->end && isdigit((unsigned char) *p)) p++;
+  if (p < w->end && *p == '.') {
+    p++;
+    if (p >= w->end) return JSON_STRING_INCOMPLETE;
+    if (!isdigit((unsigned char) *p)) return JSON_STRING_INVALID;
+    while (p < w->end && isdigit((unsigned char) *p)) p++;
+  }
+  if (p < w->end && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < w->end && (*p == '+' || *p == '-')) p++;
+    if (p >= w->end) return JSON_STRING_INCOMPLETE;
+    if (!isdigit((unsigned char) *p)) return JSON_STRING_INVALID;
+    while (p < w->end && isdigit((unsigned char) *p)) p++;
+  }
+  w->cur = p;
+  return 0;
+}
+
+static int parse_value(struct walker *w, const char *name, size_t name_len);
+
+static int parse_container(struct walker *w, const char *name,
+                           size_t name_len) {
+  bool is_obj = (*w->cur == '{');
+  const char *start = w->cur;
+  size_t path_len = strlen(w->path);
+  int i = 0, res;
+  call_back(w, name, name_len,
+            is_obj ? JSON_TYPE_OBJECT_START : JSON_TYPE_ARRAY_START, NULL, 0);
+  w->cur++;
+  skip_space(w);
+  if (w->cur >= w->end) return JSON_STRING_INCOMPLETE;
+  if (*w->cur != (is_obj ? '}' : ']')) {
+    for (;;) {
+      char elem[JSON_MAX_PATH_LEN];
+      const char *el_name;
+      size_t el_len;
+      if (is_obj) {
+        const char *key;
+        skip_space(w);
+        if (w->cur >= w->end) return JSON_STRING_INCOMPLETE;
+        if (*w->cur == '"') {
+          key = w->cur + 1;
+          if ((res = scan_string(w)) != 0) return res;
+          el_len = w->cur - key - 1;
+        } else if (isalpha((unsigned char) *w->cur) || *w->cur == '_') {
+          /* frozen takes identifiers as keys too, as in {a: 1}. */
+          key = w->cur;
+          while (w->cur < w->end &&
+                 (isalnum((unsigned char) *w->cur) || *w->cur == '_')) {
+            w->cur++;
+          }
+          el_len = w->cur - key;
+        } else {
+          return JSON_STRING_INVALID;
+        }
+        el_name = key;
+        skip_space(w);
+        if (w->cur >= w->end) return JSON_STRING_INCOMPLETE;
+        if (*w->cur++ != ':') return JSON_STRING_INVALID;
+        snprintf(elem, sizeof(elem), ".%.*s", (int) el_len, el_name);
+      } else {
+        snprintf(elem, sizeof(elem), "[%d]", i++);
+      }
+      if (path_len + strlen(elem) >= sizeof(w->path)) {
+        return JSON_STRING_INVALID;
+      }
+      strcpy(w->path + path_len, elem);
+      if (!is_obj) {
+        el_name = w->path + path_len;
+        el_len = strlen(elem);
+      }
+      res = parse_value(w, el_name, el_len);
+      w->path[path_len] = '\0';
+      if (res != 0) return res;
+      skip_space(w);
+      if (w->cur >= w->end) return JSON_STRING_INCOMPLETE;
+      if (*w->cur == ',') {
+        w->cur++;
+        continue;
+      }
+      if (*w->cur != (is_obj ? '}' : ']')) return JSON_STRING_INVALID;
+      break;
+    }
+  }
+  w->cur++;
+  call_back(w, name, name_len,
+            is_obj ? JSON_TYPE_OBJECT_END : JSON_TYPE_ARRAY_END, start,
+            (int) (w->cur - start));
+  return 0;
+}
+
+static int parse_literal(struct walker *w, const char *lit) {
+  size_t n = strlen(lit), avail = w->end - w->cur;
+  if (strncmp(w->cur, lit, avail < n ? avail : n) != 0) {
+    return JSON_STRING_INVALID;
+  }
+  if (avail < n) return JSON_STRING_INCOMPLETE;
+  w->cur += n;
+  return 0;
+}
+
+static int parse_value(struct walker *w, const char *name, size_t name_len) {
+  const char *start;
+  int res = 0;
+  skip_space(w);
+  if (w->cur >= w->end) return JSON_STRING_INCOMPLETE;
+  start = w->cur;
+  switch (*w->cur) {
+    case '{':
+    case '[':
+      return parse_container(w, name, name_len);
+    case '"':
+      if ((res = scan_string(w)) != 0) return res;
+      call_back(w, name, name_len, JSON_TYPE_STRING, start + 1,
+                (int) (w->cur - start - 2));
+      return 0;
+    case 't':
+      if ((res = parse_literal(w, "true")) != 0) return res;
+      call_back(w, name, name_len, JSON_TYPE_TRUE, start, 4);
+      return 0;
+    case 'f':
+      if ((res = parse_literal(w, "false")) != 0) return res;
+      call_back(w, name, name_len, JSON_TYPE_FALSE, start, 5);
+      return 0;
+    case 'n':
+      if ((res = parse_literal(w, "null")) != 0) return res;
+      call_back(w, name, name_len, JSON_TYPE_NULL, start, 4);
+      return 0;
+    default:
+      if ((res = scan_number(w)) != 0) return res;
+      call_back(w, name, name_len, JSON_TYPE_NUMBER, start,
+                (int) (w->cur - start));
+      return 0;
+  }
+}
+
+int json_walk(const char *json_string, int json_string_length,
+              json_walk_callback_t callback, void *callback_data) {
+  struct walker w;
+  int res;
+  memset(&w, 0, sizeof(w));
+  w.cur = json_string;
+  w.end = json_string + json_string_length;
+  w.cb = callback;
+  w.cb_data = callback_data;
+  skip_space(&w);
+  if (w.cur >= w.end) return JSON_STRING_INCOMPLETE;
+  if (*w.cur != '{' && *w.cur != '[') return JSON_STRING_INVALID;
+  if ((res = parse_value(&w, NULL, 0)) != 0) return res;
+  return (int) (w.cur - json_string);
+}
+
+/* Finding a token by path */
+
+struct find_ctx {
+  const char *path;
+  struct json_token token;
+};
+
+static void find_cb(void *data, const char *name, size_t name_len,
+                    const char *path, const struct json_token *token) {
+  struct find_ctx *fc = (struct find_ctx *) data;
+  (void) name;
+  (void) name_len;
+  if (token->type == JSON_TYPE_OBJECT_START ||
+      token->type == JSON_TYPE_ARRAY_START || fc->token.ptr != NULL) {
+    return;
+  }
+  if (strcmp(path, fc->path) == 0) fc->token = *token;
+}
+
+static bool find_token(const char *s, int len, const char *path,
+                       struct json_token *token) {
+  struct find_ctx fc;
+  memset(&fc, 0, sizeof(fc));
+  fc.path = path;
+  if (json_walk(s, len, find_cb, &fc) < 0 || fc.token.ptr == NULL) {
+    return false;
+  }
+  *token = fc.token;
+  return true;
+}
+
+int json_scanf_array_elem(const char *s, int len, const char *path, int idx,
+                          struct json_token *token) {
+  char elem_path[JSON_MAX_PATH_LEN];
+  snprintf(elem_path, sizeof(elem_path), "%s[%d]", path, idx);
+  memset(token, 0, sizeof(*token));
+  if (!find_token(s, len, elem_path, token)) return -1;
+  return token->len;
+}
+
+/* json_scanf() */
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  return (tolower((unsigned char) c) - 'a') + 10;
+}
+
+/* Unescapes a string token into a fresh allocation. */
+static char *unescape(const char *s, int len) {
+  char *res = (char *) malloc(len + 1), *d = res;
+  const char *end = s + len;
+  if (res == NULL) return NULL;
+  while (s < end) {
+    if (*s != '\\' || s + 1 >= end) {
+      *d++ = *s++;
+      continue;
+    }
+    s++;
+    switch (*s) {
+      case 'b':
+        *d++ = '\b';
+        break;
+      case 'f':
+        *d++ = '\f';
+        break;
+      case 'n':
+        *d++ = '\n';
+        break;
+      case 'r':
+        *d++ = '\r';
+        break;
+      case 't':
+        *d++ = '\t';
+        break;
+      case 'u':
+        if (s + 4 < end) {
+          unsigned cp = 0;
+          int i;
+          for (i = 1; i <= 4; i++) cp = cp << 4 | hex_digit(s[i]);
+          s += 4;
+          if (cp < 0x80) {
+            *d++ = (char) cp;
+          } else if (cp < 0x800) {
+            *d++ = (char) (0xc0 | cp >> 6);
+            *d++ = (char) (0x80 | (cp & 0x3f));
+          } else {
+            *d++ = (char) (0xe0 | cp >> 12);
+            *d++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+            *d++ = (char) (0x80 | (cp & 0x3f));
+          }
+        }
+        break;
+      default:
+        *d++ = *s;
+        break;
+    }
+    s++;
+  }
+  *d = '\0';
+  return res;
+}
+
+typedef void (*json_scanner_t)(const char *str, int len, void *user_data);
+
+static bool scan_one(const struct json_token *t, const char *conv,
+                     va_list *ap) {
+  char conv_ch = conv[strlen(conv) - 1];
+  switch (conv_ch) {
+    case 'Q': {
+      char **dst = va_arg(*ap, char **);
+      if (t == NULL) return false;
+      if (t->type == JSON_TYPE_NULL) {
+        *dst = NULL;
+        return true;
+      }
+      if (t->type != JSON_TYPE_STRING) return false;
+      *dst = unescape(t->ptr, t->len);
+      return (*dst != NULL);
+    }
+    case 'B': {
+      bool *dst = va_arg(*ap, bool *);
+      if (t == NULL) return false;
+      if (t->type != JSON_TYPE_TRUE && t->type != JSON_TYPE_FALSE) {
+        return false;
+      }
+      *dst = (t->type == JSON_TYPE_TRUE);
+      return true;
+    }
+    case 'T': {
+      struct json_token *dst = va_arg(*ap, struct json_token *);
+      if (t == NULL) return false;
+      *dst = *t;
+      return true;
+    }
+    case 'M': {
+      json_scanner_t scanner = va_arg(*ap, json_scanner_t);
+      void *user_data = va_arg(*ap, void *);
+      if (t == NULL) return false;
+      scanner(t->ptr, t->len, user_data);
+      return true;
+    }
+    default: {
+      void *dst = va_arg(*ap, void *);
+      char buf[64];
+      if (t == NULL || t->len >= (int) sizeof(buf)) return false;
+      memcpy(buf, t->ptr, t->len);
+      buf[t->len] = '\0';
+      return (sscanf(buf, conv, dst) == 1);
+    }
+  }
+}
+
+int json_vscanf(const char *str, int str_len, const char *fmt, va_list ap) {
+  char path[JSON_MAX_PATH_LEN] = "";
+  size_t depth_len[16];
+  int depth = 0, result = 0;
+  const char *key = NULL;
+  size_t key_len = 0;
+  va_list ap2;
+  va_copy(ap2, ap);
+  while (*fmt != '\0') {
+    if (*fmt == '{') {
+      if (depth >= 16) break;
+      depth_len[depth++] = strlen(path);
+      if (key != NULL) {
+        snprintf(path + strlen(path), sizeof(path) - strlen(path), ".%.*s",
+                 (int) key_len, key);
+        key = NULL;
+      }
+      fmt++;
+    } else if (*fmt == '}') {
+      if (depth > 0) path[depth_len[--depth]] = '\0';
+      fmt++;
+    } else if (*fmt == '%') {
+      char conv[16], full[JSON_MAX_PATH_LEN];
+      struct json_token t;
+      size_t n = 1;
+      conv[0] = '%';
+      fmt++;
+      while (*fmt != '\0' && n < sizeof(conv) - 1) {
+        char c = *fmt++;
+        conv[n++] = c;
+        if (isalpha((unsigned char) c) && c != 'l' && c != 'h' && c != 'z') {
+          break;
+        }
+      }
+      conv[n] = '\0';
+      snprintf(full, sizeof(full), "%s.%.*s", path, (int) key_len,
+               key != NULL ? key : "");
+      if (scan_one(find_token(str, str_len, full, &t) ? &t : NULL, conv,
+                   &ap2)) {
+        result++;
+      }
+      key = NULL;
+    } else if (isalnum((unsigned char) *fmt) || *fmt == '_' || *fmt == '"') {
+      bool quoted = (*fmt == '"');
+      if (quoted) fmt++;
+      key = fmt;
+      while (*fmt != '\0' &&
+             (quoted ? *fmt != '"'
+                     : (isalnum((unsigned char) *fmt) || *fmt == '_'))) {
+        fmt++;
+      }
+      key_len = fmt - key;
+      if (quoted && *fmt == '"') fmt++;
+    } else {
+      fmt++;
+    }
+  }
+  va_end(ap2);
+  return result;
+}
+
+int json_scanf(const char *str, int str_len, const char *fmt, ...) {
+  va_list ap;
+  int res;
+  va_start(ap, fmt);
+  res = json_vscanf(str, str_len, fmt, ap);
+  va_end(ap);
+  return res;
+}
+
+/* json_printf() */
+
+int json_printer_buf(struct json_out *out, const char *buf, size_t len) {
+  size_t avail = out->u.buf.size - out->u.buf.len;
+  size_t n = len < avail ? len : avail;
+  memcpy(out->u.buf.buf + out->u.buf.len, buf, n);
+  out->u.buf.len += n;
+  if (out->u.buf.size > 0) {
+    size_t idx = out->u.buf.len;
+    if (idx >= out->u.buf.size) idx = out->u.buf.size - 1;
+    out->u.buf.buf[idx] = '\0';
+  }
+  return (int) len;
+}
+
+static int json_printer_file(struct json_out *out, const char *buf,
+                             size_t len) {
+  return (int) fwrite(buf, 1, len, out->u.fp);
+}
+
+static int print_quoted(struct json_out *out, const char *s) {
+  int len = 0;
+  if (s == NULL) return out->printer(out, "null", 4);
+  len += out->printer(out, "\"", 1);
+  for (; *s != '\0'; s++) {
+    const char *esc = NULL;
+    char ubuf[8];
+    switch (*s) {
+      case '"':
+        esc = "\\\"";
+        break;
+      case '\\':
+        esc = "\\\\";
+        break;
+      case '\n':
+        esc = "\\n";
+        break;
+      case '\r':
+        esc = "\\r";
+        break;
+      case '\t':
+        esc = "\\t";
+        break;
+      default:
+        if ((unsigned char) *s < 0x20) {
+          snprintf(ubuf, sizeof(ubuf), "\\u%04x", (unsigned char) *s);
+          esc = ubuf;
+        }
+        break;
+    }
+    if (esc != NULL) {
+      len += out->printer(out, esc, strlen(esc));
+    } else {
+      len += out->printer(out, s, 1);
+    }
+  }
+  len += out->printer(out, "\"", 1);
+  return len;
+}
+
+int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
+  int len = 0;
+  va_list ap;
+  va_copy(ap, xap);
+  while (*fmt != '\0') {
+    if (*fmt == '%') {
+      char spec[16], buf[128];
+      size_t n = 1;
+      int star = -1;
+      spec[0] = '%';
+      fmt++;
+      while (*fmt != '\0' && n < sizeof(spec) - 1) {
+        char c = *fmt++;
+        if (c == '*') star = va_arg(ap, int);
+        spec[n++] = c;
+        if (isalpha((unsigned char) c) && c != 'l' && c != 'h' && c != 'z') {
+          break;
+        }
+      }
+      spec[n] = '\0';
+      switch (spec[n - 1]) {
+        case 'Q':
+          len += print_quoted(out, va_arg(ap, const char *));
+          break;
+        case 'B': {
+          const char *b = va_arg(ap, int) ? "true" : "false";
+          len += out->printer(out, b, strlen(b));
+          break;
+        }
+        case 'M': {
+          json_printf_callback_t cb = va_arg(ap, json_printf_callback_t);
+          len += cb(out, &ap);
+          break;
+        }
+        case 's': {
+          const char *s = va_arg(ap, const char *);
+          int sl = (int) strlen(s);
+          if (star >= 0 && star < sl) sl = star;
+          len += out->printer(out, s, sl);
+          break;
+        }
+        case '%':
+          len += out->printer(out, "%", 1);
+          break;
+        case 'f':
+        case 'g':
+        case 'e': {
+          double v = va_arg(ap, double);
+          int k = (star >= 0 ? snprintf(buf, sizeof(buf), spec, star, v)
+                             : snprintf(buf, sizeof(buf), spec, v));
+          len += out->printer(out, buf, k);
+          break;
+        }
+        default: {
+          int k;
+          if (strstr(spec, "ll") != NULL) {
+            k = snprintf(buf, sizeof(buf), spec, va_arg(ap, long long));
+          } else if (strchr(spec, 'l') != NULL || strchr(spec, 'z') != NULL) {
+            k = snprintf(buf, sizeof(buf), spec, va_arg(ap, long));
+          } else {
+            k = snprintf(buf, sizeof(buf), spec, va_arg(ap, int));
+          }
+          len += out->printer(out, buf, k);
+          break;
+        }
+      }
+    } else if (*fmt == '"') {
+      /* Quoted text goes out as is. */
+      const char *end = strchr(fmt + 1, '"');
+      size_t n = (end != NULL ? (size_t)(end - fmt + 1) : strlen(fmt));
+      len += out->printer(out, fmt, n);
+      fmt += n;
+    } else if (isalpha((unsigned char) *fmt) || *fmt == '_') {
+      /* Bare keys get quoted. */
+      const char *start = fmt;
+      while (isalnum((unsigned char) *fmt) || *fmt == '_') fmt++;
+      len += out->printer(out, "\"", 1);
+      len += out->printer(out, start, fmt - start);
+      len += out->printer(out, "\"", 1);
+    } else {
+      len += out->printer(out, fmt, 1);
+      fmt++;
+    }
+  }
+  va_end(ap);
+  return len;
+}
+
+int json_printf(struct json_out *out, const char *fmt, ...) {
+  va_list ap;
+  int res;
+  va_start(ap, fmt);
+  res = json_vprintf(out, fmt, ap);
+  va_end(ap);
+  return res;
+}
+
+int json_fprintf(const char *file_name, const char *fmt, ...) {
+  struct json_out out;
+  FILE *fp = fopen(file_name, "wb");
+  va_list ap;
+  int res;
+  if (fp == NULL) return -1;
+  out.printer = json_printer_file;
+  out.u.fp = fp;
+  va_start(ap, fmt);
+  res = json_vprintf(&out, fmt, ap);
+  va_end(ap);
+  if (fclose(fp) != 0) res = -1;
+  return res;
+}
+
+char *json_fread(const char *file_name) {
+  return mock_read_file(file_name, NULL);
+}
@@ -0,0 +1,81 @@
+/*
+ * LED outputs on the host: neopixel strips that keep their pixels in a
+ * buffer in wire order, as the library does, and PWM pins that keep the
+ * last duty set.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos_neopixel.h"
+#include "mgos_pwm.h"
+
+#include "mock.h"
+
+struct mgos_neopixel {
+  int pin;
+  int num_pixels;
+  enum mgos_neopixel_order order;
+  uint8_t *data; /* 3 bytes per pixel */
+};
+
+struct mock_led mock_led;
+
+struct mgos_neopixel *mgos_neopixel_create(int pin, int num_pixels,
+                                           enum mgos_neopixel_order order) {
+  struct mgos_neopixel *np =
+      (struct mgos_neopixel *) calloc(1, sizeof(*np));
+  if (np == NULL) return NULL;
+  if ((np->data = (uint8_t *) calloc(num_pixels, 3)) == NULL) {
+    free(np);
+    return NULL;
+  }
+  np->pin = pin;
+  np->num_pixels = num_pixels;
+  np->order = order;
+  return np;
+}
+
+void mgos_neopixel_set(struct mgos_neopixel *np, int i, int r, int g, int b) {
+  uint8_t *p;
+  if (i < 0 || i >= np->num_pixels) return;
+  p = np->data + i * 3;
+  switch (np->order) {
+    case MGOS_NEOPIXEL_ORDER_RGB:
+      p[0] = r, p[1] = g, p[2] = b;
+      break;
+    case MGOS_NEOPIXEL_ORDER_GRB:
+      p[0] = g, p[1] = r, p[2] = b;
+      break;
+    case MGOS_NEOPIXEL_ORDER_BGR:
+      p[0] = b, p[1] = g, p[2] = r;
+      break;
+  }
+}
+
+void mgos_neopixel_clear(struct mgos_neopixel *np) {
+  memset(np->data, 0, np->num_pixels * 3);
+}
+
+void mgos_neopixel_show(struct mgos_neopixel *np) {
+  int i;
+  mock_led.shows++;
+  mock_led.pixels_shown += np->num_pixels;
+  /* Reads what would go on the wire, so none of it is optimised away. */
+  for (i = 0; i < np->num_pixels * 3; i++) mock_led.checksum += np->data[i];
+}
+
+void mgos_neopixel_free(struct mgos_neopixel *np) {
+  if (np == NULL) return;
+  free(np->data);
+  free(np);
+}
+
+bool mgos_pwm_set(int pin, int freq, float duty) {
+  (void) freq;
+  mock_led.pwm_writes++;
+  if (pin >= 0 && pin < MOCK_LED_PINS) {
+    mock_led.duty[pin] = (int) (duty * 65535 + 0.5f);
+  }
+  return true;
+}
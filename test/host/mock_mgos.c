@@ -0,0 +1,570 @@
+/*
+ * Mongoose OS core on the host: logging, clock and timers, config, heap,
+ * mbuf / mg_str helpers, SHA-1 and SHA-256.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/cs_dbg.h"
+#include "common/cs_file.h"
+#include "common/cs_sha1.h"
+#include "mbedtls/sha256.h"
+#include "mgos.h"
+#include "mgos_updater_common.h"
+
+#include "mock.h"
+
+/* Normally generated by the build. */
+const char *build_id = "20180101-000000/host";
+const char *build_version = "0.0.1";
+
+enum cs_log_level cs_log_level = LL_NONE;
+
+struct mock_config mock_cfg = {
+    .update_timeout = 300,
+    .fetch_max_conns = 4,
+    .fetch_pipeline = 4,
+    .fetch_idle_timeout = 30,
+    .fetch_write_buf_budget = 8192,
+    .fetch_min_free_heap = 16384,
+    .fetch_gzip_decoders = 1,
+    .fetch_cache_index = "fetch_cache.json",
+    .led_fps = 50,
+    .led_curve = "gamma",
+    .profile_lag_interval = 0,
+};
+
+size_t mock_free_heap = 200000;
+int mock_restarts = 0;
+
+void mock_init(void) {
+  const char *ll = getenv("LOG_LEVEL");
+  if (ll != NULL) cs_log_level = (enum cs_log_level) atoi(ll);
+}
+
+/* Logging */
+
+int cs_log_print_prefix(enum cs_log_level level, const char *func) {
+  if (level > cs_log_level) return 0;
+  fprintf(stderr, "%-24s ", func);
+  return 1;
+}
+
+void cs_log_printf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+/* Clock and timers */
+
+#define MOCK_MAX_TIMERS 64
+
+struct mock_timer {
+  mgos_timer_id id;
+  double due;
+  double interval;
+  bool repeat;
+  timer_callback cb;
+  void *arg;
+};
+
+static struct mock_timer s_timers[MOCK_MAX_TIMERS];
+static mgos_timer_id s_last_timer_id = 0;
+static double s_virtual_now = -1;
+
+static double real_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double mgos_uptime(void) {
+  return (s_virtual_now >= 0 ? s_virtual_now : real_now());
+}
+
+double mg_time(void) {
+  return 1.5e9 + mgos_uptime();
+}
+
+void mock_clock_set(double now) {
+  s_virtual_now = now;
+}
+
+void mock_clock_advance(double seconds) {
+  double end;
+  if (s_virtual_now < 0) s_virtual_now = 0;
+  end = s_virtual_now + seconds;
+  /* Step through the due times so that timers see the time they asked for. */
+  for (;;) {
+    double next = end;
+    int i;
+    for (i = 0; i < MOCK_MAX_TIMERS; i++) {
+      if (s_timers[i].id != 0 && s_timers[i].due < next) {
+        next = s_timers[i].due;
+      }
+    }
+    if (next > s_virtual_now) s_virtual_now = next;
+    mock_timers_run();
+    if (next >= end) break;
+  }
+}
+
+int mock_timers_run(void) {
+  double now = mgos_uptime();
+  int i, n = 0;
+  for (i = 0; i < MOCK_MAX_TIMERS; i++) {
+    struct mock_timer *t = &s_timers[i];
+    mgos_timer_id id = t->id;
+    if (id == 0 || t->due > now) continue;
+    if (t->repeat) {
+      t->due += t->interval;
+      if (t->due < now) t->due = now + t->interval;
+    } else {
+      t->id = 0;
+    }
+    t->cb(t->arg);
+    n++;
+  }
+  return n;
+}
+
+int mock_timers_pending(void) {
+  int i, n = 0;
+  for (i = 0; i < MOCK_MAX_TIMERS; i++) n += (s_timers[i].id != 0);
+  return n;
+}
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb,
+                             void *cb_arg) {
+  int i;
+  for (i = 0; i < MOCK_MAX_TIMERS; i++) {
+    struct mock_timer *t = &s_timers[i];
+    if (t->id != 0) continue;
+    t->id = ++s_last_timer_id;
+    t->interval = msecs / 1000.0;
+    t->due = mgos_uptime() + t->interval;
+    t->repeat = (flags & MGOS_TIMER_REPEAT) != 0;
+    t->cb = cb;
+    t->arg = cb_arg;
+    return t->id;
+  }
+  fprintf(stderr, "out of mock timers\n");
+  abort();
+}
+
+void mgos_clear_timer(mgos_timer_id id) {
+  int i;
+  if (id == MGOS_INVALID_TIMER_ID) return;
+  for (i = 0; i < MOCK_MAX_TIMERS; i++) {
+    if (s_timers[i].id == id) s_timers[i].id = 0;
+  }
+}
+
+/* System */
+
+size_t mgos_get_heap_size(void) {
+  return 300000;
+}
+
+size_t mgos_get_free_heap_size(void) {
+  return mock_free_heap;
+}
+
+size_t mgos_get_min_free_heap_size(void) {
+  return mock_free_heap;
+}
+
+void mgos_wdt_feed(void) {
+}
+
+void mgos_system_restart(void) {
+  mock_restarts++;
+}
+
+int mgos_event_trigger(int ev, void *ev_data) {
+  (void) ev;
+  (void) ev_data;
+  return 0;
+}
+
+int mgos_sys_config_get_update_timeout(void) {
+  return mock_cfg.update_timeout;
+}
+
+int mgos_sys_config_get_fetch_max_conns(void) {
+  return mock_cfg.fetch_max_conns;
+}
+
+int mgos_sys_config_get_fetch_pipeline(void) {
+  return mock_cfg.fetch_pipeline;
+}
+
+int mgos_sys_config_get_fetch_idle_timeout(void) {
+  return mock_cfg.fetch_idle_timeout;
+}
+
+int mgos_sys_config_get_fetch_write_buf_budget(void) {
+  return mock_cfg.fetch_write_buf_budget;
+}
+
+int mgos_sys_config_get_fetch_min_free_heap(void) {
+  return mock_cfg.fetch_min_free_heap;
+}
+
+int mgos_sys_config_get_fetch_gzip_decoders(void) {
+  return mock_cfg.fetch_gzip_decoders;
+}
+
+const char *mgos_sys_config_get_fetch_cache_index(void) {
+  return mock_cfg.fetch_cache_index;
+}
+
+int mgos_sys_config_get_led_fps(void) {
+  return mock_cfg.led_fps;
+}
+
+const char *mgos_sys_config_get_led_curve(void) {
+  return mock_cfg.led_curve;
+}
+
+int mgos_sys_config_get_profile_lag_interval(void) {
+  return mock_cfg.profile_lag_interval;
+}
+
+/* mbuf and mg_str, with mongoose's growth policy */
+
+#define MBUF_SIZE_MULTIPLIER 1.5
+
+void mbuf_init(struct mbuf *mb, size_t initial_capacity) {
+  mb->len = mb->size = 0;
+  mb->buf = NULL;
+  mbuf_resize(mb, initial_capacity);
+}
+
+void mbuf_free(struct mbuf *mb) {
+  free(mb->buf);
+  mbuf_init(mb, 0);
+}
+
+void mbuf_resize(struct mbuf *mb, size_t new_size) {
+  if (new_size > mb->size || (new_size < mb->size && new_size >= mb->len)) {
+    char *buf = (char *) realloc(mb->buf, new_size);
+    if (buf == NULL && new_size != 0) return;
+    mb->buf = buf;
+    mb->size = new_size;
+  }
+}
+
+void mbuf_trim(struct mbuf *mb) {
+  mbuf_resize(mb, mb->len);
+}
+
+size_t mbuf_insert(struct mbuf *mb, size_t off, const void *data, size_t len) {
+  if (off > mb->len) return 0;
+  if (mb->len + len > mb->size) {
+    size_t new_size = (size_t)((mb->len + len) * MBUF_SIZE_MULTIPLIER);
+    mbuf_resize(mb, new_size);
+    if (mb->len + len > mb->size) return 0;
+  }
+  memmove(mb->buf + off + len, mb->buf + off, mb->len - off);
+  if (data != NULL) memcpy(mb->buf + off, data, len);
+  mb->len += len;
+  return len;
+}
+
+size_t mbuf_append(struct mbuf *mb, const void *data, size_t len) {
+  return mbuf_insert(mb, mb->len, data, len);
+}
+
+void mbuf_remove(struct mbuf *mb, size_t n) {
+  if (n > mb->len) n = mb->len;
+  memmove(mb->buf, mb->buf + n, mb->len - n);
+  mb->len -= n;
+}
+
+struct mg_str mg_mk_str(const char *s) {
+  struct mg_str ret = {s, s != NULL ? strlen(s) : 0};
+  return ret;
+}
+
+struct mg_str mg_mk_str_n(const char *s, size_t len) {
+  struct mg_str ret = {s, len};
+  return ret;
+}
+
+int mg_vcmp(const struct mg_str *str1, const char *str2) {
+  size_t n2 = strlen(str2), n1 = str1->len;
+  int r = strncmp(str1->p, str2, (n1 < n2) ? n1 : n2);
+  if (r == 0) return (int) (n1 - n2);
+  return r;
+}
+
+int mg_vcasecmp(const struct mg_str *str1, const char *str2) {
+  size_t n2 = strlen(str2), n1 = str1->len;
+  int r = strncasecmp(str1->p, str2, (n1 < n2) ? n1 : n2);
+  if (r == 0) return (int) (n1 - n2);
+  return r;
+}
+
+int mg_strcmp(const struct mg_str str1, const struct mg_str str2) {
+  size_t i = 0;
+  while (i < str1.len && i < str2.len) {
+    if (str1.p[i] < str2.p[i]) return -1;
+    if (str1.p[i] > str2.p[i]) return 1;
+    i++;
+  }
+  if (i < str1.len) return 1;
+  if (i < str2.len) return -1;
+  return 0;
+}
+
+struct mg_str mg_strdup_nul(const struct mg_str s) {
+  struct mg_str r = {NULL, 0};
+  char *p = (char *) malloc(s.len + 1);
+  if (p != NULL) {
+    if (s.len > 0) memcpy(p, s.p, s.len);
+    p[s.len] = '\0';
+    r.p = p;
+    r.len = s.len;
+  }
+  return r;
+}
+
+const char *mg_strstr(const struct mg_str haystack,
+                      const struct mg_str needle) {
+  size_t i;
+  if (needle.len > haystack.len) return NULL;
+  for (i = 0; i <= haystack.len - needle.len; i++) {
+    if (memcmp(haystack.p + i, needle.p, needle.len) == 0) {
+      return haystack.p + i;
+    }
+  }
+  return NULL;
+}
+
+/* Always allocates; the caller's buffer is not used. */
+int mg_asprintf(char **buf, size_t size, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  (void) size;
+  va_start(ap, fmt);
+  n = vasprintf(buf, fmt, ap);
+  va_end(ap);
+  if (n < 0) *buf = NULL;
+  return n;
+}
+
+char *cs_read_file(const char *path, size_t *size) {
+  return mock_read_file(path, size);
+}
+
+char *mock_read_file(const char *path, size_t *size) {
+  FILE *fp = fopen(path, "rb");
+  char *data = NULL;
+  long n;
+  if (fp == NULL) return NULL;
+  if (fseek(fp, 0, SEEK_END) == 0 && (n = ftell(fp)) >= 0 &&
+      fseek(fp, 0, SEEK_SET) == 0 &&
+      (data = (char *) malloc((size_t) n + 1)) != NULL) {
+    if (fread(data, 1, (size_t) n, fp) != (size_t) n) {
+      free(data);
+      data = NULL;
+    } else {
+      data[n] = '\0';
+      if (size != NULL) *size = (size_t) n;
+    }
+  }
+  fclose(fp);
+  return data;
+}
+
+/* SHA-1 */
+
+#define ROL(v, b) (((v) << (b)) | ((v) >> (32 - (b))))
+
+static uint32_t get_be32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+         (uint32_t) p[2] << 8 | p[3];
+}
+
+static void sha1_transform(uint32_t state[5], const unsigned char block[64]) {
+  uint32_t w[80], a, b, c, d, e, t;
+  int i;
+  for (i = 0; i < 16; i++) w[i] = get_be32(block + i * 4);
+  for (; i < 80; i++) w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+  for (i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    t = ROL(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = ROL(b, 30);
+    b = a;
+    a = t;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void cs_sha1_init(cs_sha1_ctx *ctx) {
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  ctx->state[4] = 0xc3d2e1f0;
+  ctx->count[0] = ctx->count[1] = 0;
+}
+
+void cs_sha1_update(cs_sha1_ctx *ctx, const unsigned char *data, uint32_t len) {
+  size_t off = ctx->count[0] % 64;
+  uint64_t total = ((uint64_t) ctx->count[1] << 32 | ctx->count[0]) + len;
+  ctx->count[0] = (uint32_t) total;
+  ctx->count[1] = (uint32_t)(total >> 32);
+  while (len > 0) {
+    size_t n = 64 - off;
+    if (n > len) n = len;
+    if (off == 0 && n == 64) {
+      sha1_transform(ctx->state, data);
+    } else {
+      memcpy(ctx->buffer + off, data, n);
+      if (off + n == 64) sha1_transform(ctx->state, ctx->buffer);
+    }
+    off = (off + n) % 64;
+    data += n;
+    len -= n;
+  }
+}
+
+void cs_sha1_final(unsigned char digest[20], cs_sha1_ctx *ctx) {
+  uint64_t bits = ((uint64_t) ctx->count[1] << 32 | ctx->count[0]) * 8;
+  unsigned char pad[72] = {0x80}, len[8];
+  size_t off = ctx->count[0] % 64;
+  int i;
+  cs_sha1_update(ctx, pad, (uint32_t)(off < 56 ? 56 - off : 120 - off));
+  for (i = 0; i < 8; i++) len[i] = (unsigned char) (bits >> (56 - 8 * i));
+  cs_sha1_update(ctx, len, 8);
+  for (i = 0; i < 20; i++) {
+    digest[i] = (unsigned char) (ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+  }
+}
+
+/* SHA-256 */
+
+#define ROR(v, b) (((v) >> (b)) | ((v) << (32 - (b))))
+
+static const uint32_t s_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_transform(uint32_t state[8], const unsigned char block[64]) {
+  uint32_t w[64], s[8], t1, t2;
+  int i;
+  for (i = 0; i < 16; i++) w[i] = get_be32(block + i * 4);
+  for (; i < 64; i++) {
+    uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  memcpy(s, state, sizeof(s));
+  for (i = 0; i < 64; i++) {
+    uint32_t e1 = ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25);
+    uint32_t ch = (s[4] & s[5]) ^ (~s[4] & s[6]);
+    uint32_t e0 = ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22);
+    uint32_t maj = (s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]);
+    t1 = s[7] + e1 + ch + s_sha256_k[i] + w[i];
+    t2 = e0 + maj;
+    memmove(s + 1, s, 7 * sizeof(s[0]));
+    s[4] += t1;
+    s[0] = t1 + t2;
+  }
+  for (i = 0; i < 8; i++) state[i] += s[i];
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224) {
+  static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx->state, init, sizeof(init));
+  ctx->total[0] = ctx->total[1] = 0;
+  ctx->is224 = is224;
+}
+
+void mbedtls_sha256_update(mbedtls_sha256_context *ctx,
+                           const unsigned char *input, size_t ilen) {
+  size_t off = ctx->total[0] % 64;
+  uint64_t total = ((uint64_t) ctx->total[1] << 32 | ctx->total[0]) + ilen;
+  ctx->total[0] = (uint32_t) total;
+  ctx->total[1] = (uint32_t)(total >> 32);
+  while (ilen > 0) {
+    size_t n = 64 - off;
+    if (n > ilen) n = ilen;
+    if (off == 0 && n == 64) {
+      sha256_transform(ctx->state, input);
+    } else {
+      memcpy(ctx->buffer + off, input, n);
+      if (off + n == 64) sha256_transform(ctx->state, ctx->buffer);
+    }
+    off = (off + n) % 64;
+    input += n;
+    ilen -= n;
+  }
+}
+
+void mbedtls_sha256_finish(mbedtls_sha256_context *ctx,
+                           unsigned char output[32]) {
+  uint64_t bits = ((uint64_t) ctx->total[1] << 32 | ctx->total[0]) * 8;
+  unsigned char pad[72] = {0x80}, len[8];
+  size_t off = ctx->total[0] % 64;
+  int i;
+  mbedtls_sha256_update(ctx, pad, off < 56 ? 56 - off : 120 - off);
+  for (i = 0; i < 8; i++) len[i] = (unsigned char) (bits >> (56 - 8 * i));
+  mbedtls_sha256_update(ctx, len, 8);
+  for (i = 0; i < 32; i++) {
+    output[i] = (unsigned char) (ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+  }
+}
@@ -0,0 +1,663 @@
+/*
+ * Network on the host: client connections of the mongoose API to a
+ * simulated HTTP/1.1 server, on the virtual clock.
+ *
+ * A connection is up `handshake` seconds after mg_connect_opt(). What the
+ * client sends reaches the server half a round trip later. The server
+ * answers each request as soon as it is in, in order, and its replies go
+ * out in packets over one link of `bandwidth` bytes per second shared by
+ * all connections, each packet arriving half a round trip after it has
+ * been sent. A connection takes no more than its recv_mbuf_limit; the rest
+ * waits, as it would in the socket buffers.
+ *
+ * Events are delivered by mock_net_run(), which also moves the clock on to
+ * the next one. A UART that has data to send counts as one.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+
+#include "mock.h"
+
+#define MOCK_NET_MSS 1460
+#define MOCK_NET_MAX_FILES 64
+
+struct mock_net_config mock_net;
+
+/* In the UART transmit buffer, see mgos_uart_write(). */
+static size_t s_uart_queued = 0;
+static double s_uart_since = 0;
+static double uart_next(void);
+
+struct mock_file {
+  char *path;
+  char *data;
+  size_t len;
+  char *etag;
+};
+
+/* Bytes that arrive at `at`, up to `end` in the stream they belong to. */
+struct mock_packet {
+  double at;
+  size_t end;
+};
+
+struct mock_conn {
+  struct mg_connection nc;
+  double connect_at; /* < 0 once connected */
+  bool server_closed;
+  double close_at;   /* When the FIN arrives, if server_closed */
+  int num_replies;
+  /* Client to server: bytes sent, and when they arrive. */
+  struct mbuf up;
+  struct mock_packet *up_pkts;
+  int num_up_pkts;
+  size_t up_done; /* Bytes of up taken by the server */
+  /* Server to client: bytes sent, and when they arrive. */
+  struct mbuf down;
+  struct mock_packet *down_pkts;
+  int num_down_pkts;
+  size_t down_done; /* Bytes of down put in recv_mbuf */
+  struct mock_conn *next;
+};
+
+static struct mock_file s_files[MOCK_NET_MAX_FILES];
+static int s_num_files;
+static struct mock_conn *s_conns;
+static double s_link_free; /* When the shared link is free */
+
+static struct mg_mgr *s_mgr = (struct mg_mgr *) &s_files;
+
+struct mg_mgr *mgos_get_mgr(void) {
+  return s_mgr;
+}
+
+void mock_net_reset(void) {
+  int i;
+  for (i = 0; i < s_num_files; i++) {
+    free(s_files[i].path);
+    free(s_files[i].data);
+    free(s_files[i].etag);
+  }
+  s_num_files = 0;
+  s_link_free = 0;
+  s_uart_queued = 0;
+  memset(&mock_net, 0, sizeof(mock_net));
+  mock_net.rtt = 0.05;
+  mock_net.handshake = 0.05;
+  mock_net.bandwidth = 1e6;
+  mock_net.ranges = true;
+}
+
+void mock_net_add_file(const char *path, const void *data, size_t len,
+                       const char *etag) {
+  struct mock_file *f;
+  if (s_num_files == MOCK_NET_MAX_FILES) {
+    fprintf(stderr, "out of mock files\n");
+    abort();
+  }
+  f = &s_files[s_num_files++];
+  f->path = strdup(path);
+  f->data = (char *) malloc(len + 1);
+  memcpy(f->data, data, len);
+  f->len = len;
+  f->etag = (etag != NULL ? strdup(etag) : NULL);
+}
+
+static const struct mock_file *find_file(const struct mg_str path) {
+  int i;
+  for (i = 0; i < s_num_files; i++) {
+    if (mg_vcmp(&path, s_files[i].path) == 0) return &s_files[i];
+  }
+  return NULL;
+}
+
+static void add_packet(struct mock_packet **pkts, int *num, double at,
+                       size_t end) {
+  *pkts = (struct mock_packet *) realloc(*pkts, (*num + 1) * sizeof(**pkts));
+  (*pkts)[*num].at = at;
+  (*pkts)[*num].end = end;
+  (*num)++;
+}
+
+/* Sends data from the server, in packets over the shared link. */
+static void server_send(struct mock_conn *mc, const char *data, size_t len) {
+  double now = mgos_uptime();
+  while (len > 0) {
+    size_t n = (len < MOCK_NET_MSS ? len : MOCK_NET_MSS);
+    if (s_link_free < now) s_link_free = now;
+    s_link_free += n / mock_net.bandwidth;
+    mbuf_append(&mc->down, data, n);
+    add_packet(&mc->down_pkts, &mc->num_down_pkts,
+               s_link_free + mock_net.rtt / 2, mc->down.len);
+    data += n;
+    len -= n;
+  }
+}
+
+static void server_printf(struct mock_conn *mc, const char *fmt, ...) {
+  char buf[512];
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  server_send(mc, buf, n);
+}
+
+/* Closes the connection from the server side once all sent has arrived. */
+static void server_close(struct mock_conn *mc) {
+  double now = mgos_uptime();
+  mc->server_closed = true;
+  mc->close_at = now + mock_net.rtt / 2;
+  if (mc->num_down_pkts > 0 &&
+      mc->down_pkts[mc->num_down_pkts - 1].at > mc->close_at) {
+    mc->close_at = mc->down_pkts[mc->num_down_pkts - 1].at;
+  }
+}
+
+static void server_reply(struct mock_conn *mc, struct http_message *hm) {
+  const struct mock_file *f = find_file(hm->uri);
+  struct mg_str *range = mg_get_http_header(hm, "Range");
+  struct mg_str *inm = mg_get_http_header(hm, "If-None-Match");
+  unsigned long start = 0, end = 0;
+  size_t len;
+  bool close;
+  mock_net.requests++;
+  mc->num_replies++;
+  close = (mock_net.close || (mock_net.max_requests > 0 &&
+                              mc->num_replies >= mock_net.max_requests));
+  if (f == NULL) {
+    server_printf(mc,
+                  "HTTP/1.1 404 Not Found\r\nContent-Length: 9\r\n%s\r\n"
+                  "Not found",
+                  (close ? "Connection: close\r\n" : ""));
+    if (close) server_close(mc);
+    return;
+  }
+  if (inm != NULL && f->etag != NULL && mg_vcmp(inm, f->etag) == 0) {
+    mock_net.not_modified++;
+    server_printf(mc, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n%s\r\n",
+                  f->etag, (close ? "Connection: close\r\n" : ""));
+    if (close) server_close(mc);
+    return;
+  }
+  if (range != NULL && mock_net.ranges) {
+    char buf[64];
+    int n;
+    snprintf(buf, sizeof(buf), "%.*s", (int) range->len, range->p);
+    n = sscanf(buf, "bytes=%lu-%lu", &start, &end);
+    if (n < 1 || start >= f->len) {
+      server_printf(mc,
+                    "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                    "Content-Range: bytes */%lu\r\nContent-Length: 0\r\n%s\r\n",
+                    (unsigned long) f->len,
+                    (close ? "Connection: close\r\n" : ""));
+      if (close) server_close(mc);
+      return;
+    }
+    if (n < 2 || end >= f->len) end = f->len - 1;
+    mock_net.ranges_served++;
+    mock_net.last_range_start = start;
+  } else {
+    range = NULL;
+    end = (f->len > 0 ? f->len - 1 : 0);
+  }
+  len = (f->len > 0 ? end - start + 1 : 0);
+  server_printf(mc, "HTTP/1.1 %s\r\nContent-Length: %lu\r\n",
+                (range != NULL ? "206 Partial Content" : "200 OK"),
+                (unsigned long) len);
+  if (range != NULL) {
+    server_printf(mc, "Content-Range: bytes %lu-%lu/%lu\r\n", start, end,
+                  (unsigned long) f->len);
+  }
+  if (mock_net.ranges) server_printf(mc, "Accept-Ranges: bytes\r\n");
+  if (f->etag != NULL) server_printf(mc, "ETag: %s\r\n", f->etag);
+  server_printf(mc, "%s\r\n", (close ? "Connection: close\r\n" : ""));
+  if (mock_net.drop_after > 0 && len > mock_net.drop_after) {
+    /* Once: the connection breaks in the middle of the body. */
+    len = mock_net.drop_after;
+    mock_net.drop_after = 0;
+    close = true;
+  }
+  server_send(mc, f->data + start, len);
+  mock_net.body_bytes += len;
+  if (close) server_close(mc);
+}
+
+/* Takes the requests that have arrived at the server. */
+static bool server_poll(struct mock_conn *mc, double now) {
+  size_t arrived = mc->up_done;
+  bool any = false;
+  int i;
+  for (i = 0; i < mc->num_up_pkts && mc->up_pkts[i].at <= now; i++) {
+    arrived = mc->up_pkts[i].end;
+  }
+  if (mc->server_closed) {
+    /* Nobody is listening any more. */
+    mc->up_done = arrived;
+    return false;
+  }
+  while (arrived > mc->up_done) {
+    struct http_message hm;
+    int len = mg_parse_http(mc->up.buf + mc->up_done,
+                            (int) (arrived - mc->up_done), &hm, 1 /* is_req */);
+    if (len == 0) break;
+    if (len < 0) {
+      mc->up_done = arrived;
+      server_close(mc);
+      break;
+    }
+    mc->up_done += len;
+    server_reply(mc, &hm);
+    any = true;
+    if (mc->server_closed) mc->up_done = arrived;
+  }
+  return any;
+}
+
+static void conn_event(struct mock_conn *mc, int ev, void *ev_data) {
+  mc->nc.handler(&mc->nc, ev, ev_data, mc->nc.user_data);
+}
+
+/* Moves what has arrived into recv_mbuf, as far as the limit allows. */
+static bool client_recv(struct mock_conn *mc, double now) {
+  size_t avail = mc->down_done, room;
+  int i, n;
+  for (i = 0; i < mc->num_down_pkts && mc->down_pkts[i].at <= now; i++) {
+    avail = mc->down_pkts[i].end;
+  }
+  if (avail <= mc->down_done) return false;
+  room = (mc->nc.recv_mbuf_limit > mc->nc.recv_mbuf.len
+              ? mc->nc.recv_mbuf_limit - mc->nc.recv_mbuf.len
+              : 0);
+  if (mc->nc.recv_mbuf_limit == 0) room = avail - mc->down_done;
+  n = (int) (avail - mc->down_done < room ? avail - mc->down_done : room);
+  if (n == 0) return false;
+  mbuf_append(&mc->nc.recv_mbuf, mc->down.buf + mc->down_done, n);
+  mc->down_done += n;
+  conn_event(mc, MG_EV_RECV, &n);
+  return true;
+}
+
+/*
+ * Next time after `now` something is due on the connection, -1 if nothing
+ * is. What is due by now has been delivered, or is held up by a full
+ * recv_mbuf.
+ */
+static double conn_next(const struct mock_conn *mc, double now) {
+  double next = -1;
+  int i;
+  if (mc->connect_at >= 0) return mc->connect_at;
+  for (i = 0; i < mc->num_up_pkts; i++) {
+    if (mc->up_pkts[i].end <= mc->up_done) continue;
+    if (mc->up_pkts[i].at > now) next = mc->up_pkts[i].at;
+    break;
+  }
+  for (i = 0; i < mc->num_down_pkts; i++) {
+    if (mc->down_pkts[i].end <= mc->down_done) continue;
+    if (mc->down_pkts[i].at > now &&
+        (next < 0 || mc->down_pkts[i].at < next)) {
+      next = mc->down_pkts[i].at;
+    }
+    break;
+  }
+  if (mc->server_closed && mc->down_done == mc->down.len &&
+      mc->close_at > now && (next < 0 || mc->close_at < next)) {
+    next = mc->close_at;
+  }
+  return next;
+}
+
+static void conn_free(struct mock_conn *mc) {
+  struct mock_conn **p;
+  for (p = &s_conns; *p != mc; p = &(*p)->next) {
+  }
+  *p = mc->next;
+  mbuf_free(&mc->nc.recv_mbuf);
+  mbuf_free(&mc->nc.send_mbuf);
+  mbuf_free(&mc->up);
+  mbuf_free(&mc->down);
+  free(mc->up_pkts);
+  free(mc->down_pkts);
+  free(mc);
+}
+
+static void conn_close(struct mock_conn *mc) {
+  mock_net.closes++;
+  conn_event(mc, MG_EV_CLOSE, NULL);
+  conn_free(mc);
+}
+
+/* Delivers what is due now. Returns true if anything was. */
+static bool net_step(void) {
+  double now = mgos_uptime();
+  struct mock_conn *mc, *next;
+  bool any = false;
+  for (mc = s_conns; mc != NULL; mc = next) {
+    next = mc->next;
+    if (mc->nc.flags & MG_F_CLOSE_IMMEDIATELY) {
+      conn_close(mc);
+      any = true;
+      continue;
+    }
+    if (mc->connect_at >= 0 && mc->connect_at <= now) {
+      int err = 0;
+      mc->connect_at = -1;
+      conn_event(mc, MG_EV_CONNECT, &err);
+      any = true;
+    }
+    if (mc->connect_at < 0 && mc->nc.send_mbuf.len > 0) {
+      /* Requests are small: a packet each, no queueing on the way up. */
+      mbuf_append(&mc->up, mc->nc.send_mbuf.buf, mc->nc.send_mbuf.len);
+      add_packet(&mc->up_pkts, &mc->num_up_pkts, now + mock_net.rtt / 2,
+                 mc->up.len);
+      mbuf_remove(&mc->nc.send_mbuf, mc->nc.send_mbuf.len);
+    }
+    if (server_poll(mc, now)) any = true;
+    if (client_recv(mc, now)) any = true;
+    if (mc->nc.flags & MG_F_CLOSE_IMMEDIATELY) continue;
+    if (mc->server_closed && mc->down_done == mc->down.len &&
+        mc->close_at <= now) {
+      conn_close(mc);
+      any = true;
+    }
+  }
+  return any;
+}
+
+void mock_net_poll(void) {
+  struct mock_conn *mc, *next;
+  while (net_step()) {
+  }
+  for (mc = s_conns; mc != NULL; mc = next) {
+    next = mc->next;
+    if (!(mc->nc.flags & MG_F_CLOSE_IMMEDIATELY)) {
+      conn_event(mc, MG_EV_POLL, NULL);
+    }
+  }
+  while (net_step()) {
+  }
+}
+
+bool mock_net_run(double max_seconds) {
+  double end = mgos_uptime() + max_seconds;
+  for (;;) {
+    struct mock_conn *mc;
+    double next = -1, now;
+    mock_net_poll();
+    now = mgos_uptime();
+    for (mc = s_conns; mc != NULL; mc = mc->next) {
+      double t = conn_next(mc, now);
+      if (t >= 0 && (next < 0 || t < next)) next = t;
+    }
+    /* The UART sending what it has been given, for whoever waits on it. */
+    if (next < 0) next = uart_next();
+    if (next < 0) return true;
+    if (next > end) {
+      mock_clock_advance(end - now);
+      return false;
+    }
+    mock_clock_advance(next - now);
+  }
+}
+
+int mock_net_conns(void) {
+  struct mock_conn *mc;
+  int n = 0;
+  for (mc = s_conns; mc != NULL; mc = mc->next) n++;
+  return n;
+}
+
+/* mongoose */
+
+struct mg_connection *mg_connect_opt(struct mg_mgr *mgr, const char *address,
+                                     mg_event_handler_t handler,
+                                     void *user_data,
+                                     struct mg_connect_opts opts) {
+  struct mock_conn *mc = (struct mock_conn *) calloc(1, sizeof(*mc));
+  (void) address;
+  (void) opts;
+  if (mc == NULL) return NULL;
+  mc->nc.mgr = mgr;
+  mc->nc.handler = handler;
+  mc->nc.user_data = user_data;
+  mc->nc.priv_mock = mc;
+  mbuf_init(&mc->nc.recv_mbuf, 0);
+  mbuf_init(&mc->nc.send_mbuf, 0);
+  mbuf_init(&mc->up, 0);
+  mbuf_init(&mc->down, 0);
+  mc->connect_at = mgos_uptime() + mock_net.handshake;
+  mc->next = s_conns;
+  s_conns = mc;
+  mock_net.connects++;
+  return &mc->nc;
+}
+
+void mg_send(struct mg_connection *nc, const void *buf, int len) {
+  mbuf_append(&nc->send_mbuf, buf, len);
+}
+
+int mg_printf(struct mg_connection *nc, const char *fmt, ...) {
+  char *buf = NULL;
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = vasprintf(&buf, fmt, ap);
+  va_end(ap);
+  if (n > 0) mg_send(nc, buf, n);
+  free(buf);
+  return n;
+}
+
+static const char *next_line(const char *p, const char *end) {
+  const char *eol = (const char *) memchr(p, '\n', end - p);
+  return (eol != NULL ? eol + 1 : end);
+}
+
+static struct mg_str trim_line(const char *p, const char *eol) {
+  while (eol > p && (eol[-1] == '\n' || eol[-1] == '\r')) eol--;
+  return mg_mk_str_n(p, eol - p);
+}
+
+/* Splits `s` at the first space. */
+static struct mg_str split(struct mg_str *s) {
+  struct mg_str word = *s;
+  const char *sp = (const char *) memchr(s->p, ' ', s->len);
+  if (sp == NULL) {
+    s->p += s->len;
+    s->len = 0;
+    return word;
+  }
+  word.len = sp - s->p;
+  s->len -= word.len + 1;
+  s->p = sp + 1;
+  return word;
+}
+
+int mg_parse_http(const char *s, int n, struct http_message *hm, int is_req) {
+  const char *end = s + n, *p, *eol, *hdr_end = NULL;
+  struct mg_str line;
+  int i = 0;
+  for (p = s; p < end; p = eol) {
+    eol = next_line(p, end);
+    if (eol == end && (eol == p || eol[-1] != '\n')) break;
+    if (p != s && trim_line(p, eol).len == 0) {
+      hdr_end = eol;
+      break;
+    }
+  }
+  if (hdr_end == NULL) return 0;
+  memset(hm, 0, sizeof(*hm));
+  eol = next_line(s, end);
+  line = trim_line(s, eol);
+  if (is_req) {
+    hm->method = split(&line);
+    hm->uri = split(&line);
+    hm->proto = line;
+    if (hm->method.len == 0 || hm->uri.len == 0) return -1;
+    p = (const char *) memchr(hm->uri.p, '?', hm->uri.len);
+    if (p != NULL) {
+      hm->query_string = mg_mk_str_n(p + 1, hm->uri.p + hm->uri.len - p - 1);
+      hm->uri.len = p - hm->uri.p;
+    }
+  } else {
+    struct mg_str code;
+    hm->proto = split(&line);
+    code = split(&line);
+    hm->resp_status_msg = line;
+    if (hm->proto.len < 5 || strncmp(hm->proto.p, "HTTP/", 5) != 0 ||
+        code.len != 3) {
+      return -1;
+    }
+    hm->resp_code = atoi(code.p);
+  }
+  for (p = eol; p < hdr_end && i < MG_MAX_HTTP_HEADERS; p = eol) {
+    const char *colon;
+    eol = next_line(p, hdr_end);
+    line = trim_line(p, eol);
+    if (line.len == 0) break;
+    if ((colon = (const char *) memchr(line.p, ':', line.len)) == NULL) {
+      return -1;
+    }
+    hm->header_names[i] = mg_mk_str_n(line.p, colon - line.p);
+    for (colon++; colon < line.p + line.len && *colon == ' '; colon++) {
+    }
+    hm->header_values[i++] = mg_mk_str_n(colon, line.p + line.len - colon);
+  }
+  hm->message = mg_mk_str_n(s, n);
+  hm->body = mg_mk_str_n(hdr_end, end - hdr_end);
+  return (int) (hdr_end - s);
+}
+
+struct mg_str *mg_get_http_header(struct http_message *hm, const char *name) {
+  size_t len = strlen(name);
+  int i;
+  for (i = 0; i < MG_MAX_HTTP_HEADERS && hm->header_names[i].len > 0; i++) {
+    if (hm->header_names[i].len == len &&
+        strncasecmp(hm->header_names[i].p, name, len) == 0) {
+      return &hm->header_values[i];
+    }
+  }
+  return NULL;
+}
+
+int mg_parse_uri(const struct mg_str uri, struct mg_str *scheme,
+                 struct mg_str *user_info, struct mg_str *host,
+                 unsigned int *port, struct mg_str *path, struct mg_str *query,
+                 struct mg_str *fragment) {
+  const char *p = uri.p, *end = uri.p + uri.len, *q;
+  struct mg_str rest;
+  memset(scheme, 0, sizeof(*scheme));
+  memset(user_info, 0, sizeof(*user_info));
+  memset(host, 0, sizeof(*host));
+  memset(path, 0, sizeof(*path));
+  memset(query, 0, sizeof(*query));
+  memset(fragment, 0, sizeof(*fragment));
+  *port = 0;
+  rest = mg_mk_str_n(p, end - p);
+  if ((q = mg_strstr(rest, mg_mk_str("://"))) != NULL) {
+    *scheme = mg_mk_str_n(p, q - p);
+    p = q + 3;
+  }
+  for (q = p; q < end && *q != '/' && *q != '?' && *q != '#'; q++) {
+  }
+  host->p = p;
+  host->len = q - p;
+  for (p = host->p; p < q; p++) {
+    if (*p == '@') {
+      *user_info = mg_mk_str_n(host->p, p - host->p);
+      host->len -= p + 1 - host->p;
+      host->p = p + 1;
+    }
+  }
+  for (p = host->p; p < host->p + host->len; p++) {
+    if (*p == ':') {
+      char *e;
+      unsigned long v = strtoul(p + 1, &e, 10);
+      if (e != host->p + host->len || v == 0 || v > 65535) return -1;
+      *port = (unsigned int) v;
+      host->len = p - host->p;
+      break;
+    }
+  }
+  p = q;
+  for (q = p; q < end && *q != '?' && *q != '#'; q++) {
+  }
+  *path = mg_mk_str_n(p, q - p);
+  if (q < end && *q == '?') {
+    for (p = ++q; q < end && *q != '#'; q++) {
+    }
+    *query = mg_mk_str_n(p, q - p);
+  }
+  if (q < end && *q == '#') *fragment = mg_mk_str_n(q + 1, end - q - 1);
+  return 0;
+}
+
+/*
+ * UARTs: all share one transmit buffer of mock_net.uart_buf_size bytes,
+ * which empties at mock_net.uart_rate, see mock_net_run().
+ */
+
+#define MOCK_UART_MAX 3
+
+static struct {
+  mgos_uart_dispatcher_t cb;
+  void *arg;
+} s_uart_dispatchers[MOCK_UART_MAX];
+
+/* Takes out of the buffer what has been sent by now. */
+static void uart_drain(void) {
+  double now = mgos_uptime();
+  size_t sent;
+  /* By the time uart_next() has said, whatever the rounding. */
+  if (s_uart_queued == 0 ||
+      now >= s_uart_since + s_uart_queued / mock_net.uart_rate) {
+    s_uart_queued = 0;
+    s_uart_since = now;
+    return;
+  }
+  sent = (size_t) ((now - s_uart_since) * mock_net.uart_rate);
+  s_uart_queued -= sent;
+  s_uart_since += sent / mock_net.uart_rate;
+}
+
+/* When the transmit buffer is empty, -1 if it is already. */
+static double uart_next(void) {
+  uart_drain();
+  if (s_uart_queued == 0) return -1;
+  return s_uart_since + s_uart_queued / mock_net.uart_rate;
+}
+
+size_t mgos_uart_write(int uart_no, const void *buf, size_t len) {
+  size_t avail = mgos_uart_write_avail(uart_no);
+  (void) buf;
+  if (len > avail) len = avail;
+  if (mock_net.uart_buf_size > 0) s_uart_queued += len;
+  mock_net.uart_bytes += len;
+  return len;
+}
+
+size_t mgos_uart_write_avail(int uart_no) {
+  (void) uart_no;
+  if (mock_net.uart_buf_size == 0) return 65536;
+  uart_drain();
+  return mock_net.uart_buf_size - s_uart_queued;
+}
+
+void mgos_uart_set_dispatcher(int uart_no, mgos_uart_dispatcher_t cb,
+                              void *arg) {
+  if (uart_no < 0 || uart_no >= MOCK_UART_MAX) return;
+  s_uart_dispatchers[uart_no].cb = cb;
+  s_uart_dispatchers[uart_no].arg = arg;
+}
+
+void mock_uart_dispatch(int uart_no) {
+  if (uart_no < 0 || uart_no >= MOCK_UART_MAX) return;
+  if (s_uart_dispatchers[uart_no].cb == NULL) return;
+  s_uart_dispatchers[uart_no].cb(uart_no, s_uart_dispatchers[uart_no].arg);
+}
@@ -0,0 +1,116 @@
+/*
+ * RPC on the host: handlers are kept in a table and called directly by
+ * mock_rpc_call(), which returns what they send right away. Replies sent
+ * later go to mock_rpc_on_reply.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frozen.h"
+#include "mgos_rpc.h"
+
+#include "mock.h"
+
+#define MOCK_MAX_HANDLERS 32
+
+struct mock_handler {
+  const char *method;
+  const char *args_fmt;
+  mg_handler_cb_t cb;
+  void *cb_arg;
+};
+
+static struct mock_handler s_handlers[MOCK_MAX_HANDLERS];
+static int s_num_handlers;
+
+static char s_response[4096];
+static int s_error_code;
+static bool s_responded;
+static int64_t s_last_id;
+
+void (*mock_rpc_on_reply)(int64_t id, int error_code, const char *reply);
+
+struct mg_rpc *mgos_rpc_get_global(void) {
+  /* Never dereferenced. */
+  return (struct mg_rpc *) s_handlers;
+}
+
+void mg_rpc_add_handler(struct mg_rpc *c, const char *method,
+                        const char *args_fmt, mg_handler_cb_t cb,
+                        void *cb_arg) {
+  struct mock_handler *h;
+  int i;
+  (void) c;
+  for (i = 0; i < s_num_handlers; i++) {
+    if (strcmp(s_handlers[i].method, method) == 0) break;
+  }
+  if (i == MOCK_MAX_HANDLERS) {
+    fprintf(stderr, "out of mock RPC handlers\n");
+    abort();
+  }
+  if (i == s_num_handlers) s_num_handlers++;
+  h = &s_handlers[i];
+  h->method = method;
+  h->args_fmt = args_fmt;
+  h->cb = cb;
+  h->cb_arg = cb_arg;
+}
+
+bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri,
+                           const char *result_json_fmt, ...) {
+  struct json_out out = JSON_OUT_BUF(s_response, sizeof(s_response));
+  va_list ap;
+  s_response[0] = '\0';
+  if (result_json_fmt != NULL) {
+    va_start(ap, result_json_fmt);
+    json_vprintf(&out, result_json_fmt, ap);
+    va_end(ap);
+  }
+  s_error_code = 0;
+  s_responded = true;
+  if (mock_rpc_on_reply != NULL) mock_rpc_on_reply(ri->id, 0, s_response);
+  free(ri);
+  return true;
+}
+
+bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code,
+                        const char *error_msg_fmt, ...) {
+  va_list ap;
+  s_response[0] = '\0';
+  if (error_msg_fmt != NULL) {
+    va_start(ap, error_msg_fmt);
+    vsnprintf(s_response, sizeof(s_response), error_msg_fmt, ap);
+    va_end(ap);
+  }
+  s_error_code = error_code;
+  s_responded = true;
+  if (mock_rpc_on_reply != NULL) {
+    mock_rpc_on_reply(ri->id, error_code, s_response);
+  }
+  free(ri);
+  return true;
+}
+
+const char *mock_rpc_call(const char *method, const char *args,
+                          int *error_code) {
+  struct mg_rpc_request_info *ri;
+  int i;
+  for (i = 0; i < s_num_handlers; i++) {
+    if (strcmp(s_handlers[i].method, method) == 0) break;
+  }
+  if (i == s_num_handlers) return NULL;
+  ri = (struct mg_rpc_request_info *) calloc(1, sizeof(*ri));
+  ri->rpc = mgos_rpc_get_global();
+  ri->id = ++s_last_id;
+  ri->method = mg_mk_str(method);
+  ri->args_fmt = s_handlers[i].args_fmt;
+  s_responded = false;
+  s_handlers[i].cb(ri, s_handlers[i].cb_arg, NULL,
+                   mg_mk_str(args != NULL ? args : "{}"));
+  if (!s_responded) return NULL;
+  if (error_code != NULL) *error_code = s_error_code;
+  return s_response;
+}
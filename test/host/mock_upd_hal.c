@@ -0,0 +1,260 @@
+/*
+ * File-backed update HAL, with the ESP32 flash reads the updater makes for
+ * deltas and for parts that are already installed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_sha1.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "mgos_updater_hal.h"
+#include "rom/crc.h"
+
+#include "mock.h"
+
+#define MAX_PARTS 16
+
+struct mock_part {
+  char src[50];
+  char cs_sha1[41];
+};
+
+struct mgos_upd_hal_ctx {
+  struct mock_part parts[MAX_PARTS];
+  int num_parts;
+  const struct mock_part *cur;
+  FILE *fp;
+  cs_sha1_ctx sha1;
+  char status_msg[100];
+};
+
+struct mock_upd mock_upd;
+
+/* File contents cached by path. */
+struct mock_image {
+  const char *path;
+  char *data;
+  size_t size;
+};
+
+static struct mock_image s_running_app, s_flash;
+
+static void image_reset(struct mock_image *img) {
+  free(img->data);
+  memset(img, 0, sizeof(*img));
+}
+
+static const struct mock_image *image_get(struct mock_image *img,
+                                          const char *path) {
+  if (path == NULL) return NULL;
+  if (img->path != path) {
+    image_reset(img);
+    if ((img->data = mock_read_file(path, &img->size)) == NULL) return NULL;
+    img->path = path;
+  }
+  return img;
+}
+
+/* Copies [off, off + len) of the image, 0xff past its end. */
+static void image_read(const struct mock_image *img, size_t off, void *dst,
+                       size_t len) {
+  memset(dst, 0xff, len);
+  if (off < img->size) {
+    size_t n = img->size - off;
+    memcpy(dst, img->data + off, n < len ? n : len);
+  }
+}
+
+void mock_upd_reset(void) {
+  image_reset(&s_running_app);
+  image_reset(&s_flash);
+  memset(&mock_upd, 0, sizeof(mock_upd));
+  mock_upd.align = 16;
+  mock_upd.running_app_slot_size = 0x180000;
+  mock_upd.committed = true;
+}
+
+/* Collects src and cs_sha1 of every part. */
+static void parts_cb(void *data, const char *name, size_t name_len,
+                     const char *path, const struct json_token *token) {
+  struct mgos_upd_hal_ctx *ctx = (struct mgos_upd_hal_ctx *) data;
+  struct mock_part *p;
+  if (token->type == JSON_TYPE_OBJECT_START && path[0] == '.' &&
+      strchr(path + 1, '.') == NULL && ctx->num_parts < MAX_PARTS) {
+    memset(&ctx->parts[ctx->num_parts++], 0, sizeof(struct mock_part));
+    return;
+  }
+  if (token->type != JSON_TYPE_STRING || ctx->num_parts == 0) return;
+  p = &ctx->parts[ctx->num_parts - 1];
+  if (name_len == 3 && strncmp(name, "src", 3) == 0) {
+    snprintf(p->src, sizeof(p->src), "%.*s", token->len, token->ptr);
+  } else if (name_len == 7 && strncmp(name, "cs_sha1", 7) == 0) {
+    snprintf(p->cs_sha1, sizeof(p->cs_sha1), "%.*s", token->len, token->ptr);
+  }
+}
+
+struct mgos_upd_hal_ctx *mgos_upd_hal_ctx_create(void) {
+  return (struct mgos_upd_hal_ctx *) calloc(1, sizeof(struct mgos_upd_hal_ctx));
+}
+
+const char *mgos_upd_get_status_msg(struct mgos_upd_hal_ctx *ctx) {
+  return ctx->status_msg;
+}
+
+int mgos_upd_begin(struct mgos_upd_hal_ctx *ctx, struct json_token *parts) {
+  ctx->num_parts = 0;
+  if (json_walk(parts->ptr, parts->len, parts_cb, ctx) < 0) {
+    snprintf(ctx->status_msg, sizeof(ctx->status_msg), "Bad parts");
+    return -1;
+  }
+  mock_upd.begins++;
+  return 1;
+}
+
+enum mgos_upd_file_action mgos_upd_file_begin(
+    struct mgos_upd_hal_ctx *ctx, const struct mgos_upd_file_info *fi) {
+  int i;
+  if (mock_upd.skip != NULL && strcmp(fi->name, mock_upd.skip) == 0) {
+    mock_upd.skipped++;
+    return MGOS_UPDATER_SKIP_FILE;
+  }
+  ctx->cur = NULL;
+  for (i = 0; i < ctx->num_parts; i++) {
+    if (strcmp(ctx->parts[i].src, fi->name) == 0) ctx->cur = &ctx->parts[i];
+  }
+  if (ctx->cur == NULL) {
+    /* Not in the manifest: the real HALs ignore such files. */
+    return MGOS_UPDATER_SKIP_FILE;
+  }
+  if (mock_upd.out_dir != NULL) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", mock_upd.out_dir, fi->name);
+    if ((ctx->fp = fopen(path, "wb")) == NULL) {
+      snprintf(ctx->status_msg, sizeof(ctx->status_msg), "Cannot open %s",
+               path);
+      return MGOS_UPDATER_ABORT;
+    }
+  }
+  cs_sha1_init(&ctx->sha1);
+  return MGOS_UPDATER_PROCESS_FILE;
+}
+
+static int write_data(struct mgos_upd_hal_ctx *ctx, struct mg_str data) {
+  if (ctx->fp != NULL && fwrite(data.p, 1, data.len, ctx->fp) != data.len) {
+    snprintf(ctx->status_msg, sizeof(ctx->status_msg), "Write failed");
+    return -1;
+  }
+  cs_sha1_update(&ctx->sha1, (const unsigned char *) data.p, data.len);
+  mock_upd.bytes += data.len;
+  return (int) data.len;
+}
+
+int mgos_upd_file_data(struct mgos_upd_hal_ctx *ctx,
+                       const struct mgos_upd_file_info *fi,
+                       struct mg_str data) {
+  (void) fi;
+  /* Like a flash write: whole blocks only, the rest comes again later. */
+  if (mock_upd.align > 1) data.len -= data.len % mock_upd.align;
+  return write_data(ctx, data);
+}
+
+int mgos_upd_file_end(struct mgos_upd_hal_ctx *ctx,
+                      const struct mgos_upd_file_info *fi,
+                      struct mg_str tail) {
+  unsigned char digest[20];
+  char sha1[41];
+  int i;
+  if (mock_upd.align > 1 && tail.len >= mock_upd.align) {
+    snprintf(ctx->status_msg, sizeof(ctx->status_msg), "Tail too big: %d",
+             (int) tail.len);
+    return -1;
+  }
+  if (write_data(ctx, tail) < 0) return -1;
+  if (ctx->fp != NULL) fclose(ctx->fp);
+  ctx->fp = NULL;
+  cs_sha1_final(digest, &ctx->sha1);
+  for (i = 0; i < 20; i++) sprintf(sha1 + i * 2, "%02x", digest[i]);
+  if (ctx->cur->cs_sha1[0] != '\0' &&
+      strcasecmp(sha1, ctx->cur->cs_sha1) != 0) {
+    snprintf(ctx->status_msg, sizeof(ctx->status_msg),
+             "Invalid SHA1 of %s: %s", fi->name, sha1);
+    return -1;
+  }
+  mock_upd.files++;
+  return (int) tail.len;
+}
+
+int mgos_upd_finalize(struct mgos_upd_hal_ctx *ctx) {
+  (void) ctx;
+  mock_upd.finalized++;
+  return 1;
+}
+
+void mgos_upd_hal_ctx_free(struct mgos_upd_hal_ctx *ctx) {
+  if (ctx == NULL) return;
+  if (ctx->fp != NULL) fclose(ctx->fp);
+  free(ctx);
+}
+
+bool mgos_upd_boot_get_state(struct mgos_upd_boot_state *bs) {
+  memset(bs, 0, sizeof(*bs));
+  bs->is_committed = mock_upd.committed;
+  return true;
+}
+
+bool mgos_upd_boot_set_state(const struct mgos_upd_boot_state *bs) {
+  mock_upd.committed = bs->is_committed;
+  return true;
+}
+
+void mgos_upd_boot_commit(void) {
+  mock_upd.committed = true;
+  mock_upd.commits++;
+}
+
+void mgos_upd_boot_revert(void) {
+  mock_upd.reverts++;
+}
+
+/* ESP32 */
+
+const esp_partition_t *esp_ota_get_running_partition(void) {
+  static esp_partition_t p = {0x10000, 0, "app_0"};
+  p.size = mock_upd.running_app_slot_size;
+  return &p;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+                             size_t src_offset, void *dst, size_t size) {
+  const struct mock_image *img =
+      image_get(&s_running_app, mock_upd.running_app);
+  if (src_offset + size > partition->size) return ESP_ERR_INVALID_SIZE;
+  if (img == NULL) return ESP_FAIL;
+  image_read(img, src_offset, dst, size);
+  return ESP_OK;
+}
+
+esp_err_t spi_flash_read(size_t src_addr, void *dest, size_t size) {
+  const struct mock_image *img = image_get(&s_flash, mock_upd.flash);
+  if (img == NULL) return ESP_FAIL;
+  image_read(img, src_addr, dest, size);
+  return ESP_OK;
+}
+
+uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+  static uint32_t table[256];
+  if (table[1] == 0) {
+    uint32_t i, j, c;
+    for (i = 0; i < 256; i++) {
+      for (c = i, j = 0; j < 8; j++) c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+      table[i] = c;
+    }
+  }
+  crc = ~crc;
+  while (len-- > 0) crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
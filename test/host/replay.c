@@ -0,0 +1,41 @@
+#include "replay.h"
+
+#include <stdio.h>
+
+#include "mgos_updater_common.h"
+
+int replay(const char *data, size_t len, replay_chunk_cb next_chunk,
+           void *arg, char *msg, size_t msg_size) {
+  struct update_context *ctx = updater_context_create(0);
+  size_t off = 0;
+  int result;
+  if (ctx == NULL) {
+    snprintf(msg, msg_size, "%s", "No update context");
+    return -2;
+  }
+  while (off < len && ctx->result == 0) {
+    size_t n = next_chunk(arg);
+    if (n > len - off) n = len - off;
+    updater_process(ctx, data + off, n);
+    off += n;
+  }
+  if (ctx->result == 0 && is_write_finished(ctx)) updater_finalize(ctx);
+  if (!is_update_finished(ctx)) {
+    ctx->status_msg = "Archive is incomplete";
+    ctx->result = -1;
+    updater_finish(ctx);
+  }
+  result = ctx->result;
+  snprintf(msg, msg_size, "%s", ctx->status_msg ? ctx->status_msg : "");
+  updater_context_free(ctx);
+  return result;
+}
+
+static size_t fixed_chunk(void *arg) {
+  return *(size_t *) arg;
+}
+
+int replay_fixed(const char *data, size_t len, size_t chunk, char *msg,
+                 size_t msg_size) {
+  return replay(data, len, fixed_chunk, &chunk, msg, msg_size);
+}
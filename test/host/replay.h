@@ -0,0 +1,27 @@
+/*
+ * Runs an archive through the updater the way the Fetch OTA path does:
+ * updater_process() on each chunk as it arrives, updater_finalize() once the
+ * archive has been written, updater_finish() if it never was.
+ */
+
+#ifndef TEST_HOST_REPLAY_H_
+#define TEST_HOST_REPLAY_H_
+
+#include <stddef.h>
+
+/* Size of the next chunk; never 0. */
+typedef size_t (*replay_chunk_cb)(void *arg);
+
+/*
+ * Returns ctx->result: 1 if the update was applied or there was nothing to
+ * do, -1 if it failed; ctx->status_msg goes to `msg` either way. Returns -2 if
+ * no update context could be created.
+ */
+int replay(const char *data, size_t len, replay_chunk_cb next_chunk,
+           void *arg, char *msg, size_t msg_size);
+
+/* Same in chunks of a fixed size. */
+int replay_fixed(const char *data, size_t len, size_t chunk, char *msg,
+                 size_t msg_size);
+
+#endif /* TEST_HOST_REPLAY_H_ */
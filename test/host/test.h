@@ -0,0 +1,35 @@
+/* Assertions for the host tests: a test is a function returning 0 if OK. */
+
+#ifndef TEST_HOST_TEST_H_
+#define TEST_HOST_TEST_H_
+
+#include <stdio.h>
+
+#define ASSERT(cond)                                                 \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, __func__, \
+              #cond);                                                \
+      return 1;                                                      \
+    }                                                                \
+  } while (0)
+
+#define ASSERT_EQ(a, b)                                                  \
+  do {                                                                   \
+    long long a_ = (long long) (a), b_ = (long long) (b);                \
+    if (a_ != b_) {                                                      \
+      fprintf(stderr, "%s:%d: %s: %s == %s: %lld != %lld\n", __FILE__,   \
+              __LINE__, __func__, #a, #b, a_, b_);                       \
+      return 1;                                                          \
+    }                                                                    \
+  } while (0)
+
+#define RUN_TEST(fn, failed)                     \
+  do {                                           \
+    int r_ = fn();                               \
+    printf("%s %s\n", r_ == 0 ? "PASS" : "FAIL", #fn); \
+    fflush(stdout);                              \
+    if (r_ != 0) (failed)++;                     \
+  } while (0)
+
+#endif /* TEST_HOST_TEST_H_ */
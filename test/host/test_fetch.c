@@ -0,0 +1,762 @@
+/*
+ * Fetch against the simulated server of mock_net.c: the download cache, and
+ * updates from the fixtures of mkfixtures.py, with Fetch or OTA.Update.
+ *
+ * Usage: test_fetch <fixtures dir>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "fetch.h"
+#include "fetch_cache.h"
+#include "profile.h"
+#include "updater.h"
+
+#include "mock.h"
+#include "test.h"
+
+#define FILE_SIZE 4000
+#define BIG_SIZE 200000
+#define FW_FS_SIZE 262144
+#define OTA_ARGS "{url: \"http://files.local/fw.zip\", ota: true}"
+
+static const char *s_fixtures;
+static char s_data[FILE_SIZE];
+static char s_big[BIG_SIZE];
+static int s_replies, s_error_code;
+static char s_reply[1024];
+/* Bytes written by each download that has replied, in turn; -1 for errors. */
+static long s_written[8];
+
+static void on_reply(int64_t id, int error_code, const char *reply) {
+  const char *w = strstr(reply, "\"written\": ");
+  /* Those of Fetch.List and Fetch.Cancel are returned by mock_rpc_call(). */
+  if (strncmp(reply, "{\"transfers\": ", 14) == 0 ||
+      strncmp(reply, "{\"id\": ", 7) == 0) {
+    return;
+  }
+  if (s_replies < (int) (sizeof(s_written) / sizeof(s_written[0]))) {
+    s_written[s_replies] = (error_code == 0 && w != NULL ? atol(w + 11) : -1);
+  }
+  s_replies++;
+  s_error_code = error_code;
+  snprintf(s_reply, sizeof(s_reply), "%s", reply);
+  (void) id;
+}
+
+static char *load(const char *name, size_t *len) {
+  char path[256];
+  char *data;
+  snprintf(path, sizeof(path), "%s/%s", s_fixtures, name);
+  if ((data = mock_read_file(path, len)) == NULL) {
+    fprintf(stderr, "cannot read %s\n", path);
+    exit(2);
+  }
+  return data;
+}
+
+/* Serves a fixture as /fw.zip. Returns its size. */
+static size_t add_archive(const char *name) {
+  size_t len;
+  char *data = load(name, &len);
+  mock_net_add_file("/fw.zip", data, len, NULL);
+  free(data);
+  return len;
+}
+
+/* Calls `method` and runs the network until it replies. Returns the code. */
+static int call(const char *method, const char *args) {
+  s_replies = 0;
+  s_error_code = -1;
+  if (mock_rpc_call(method, args, NULL) == NULL) mock_net_run(60);
+  if (s_replies != 1) {
+    fprintf(stderr, "%s: %d replies\n", args, s_replies);
+    return -1;
+  }
+  if (s_error_code != 0) fprintf(stderr, "%s: %s\n", args, s_reply);
+  return s_error_code;
+}
+
+static int fetch(const char *args) {
+  return call("Fetch", args);
+}
+
+/* Starts a download of /<name> to t_<name>.bin, without waiting for it. */
+static void start(const char *name, int priority) {
+  char args[200];
+  snprintf(args, sizeof(args),
+           "{url: \"http://files.local/%s\", file: \"t_%s.bin\", "
+           "priority: %d}",
+           name, name, priority);
+  mock_rpc_call("Fetch", args, NULL);
+}
+
+/* Serves /<name> with `len` bytes. */
+static void add_sized(const char *name, size_t len) {
+  char path[64], *data = (char *) calloc(1, len);
+  snprintf(path, sizeof(path), "/%s", name);
+  mock_net_add_file(path, data, len, NULL);
+  free(data);
+}
+
+/* ID of the transfer of /<name> in a Fetch.List reply, -1 if not there. */
+static int job_id(const char *list, const char *name) {
+  char url[64];
+  const char *p, *id = NULL;
+  snprintf(url, sizeof(url), "\"http://files.local/%s\"", name);
+  if ((p = strstr(list, url)) == NULL) return -1;
+  for (; p > list && id == NULL; p--) {
+    if (strncmp(p, "\"id\": ", 6) == 0) id = p + 6;
+  }
+  return (id != NULL ? atoi(id) : -1);
+}
+
+/* Lets the connections kept from earlier tests time out. */
+static void close_idle(void) {
+  mock_clock_advance(mock_cfg.fetch_idle_timeout + 1);
+  mock_net_poll();
+}
+
+static int count(const char *s, const char *what) {
+  int n = 0;
+  for (; (s = strstr(s, what)) != NULL; s++) n++;
+  return n;
+}
+
+static bool has_data(const char *file) {
+  size_t len;
+  char *data = mock_read_file(file, &len);
+  bool res = (data != NULL && len == FILE_SIZE &&
+              memcmp(data, s_data, FILE_SIZE) == 0);
+  free(data);
+  return res;
+}
+
+static bool has_big(const char *file) {
+  size_t len;
+  char *data = mock_read_file(file, &len);
+  bool res = (data != NULL && len == BIG_SIZE &&
+              memcmp(data, s_big, BIG_SIZE) == 0);
+  free(data);
+  return res;
+}
+
+/* Flips a byte of a file, leaving its size as it is. */
+static void corrupt(const char *file) {
+  FILE *fp = fopen(file, "r+b");
+  int c;
+  fseek(fp, FILE_SIZE / 2, SEEK_SET);
+  c = fgetc(fp);
+  fseek(fp, FILE_SIZE / 2, SEEK_SET);
+  fputc(c ^ 0x55, fp);
+  fclose(fp);
+}
+
+/* A file found by its SHA-256 is hashed again before it is served. */
+static int test_sha256_hit_rehashed(void) {
+  char sha256[FETCH_CACHE_SHA256_LEN + 1], args[200];
+  mock_net_reset();
+  mock_net_add_file("/a", s_data, FILE_SIZE, NULL);
+  ASSERT_EQ(fetch("{url: \"http://files.local/a\", file: \"t_a.bin\"}"), 0);
+  ASSERT_EQ(mock_net.requests, 1);
+  ASSERT(fetch_cache_hash_file("t_a.bin", sha256));
+
+  /* Same contents under another name: copied, not downloaded. */
+  snprintf(args, sizeof(args),
+           "{url: \"http://files.local/a\", file: \"t_b.bin\", sha256: \"%s\"}",
+           sha256);
+  ASSERT_EQ(fetch(args), 0);
+  ASSERT_EQ(mock_net.requests, 1);
+  ASSERT(has_data("t_b.bin"));
+
+  /* Changed in place, at the same size: downloaded again. */
+  corrupt("t_a.bin");
+  corrupt("t_b.bin");
+  snprintf(args, sizeof(args),
+           "{url: \"http://files.local/a\", file: \"t_c.bin\", sha256: \"%s\"}",
+           sha256);
+  ASSERT_EQ(fetch(args), 0);
+  ASSERT_EQ(mock_net.requests, 2);
+  ASSERT(has_data("t_c.bin"));
+  remove("t_a.bin");
+  remove("t_b.bin");
+  remove("t_c.bin");
+  return 0;
+}
+
+/* Downloads from one host, one after another, share a connection. */
+static int test_keep_alive(void) {
+  mock_net_reset();
+  mock_net_add_file("/a", s_data, FILE_SIZE, NULL);
+  ASSERT_EQ(fetch("{url: \"http://ka.local/a\", file: \"t_a.bin\"}"), 0);
+  ASSERT(strstr(s_reply, "\"reused\": false") != NULL);
+  ASSERT_EQ(fetch("{url: \"http://ka.local/a\", file: \"t_b.bin\"}"), 0);
+  ASSERT(strstr(s_reply, "\"reused\": true") != NULL);
+  ASSERT_EQ(fetch("{url: \"http://ka.local/a\", file: \"t_c.bin\"}"), 0);
+  ASSERT_EQ(mock_net.connects, 1);
+  ASSERT_EQ(mock_net.requests, 3);
+  /* Not from another host. */
+  ASSERT_EQ(fetch("{url: \"http://ka2.local/a\", file: \"t_a.bin\"}"), 0);
+  ASSERT_EQ(mock_net.connects, 2);
+
+  /* Nor from a server that closes after every reply. */
+  mock_net.close = true;
+  ASSERT_EQ(fetch("{url: \"http://ka3.local/a\", file: \"t_a.bin\"}"), 0);
+  ASSERT_EQ(fetch("{url: \"http://ka3.local/a\", file: \"t_b.bin\"}"), 0);
+  ASSERT(strstr(s_reply, "\"reused\": false") != NULL);
+  ASSERT_EQ(mock_net.connects, 4);
+  ASSERT(has_data("t_b.bin"));
+
+  /* Idle connections are closed after fetch.idle_timeout. */
+  ASSERT(mock_net_conns() > 0);
+  close_idle();
+  ASSERT_EQ(mock_net_conns(), 0);
+  remove("t_a.bin");
+  remove("t_b.bin");
+  remove("t_c.bin");
+  return 0;
+}
+
+/* No more than fetch.max_conns connections, whatever is waiting. */
+static int test_max_conns(void) {
+  int max_conns = mock_cfg.fetch_max_conns, pipeline = mock_cfg.fetch_pipeline;
+  int i, most = 0;
+  char args[100];
+  close_idle();
+  mock_net_reset();
+  mock_cfg.fetch_max_conns = 2;
+  mock_cfg.fetch_pipeline = 0;
+  mock_net_add_file("/a", s_data, FILE_SIZE, NULL);
+  s_replies = 0;
+  for (i = 0; i < 6; i++) {
+    snprintf(args, sizeof(args),
+             "{url: \"http://mc.local/a\", file: \"t_m%d.bin\"}", i);
+    mock_rpc_call("Fetch", args, NULL);
+  }
+  while (s_replies < 6 && !mock_net_run(0.01)) {
+    if (mock_net_conns() > most) most = mock_net_conns();
+  }
+  mock_cfg.fetch_max_conns = max_conns;
+  mock_cfg.fetch_pipeline = pipeline;
+  ASSERT_EQ(s_replies, 6);
+  ASSERT_EQ(most, 2);
+  ASSERT_EQ(mock_net.connects, 2);
+  for (i = 0; i < 6; i++) {
+    snprintf(args, sizeof(args), "t_m%d.bin", i);
+    ASSERT(has_data(args));
+    remove(args);
+  }
+  return 0;
+}
+
+/* Time to fetch a batch of files over one connection. */
+static double batch_time(int pipeline) {
+  int max_conns = mock_cfg.fetch_max_conns, old = mock_cfg.fetch_pipeline;
+  double start_time;
+  int i;
+  close_idle();
+  mock_net_reset();
+  mock_cfg.fetch_max_conns = 1;
+  mock_cfg.fetch_pipeline = pipeline;
+  mock_net.rtt = 0.2;
+  mock_net_add_file("/a", s_data, FILE_SIZE, NULL);
+  start_time = mgos_uptime();
+  s_replies = 0;
+  for (i = 0; i < 5; i++) start("a", 0);
+  mock_net_run(60);
+  mock_cfg.fetch_max_conns = max_conns;
+  mock_cfg.fetch_pipeline = old;
+  remove("t_a.bin");
+  return (s_replies == 5 && s_error_code == 0 ? mgos_uptime() - start_time
+                                              : -1);
+}
+
+/* Requests sent before the replies ahead of them are in save round trips. */
+static int test_pipelining(void) {
+  double serial = batch_time(0), pipelined = batch_time(4);
+  ASSERT(serial > 0 && pipelined > 0);
+  ASSERT_EQ(mock_net.connects, 1);
+  ASSERT_EQ(mock_net.requests, 5);
+  /* Five round trips against about two. */
+  ASSERT(serial > 5 * 0.2);
+  ASSERT(pipelined < 3 * 0.2);
+  return 0;
+}
+
+/*
+ * Requests pipelined behind a cancelled one are sent again. One cancelled
+ * while it waits behind another is answered as such, the rest get theirs.
+ */
+static int test_pipelined_cancel(void) {
+  int max_conns = mock_cfg.fetch_max_conns, pipeline = mock_cfg.fetch_pipeline;
+  char args[32];
+  const char *list;
+  int code, a, b;
+  close_idle();
+  mock_net_reset();
+  mock_cfg.fetch_max_conns = 1;
+  mock_cfg.fetch_pipeline = 4;
+  mock_net.bandwidth = 100000;
+  add_sized("c1", 300000);
+  add_sized("c2", 1000);
+  add_sized("c3", 2000);
+  add_sized("c4", 3000);
+  /* Pipelining starts once the server has kept the connection. */
+  ASSERT_EQ(fetch("{url: \"http://files.local/c2\", file: \"t_c2.bin\"}"), 0);
+  s_replies = 0;
+  start("c1", 0);
+  start("c2", 0);
+  start("c3", 0);
+  start("c4", 0);
+  mock_net_run(1);
+  ASSERT_EQ(mock_net.requests, 5);
+  list = mock_rpc_call("Fetch.List", NULL, NULL);
+  ASSERT(list != NULL);
+  a = job_id(list, "c1");
+  b = job_id(list, "c3");
+  snprintf(args, sizeof(args), "{id: %d}", b);
+  mock_rpc_call("Fetch.Cancel", args, &code);
+  ASSERT_EQ(code, 0);
+  snprintf(args, sizeof(args), "{id: %d}", a);
+  mock_rpc_call("Fetch.Cancel", args, &code);
+  ASSERT_EQ(code, 0);
+  mock_net_run(60);
+  mock_cfg.fetch_max_conns = max_conns;
+  mock_cfg.fetch_pipeline = pipeline;
+  ASSERT_EQ(s_replies, 4);
+  ASSERT_EQ(s_written[0], -1);
+  ASSERT_EQ(s_written[1], -1);
+  ASSERT_EQ(s_written[2], 1000);
+  ASSERT_EQ(s_written[3], 3000);
+  /* c2 and c4 again, on a new connection. */
+  ASSERT_EQ(mock_net.requests, 7);
+  remove("t_c1.bin");
+  remove("t_c2.bin");
+  remove("t_c3.bin");
+  remove("t_c4.bin");
+  return 0;
+}
+
+/* A big file in parallel ranges, put together at their offsets. */
+static int test_segments(void) {
+  char args[200];
+  mock_net_reset();
+  mock_net_add_file("/big", s_big, BIG_SIZE, NULL);
+  snprintf(args, sizeof(args),
+           "{url: \"http://seg.local/big\", file: \"t_big.bin\", "
+           "segments: 4}");
+  ASSERT_EQ(fetch(args), 0);
+  /* The first range, which tells the size, and four after it. */
+  ASSERT(strstr(s_reply, "\"segments\": 5") != NULL);
+  ASSERT(strstr(s_reply, "\"written\": 200000") != NULL);
+  ASSERT_EQ(mock_net.ranges_served, 5);
+  /* On parallel connections. */
+  ASSERT(mock_net.connects > 1);
+  ASSERT(has_big("t_big.bin"));
+  /* The CRC of the whole, from those of the segments. */
+  snprintf(args, sizeof(args), "\"crc32\": %lu,",
+           (unsigned long) crc32_update(0, (const uint8_t *) s_big, BIG_SIZE));
+  ASSERT(strstr(s_reply, args) != NULL);
+
+  /* A server that does not serve ranges sends it all in one go. */
+  mock_net_reset();
+  mock_net.ranges = false;
+  mock_net_add_file("/big", s_big, BIG_SIZE, NULL);
+  ASSERT_EQ(fetch("{url: \"http://files.local/big\", file: \"t_big.bin\", "
+                  "segments: 4}"),
+            0);
+  ASSERT(strstr(s_reply, "\"segments\": 1") != NULL);
+  ASSERT_EQ(mock_net.requests, 1);
+  ASSERT(has_big("t_big.bin"));
+  remove("t_big.bin");
+  return 0;
+}
+
+/* A number from a JSON reply, by its key; -1 if not there. */
+static long field(const char *reply, const char *key) {
+  char k[64];
+  const char *p;
+  snprintf(k, sizeof(k), "\"%s\": ", key);
+  if ((p = strstr(reply, k)) == NULL) return -1;
+  return atol(p + strlen(k));
+}
+
+/* Writes to flash in whole sectors, not as packets arrive. */
+static int test_write_behind(void) {
+  long writes, over_budget;
+  char stats[512];
+  int budget = mock_cfg.fetch_write_buf_budget;
+  mock_net_reset();
+  mock_net_add_file("/big", s_big, BIG_SIZE, NULL);
+  snprintf(stats, sizeof(stats), "%s", mock_rpc_call("Fetch.Stats", NULL, NULL));
+  ASSERT_EQ(fetch("{url: \"http://files.local/big\", file: \"t_big.bin\"}"),
+            0);
+  ASSERT(has_big("t_big.bin"));
+  /* 48 sectors and what is left; packets are 1460 bytes. */
+  ASSERT((writes = field(s_reply, "writes")) > 0);
+  ASSERT(writes <= (BIG_SIZE + 4095) / 4096);
+  writes = field(stats, "writes");
+  snprintf(stats, sizeof(stats), "%s", mock_rpc_call("Fetch.Stats", NULL, NULL));
+  ASSERT(field(stats, "writes") - writes <= (BIG_SIZE + 4095) / 4096);
+  ASSERT_EQ(field(stats, "buf_mem"), 0);
+  ASSERT(field(stats, "peak_buf_mem") >= 4096);
+
+  /* With no budget left it writes through, a write per packet or so. */
+  over_budget = field(stats, "over_budget");
+  mock_cfg.fetch_write_buf_budget = 0;
+  ASSERT_EQ(fetch("{url: \"http://files.local/big\", file: \"t_big2.bin\"}"),
+            0);
+  mock_cfg.fetch_write_buf_budget = budget;
+  ASSERT(has_big("t_big2.bin"));
+  ASSERT(field(s_reply, "writes") > BIG_SIZE / 1460);
+  snprintf(stats, sizeof(stats), "%s", mock_rpc_call("Fetch.Stats", NULL, NULL));
+  ASSERT_EQ(field(stats, "over_budget"), over_budget + 1);
+  remove("t_big.bin");
+  remove("t_big2.bin");
+  return 0;
+}
+
+/* A file the server says has not changed is kept, not downloaded again. */
+static int test_not_modified(void) {
+  FILE *fp;
+  mock_net_reset();
+  mock_net_add_file("/e", s_data, FILE_SIZE, "\"v1\"");
+  ASSERT_EQ(fetch("{url: \"http://files.local/e\", file: \"t_e.bin\"}"), 0);
+  ASSERT(strstr(s_reply, "\"cached\": false") != NULL);
+  ASSERT_EQ(fetch("{url: \"http://files.local/e\", file: \"t_e.bin\"}"), 0);
+  ASSERT_EQ(mock_net.requests, 2);
+  ASSERT_EQ(mock_net.not_modified, 1);
+  ASSERT(strstr(s_reply, "\"cached\": true") != NULL);
+  ASSERT(has_data("t_e.bin"));
+
+  /* Not asked conditionally once the file is not what was downloaded. */
+  fp = fopen("t_e.bin", "w");
+  fputs("short", fp);
+  fclose(fp);
+  ASSERT_EQ(fetch("{url: \"http://files.local/e\", file: \"t_e.bin\"}"), 0);
+  ASSERT_EQ(mock_net.requests, 3);
+  ASSERT_EQ(mock_net.not_modified, 1);
+  ASSERT(has_data("t_e.bin"));
+  remove("t_e.bin");
+  return 0;
+}
+
+/* On one connection: by priority, then in arrival order. */
+static int test_priority(void) {
+  int max_conns = mock_cfg.fetch_max_conns, pipeline = mock_cfg.fetch_pipeline;
+  close_idle();
+  mock_net_reset();
+  mock_cfg.fetch_max_conns = 1;
+  mock_cfg.fetch_pipeline = 0;
+  add_sized("p1", 1000);
+  add_sized("p2", 2000);
+  add_sized("p3", 3000);
+  add_sized("p4", 4000);
+  s_replies = 0;
+  start("p1", 0); /* Starts at once */
+  start("p2", 0);
+  start("p3", 5);
+  start("p4", 9);
+  mock_net_run(60);
+  mock_cfg.fetch_max_conns = max_conns;
+  mock_cfg.fetch_pipeline = pipeline;
+  ASSERT_EQ(s_replies, 4);
+  ASSERT_EQ(s_written[0], 1000);
+  ASSERT_EQ(s_written[1], 4000);
+  ASSERT_EQ(s_written[2], 3000);
+  ASSERT_EQ(s_written[3], 2000);
+  remove("t_p1.bin");
+  remove("t_p2.bin");
+  remove("t_p3.bin");
+  remove("t_p4.bin");
+  return 0;
+}
+
+/* Below fetch.min_free_heap, one transfer at a time. */
+static int test_low_heap(void) {
+  size_t free_heap = mock_free_heap;
+  double start_time = mgos_uptime();
+  const char *list;
+  mock_net_reset();
+  add_sized("h1", 20000);
+  add_sized("h2", 20000);
+  add_sized("h3", 20000);
+  mock_free_heap = mock_cfg.fetch_min_free_heap - 1;
+  s_replies = 0;
+  start("h1", 0);
+  start("h2", 0);
+  start("h3", 0);
+  list = mock_rpc_call("Fetch.List", NULL, NULL);
+  ASSERT(list != NULL);
+  ASSERT(strstr(list, "\"active\": 1,") != NULL);
+  ASSERT_EQ(count(list, "\"queued\""), 2);
+  while (s_replies < 3 && mgos_uptime() < start_time + 60) {
+    mock_net_run(0.05);
+    list = mock_rpc_call("Fetch.List", NULL, NULL);
+    ASSERT(strstr(list, "\"active\": 2") == NULL);
+    ASSERT(strstr(list, "\"active\": 3") == NULL);
+  }
+  mock_free_heap = free_heap;
+  ASSERT_EQ(s_replies, 3);
+  ASSERT_EQ(s_written[2], 20000);
+  remove("t_h1.bin");
+  remove("t_h2.bin");
+  remove("t_h3.bin");
+  return 0;
+}
+
+/* Progress of an active transfer, and one waiting behind it. */
+static int test_list(void) {
+  int max_conns = mock_cfg.fetch_max_conns, pipeline = mock_cfg.fetch_pipeline;
+  const char *list;
+  char *active, *queued;
+  close_idle();
+  mock_net_reset();
+  mock_cfg.fetch_max_conns = 1;
+  mock_cfg.fetch_pipeline = 0;
+  mock_net.bandwidth = 100000;
+  add_sized("l1", 300000);
+  add_sized("l2", 1000);
+  s_replies = 0;
+  start("l1", 0);
+  start("l2", 3);
+  mock_net_run(1);
+  list = mock_rpc_call("Fetch.List", NULL, NULL);
+  ASSERT(list != NULL);
+  ASSERT((active = strstr(list, "\"http://files.local/l1\"")) != NULL);
+  ASSERT((queued = strstr(list, "\"http://files.local/l2\"")) != NULL);
+  /* In arrival order. */
+  ASSERT(active < queued);
+  ASSERT_EQ(job_id(list, "l2"), job_id(list, "l1") + 1);
+  ASSERT(strstr(active, "\"file\": \"t_l1.bin\"") < queued);
+  ASSERT(strstr(active, "\"state\": \"active\"") < queued);
+  ASSERT(strstr(active, "\"total\": 300000") < queued);
+  ASSERT(strstr(active, "\"received\": 0,") == NULL ||
+         strstr(active, "\"received\": 0,") > queued);
+  ASSERT(strstr(active, "\"eta\": -1.0") == NULL ||
+         strstr(active, "\"eta\": -1.0") > queued);
+  ASSERT(strstr(queued, "\"priority\": 3") != NULL);
+  ASSERT(strstr(queued, "\"state\": \"queued\"") != NULL);
+  ASSERT(strstr(queued, "\"eta\": -1.0") != NULL);
+  mock_net_run(60);
+  mock_cfg.fetch_max_conns = max_conns;
+  mock_cfg.fetch_pipeline = pipeline;
+  ASSERT_EQ(s_replies, 2);
+  list = mock_rpc_call("Fetch.List", NULL, NULL);
+  ASSERT(strstr(list, "\"transfers\": []") != NULL);
+  remove("t_l1.bin");
+  remove("t_l2.bin");
+  return 0;
+}
+
+/* A queued transfer is dropped, an active one cut off. */
+static int test_cancel(void) {
+  int max_conns = mock_cfg.fetch_max_conns, pipeline = mock_cfg.fetch_pipeline;
+  char args[32];
+  const char *list;
+  int code, a, b;
+  close_idle();
+  mock_net_reset();
+  mock_cfg.fetch_max_conns = 1;
+  mock_cfg.fetch_pipeline = 0;
+  mock_net.bandwidth = 100000;
+  add_sized("c1", 300000);
+  add_sized("c2", 1000);
+  add_sized("c3", 2000);
+  s_replies = 0;
+  start("c1", 0);
+  start("c2", 0);
+  start("c3", 0);
+  list = mock_rpc_call("Fetch.List", NULL, NULL);
+  ASSERT(list != NULL);
+  a = job_id(list, "c1");
+  b = job_id(list, "c2");
+
+  /* Queued: never requested. */
+  snprintf(args, sizeof(args), "{id: %d}", b);
+  mock_rpc_call("Fetch.Cancel", args, &code);
+  ASSERT_EQ(code, 0);
+  ASSERT_EQ(s_replies, 1);
+  ASSERT(s_error_code != 0);
+  ASSERT(strstr(s_reply, "cancelled") != NULL);
+
+  /* Active: its connection is closed, and the next one goes ahead. */
+  mock_net_run(1);
+  ASSERT_EQ(s_replies, 1);
+  snprintf(args, sizeof(args), "{id: %d}", a);
+  mock_rpc_call("Fetch.Cancel", args, &code);
+  ASSERT_EQ(code, 0);
+  mock_net_run(60);
+  mock_cfg.fetch_max_conns = max_conns;
+  mock_cfg.fetch_pipeline = pipeline;
+  ASSERT_EQ(s_replies, 3);
+  ASSERT_EQ(s_written[1], -1);
+  ASSERT_EQ(s_written[2], 2000);
+  ASSERT_EQ(mock_net.requests, 2);
+  ASSERT_EQ(mock_net.closes, 1);
+
+  mock_rpc_call("Fetch.Cancel", args, &code);
+  ASSERT_EQ(code, 404);
+  remove("t_c1.bin");
+  remove("t_c3.bin");
+  return 0;
+}
+
+static int s_dispatched;
+
+static void app_dispatcher(int uart_no, void *arg) {
+  s_dispatched++;
+  (void) uart_no;
+  (void) arg;
+}
+
+/* A reply that waits for the UART leaves the app's dispatcher alone. */
+static int test_uart_paused(void) {
+  mock_net_reset();
+  mock_net.uart_buf_size = 256;
+  mock_net.uart_rate = 11520;
+  mock_net_add_file("/a", s_data, FILE_SIZE, NULL);
+  mgos_uart_set_dispatcher(1, app_dispatcher, NULL);
+  ASSERT_EQ(fetch("{url: \"http://files.local/a\", uart: 1}"), 0);
+  ASSERT_EQ(mock_net.uart_bytes, FILE_SIZE);
+  ASSERT(strstr(s_reply, "\"paused\": 0.000") == NULL);
+  ASSERT(strstr(s_reply, "\"paused\": ") != NULL);
+  ASSERT_EQ(mock_timers_pending(), 0);
+  s_dispatched = 0;
+  mock_uart_dispatch(1);
+  ASSERT_EQ(s_dispatched, 1);
+  mgos_uart_set_dispatcher(1, NULL, NULL);
+  return 0;
+}
+
+/*
+ * The server closes while the reply waits for the UART: what has come in
+ * is still sent, and the connection let go after.
+ */
+static int test_uart_closed(void) {
+  close_idle();
+  mock_net_reset();
+  mock_net.close = true;
+  mock_net.uart_buf_size = 256;
+  mock_net.uart_rate = 11520;
+  mock_net_add_file("/a", s_data, FILE_SIZE, NULL);
+  ASSERT_EQ(fetch("{url: \"http://files.local/a\", uart: 1}"), 0);
+  ASSERT_EQ(mock_net.uart_bytes, FILE_SIZE);
+  ASSERT_EQ(mock_net_conns(), 0);
+  ASSERT_EQ(mock_timers_pending(), 0);
+  return 0;
+}
+
+static int test_ota(void) {
+  mock_net_reset();
+  mock_upd_reset();
+  add_archive("fw_stored.zip");
+  ASSERT_EQ(fetch(OTA_ARGS), 0);
+  ASSERT_EQ(mock_upd.finalized, 1);
+  ASSERT(updater_context_get_current() == NULL);
+  return 0;
+}
+
+/* OTA.Update goes through Fetch, and resumes where the connection broke. */
+static int test_ota_update_resumes(void) {
+  mock_net_reset();
+  mock_upd_reset();
+  add_archive("fw_stored.zip");
+  mock_net.drop_after = 300000;
+  ASSERT_EQ(call("OTA.Update", "{url: \"http://files.local/fw.zip\"}"), 0);
+  ASSERT_EQ(mock_upd.finalized, 1);
+  ASSERT_EQ(mock_net.ranges_served, 1);
+  ASSERT_EQ(mock_net.last_range_start, 300000);
+  return 0;
+}
+
+/* A part the HAL skips is not downloaded if the server serves ranges. */
+static int test_ota_skips_part(void) {
+  struct updater_stats st;
+  size_t len;
+  mock_net_reset();
+  mock_upd_reset();
+  mock_upd.skip = "fs.img";
+  len = add_archive("fw_stored.zip");
+  ASSERT_EQ(fetch(OTA_ARGS), 0);
+  ASSERT_EQ(mock_upd.skipped, 1);
+  ASSERT_EQ(mock_upd.finalized, 1);
+  ASSERT_EQ(mock_net.ranges_served, 1);
+  /* Archive bytes that have reached the updater. */
+  ASSERT(updater_get_stats(0, &st));
+  ASSERT(st.bytes < len - FW_FS_SIZE / 2);
+
+  /* Otherwise it is received and dropped. */
+  mock_net_reset();
+  mock_upd_reset();
+  mock_upd.skip = "fs.img";
+  mock_net.ranges = false;
+  len = add_archive("fw_stored.zip");
+  ASSERT_EQ(fetch(OTA_ARGS), 0);
+  ASSERT_EQ(mock_upd.finalized, 1);
+  ASSERT(updater_get_stats(0, &st));
+  ASSERT_EQ(st.bytes, len);
+  return 0;
+}
+
+/* The download stops, and its connection closes, when the update times out. */
+static int test_ota_timeout(void) {
+  int timeout = mock_cfg.update_timeout;
+  double start = mgos_uptime();
+  mock_net_reset();
+  mock_upd_reset();
+  /* Some 20 s for the archive. */
+  mock_net.bandwidth = 100000;
+  mock_cfg.update_timeout = 5;
+  add_archive("fw_stored.zip");
+  ASSERT_EQ(fetch(OTA_ARGS), 500);
+  mock_cfg.update_timeout = timeout;
+  ASSERT(strstr(s_reply, "timed out") != NULL);
+  ASSERT(mgos_uptime() - start < 10);
+  ASSERT_EQ(mock_net_conns(), 0);
+  ASSERT_EQ(mock_upd.finalized, 0);
+  ASSERT(updater_context_get_current() == NULL);
+  ASSERT_EQ(mock_timers_pending(), 0);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int failed = 0, i;
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <fixtures dir>\n", argv[0]);
+    return 2;
+  }
+  s_fixtures = argv[1];
+  mock_init();
+  mock_clock_set(0);
+  mock_cfg.fetch_cache_index = "test_fetch_cache.json";
+  remove(mock_cfg.fetch_cache_index);
+  mock_rpc_on_reply = on_reply;
+  prof_init();
+  fetch_init();
+  srand(5);
+  for (i = 0; i < FILE_SIZE; i++) s_data[i] = (char) rand();
+  for (i = 0; i < BIG_SIZE; i++) s_big[i] = (char) rand();
+  RUN_TEST(test_sha256_hit_rehashed, failed);
+  RUN_TEST(test_keep_alive, failed);
+  RUN_TEST(test_max_conns, failed);
+  RUN_TEST(test_pipelining, failed);
+  RUN_TEST(test_pipelined_cancel, failed);
+  RUN_TEST(test_segments, failed);
+  RUN_TEST(test_write_behind, failed);
+  RUN_TEST(test_not_modified, failed);
+  RUN_TEST(test_priority, failed);
+  RUN_TEST(test_low_heap, failed);
+  RUN_TEST(test_list, failed);
+  RUN_TEST(test_cancel, failed);
+  RUN_TEST(test_uart_paused, failed);
+  RUN_TEST(test_uart_closed, failed);
+  RUN_TEST(test_ota, failed);
+  RUN_TEST(test_ota_update_resumes, failed);
+  RUN_TEST(test_ota_skips_part, failed);
+  RUN_TEST(test_ota_timeout, failed);
+  return (failed == 0 ? 0 : 1);
+}
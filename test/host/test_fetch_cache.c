@@ -0,0 +1,156 @@
+/*
+ * The Fetch download cache index: eviction of the least recently used
+ * entry, and what is read back after a reboot, including one in the middle
+ * of a write. A reboot is a fork(): the index is loaded once per process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fetch_cache.h"
+
+#include "mock.h"
+#include "test.h"
+
+/* As in fetch_cache.c. */
+#define MAX_ENTRIES 16
+
+#define INDEX "test_cache_index.json"
+#define INDEX_TMP INDEX ".tmp"
+
+/* Runs `fn` in a process that has not loaded the index yet. */
+static int after_reboot(int (*fn)(void)) {
+  int status;
+  pid_t pid = fork();
+  if (pid == 0) _exit(fn());
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) return 1;
+  return (WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+static void name(char *buf, size_t len, const char *fmt, int i) {
+  snprintf(buf, len, fmt, i);
+}
+
+/* Writes file `i`, of i + 1 bytes, and records it as a download. */
+static void put(int i) {
+  struct fetch_cache_entry e;
+  char url[64], file[64];
+  FILE *fp;
+  name(url, sizeof(url), "http://files.local/%d", i);
+  name(file, sizeof(file), "t_cache_%d.bin", i);
+  fp = fopen(file, "w");
+  fprintf(fp, "%*d", i + 1, i);
+  fclose(fp);
+  memset(&e, 0, sizeof(e));
+  e.url = url;
+  e.file = file;
+  e.etag = "\"x\"";
+  fetch_cache_hash_file(file, e.sha256);
+  e.size = i + 1;
+  fetch_cache_put(&e);
+}
+
+static bool has(int i) {
+  char url[64], file[64];
+  name(url, sizeof(url), "http://files.local/%d", i);
+  name(file, sizeof(file), "t_cache_%d.bin", i);
+  return (fetch_cache_find(url, file) != NULL);
+}
+
+static void clean(void) {
+  char file[64];
+  int i;
+  for (i = 0; i <= MAX_ENTRIES + 2; i++) {
+    name(file, sizeof(file), "t_cache_%d.bin", i);
+    remove(file);
+  }
+  remove(INDEX);
+  rmdir(INDEX_TMP);
+  remove(INDEX_TMP);
+}
+
+static int fill(void) {
+  int i;
+  for (i = 0; i <= MAX_ENTRIES; i++) put(i);
+  /* Full: the least recently used has gone, 0 then 2. */
+  ASSERT(!has(0));
+  ASSERT(has(1)); /* Now the most recently used */
+  put(MAX_ENTRIES + 1);
+  ASSERT(!has(2));
+  ASSERT(has(1));
+  return 0;
+}
+
+static int check_filled(void) {
+  int i;
+  ASSERT(!has(0));
+  ASSERT(!has(2));
+  for (i = 3; i <= MAX_ENTRIES + 1; i++) ASSERT(has(i));
+  ASSERT(has(1));
+  return 0;
+}
+
+static int test_eviction(void) {
+  clean();
+  ASSERT_EQ(after_reboot(fill), 0);
+  ASSERT_EQ(after_reboot(check_filled), 0);
+  clean();
+  return 0;
+}
+
+static int put_one(void) {
+  put(1);
+  return 0;
+}
+
+static int check_one(void) {
+  ASSERT(has(1));
+  ASSERT(!has(2));
+  return 0;
+}
+
+/* Cut off while writing the temporary file: the index is as before. */
+static int test_cut_in_tmp(void) {
+  FILE *fp;
+  clean();
+  ASSERT_EQ(after_reboot(put_one), 0);
+  fp = fopen(INDEX_TMP, "w");
+  fputs("{entries: [{url: \"http://files.local/9\", fi", fp);
+  fclose(fp);
+  ASSERT_EQ(after_reboot(check_one), 0);
+  clean();
+  return 0;
+}
+
+static int put_two_failing(void) {
+  ASSERT(has(1));
+  /* The temporary file cannot be written. */
+  ASSERT_EQ(mkdir(INDEX_TMP, 0755), 0);
+  put(2);
+  ASSERT(has(2));
+  return 0;
+}
+
+/* A write that fails leaves the index on flash as it was. */
+static int test_failed_write(void) {
+  clean();
+  ASSERT_EQ(after_reboot(put_one), 0);
+  ASSERT_EQ(after_reboot(put_two_failing), 0);
+  ASSERT_EQ(after_reboot(check_one), 0);
+  clean();
+  return 0;
+}
+
+int main(void) {
+  int failed = 0;
+  mock_init();
+  mock_cfg.fetch_cache_index = INDEX;
+  RUN_TEST(test_eviction, failed);
+  RUN_TEST(test_cut_in_tmp, failed);
+  RUN_TEST(test_failed_write, failed);
+  return (failed == 0 ? 0 : 1);
+}
@@ -0,0 +1,213 @@
+/*
+ * The streaming gzip decoder on the gzip fixtures of mkfixtures.py: whole
+ * streams fed in pieces of any size, with every optional header field, and
+ * streams cut short, with a bad trailer or damaged data, which must never
+ * come out as complete.
+ *
+ * Usage: test_gunzip <fixtures dir>
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gunzip.h"
+
+#include "mock.h"
+#include "test.h"
+
+/* Output is taken at most this much at a time, as a file write would. */
+#define OUT_PIECE 1000
+
+static const char *s_fixtures;
+static uint8_t *s_raw, *s_gz, *s_named;
+static size_t s_raw_len, s_gz_len, s_named_len;
+static uint8_t *s_out;
+static size_t s_out_len;
+
+static uint8_t *load(const char *name, size_t *len) {
+  char path[256];
+  uint8_t *data;
+  snprintf(path, sizeof(path), "%s/%s", s_fixtures, name);
+  if ((data = (uint8_t *) mock_read_file(path, len)) == NULL) {
+    fprintf(stderr, "cannot read %s\n", path);
+    exit(1);
+  }
+  return data;
+}
+
+/*
+ * Decodes `len` bytes of `in` handed over `chunk` at a time into s_out, as
+ * Fetch does: all of it, past GUNZIP_DONE too. Returns the last result;
+ * NEED_INPUT with input left over is reported as an error, as the API
+ * promises to take all of it. Output past the size of head.bin is dropped.
+ */
+static enum gunzip_result decode(const uint8_t *in, size_t len, size_t chunk,
+                                 const char **error) {
+  struct gunzip *gz = gunzip_create();
+  enum gunzip_result res = GUNZIP_NEED_INPUT;
+  size_t pos = 0, n, consumed, pending = 0;
+  const uint8_t *p;
+  s_out_len = 0;
+  while (pos < len || res == GUNZIP_OUTPUT_FULL ||
+         (res == GUNZIP_NEED_INPUT && pending > 0)) {
+    n = (len - pos < chunk ? len - pos : chunk);
+    res = gunzip_run(gz, in + pos, n, &consumed);
+    pos += consumed;
+    if (res == GUNZIP_NEED_INPUT && consumed != n) res = GUNZIP_ERROR;
+    if (res == GUNZIP_ERROR) break;
+    p = gunzip_output(gz, &pending);
+    if (pending > OUT_PIECE) pending = OUT_PIECE;
+    if (s_out_len + pending <= s_raw_len) {
+      memcpy(s_out + s_out_len, p, pending);
+    }
+    s_out_len += pending;
+    gunzip_consume(gz, pending);
+    gunzip_output(gz, &pending);
+  }
+  *error = gunzip_error(gz);
+  /* Once failed, it stays failed; if not, no failing case passes. */
+  if (res == GUNZIP_ERROR && gunzip_run(gz, in, 1, &consumed) != res) {
+    res = GUNZIP_NEED_INPUT;
+  }
+  gunzip_free(gz);
+  return res;
+}
+
+static bool output_ok(void) {
+  return (s_out_len == s_raw_len && memcmp(s_out, s_raw, s_raw_len) == 0);
+}
+
+static int test_whole(void) {
+  static const size_t chunks[] = {1, 2, 7, 100, 1460, 65536};
+  const char *error;
+  size_t i;
+  for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+    ASSERT_EQ(decode(s_gz, s_gz_len, chunks[i], &error), GUNZIP_DONE);
+    ASSERT(error == NULL);
+    ASSERT(output_ok());
+    ASSERT_EQ(decode(s_named, s_named_len, chunks[i], &error), GUNZIP_DONE);
+    ASSERT(output_ok());
+  }
+  return 0;
+}
+
+/* head.gz with FEXTRA, FNAME, FCOMMENT and FHCRC added to its header. */
+static int test_header_fields(void) {
+  static const uint8_t fields[] = {6, 0, 'a', 'b', 2, 0, 'x', 'y', /* Extra */
+                                   'n', 'a', 'm', 'e', 0,           /* Name */
+                                   'h', 'i', 0,                     /* Comment */
+                                   0x12, 0x34};                     /* HCRC */
+  size_t len = s_gz_len + sizeof(fields), chunk;
+  uint8_t *gz = (uint8_t *) malloc(len);
+  const char *error;
+  memcpy(gz, s_gz, 10);
+  gz[3] = 0x02 | 0x04 | 0x08 | 0x10;
+  memcpy(gz + 10, fields, sizeof(fields));
+  memcpy(gz + 10 + sizeof(fields), s_gz + 10, s_gz_len - 10);
+  for (chunk = 1; chunk <= 32; chunk++) {
+    ASSERT_EQ(decode(gz, len, chunk, &error), GUNZIP_DONE);
+    ASSERT(output_ok());
+  }
+  /* A reserved flag. */
+  gz[3] |= 0x20;
+  ASSERT_EQ(decode(gz, len, 1460, &error), GUNZIP_ERROR);
+  ASSERT(error != NULL);
+  free(gz);
+  return 0;
+}
+
+/*
+ * Cut anywhere, in the header, the deflate data or the trailer, a stream
+ * waits for more: all input is taken and no error is raised.
+ */
+static int test_truncated(void) {
+  const char *error;
+  size_t len;
+  for (len = 0; len < s_gz_len; len += (len < 16 ? 1 : 997)) {
+    ASSERT_EQ(decode(s_gz, len, 1460, &error), GUNZIP_NEED_INPUT);
+    ASSERT(error == NULL);
+  }
+  for (len = s_gz_len - 16; len < s_gz_len; len++) {
+    ASSERT_EQ(decode(s_gz, len, 1, &error), GUNZIP_NEED_INPUT);
+    ASSERT_EQ(decode(s_gz, len, 1460, &error), GUNZIP_NEED_INPUT);
+    ASSERT(error == NULL);
+  }
+  /* All of the data is out, the trailer is all that is missing. */
+  ASSERT(output_ok());
+  return 0;
+}
+
+static int test_bad_trailer(void) {
+  uint8_t *gz = (uint8_t *) malloc(s_gz_len + 1);
+  const char *error;
+  size_t i;
+  memcpy(gz, s_gz, s_gz_len);
+  /* CRC-32, then the length. */
+  for (i = s_gz_len - 8; i < s_gz_len; i++) {
+    gz[i] ^= 0x01;
+    ASSERT_EQ(decode(gz, s_gz_len, 1460, &error), GUNZIP_ERROR);
+    ASSERT(error != NULL && strstr(error, "mismatch") != NULL);
+    ASSERT_EQ(decode(gz, s_gz_len, 1, &error), GUNZIP_ERROR);
+    gz[i] ^= 0x01;
+  }
+  /* A byte past the end. */
+  gz[s_gz_len] = 0;
+  ASSERT_EQ(decode(gz, s_gz_len + 1, 1460, &error), GUNZIP_ERROR);
+  ASSERT(error != NULL);
+  ASSERT_EQ(decode(gz, s_gz_len + 1, 1, &error), GUNZIP_ERROR);
+  free(gz);
+  return 0;
+}
+
+/*
+ * Damaged deflate data fails, in the inflater or at the CRC, or if the
+ * damage moved the end of the data, is still waiting for it.
+ */
+static int test_bad_data(void) {
+  uint8_t *gz = (uint8_t *) malloc(s_gz_len);
+  enum gunzip_result res;
+  const char *error;
+  int errors = 0, tries = 0;
+  size_t i;
+  for (i = 10; i < s_gz_len - 8; i += 1009) {
+    memcpy(gz, s_gz, s_gz_len);
+    gz[i] ^= 0x10;
+    res = decode(gz, s_gz_len, 1460, &error);
+    ASSERT(res == GUNZIP_ERROR || res == GUNZIP_NEED_INPUT);
+    ASSERT((res == GUNZIP_ERROR) == (error != NULL));
+    if (res == GUNZIP_ERROR) errors++;
+    tries++;
+  }
+  ASSERT(errors > tries / 2);
+  /* Not gzip at all. */
+  ASSERT_EQ(decode(s_raw, 64, 1460, &error), GUNZIP_ERROR);
+  ASSERT(error != NULL);
+  free(gz);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int failed = 0;
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <fixtures dir>\n", argv[0]);
+    return 2;
+  }
+  s_fixtures = argv[1];
+  mock_init();
+  s_raw = load("head.bin", &s_raw_len);
+  s_gz = load("head.gz", &s_gz_len);
+  s_named = load("head_named.gz", &s_named_len);
+  s_out = (uint8_t *) malloc(s_raw_len);
+  RUN_TEST(test_whole, failed);
+  RUN_TEST(test_header_fields, failed);
+  RUN_TEST(test_truncated, failed);
+  RUN_TEST(test_bad_trailer, failed);
+  RUN_TEST(test_bad_data, failed);
+  free(s_out);
+  free(s_raw);
+  free(s_gz);
+  free(s_named);
+  return (failed == 0 ? 0 : 1);
+}
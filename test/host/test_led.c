@@ -0,0 +1,468 @@
+/*
+ * The LED engine on the strips and PWM pins of mock_led.c, with the frame
+ * timer on the virtual clock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "led.h"
+#include "profile.h"
+
+#include "mock.h"
+#include "test.h"
+
+#define STRIP_PIXELS 30
+
+/* Pins of the PWM fixture. */
+#define R_PIN 4
+#define G_PIN 15
+#define B_PIN 5
+#define W_PIN 19
+
+/*
+ * Duty of full scale, one frame at the default led.fps of 50, and the duty
+ * a 1 s fade moves in 2 ms: the time elapsed is taken in whole ms, and the
+ * frame timer keeps its phase from an earlier transition.
+ */
+#define FULL 65535
+#define FRAME 0.02
+#define SLACK (FULL / 500)
+
+/* Sets up the fixture alone with brightness curve `curve`, all off. */
+static void setup(const char *curve) {
+  const char *saved = mock_cfg.led_curve;
+  mock_cfg.led_curve = curve;
+  led_setup(R_PIN, G_PIN, B_PIN, W_PIN, 200);
+  mock_cfg.led_curve = saved;
+}
+
+/*
+ * Runs the frame timer for `s` seconds, a frame at a time, and a little
+ * more, so that a frame due at the end is not missed to rounding.
+ */
+static void run(double s) {
+  mock_clock_advance(s + 1e-6);
+}
+
+/* A frame `s` seconds late: the clock jumps, the timer fires once. */
+static void stall(double s) {
+  mock_clock_set(mgos_uptime() + s);
+  mock_timers_run();
+}
+
+static int near(int duty, double fraction, int tolerance) {
+  int d = duty - (int) (fraction * FULL + 0.5);
+  return (d < 0 ? -d : d) <= tolerance;
+}
+
+/* Pixels out of range, or of an output that is not there, are refused. */
+static int test_set_pixel_range(void) {
+  led_setup(4, 15, 5, 19, 200);
+  ASSERT(led_add_strip(18, STRIP_PIXELS));
+  led_write(10, 10, 10, 10, 0);
+  memset(&mock_led, 0, sizeof(mock_led));
+  ASSERT(!led_set_pixel(1, -1, 255, 0, 0, 0));
+  ASSERT(!led_set_pixel(1, STRIP_PIXELS, 255, 0, 0, 0));
+  ASSERT(!led_set_pixel(-1, 0, 255, 0, 0, 0));
+  ASSERT(!led_set_pixel(2, 0, 255, 0, 0, 0));
+  led_flush();
+  /* Nothing is taken to have been set over the colour shown. */
+  led_write(10, 10, 10, 10, 0);
+  ASSERT_EQ(mock_led.shows, 0);
+  ASSERT_EQ(mock_led.pwm_writes, 0);
+  ASSERT(led_set_pixel(1, STRIP_PIXELS - 1, 255, 0, 0, 0));
+  led_flush();
+  ASSERT_EQ(mock_led.shows, 1);
+  return 0;
+}
+
+/* A fade moves with the time elapsed, and ends on time. */
+static int test_transit_timing(void) {
+  int last = 0, t;
+  setup("linear");
+  led_transit(255, 0, 0, 0, 1000, LED_EASE_LINEAR);
+  ASSERT(led_busy());
+  ASSERT_EQ(mock_led.duty[R_PIN], 0);
+  for (t = 1; t < 50; t++) {
+    run(FRAME);
+    /* Within a frame of where it should be, and never back. */
+    ASSERT(near(mock_led.duty[R_PIN], t / 50.0, FULL / 50));
+    ASSERT(mock_led.duty[R_PIN] >= last);
+    ASSERT(led_busy());
+    last = mock_led.duty[R_PIN];
+  }
+  run(FRAME);
+  ASSERT_EQ(mock_led.duty[R_PIN], FULL);
+  ASSERT_EQ(mock_led.duty[G_PIN], 0);
+  ASSERT(!led_busy());
+  ASSERT_EQ(mock_timers_pending(), 0);
+
+  /* A late frame shows where the fade is by now, and does not delay it. */
+  led_transit(0, 0, 0, 0, 1000, LED_EASE_LINEAR);
+  run(FRAME);
+  stall(0.6);
+  ASSERT(near(mock_led.duty[R_PIN], 0.38, SLACK));
+  run(0.3);
+  ASSERT(near(mock_led.duty[R_PIN], 0.08, SLACK));
+  ASSERT(led_busy());
+  run(0.1);
+  ASSERT_EQ(mock_led.duty[R_PIN], 0);
+  ASSERT(!led_busy());
+  return 0;
+}
+
+/* Where each easing has got to 30% of the way through. */
+static int eased(int easing) {
+  setup("linear");
+  led_transit(255, 0, 0, 0, 1000, easing);
+  run(0.3);
+  return mock_led.duty[R_PIN];
+}
+
+static int test_easing(void) {
+  int linear = eased(LED_EASE_LINEAR), in = eased(LED_EASE_IN),
+      out = eased(LED_EASE_OUT), in_out = eased(LED_EASE_IN_OUT);
+  ASSERT(near(linear, 0.3, SLACK));
+  ASSERT(near(in, 0.09, SLACK));         /* t^2 */
+  ASSERT(near(out, 0.51, SLACK));        /* 1 - (1 - t)^2 */
+  ASSERT(near(in_out, 0.216, SLACK));    /* 3t^2 - 2t^3 */
+  /* Unknown easings are linear. */
+  ASSERT_EQ(eased(7), linear);
+  led_stop();
+  return 0;
+}
+
+/*
+ * A transition replaced half way starts from where it has got to, and
+ * one of 0 ms switches at once, stopping the frame timer.
+ */
+static int test_transit_replaced(void) {
+  int half;
+  setup("linear");
+  led_transit(255, 0, 0, 0, 1000, LED_EASE_LINEAR);
+  run(0.5);
+  half = mock_led.duty[R_PIN];
+  ASSERT(near(half, 0.5, SLACK));
+  led_transit(0, 0, 255, 0, 1000, LED_EASE_LINEAR);
+  ASSERT_EQ(mock_led.duty[R_PIN], half);
+  run(FRAME);
+  ASSERT(mock_led.duty[R_PIN] < half);
+  ASSERT(near(mock_led.duty[R_PIN], 0.49, SLACK));
+  ASSERT(near(mock_led.duty[B_PIN], 0.02, SLACK));
+  led_transit(0, 255, 0, 0, 0, LED_EASE_LINEAR);
+  ASSERT(!led_busy());
+  ASSERT_EQ(mock_timers_pending(), 0);
+  ASSERT_EQ(mock_led.duty[R_PIN], 0);
+  ASSERT_EQ(mock_led.duty[G_PIN], FULL);
+  ASSERT_EQ(mock_led.duty[B_PIN], 0);
+  /* led_stop() leaves the colour a fade has got to. */
+  led_transit(0, 0, 0, 0, 1000, LED_EASE_LINEAR);
+  run(0.3);
+  led_stop();
+  ASSERT(!led_busy());
+  run(0.5);
+  ASSERT(near(mock_led.duty[G_PIN], 0.7, SLACK));
+  return 0;
+}
+
+/* Duty of component `c` with no curve: 8.8 level c << 8, to 16 bits. */
+#define LINEAR(c) ((c) * 257)
+
+static int test_white(void) {
+  setup("linear");
+  led_write(200, 150, 100, 10, 0);
+  ASSERT_EQ(mock_led.duty[R_PIN], LINEAR(200));
+  ASSERT_EQ(mock_led.duty[W_PIN], LINEAR(10));
+  /* What red, green and blue have in common goes to white. */
+  led_write(200, 150, 100, 10, LED_WHITE);
+  ASSERT_EQ(mock_led.duty[R_PIN], LINEAR(100));
+  ASSERT_EQ(mock_led.duty[G_PIN], LINEAR(50));
+  ASSERT_EQ(mock_led.duty[B_PIN], 0);
+  ASSERT_EQ(mock_led.duty[W_PIN], LINEAR(110));
+  led_write(255, 255, 255, 200, LED_WHITE);
+  ASSERT_EQ(mock_led.duty[R_PIN], 0);
+  ASSERT_EQ(mock_led.duty[W_PIN], FULL);
+  /* The target of a fade too, with the flag next to the easing. */
+  led_transit(50, 80, 30, 0, 1000, LED_EASE_IN | LED_WHITE);
+  run(1 + FRAME);
+  ASSERT_EQ(mock_led.duty[R_PIN], LINEAR(20));
+  ASSERT_EQ(mock_led.duty[G_PIN], LINEAR(50));
+  ASSERT_EQ(mock_led.duty[B_PIN], 0);
+  ASSERT_EQ(mock_led.duty[W_PIN], LINEAR(30));
+  /* Out of range components are clamped. */
+  led_write(300, -20, 0, 0, 0);
+  ASSERT_EQ(mock_led.duty[R_PIN], FULL);
+  ASSERT_EQ(mock_led.duty[G_PIN], 0);
+  return 0;
+}
+
+/* Brightness and levels scale what is shown, at once. */
+static int test_brightness_levels(void) {
+  setup("linear");
+  led_write(255, 255, 255, 100, 0);
+  led_set_brightness(128);
+  ASSERT(near(mock_led.duty[R_PIN], 128 / 255.0, 2));
+  ASSERT(near(mock_led.duty[W_PIN], 128 / 255.0 * 100 / 255, 2));
+  led_set_levels(255, 128, 0, 255);
+  ASSERT(near(mock_led.duty[R_PIN], 128 / 255.0, 2));
+  ASSERT(near(mock_led.duty[G_PIN], 128 / 255.0 * 128 / 255, 2));
+  ASSERT_EQ(mock_led.duty[B_PIN], 0);
+  /* And what comes next. */
+  led_write(0, 0, 200, 0, 0);
+  ASSERT_EQ(mock_led.duty[B_PIN], 0);
+  led_set_levels(255, 255, 255, 255);
+  ASSERT(near(mock_led.duty[B_PIN], 128 / 255.0 * 200 / 255, 2));
+  led_set_brightness(1000);
+  ASSERT_EQ(mock_led.duty[B_PIN], LINEAR(200));
+  led_set_brightness(-1);
+  ASSERT_EQ(mock_led.duty[B_PIN], 0);
+  /* led_setup() starts at full brightness and levels again. */
+  setup("linear");
+  led_write(255, 0, 0, 0, 0);
+  ASSERT_EQ(mock_led.duty[R_PIN], FULL);
+  return 0;
+}
+
+/* Relative luminance of component `i` by each curve, see led.c. */
+static double cie(int i) {
+  double l = i * 100.0 / 255, y = (l + 16) / 116;
+  return (l <= 8 ? l / 903.3 : y * y * y);
+}
+
+static double gamma_curve(int i) {
+  double x = i / 255.0;
+  return 0.8 * x * x + 0.2 * x * x * x;
+}
+
+static int check_curve(const char *name, double (*curve)(int)) {
+  int c, last = -1;
+  setup(name);
+  for (c = 0; c <= 255; c++) {
+    led_write(0, c, 0, 0, 0);
+    ASSERT(near(mock_led.duty[G_PIN], curve(c), 1));
+    ASSERT(mock_led.duty[G_PIN] > last || c == 0);
+    last = mock_led.duty[G_PIN];
+  }
+  ASSERT_EQ(mock_led.duty[G_PIN], FULL);
+  /* Between two entries of the table, the duty is between them too. */
+  led_set_brightness(128);
+  ASSERT(mock_led.duty[G_PIN] >= (int) (curve(127) * FULL));
+  ASSERT(mock_led.duty[G_PIN] <= (int) (curve(128) * FULL + 1));
+  return 0;
+}
+
+static int test_curves(void) {
+  ASSERT_EQ(check_curve("cie", cie), 0);
+  ASSERT_EQ(check_curve("gamma", gamma_curve), 0);
+  /* An unknown curve is linear. */
+  setup("no such curve");
+  led_write(0, 100, 0, 0, 0);
+  ASSERT_EQ(mock_led.duty[G_PIN], LINEAR(100));
+  return 0;
+}
+
+#define RGB_STEP(repeat)                                 \
+  "{keys: [{r: 255, ms: 100}, {g: 255, ms: 100}, "       \
+  "{b: 255, ms: 100}], repeat: " #repeat ", blend: \"step\"}"
+
+/* Which of red, green and blue alone is on, or '?'. */
+static char shown(void) {
+  int r = mock_led.duty[R_PIN], g = mock_led.duty[G_PIN],
+      b = mock_led.duty[B_PIN];
+  if (r == FULL && g == 0 && b == 0) return 'r';
+  if (r == 0 && g == FULL && b == 0) return 'g';
+  if (r == 0 && g == 0 && b == FULL) return 'b';
+  return '?';
+}
+
+/* Steps through the keys on time, twice, and holds the last. */
+static int test_play_step(void) {
+  static const char order[] = "rgbrgb";
+  int i;
+  setup("linear");
+  ASSERT(led_play(RGB_STEP(2)));
+  ASSERT_EQ(shown(), 'r');
+  run(0.05);
+  for (i = 0; i < 6; i++) {
+    ASSERT_EQ(shown(), order[i]);
+    ASSERT(led_busy());
+    run(0.1);
+  }
+  ASSERT(!led_busy());
+  ASSERT_EQ(shown(), 'b');
+  return 0;
+}
+
+static int test_play_fade(void) {
+  setup("linear");
+  ASSERT(led_play("{keys: [{r: 255, ms: 1000}, {r: 0, ms: 1000}]}"));
+  run(0.5);
+  ASSERT(near(mock_led.duty[R_PIN], 0.5, SLACK));
+  run(1);
+  ASSERT(near(mock_led.duty[R_PIN], 0.5, SLACK));
+  run(0.5 + FRAME);
+  ASSERT_EQ(mock_led.duty[R_PIN], 0);
+  ASSERT(!led_busy());
+  /* In and out, as the easings. */
+  ASSERT(led_play("{keys: [{r: 255, ms: 1000}], blend: \"in\"}"));
+  run(0.3);
+  ASSERT(near(mock_led.duty[R_PIN], 0.09, SLACK));
+  ASSERT(led_play("{keys: [{r: 0, ms: 1000}], blend: \"out\"}"));
+  run(0.3);
+  ASSERT(mock_led.duty[R_PIN] < FULL * 0.09 * 0.5);
+  led_stop();
+  return 0;
+}
+
+/*
+ * A frame late by less than a key keeps the effect on its timing. One late
+ * by more than a key has it fall behind: the key due is still shown, for
+ * all of its time from then, rather than skipped.
+ */
+static int test_play_resync(void) {
+  setup("linear");
+  ASSERT(led_play(RGB_STEP(0)));
+  run(0.04);
+  stall(0.05);
+  ASSERT_EQ(shown(), 'r');
+  run(0.02);
+  ASSERT_EQ(shown(), 'g'); /* At 0.11 s, on time */
+  run(0.08);
+  ASSERT_EQ(shown(), 'g');
+  run(0.02);
+  ASSERT_EQ(shown(), 'b'); /* At 0.21 s */
+
+  /* Blue is due to end at 0.3 s, red at 0.4 s: a frame at 0.46 s. */
+  stall(0.25);
+  ASSERT_EQ(shown(), 'r');
+  run(0.08);
+  ASSERT_EQ(shown(), 'r');
+  run(0.04);
+  ASSERT_EQ(shown(), 'g');
+  run(0.1);
+  ASSERT_EQ(shown(), 'b');
+  ASSERT(led_busy());
+  led_stop();
+  ASSERT(!led_busy());
+  ASSERT_EQ(mock_timers_pending(), 0);
+  return 0;
+}
+
+static int test_play_invalid(void) {
+  char effect[2048];
+  int i, n;
+  setup("linear");
+  ASSERT(!led_play("{keys: []}"));
+  ASSERT(!led_play("{repeat: 1}"));
+  n = snprintf(effect, sizeof(effect), "{keys: [");
+  for (i = 0; i < 65; i++) {
+    n += snprintf(effect + n, sizeof(effect) - n, "%s{r: %d, ms: 10}",
+                  (i > 0 ? ", " : ""), i);
+  }
+  snprintf(effect + n, sizeof(effect) - n, "]}");
+  ASSERT(!led_play(effect));
+  ASSERT(!led_busy());
+  /* An unknown blend is linear. */
+  ASSERT(led_play("{keys: [{r: 255, ms: 1000}], blend: \"wobble\"}"));
+  run(0.3);
+  ASSERT(near(mock_led.duty[R_PIN], 0.3, SLACK));
+  /* led_transit() stops an effect. */
+  ASSERT(led_play(RGB_STEP(0)));
+  led_transit(0, 0, 0, 255, 100, LED_EASE_LINEAR);
+  run(0.5);
+  ASSERT(!led_busy());
+  ASSERT_EQ(mock_led.duty[W_PIN], FULL);
+  return 0;
+}
+
+/* A counter of LED.Stats. */
+static long stat(const char *key) {
+  const char *reply = mock_rpc_call("LED.Stats", NULL, NULL), *p;
+  char k[64];
+  snprintf(k, sizeof(k), "\"%s\": ", key);
+  if (reply == NULL || (p = strstr(reply, k)) == NULL) return -1;
+  return atol(p + strlen(k));
+}
+
+/*
+ * Colours submitted between two frames are coalesced: the latest is shown,
+ * the rest dropped, and LED.Stats tells how many of each.
+ */
+static int test_submit_coalesced(void) {
+  long received = stat("received"), rendered = stat("rendered"),
+       superseded = stat("superseded"), frames;
+  int i;
+  setup("linear");
+  /* Nothing in progress: shown at once. */
+  led_submit(255, 0, 0, 0, 1000, LED_EASE_LINEAR);
+  ASSERT(led_busy());
+  ASSERT_EQ(stat("rendered"), rendered + 1);
+  for (i = 0; i < 5; i++) {
+    led_submit(0, 0, 50 * (i + 1), 0, 200, LED_EASE_LINEAR);
+  }
+  ASSERT_EQ(stat("received"), received + 6);
+  ASSERT_EQ(stat("rendered"), rendered + 1);
+  ASSERT_EQ(stat("superseded"), superseded + 4);
+  frames = stat("frames");
+  run(FRAME);
+  ASSERT_EQ(stat("frames"), frames + 1);
+  ASSERT_EQ(stat("rendered"), rendered + 2);
+  /* Its first step, of 20 of its 200 ms, is in the frame that takes it. */
+  ASSERT(near(mock_led.duty[B_PIN], 0.1 * 250 / 255, FULL / 100));
+  run(0.2);
+  ASSERT(!led_busy());
+  ASSERT_EQ(mock_led.duty[B_PIN], LINEAR(250));
+  ASSERT_EQ(mock_led.duty[R_PIN], 0);
+  ASSERT_EQ(stat("frames"), frames + 11);
+
+  /* led_transit() drops one waiting for a frame. */
+  led_submit(255, 0, 0, 0, 1000, LED_EASE_LINEAR);
+  led_submit(0, 255, 0, 0, 1000, LED_EASE_LINEAR);
+  led_transit(0, 0, 0, 255, 100, LED_EASE_LINEAR);
+  ASSERT_EQ(stat("superseded"), superseded + 5);
+  run(0.2);
+  ASSERT_EQ(mock_led.duty[G_PIN], 0);
+  ASSERT_EQ(mock_led.duty[W_PIN], FULL);
+  ASSERT_EQ(stat("received"), received + 8);
+  ASSERT_EQ(stat("rendered"), rendered + 3);
+  return 0;
+}
+
+/* A colour submitted every frame still moves the output every frame. */
+static int test_submit_stream(void) {
+  int i, last = 0;
+  setup("linear");
+  led_submit(255, 0, 0, 0, 100, LED_EASE_LINEAR);
+  for (i = 0; i < 4; i++) {
+    run(FRAME);
+    ASSERT(mock_led.duty[R_PIN] > last);
+    last = mock_led.duty[R_PIN];
+    led_submit(255, 0, 0, 0, 100, LED_EASE_LINEAR);
+  }
+  led_stop();
+  return 0;
+}
+
+int main(void) {
+  int failed = 0;
+  mock_init();
+  mock_clock_set(0);
+  prof_init();
+  led_init();
+  RUN_TEST(test_set_pixel_range, failed);
+  RUN_TEST(test_transit_timing, failed);
+  RUN_TEST(test_easing, failed);
+  RUN_TEST(test_transit_replaced, failed);
+  RUN_TEST(test_white, failed);
+  RUN_TEST(test_brightness_levels, failed);
+  RUN_TEST(test_curves, failed);
+  RUN_TEST(test_play_step, failed);
+  RUN_TEST(test_play_fade, failed);
+  RUN_TEST(test_play_resync, failed);
+  RUN_TEST(test_play_invalid, failed);
+  RUN_TEST(test_submit_coalesced, failed);
+  RUN_TEST(test_submit_stream, failed);
+  return (failed == 0 ? 0 : 1);
+}
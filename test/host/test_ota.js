@@ -0,0 +1,178 @@
+// Replays the script update journal of fs/ota.js from each of its states,
+// as UPD.check() finds it at boot, on an in-memory filesystem with the mJS
+// APIs it uses stubbed out.
+//
+// Usage: node test_ota.js <fs/ota.js>
+
+'use strict';
+
+const fs = require('fs');
+const vm = require('vm');
+
+const JOURNAL = 'updater_data.json';
+const OLD = 'old a';
+const NEW = 'new a';
+
+// A device: files, timers and reboots. worker.js fails to load if
+// `broken`.
+function boot(files, broken) {
+  const dev = {files: new Map(Object.entries(files)), timers: [],
+               reboots: 0};
+  const File = {
+    fopen: (name) => (dev.files.has(name) ? {name: name} : null),
+    fclose: () => {},
+    read: (name) => (dev.files.has(name) ? dev.files.get(name) : null),
+    write: (data, name) => { dev.files.set(name, data); return true; },
+    remove: (name) => dev.files.delete(name),
+    rename: (from, to) => {
+      if (!dev.files.has(from)) return false;
+      dev.files.set(to, dev.files.get(from));
+      dev.files.delete(from);
+      return true;
+    },
+  };
+  dev.ctx = vm.createContext({
+    File: File,
+    Timer: {set: (ms, flags, cb, arg) => dev.timers.push([cb, arg])},
+    Sys: {reboot: () => dev.reboots++},
+    RPC: {call: () => false},
+    print: () => {},
+    load: (name) => {
+      if (name === 'worker.js' && broken) throw new Error('worker.js');
+    },
+  });
+  vm.runInContext(fs.readFileSync(process.argv[2], 'utf8'), dev.ctx);
+  return dev;
+}
+
+function check(dev) {
+  try {
+    vm.runInContext('UPD.check()', dev.ctx);
+  } catch (e) {
+    // A script that fails to load stops the one that loads it.
+  }
+}
+
+function runTimers(dev) {
+  const timers = dev.timers;
+  dev.timers = [];
+  timers.forEach((t) => t[0](t[1]));
+}
+
+function journal(dev) {
+  return JSON.parse(dev.files.get(JOURNAL)).status;
+}
+
+function assertEq(a, b, what) {
+  if (a !== b) {
+    throw new Error(what + ': ' + JSON.stringify(a) + ' != ' +
+                    JSON.stringify(b));
+  }
+}
+
+// a.js replaced, b.js new to the bundle.
+const BUNDLE = [{file_o: 'a.js', file_n: 'a.js.new', is_new: false},
+                {file_o: 'b.js', file_n: 'b.js.new', is_new: true}];
+
+function withJournal(status, files) {
+  files[JOURNAL] = JSON.stringify({files: BUNDLE, status: status});
+  return files;
+}
+
+function assertOld(dev) {
+  assertEq(dev.files.get('a.js'), OLD, 'a.js');
+  assertEq(dev.files.has('b.js'), false, 'b.js');
+  assertEq(dev.files.has('a.js.bak'), false, 'a.js.bak');
+  assertEq(dev.files.has('a.js.new'), false, 'a.js.new');
+  assertEq(journal(dev), 'COMMITED_OK', 'status');
+}
+
+function assertNew(dev) {
+  assertEq(dev.files.get('a.js'), NEW, 'a.js');
+  assertEq(dev.files.get('b.js'), 'b', 'b.js');
+  assertEq(dev.files.has('a.js.bak'), false, 'a.js.bak');
+  assertEq(journal(dev), 'COMMITED_OK', 'status');
+}
+
+const tests = {
+  test_no_journal: () => {
+    const dev = boot({'a.js': OLD});
+    check(dev);
+    assertEq(journal(dev), 'COMMITED_OK', 'status');
+    assertEq(dev.files.get('a.js'), OLD, 'a.js');
+  },
+
+  test_committed: () => {
+    const dev = boot(withJournal('COMMITED_OK', {'a.js': OLD}));
+    check(dev);
+    assertEq(dev.timers.length, 0, 'timers');
+    assertEq(dev.reboots, 0, 'reboots');
+    assertEq(dev.files.get('a.js'), OLD, 'a.js');
+  },
+
+  // Applied, on trial, and committed once worker.js has loaded and run.
+  test_to_commit: () => {
+    const dev = boot(withJournal('TO_COMMIT',
+                                 {'a.js': OLD, 'a.js.new': NEW,
+                                  'b.js.new': 'b'}));
+    check(dev);
+    assertEq(journal(dev), 'TRIAL', 'status');
+    assertEq(dev.files.get('a.js.bak'), OLD, 'a.js.bak');
+    runTimers(dev);
+    assertNew(dev);
+    assertEq(dev.reboots, 0, 'reboots');
+  },
+
+  // The journal was cut off before its rename.
+  test_to_commit_tmp: () => {
+    const files = withJournal('TO_COMMIT', {'a.js': OLD, 'a.js.new': NEW,
+                                            'b.js.new': 'b'});
+    files[JOURNAL + '.tmp'] = files[JOURNAL];
+    delete files[JOURNAL];
+    const dev = boot(files);
+    check(dev);
+    runTimers(dev);
+    assertNew(dev);
+  },
+
+  test_to_commit_broken: () => {
+    const dev = boot(withJournal('TO_COMMIT',
+                                 {'a.js': OLD, 'a.js.new': NEW,
+                                  'b.js.new': 'b'}),
+                     true);
+    check(dev);
+    runTimers(dev);
+    assertOld(dev);
+    assertEq(dev.reboots, 1, 'reboots');
+  },
+
+  // Rebooted while on trial.
+  test_trial: () => {
+    const dev = boot(withJournal('TRIAL',
+                                 {'a.js': NEW, 'a.js.bak': OLD, 'b.js': 'b'}));
+    check(dev);
+    assertOld(dev);
+    assertEq(dev.reboots, 1, 'reboots');
+  },
+
+  // Rebooted while rolling back, with a.js moved back already.
+  test_rollback: () => {
+    const dev = boot(withJournal('ROLLBACK', {'a.js': OLD, 'b.js': 'b'}));
+    check(dev);
+    assertOld(dev);
+    assertEq(dev.reboots, 1, 'reboots');
+  },
+};
+
+let failed = 0;
+Object.keys(tests).forEach((name) => {
+  try {
+    tests[name]();
+    console.log('PASS ' + name);
+  } catch (e) {
+    console.log('test_ota.js: ' + name + ': ' + e.message);
+    console.log('FAIL ' + name);
+    failed++;
+  }
+});
+process.exit(failed === 0 ? 0 : 1);
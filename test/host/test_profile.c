@@ -0,0 +1,179 @@
+/*
+ * The profiler on the virtual clock: latency histograms and heap use of an
+ * RPC handler that takes as long as it is told to, nested calls, event loop
+ * lag, and what Sys.Profile reports of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+#include "mock.h"
+#include "test.h"
+
+/* As in profile.c. */
+#define PROF_MAX_STATS 32
+#define PROF_HIST_BUCKETS 16
+
+#define LAG_INTERVAL_MS 100
+
+/* Takes `us` microseconds of the clock and `heap` bytes of the heap. */
+static void busy_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                         struct mg_rpc_frame_info *fi, struct mg_str args) {
+  int us = 0, heap = 0;
+  json_scanf(args.p, args.len, ri->args_fmt, &us, &heap);
+  mock_clock_set(mgos_uptime() + us / 1e6);
+  mock_free_heap -= heap;
+  mg_rpc_send_responsef(ri, "{}");
+  (void) cb_arg;
+  (void) fi;
+}
+
+static void busy(int us, int heap) {
+  char args[64];
+  snprintf(args, sizeof(args), "{us: %d, heap: %d}", us, heap);
+  mock_rpc_call("Test.Busy", args, NULL);
+}
+
+/*
+ * Reads the stat `name` of a Sys.Profile reply: `key`, or the histogram
+ * into `hist` if not NULL. Returns -1 if it is not there.
+ */
+static long stat(const char *name, const char *key, long *hist) {
+  const char *reply = mock_rpc_call("Sys.Profile", NULL, NULL), *p;
+  char k[64];
+  int i;
+  snprintf(k, sizeof(k), "\"name\": \"%s\"", name);
+  if (reply == NULL || (p = strstr(reply, k)) == NULL) return -1;
+  snprintf(k, sizeof(k), "\"%s\": ", (hist != NULL ? "hist" : key));
+  if ((p = strstr(p, k)) == NULL) return -1;
+  p += strlen(k);
+  if (hist == NULL) return atol(p);
+  for (i = 0; i < PROF_HIST_BUCKETS; i++) {
+    char *end;
+    hist[i] = strtol(p + 1, &end, 10);
+    p = end;
+  }
+  return (*p == ']' ? 0 : -1);
+}
+
+/* Calls land in log2 buckets of 64 us up; the last takes all the rest. */
+static int test_rpc_histogram(void) {
+  static const int us[] = {10, 100, 1000, 100000, 10000000};
+  long hist[PROF_HIST_BUCKETS];
+  size_t i;
+  for (i = 0; i < sizeof(us) / sizeof(us[0]); i++) busy(us[i], 0);
+  ASSERT_EQ(stat("Test.Busy", "calls", NULL), 5);
+  ASSERT_EQ(stat("Test.Busy", NULL, hist), 0);
+  for (i = 0; i < PROF_HIST_BUCKETS; i++) {
+    ASSERT_EQ(hist[i], (i == 0 || i == 1 || i == 4 || i == 11 || i == 15));
+  }
+  ASSERT(labs(stat("Test.Busy", "max_us", NULL) - 10000000) <= 1);
+  ASSERT(labs(stat("Test.Busy", "avg_us", NULL) - 10101110 / 5) <= 1);
+  return 0;
+}
+
+/* The heap taken by a call and not given back, and the most of it. */
+static int test_rpc_heap(void) {
+  size_t heap = mock_free_heap;
+  busy(0, 512);
+  busy(0, 100);
+  ASSERT_EQ(stat("Test.Busy", "heap_before", NULL), heap - 512);
+  ASSERT_EQ(stat("Test.Busy", "heap_after", NULL), heap - 612);
+  ASSERT_EQ(stat("Test.Busy", "max_heap_used", NULL), 512);
+  mock_free_heap = heap;
+  return 0;
+}
+
+/* {reset: true} clears the counts after reporting them. */
+static int test_reset(void) {
+  long hist[PROF_HIST_BUCKETS];
+  int i;
+  ASSERT(stat("Test.Busy", "calls", NULL) > 0);
+  ASSERT(mock_rpc_call("Sys.Profile", "{reset: true}", NULL) != NULL);
+  ASSERT_EQ(stat("Test.Busy", "calls", NULL), 0);
+  ASSERT_EQ(stat("Test.Busy", "max_us", NULL), 0);
+  ASSERT_EQ(stat("Test.Busy", "max_heap_used", NULL), 0);
+  ASSERT_EQ(stat("Test.Busy", NULL, hist), 0);
+  for (i = 0; i < PROF_HIST_BUCKETS; i++) ASSERT_EQ(hist[i], 0);
+  return 0;
+}
+
+/* A call nested in one of the same stat is part of it. */
+static int test_nested(void) {
+  struct prof_stat *st = prof_stat("test", "nested");
+  ASSERT(st != NULL);
+  ASSERT(prof_stat("test", "nested") == st);
+  prof_begin(st);
+  mock_clock_set(mgos_uptime() + 0.001);
+  prof_begin(st);
+  mock_clock_set(mgos_uptime() + 0.002);
+  prof_end(st);
+  prof_end(st);
+  /* Unmatched, and of no stat: nothing. */
+  prof_end(st);
+  prof_begin(NULL);
+  prof_end(NULL);
+  ASSERT_EQ(stat("nested", "calls", NULL), 1);
+  ASSERT(labs(stat("nested", "max_us", NULL) - 3000) <= 1);
+  return 0;
+}
+
+/* How late the lag timer fires, as the loop was busy with something else. */
+static int test_lag(void) {
+  long hist[PROF_HIST_BUCKETS];
+  /* The handlers above have moved the clock past it. */
+  mock_timers_run();
+  mock_rpc_call("Sys.Profile", "{reset: true}", NULL);
+  mock_clock_advance(1.0 + 1e-6);
+  ASSERT_EQ(stat("lag", "calls", NULL), 10);
+  ASSERT_EQ(stat("lag", "max_us", NULL), 0);
+  /* Busy for 250 ms past when the timer was due. */
+  mock_clock_set(mgos_uptime() + LAG_INTERVAL_MS / 1000.0 + 0.25);
+  mock_timers_run();
+  ASSERT_EQ(stat("lag", "calls", NULL), 11);
+  ASSERT(labs(stat("lag", "max_us", NULL) - 250000) <= 10);
+  ASSERT_EQ(stat("lag", NULL, hist), 0);
+  ASSERT_EQ(hist[0], 10);
+  ASSERT_EQ(hist[12], 1);
+  /* And back on time. */
+  mock_clock_advance(LAG_INTERVAL_MS / 1000.0 + 1e-6);
+  ASSERT_EQ(stat("lag", "calls", NULL), 12);
+  ASSERT(stat("lag", NULL, hist) == 0 && hist[0] == 11);
+  return 0;
+}
+
+/* Past PROF_MAX_STATS there is no stat, and measuring with none is a no-op. */
+static int test_max_stats(void) {
+  struct prof_stat *st;
+  char name[16];
+  int i;
+  for (i = 0; i < PROF_MAX_STATS; i++) {
+    snprintf(name, sizeof(name), "s%d", i);
+    st = prof_stat("many", name);
+  }
+  ASSERT(st == NULL);
+  prof_begin(st);
+  prof_end(st);
+  /* Those there already are still found. */
+  ASSERT(prof_stat("test", "nested") != NULL);
+  return 0;
+}
+
+int main(void) {
+  int failed = 0;
+  mock_init();
+  mock_clock_set(0);
+  mock_cfg.profile_lag_interval = LAG_INTERVAL_MS;
+  prof_init();
+  prof_add_rpc_handler("Test.Busy", "{us: %d, heap: %d}", busy_handler, NULL);
+  RUN_TEST(test_rpc_histogram, failed);
+  RUN_TEST(test_rpc_heap, failed);
+  RUN_TEST(test_reset, failed);
+  RUN_TEST(test_nested, failed);
+  RUN_TEST(test_lag, failed);
+  RUN_TEST(test_max_stats, failed);
+  return (failed == 0 ? 0 : 1);
+}
@@ -0,0 +1,310 @@
+/*
+ * Replays the fixtures of mkfixtures.py through the updater and the mock
+ * HAL, at chunk sizes from one byte (a header split anywhere) to 64 KB.
+ *
+ * Usage: test_updater <fixtures dir>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mgos_updater_common.h"
+#include "updater.h"
+
+#include "mock.h"
+#include "replay.h"
+#include "test.h"
+
+/* Parts of build/fw.zip that have a src. */
+#define FW_PARTS 5
+#define FW_PARTS_SIZE (18368 + 262144 + 1541904 + 8192 + 3072)
+#define FW_APP_SIZE 1541904
+#define FW_FS_SIZE 262144
+
+static const char *s_fixtures;
+static char s_msg[200];
+
+static char *load(const char *name, size_t *len) {
+  char path[256];
+  char *data;
+  snprintf(path, sizeof(path), "%s/%s", s_fixtures, name);
+  if ((data = mock_read_file(path, len)) == NULL) {
+    fprintf(stderr, "cannot read %s\n", path);
+    exit(2);
+  }
+  return data;
+}
+
+static int check_archive(const char *name, size_t chunk) {
+  size_t len;
+  char *data = load(name, &len);
+  int res;
+  mock_upd_reset();
+  res = replay_fixed(data, len, chunk, s_msg, sizeof(s_msg));
+  free(data);
+  if (res != 1) fprintf(stderr, "%s @ %d: %s\n", name, (int) chunk, s_msg);
+  ASSERT_EQ(res, 1);
+  ASSERT_EQ(mock_upd.files, FW_PARTS);
+  ASSERT_EQ(mock_upd.bytes, FW_PARTS_SIZE);
+  ASSERT_EQ(mock_upd.finalized, 1);
+  ASSERT(updater_context_get_current() == NULL);
+  return 0;
+}
+
+static int test_chunk_sizes(void) {
+  static const char *archives[] = {"fw_stored.zip", "fw_deflate.zip",
+                                   "fw_descriptor.zip"};
+  static const size_t chunks[] = {1, 7, 1460, 65536};
+  size_t i, j;
+  for (i = 0; i < sizeof(archives) / sizeof(archives[0]); i++) {
+    for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+      if (check_archive(archives[i], chunks[j]) != 0) return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Parts smaller than the staging buffer, at every chunk size up to past it:
+ * a last piece of an entry may come from either the staging buffer or the
+ * caller's chunk.
+ */
+static int test_small_parts(void) {
+  static const char *archives[] = {"seeds/stored.zip", "seeds/deflate.zip",
+                                   "seeds/descriptor.zip"};
+  size_t i, chunk;
+  for (i = 0; i < sizeof(archives) / sizeof(archives[0]); i++) {
+    size_t len;
+    char *data = load(archives[i], &len);
+    for (chunk = 1; chunk <= 1100; chunk++) {
+      int res;
+      mock_upd_reset();
+      res = replay_fixed(data, len, chunk, s_msg, sizeof(s_msg));
+      if (res != 1) {
+        fprintf(stderr, "%s @ %d: %s\n", archives[i], (int) chunk, s_msg);
+        free(data);
+      }
+      ASSERT_EQ(res, 1);
+      ASSERT_EQ(mock_upd.files, FW_PARTS);
+    }
+    free(data);
+  }
+  return 0;
+}
+
+static int test_writes_files(void) {
+  struct stat st;
+  size_t len;
+  char *data = load("fw_deflate.zip", &len);
+  int res;
+  mock_upd_reset();
+  mock_upd.out_dir = ".";
+  res = replay_fixed(data, len, 1460, s_msg, sizeof(s_msg));
+  free(data);
+  ASSERT_EQ(res, 1);
+  ASSERT(stat("mongoose_tests.bin", &st) == 0);
+  ASSERT_EQ(st.st_size, FW_APP_SIZE);
+  ASSERT(stat("fs.img", &st) == 0);
+  ASSERT_EQ(st.st_size, FW_FS_SIZE);
+  return 0;
+}
+
+static int test_installed_parts_skipped(void) {
+  size_t len;
+  char *data = load("fw_deflate.zip", &len);
+  char flash[256];
+  int res;
+  mock_upd_reset();
+  snprintf(flash, sizeof(flash), "%s/fw_flash.bin", s_fixtures);
+  mock_upd.flash = flash;
+  res = replay_fixed(data, len, 1460, s_msg, sizeof(s_msg));
+  free(data);
+  ASSERT_EQ(res, 1);
+  /* Boot loader, partition table and otadata are in flash already. */
+  ASSERT_EQ(mock_upd.files, 2);
+  ASSERT_EQ(mock_upd.bytes, FW_APP_SIZE + FW_FS_SIZE);
+  return 0;
+}
+
+static int test_hal_skips_file(void) {
+  size_t len;
+  char *data = load("fw_descriptor.zip", &len);
+  int res;
+  mock_upd_reset();
+  mock_upd.skip = "fs.img";
+  res = replay_fixed(data, len, 4096, s_msg, sizeof(s_msg));
+  free(data);
+  ASSERT_EQ(res, 1);
+  ASSERT_EQ(mock_upd.skipped, 1);
+  ASSERT_EQ(mock_upd.files, FW_PARTS - 1);
+  ASSERT_EQ(mock_upd.bytes, FW_PARTS_SIZE - FW_FS_SIZE);
+  return 0;
+}
+
+/* Replays the delta archive with `running_app` in a slot of `slot_size`. */
+static int replay_delta(const char *running_app, uint32_t slot_size,
+                        size_t chunk) {
+  size_t len;
+  char *data = load("fw_delta.zip", &len);
+  char base[256];
+  int res;
+  mock_upd_reset();
+  snprintf(base, sizeof(base), "%s/%s", s_fixtures, running_app);
+  mock_upd.running_app = base;
+  mock_upd.running_app_slot_size = slot_size;
+  res = replay_fixed(data, len, chunk, s_msg, sizeof(s_msg));
+  free(data);
+  /* Not to be read once base is gone. */
+  mock_upd.running_app = NULL;
+  return res;
+}
+
+static int test_delta(void) {
+  static const size_t chunks[] = {1, 1460, 65536};
+  size_t i;
+  for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+    int res = replay_delta("delta_base.bin", 0x180000, chunks[i]);
+    if (res != 1) fprintf(stderr, "@ %d: %s\n", (int) chunks[i], s_msg);
+    ASSERT_EQ(res, 1);
+    /* The HAL has checked the SHA-1 of the patched app. */
+    ASSERT_EQ(mock_upd.files, FW_PARTS);
+    ASSERT_EQ(mock_upd.finalized, 1);
+  }
+  return 0;
+}
+
+static int test_delta_other_base(void) {
+  ASSERT_EQ(replay_delta("fw_flash.bin", 0x180000, 1460), -1);
+  ASSERT(strstr(s_msg, "another base") != NULL);
+  ASSERT_EQ(replay_delta("fw_stored.zip", 0x180000, 1460), -1);
+  ASSERT(strstr(s_msg, "another base") != NULL);
+  /* The base is bigger than the running slot. */
+  ASSERT_EQ(replay_delta("delta_base.bin", 0x100000, 1460), -1);
+  ASSERT(strstr(s_msg, "another base") != NULL);
+  return 0;
+}
+
+static int test_corrupt_data(void) {
+  size_t len;
+  char *data = load("fw_stored.zip", &len);
+  int res;
+  mock_upd_reset();
+  /* Well inside the app image. */
+  data[len / 2] ^= 0x55;
+  res = replay_fixed(data, len, 1460, s_msg, sizeof(s_msg));
+  free(data);
+  ASSERT_EQ(res, -1);
+  ASSERT(strstr(s_msg, "CRC") != NULL || strstr(s_msg, "SHA1") != NULL);
+  ASSERT_EQ(mock_upd.finalized, 0);
+  return 0;
+}
+
+static int test_truncated(void) {
+  size_t len;
+  char *data = load("fw_deflate.zip", &len);
+  int res;
+  mock_upd_reset();
+  res = replay_fixed(data, len / 2, 1460, s_msg, sizeof(s_msg));
+  free(data);
+  ASSERT_EQ(res, -1);
+  ASSERT_EQ(mock_upd.finalized, 0);
+  return 0;
+}
+
+static int test_not_an_archive(void) {
+  static const char junk[] = "<html>Not found</html>";
+  mock_upd_reset();
+  ASSERT_EQ(replay_fixed(junk, sizeof(junk) - 1, 5, s_msg, sizeof(s_msg)), -1);
+  ASSERT_EQ(mock_upd.begins, 0);
+  return 0;
+}
+
+static int test_one_at_a_time(void) {
+  struct update_context *ctx;
+  mock_upd_reset();
+  ASSERT((ctx = updater_context_create(0)) != NULL);
+  ASSERT(updater_context_create(0) == NULL);
+  updater_finish(ctx);
+  updater_context_free(ctx);
+  ASSERT(updater_context_get_current() == NULL);
+  ASSERT(mock_timers_pending() == 0);
+  return 0;
+}
+
+static int test_uncommitted(void) {
+  mock_upd_reset();
+  mock_upd.committed = false;
+  ASSERT(updater_context_create(0) == NULL);
+  return 0;
+}
+
+static int test_timeout(void) {
+  struct update_context *ctx;
+  mock_upd_reset();
+  mock_clock_set(100);
+  ASSERT((ctx = updater_context_create(5)) != NULL);
+  mock_clock_advance(4);
+  ASSERT(updater_context_get_current() == ctx);
+  mock_clock_advance(2);
+  ASSERT(updater_context_get_current() == NULL);
+  updater_context_free(ctx);
+  ASSERT((ctx = updater_context_create(5)) != NULL);
+  updater_finish(ctx);
+  updater_context_free(ctx);
+  mock_clock_set(-1);
+  return 0;
+}
+
+/* An update that finishes after it has timed out keeps to its own metrics. */
+static int test_timed_out_stats(void) {
+  struct update_context *old, *ctx;
+  struct updater_stats st;
+  size_t len;
+  char *data = load("fw_stored.zip", &len);
+  mock_upd_reset();
+  mock_clock_set(100);
+  ASSERT((old = updater_context_create(5)) != NULL);
+  mock_clock_advance(6);
+  ASSERT((ctx = updater_context_create(5)) != NULL);
+  ASSERT_EQ(updater_process(ctx, data, 1000), 0);
+  old->result = -1;
+  updater_finish(old);
+  updater_context_free(old);
+  ASSERT(updater_get_stats(0, &st));
+  ASSERT_EQ(st.result, 0);
+  ASSERT_EQ(st.bytes, 1000);
+  ASSERT(updater_get_stats(1, &st));
+  ASSERT_EQ(st.result, -1);
+  updater_finish(ctx);
+  updater_context_free(ctx);
+  mock_clock_set(-1);
+  free(data);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int failed = 0;
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <fixtures dir>\n", argv[0]);
+    return 2;
+  }
+  s_fixtures = argv[1];
+  mock_init();
+  RUN_TEST(test_chunk_sizes, failed);
+  RUN_TEST(test_small_parts, failed);
+  RUN_TEST(test_writes_files, failed);
+  RUN_TEST(test_installed_parts_skipped, failed);
+  RUN_TEST(test_hal_skips_file, failed);
+  RUN_TEST(test_delta, failed);
+  RUN_TEST(test_delta_other_base, failed);
+  RUN_TEST(test_corrupt_data, failed);
+  RUN_TEST(test_truncated, failed);
+  RUN_TEST(test_not_an_archive, failed);
+  RUN_TEST(test_one_at_a_time, failed);
+  RUN_TEST(test_uncommitted, failed);
+  RUN_TEST(test_timeout, failed);
+  RUN_TEST(test_timed_out_stats, failed);
+  return (failed == 0 ? 0 : 1);
+}
@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+"""Makes a delta update: a firmware archive whose app is a patch against the
+app that is running on the device.
+
+The patch is in the MGD1 format of src/delta.h. Its part in the manifest
+gets, besides the "size" and "cs_sha1" of the new app, which the updater
+checks the patched result against:
+
+  "delta": true
+  "base_size", "base_cs_sha1"   size and SHA-1 of the base app; the updater
+                                refuses the patch unless the running app is
+                                exactly that
+
+All other entries of the archive are copied as they are. The patch is
+applied here before the archive is written, and must give the new app.
+
+Usage: mkdelta.py [--part app] <base> <fw.zip> <out.zip>
+
+<base> is the app image the device is running, or the firmware archive it
+was installed from.
+"""
+
+import argparse
+import hashlib
+import json
+import struct
+import sys
+import zipfile
+
+MAGIC = b"MGD1"
+# Bytes that must match for a place in the base to be tried.
+WINDOW = 32
+# Base offsets are indexed at this step; target offsets are all tried.
+STEP = 8
+# Bytes compared at a time while a match is exact.
+RUN = 64
+
+
+def manifest_name(z):
+    names = [n for n in z.namelist() if n.endswith("manifest.json")]
+    if not names:
+        sys.exit("%s has no manifest" % z.filename)
+    return names[0]
+
+
+def entry_name(z, src):
+    """Name of the archive entry of a part's src, which is in a directory."""
+    for n in z.namelist():
+        if n == src or n.endswith("/" + src):
+            return n
+    sys.exit("%s has no %s" % (z.filename, src))
+
+
+def find_part(manifest, name):
+    parts = manifest.get("parts", {})
+    if name not in parts or "src" not in parts[name]:
+        sys.exit("manifest has no part %s with a src" % name)
+    if parts[name].get("type") != "app":
+        sys.exit("only the app can be a delta, %s is %s" %
+                 (name, parts[name].get("type")))
+    return parts[name]
+
+
+def read_base(path, part_name):
+    if not zipfile.is_zipfile(path):
+        with open(path, "rb") as f:
+            return f.read()
+    with zipfile.ZipFile(path) as z:
+        manifest = json.loads(z.read(manifest_name(z)))
+        part = find_part(manifest, part_name)
+        if part.get("delta"):
+            sys.exit("%s is a delta itself" % path)
+        return z.read(entry_name(z, part["src"]))
+
+
+def extend(base, target, b, t):
+    """Length of the match at base[b:], target[t:]: as long as it has more
+    equal bytes than different ones, as in bsdiff."""
+    limit = min(len(base) - b, len(target) - t)
+    n = score = best = best_n = 0
+    while n < limit:
+        if n + RUN <= limit and base[b + n:b + n + RUN] == \
+                target[t + n:t + n + RUN]:
+            n += RUN
+            score += RUN
+        else:
+            score += 1 if base[b + n] == target[t + n] else -1
+            n += 1
+        if score > best:
+            best, best_n = score, n
+        elif score < best - RUN:
+            break
+    return best_n
+
+
+def make_patch(base, target):
+    index = {}
+    for off in range(0, len(base) - WINDOW + 1, STEP):
+        index.setdefault(base[off:off + WINDOW], off)
+    out = bytearray(MAGIC + struct.pack("<II", len(base), len(target)))
+    cursor = 0  # Base cursor of the patcher
+    diag = 0    # Base offset minus target offset of the last match
+    pos = insert_from = 0
+    while pos + WINDOW <= len(target):
+        window = target[pos:pos + WINDOW]
+        b = pos + diag
+        if base[b:b + WINDOW] != window:
+            b = index.get(window)
+        if b is None:
+            pos += 1
+            continue
+        n = extend(base, target, b, pos)
+        if insert_from < pos:
+            out += b"I" + struct.pack("<I", pos - insert_from)
+            out += target[insert_from:pos]
+        if b != cursor:
+            out += b"S" + struct.pack("<I", (b - cursor) & 0xffffffff)
+        out += b"A" + struct.pack("<I", n)
+        out += bytes((t - s) & 0xff for s, t in zip(base[b:b + n],
+                                                    target[pos:pos + n]))
+        cursor = b + n
+        diag = b - pos
+        pos += n
+        insert_from = pos
+    if insert_from < len(target):
+        out += b"I" + struct.pack("<I", len(target) - insert_from)
+        out += target[insert_from:]
+    return bytes(out)
+
+
+def apply_patch(base, patch):
+    """What the device does, see src/delta.c."""
+    if patch[:4] != MAGIC:
+        raise ValueError("not a patch")
+    base_size, target_size = struct.unpack_from("<II", patch, 4)
+    if base_size != len(base):
+        raise ValueError("patch is for another base image")
+    out = bytearray()
+    pos, cursor = 12, 0
+    while len(out) < target_size:
+        op, arg = struct.unpack_from("<cI", patch, pos)
+        pos += 5
+        if op == b"A":
+            if cursor + arg > len(base):
+                raise ValueError("patch reads past the base image")
+            out += bytes((s + d) & 0xff for s, d in
+                         zip(base[cursor:cursor + arg],
+                             patch[pos:pos + arg]))
+            cursor += arg
+            pos += arg
+        elif op == b"I":
+            out += patch[pos:pos + arg]
+            pos += arg
+        elif op == b"S":
+            cursor = (cursor + arg) & 0xffffffff
+        else:
+            raise ValueError("invalid record %r" % op)
+    return bytes(out)
+
+
+def main():
+    ap = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    ap.add_argument("--part", default="app",
+                    help="manifest part to make a delta of (default: app)")
+    ap.add_argument("base")
+    ap.add_argument("fw")
+    ap.add_argument("out")
+    args = ap.parse_args()
+
+    base = read_base(args.base, args.part)
+    with zipfile.ZipFile(args.fw) as z:
+        mname = manifest_name(z)
+        manifest = json.loads(z.read(mname))
+        part = find_part(manifest, args.part)
+        if part.get("delta"):
+            sys.exit("%s is a delta already" % args.fw)
+        pname = entry_name(z, part["src"])
+        target = z.read(pname)
+        entries = [(i, z.read(i)) for i in z.infolist()]
+
+    patch = make_patch(base, target)
+    if apply_patch(base, patch) != target:
+        sys.exit("internal error: the patch does not give the new app")
+
+    part["delta"] = True
+    part["size"] = len(target)
+    part["cs_sha1"] = hashlib.sha1(target).hexdigest()
+    part["base_size"] = len(base)
+    part["base_cs_sha1"] = hashlib.sha1(base).hexdigest()
+
+    with zipfile.ZipFile(args.out, "w") as z:
+        for info, data in entries:
+            if info.filename == mname:
+                data = json.dumps(manifest, indent=2, sort_keys=True).encode()
+            elif info.filename == pname:
+                info.compress_type = zipfile.ZIP_DEFLATED
+                data = patch
+            z.writestr(info, data)
+
+    print("%s: %d bytes against a %d byte base, %d byte patch" %
+          (part["src"], len(target), len(base), len(patch)))
+
+
+if __name__ == "__main__":
+    main()